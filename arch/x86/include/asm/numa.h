@@ -38,6 +38,7 @@ void __init init_cpu_to_node(void);
 void __init x86_numa_init(void);
 
 int __init numa_add_memblk(int nodeid, u64 start, u64 end);
+int __init early_phys_to_nid(u64 pa);
 int __init numa_set_distance(int from, int to, int distance);
 int node_distance(int from, int to);
 
@@ -118,6 +118,13 @@ static inline int pte_zerofill_locked(pte_t pte)
 	return pte_flags(pte) & _PAGE_ZEROFILL_LOCKED;
 }
 
+/* Shares the bit with _PAGE_SPECIAL, which is only used by present ptes */
+static inline int pte_fill_pending(pte_t pte)
+{
+	return (pte_flags(pte) & (_PAGE_PRESENT | _PAGE_FILL_PENDING)) ==
+		_PAGE_FILL_PENDING;
+}
+
 static inline unsigned long pte_pfn(pte_t pte)
 {
 	return (pte_val(pte) & PTE_PFN_MASK) >> PAGE_SHIFT;
@@ -288,6 +295,11 @@ static inline pte_t pte_mkzerofill_locked(pte_t pte)
 	return pte_set_flags(pte, _PAGE_ZEROFILL_LOCKED);
 }
 
+static inline pte_t pte_mkfill_pending(pte_t pte)
+{
+	return pte_set_flags(pte, _PAGE_FILL_PENDING);
+}
+
 static inline pmd_t pmd_set_flags(pmd_t pmd, pmdval_t set)
 {
 	pmdval_t v = native_pmd_val(pmd);
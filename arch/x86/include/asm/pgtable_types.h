@@ -42,6 +42,7 @@
 
 #define _PAGE_BIT_ZEROFILL		_PAGE_BIT_SOFTW2 /* zero-fill pcache */
 #define _PAGE_BIT_ZEROFILL_LOCKED	_PAGE_BIT_SOFTW3 /* zero-fill pcache async net in progress */
+#define _PAGE_BIT_FILL_PENDING		_PAGE_BIT_SOFTW1 /* not present, pcache fill in progress */
 
 /* If _PAGE_BIT_PRESENT is clear, we use these: */
 /* - if the user mapped it with PROT_NONE; pte_present gives true */
@@ -76,6 +77,7 @@
 
 #define _PAGE_ZEROFILL		(_AT(pteval_t, 1) << _PAGE_BIT_ZEROFILL)
 #define _PAGE_ZEROFILL_LOCKED	(_AT(pteval_t, 1) << _PAGE_BIT_ZEROFILL_LOCKED)
+#define _PAGE_FILL_PENDING	(_AT(pteval_t, 1) << _PAGE_BIT_FILL_PENDING)
 
 #define _PAGE_PKEY_MASK (_PAGE_PKEY_BIT0 | \
 			 _PAGE_PKEY_BIT1 | \
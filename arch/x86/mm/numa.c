@@ -149,6 +149,28 @@ int __init numa_add_memblk(int nid, u64 start, u64 end)
 	return numa_add_memblk_to(nid, start, end, &numa_meminfo);
 }
 
+/**
+ * early_phys_to_nid - Find the node of a physical address
+ * @pa: the physical address
+ *
+ * Only valid during boot, since numa_meminfo is __initdata.
+ *
+ * RETURNS:
+ * node id, or NUMA_NO_NODE if @pa is not covered by any memblk.
+ */
+int __init early_phys_to_nid(u64 pa)
+{
+	int i;
+
+	for (i = 0; i < numa_meminfo.nr_blks; i++) {
+		struct numa_memblk *mb = &numa_meminfo.blk[i];
+
+		if (pa >= mb->start && pa < mb->end)
+			return mb->nid;
+	}
+	return NUMA_NO_NODE;
+}
+
 /*
  * Set nodes, which have memory in @mi, in *@nodemask.
  */
@@ -15,6 +15,7 @@
 #include <lego/kernel.h>
 #include <lego/spinlock.h>
 #include <lego/fcntl.h>
+#include <lego/comp_common.h>
 
 #define SEEK_SET	0	/* seek relative to beginning of file */
 #define SEEK_CUR	1	/* seek relative to current file position */
@@ -83,11 +84,15 @@
 
 struct file;
 
+struct iovec;
+struct file_cache;
 struct file_operations {
 	loff_t		(*llseek)(struct file *, loff_t, int);
 	int		(*open)(struct file *);
 	ssize_t 	(*read)(struct file *, char __user *, size_t, loff_t *);
 	ssize_t 	(*write)(struct file *, const char __user *, size_t, loff_t *);
+	ssize_t		(*readv)(struct file *, const struct iovec *, unsigned long, loff_t *);
+	ssize_t		(*writev)(struct file *, const struct iovec *, unsigned long, loff_t *);
 	int		(*release) (struct file *);
 	unsigned int	(*poll)(struct file *);
 };
@@ -115,6 +120,15 @@ struct file {
 	int			ready_size;
 
 	void			*private_data;
+
+#ifdef CONFIG_COMP_PROCESSOR
+	/* Memory's handle of regular files, see P2M_OPEN */
+	struct lego_file_token	f_token;
+	struct list_head	f_closed_list;
+#endif
+#ifdef CONFIG_PROCESSOR_FILE_CACHE
+	struct file_cache	*f_cache;
+#endif
 };
 
 #define NR_OPEN_DEFAULT		64
@@ -176,9 +190,21 @@ static inline void get_file(struct file *filp)
 	atomic_inc(&filp->f_count);
 }
 
+#ifdef CONFIG_COMP_PROCESSOR
+void close_file_token(struct file *filp);
+#endif
+
 static inline void __put_file(struct file *filp)
 {
 	BUG_ON(atomic_read(&filp->f_count) != 0);
+
+#ifdef CONFIG_COMP_PROCESSOR
+	/* Memory has to drop its handle first, it frees @filp */
+	if (file_token_valid(&filp->f_token)) {
+		close_file_token(filp);
+		return;
+	}
+#endif
 	kfree(filp);
 }
 
@@ -191,7 +217,7 @@ static inline void put_file(struct file *filp)
 int get_absolute_pathname(int dfd, char *k_pathname, const char __user *pathname);
 
 #ifdef CONFIG_MEM_PAGE_CACHE
-ssize_t get_file_size(const char *pathname);
+ssize_t get_file_size(struct file *filp);
 #endif
 
 /*
@@ -11,6 +11,7 @@
 #define _INCLUDE_FIT_API_H
 
 #include <lego/types.h>
+#include <lego/err.h>
 #include <lego/errno.h>
 #include <lego/atomic.h>
 #include <net/arch/cc.h>
@@ -23,6 +24,16 @@
 #define MY_NODE_ID	0
 #endif
 
+/*
+ * One RDMA WRITE pushed to the requester right before a reply.
+ * @remote_addr is a DMA address the requester got from ibapi_reg_mr_addr().
+ */
+struct fit_rdma_write_entry {
+	void	*local_addr;
+	u64	remote_addr;
+	u32	size;
+};
+
 #ifdef CONFIG_FIT
 
 #ifdef CONFIG_COUNTER_FIT_IB
@@ -82,6 +93,16 @@ struct fit_sglist {
 	int len;
 };
 
+/* QPs have 16 send SGEs, one is taken by FIT message header */
+#define FIT_MAX_SEND_SGE	15
+
+/*
+ * A send-reply posted by ibapi_send_reply_post(), and not waited yet.
+ * A thread may have at most FIT_MAX_PENDING_REPLIES of them.
+ */
+struct fit_pending_reply;
+#define FIT_MAX_PENDING_REPLIES	4
+
 void ibapi_free_recv_buf(void *input_buf);
 
 /* IMM related */
@@ -113,9 +134,19 @@ int ibapi_multicast_send_reply_timeout(int num_nodes, int *target_node,
 				struct fit_sglist *sglist, struct fit_sglist *output_msg,
 				int max_ret_size, int if_use_ret_phys_addr, unsigned long timeout_sec);
 
+int ibapi_send_reply_sge_timeout(int target_node, struct fit_sglist *sgl, int nr_sge,
+				 void *ret_addr, int max_ret_size, unsigned long timeout_sec);
+
+struct fit_pending_reply *
+ibapi_send_reply_post(int target_node, void *addr, int size,
+		      void *ret_addr, int max_ret_size);
+int ibapi_wait_reply(struct fit_pending_reply *pr, unsigned long timeout_sec);
+
 int ibapi_get_node_id(void);
 int ibapi_num_connected_nodes(void);
 
+u64 ibapi_reg_mr_addr(void *addr, size_t size);
+
 #ifdef CONFIG_SOCKET_O_IB
 
 int ibapi_sock_send_message(int target_node, int dest_port, int if_internal_port, void *buf, int size, unsigned long timeout_sec, int if_userspace); 
@@ -166,6 +197,21 @@ static inline int ibapi_receive_message(unsigned int designed_port, void *ret_ad
 					int receive_size, uintptr_t *descriptor)
 { return -EIO; }
 
+static inline int ibapi_send_reply_sge_timeout(int target_node, struct fit_sglist *sgl,
+				int nr_sge, void *ret_addr, int max_ret_size,
+				unsigned long timeout_sec)
+{ return -EIO; }
+
+static inline struct fit_pending_reply *
+ibapi_send_reply_post(int target_node, void *addr, int size,
+		      void *ret_addr, int max_ret_size)
+{ return ERR_PTR(-EIO); }
+
+static inline int ibapi_wait_reply(struct fit_pending_reply *pr,
+				   unsigned long timeout_sec)
+{ return -EIO; }
+
+static inline u64 ibapi_reg_mr_addr(void *addr, size_t size) { return 0; }
 static inline int ibapi_get_node_id(void) {return 0; }
 static inline int ibapi_num_connected_nodes(void) {return 0; };
 static inline int ibapi_sock_send_message(int target_node, int port, int if_internal_port, void *addr, int size, unsigned long timeout_sec, int if_userspace) {return 0; };
@@ -125,6 +125,12 @@ struct mm_struct {
 	int gpid;
 	struct list_head list;
 
+#ifdef CONFIG_PCACHE_PREFETCH
+	/* Pgtable changes vs. prefetch daemon, see pcache/prefetch.c */
+	atomic_t prefetch_blocked;
+	atomic_t nr_prefetch_inflight;
+#endif
+
 	cpumask_var_t cpu_vm_mask_var;		/* CPUs this VM has run on */
 };
 
@@ -29,14 +29,22 @@
  */
 
 #define P2M_HEARTBEAT		((__u32)0x10000000)
+#define P2M_FILE_LEASE		((__u32)0x10000001)
+#define P2M_FILE_LEASE_BREAK	((__u32)0x10000002)
 #define P2M_PCACHE_MISS		((__u32)0x20000000)
+#define P2M_PCACHE_PREFETCH	((__u32)0x20000001)
+#define P2M_PCACHE_MISS_BATCH	((__u32)0x20000002)
 #define P2M_PCACHE_FLUSH	((__u32)0x30000000)
 #define P2M_PCACHE_REPLICA	((__u32)0x30000001)
 #define P2M_PCACHE_ZEROFILL	((__u32)0x30000002)
+#define P2M_PCACHE_FLUSH_BATCH	((__u32)0x30000003)
+#define P2M_PCACHE_REPLICA_BATCH	((__u32)0x30000004)
 
 #define P2M_READ		((__u32)__NR_read)
 #define P2M_WRITE		((__u32)__NR_write)
+#define P2M_OPEN		((__u32)__NR_open)
 #define P2M_CLOSE		((__u32)__NR_close)
+#define P2M_FSTAT		((__u32)__NR_fstat)
 #define P2M_MMAP		((__u32)__NR_mmap)
 #define P2M_MPROTECT		((__u32)__NR_mprotect)
 #define P2M_MUNMAP		((__u32)__NR_munmap)
@@ -96,6 +104,10 @@
 #define M2S_BASE		((__u32)0x60000000)
 #define M2S_REPLICA_FLUSH	(M2S_BASE + 1)
 #define M2S_REPLICA_VMA		(M2S_BASE + 2)
+#define M2S_OPEN		(M2S_BASE + 3)
+#define M2S_CLOSE		(M2S_BASE + 4)
+#define M2S_READ_FH		(M2S_BASE + 5)	/* M2S_READ by handle */
+#define M2S_WRITE_FH		(M2S_BASE + 6)	/* M2S_WRITE by handle */
 
 /* Processor to GSM */
 #define P2GSM_COMMON		P2S_OPEN		/* Resue the open nr */
@@ -20,6 +20,23 @@
 
 #define MAX_FILENAME_LENGTH	256
 
+/*
+ * Handle of an opened file, returned by P2M_OPEN and M2S_OPEN.
+ * @nid is the node that keeps the handle table, @fid is the slot.
+ * @gen changes every time a slot is reused, so a stale token never
+ * hits another file. gen 0 is never handed out.
+ */
+struct lego_file_token {
+	__u32	nid;
+	__u32	fid;
+	__u32	gen;
+};
+
+static inline int file_token_valid(struct lego_file_token *token)
+{
+	return token->gen != 0;
+}
+
 #define COMMON_HEADER_ALIGNMENT (8)
 
 struct common_header {
@@ -22,6 +22,26 @@
  * should be changed!
  */
 
+/*
+ * M2S_OPEN
+ * Storage keeps the file open, and returns a token that
+ * M2S_READ_FH and M2S_WRITE_FH carry instead of the name.
+ */
+struct m2s_open_payload {
+	char	filename[MAX_FILENAME_LENGTH];
+	int	flags;
+};
+
+struct m2s_open_reply {
+	int			retval;
+	struct lego_file_token	token;
+};
+
+/* M2S_CLOSE, reply is an int */
+struct m2s_close_payload {
+	struct lego_file_token	token;
+};
+
 /* M2S_READ */
 /* M2S_WRITE */
 struct m2s_read_write_payload {
@@ -32,11 +52,35 @@ struct m2s_read_write_payload {
 	loff_t	offset;
 };
 
+/*
+ * Max bytes one M2S_READ returns. Storage returns a short read for
+ * larger requests, requester sends the next chunk from where it stopped.
+ * The reply is [ssize_t retval][retval bytes of content].
+ */
+#define M2S_READ_MAX_CHUNK	(2 * 1024 * 1024)
+
+/*
+ * M2S_READ_FH
+ * M2S_WRITE_FH
+ * Same as above, replies are the same too. Storage drops its handles
+ * when a file is renamed, unlinked or truncated, and returns -ESTALE.
+ * Requester should go on with the name then.
+ */
+struct m2s_fh_read_write_payload {
+	struct lego_file_token	token;
+	size_t			len;
+	loff_t			offset;
+};
+
 struct m2s_lseek_struct {
 	char filename[MAX_FILENAME_LENGTH];
 };
 
-/* M2S_REPLICA_FLUSH */
+/*
+ * M2S_REPLICA_FLUSH
+ * Logs may belong to different processes,
+ * storage splits them by log->meta.pid and vnode_id.
+ */
 struct m2s_replica_flush_msg {
 	unsigned int		opcode;
 	unsigned int		nr_log;
@@ -45,6 +89,9 @@ struct m2s_replica_flush_msg {
 	char			log[0];
 };
 
+/* Storage receive buffer size */
+#define M2S_REPLICA_FLUSH_MAX_SIZE	(2 * 1024 * 1024)
+
 /* M2S_REPLICA_VMA */
 struct m2s_replica_vma_msg {
 	unsigned int		opcode;
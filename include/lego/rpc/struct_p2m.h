@@ -48,6 +48,29 @@ struct p2m_flush_msg {
 
 void handle_p2m_flush_one(struct p2m_flush_msg *msg, struct thpool_buffer *tb);
 
+/*
+ * P2M_PCACHE_FLUSH_BATCH
+ *
+ * Several dirty lines that go to the same memory node, flushed in one
+ * request. Lines follow the message back to back, in entry order.
+ * The reply is an int: number of lines that failed.
+ */
+#define P2M_PCACHE_FLUSH_BATCH_MAX	8
+
+struct p2m_flush_batch_entry {
+	__u32			pid;
+	__u64			user_va;
+};
+
+struct p2m_flush_batch_msg {
+	struct common_header		header;
+	__u32				nr_entries;
+	struct p2m_flush_batch_entry	entries[P2M_PCACHE_FLUSH_BATCH_MAX];
+};
+
+void handle_p2m_flush_batch(struct p2m_flush_batch_msg *msg,
+			    struct thpool_buffer *tb);
+
 /*
  * P2M_MISS
  */
@@ -79,20 +102,176 @@ struct p2m_pcache_miss_reply_struct {
 void handle_p2m_pcache_miss(struct p2m_pcache_miss_msg *msg,
 			    struct thpool_buffer *b);
 
+/*
+ * P2M_PCACHE_MISS_BATCH
+ *
+ * Misses from different threads (and processes) that go to the same
+ * memory node at the same time, sent in one request. Entries are
+ * independent and can be anywhere in the address space.
+ *
+ * The reply starts with a per-entry status array, followed by the lines
+ * back to back. A line slot is only valid if its status is 0.
+ *
+ * If @line_addr of an entry is set, memory RDMA writes the line straight
+ * into that processor pcache line, and it takes no slot in the reply.
+ * If those writes fail, the reply is a single int RET_EAGAIN instead.
+ */
+#define P2M_PCACHE_MISS_BATCH_MAX	16
+
+struct p2m_pcache_miss_batch_entry {
+	__u32			pid;
+	__u32			tgid;
+	__u32			flags;
+	__u64			missing_vaddr;
+	__u64			line_addr;
+};
+
+struct p2m_pcache_miss_batch_msg {
+	struct common_header			header;
+	__u32					nr_entries;
+	struct p2m_pcache_miss_batch_entry	entries[P2M_PCACHE_MISS_BATCH_MAX];
+};
+
+struct p2m_pcache_miss_batch_reply {
+	__s32			status[P2M_PCACHE_MISS_BATCH_MAX];
+	char			data[0];
+};
+
+void handle_p2m_pcache_miss_batch(struct p2m_pcache_miss_batch_msg *msg,
+				  struct thpool_buffer *tb);
+
+/*
+ * P2M_PCACHE_PREFETCH
+ *
+ * Ask memory to fill @nr_lines pcache lines, starting from @start_vaddr,
+ * and each @stride bytes apart. The reply carries all lines back to back.
+ * Memory stops at the first line it fails to establish, so processor
+ * learns the number of valid lines from the reply length.
+ *
+ * If P2M_PREFETCH_RDMA_WRITE is set, memory RDMA writes line i straight
+ * into @line_addr[i], and the reply is a p2m_pcache_prefetch_rdma_reply.
+ * If those writes fail, the reply is a single int RET_EAGAIN instead,
+ * which processor tells apart by length.
+ */
+#define P2M_PCACHE_PREFETCH_MAX_LINES	64
+
+#define P2M_PREFETCH_RDMA_WRITE		0x1
+
+struct p2m_pcache_prefetch_msg {
+	struct common_header	header;
+	__u32			pid;
+	__u32			tgid;
+	__u32			flags;
+	__u32			nr_lines;
+	__s64			stride;
+	__u64			start_vaddr;
+	__u32			mode;
+	__u64			line_addr[P2M_PCACHE_PREFETCH_MAX_LINES];
+};
+
+struct p2m_pcache_prefetch_rdma_reply {
+	__s32			status;
+	__u32			nr_lines;	/* lines written */
+};
+
+void handle_p2m_pcache_prefetch(struct p2m_pcache_prefetch_msg *msg,
+				struct thpool_buffer *tb);
+
 struct p2m_replica_msg {
 	struct common_header	header;
 	struct replica_log	log;
 } __packed;
 void handle_p2m_replica(void *_msg, struct thpool_buffer *tb);
 
+/*
+ * P2M_PCACHE_REPLICA_BATCH
+ * Logs may belong to different processes. Reply is an int,
+ * the number of logs appended, or negative on failure.
+ */
+#define P2M_PCACHE_REPLICA_BATCH_MAX	16
+
+struct p2m_replica_batch_msg {
+	struct common_header	header;
+	__u32			nr_logs;
+	__u32			reserved;
+	struct replica_log	logs[0];
+} __packed __aligned(8);
+void handle_p2m_replica_batch(struct p2m_replica_batch_msg *msg,
+			      struct thpool_buffer *tb);
+
+/*
+ * P2M_OPEN
+ * Sent after storage opened the file. Memory keeps the name and
+ * returns a token, that all later file messages carry instead.
+ */
+struct p2m_open_struct {
+	char	filename[MAX_FILENAME_LENGTH];
+	int	flags;
+	__u32	storage_node;
+	__u32	want_lease;	/* processor caches file data */
+};
+
+/*
+ * A processor may serve reads from its own cache for @lease_msec since
+ * it sent the request, as long as @version does not change. @lease_msec
+ * is 0 if not granted. @file_id is the same for all opens of a file.
+ */
+struct p2m_file_lease {
+	__u64	file_id;
+	__u32	version;
+	__u32	lease_msec;
+};
+
+struct p2m_open_reply {
+	int			retval;
+	struct lego_file_token	token;
+	struct p2m_file_lease	lease;
+};
+void handle_p2m_open(struct p2m_open_struct *payload,
+		     struct common_header *hdr, struct thpool_buffer *tb);
+
+/*
+ * P2M_FILE_LEASE
+ * Renew the lease of an opened file
+ */
+struct p2m_file_lease_struct {
+	struct lego_file_token	token;
+};
+
+struct p2m_file_lease_reply {
+	int			retval;
+	struct p2m_file_lease	lease;
+};
+void handle_p2m_file_lease(struct p2m_file_lease_struct *payload,
+			   struct common_header *hdr, struct thpool_buffer *tb);
+
+/*
+ * P2M_FILE_LEASE_BREAK
+ * The file was truncated or unlinked at storage directly. Memory bumps
+ * its version once all leases have expired. Reply is an int, 0 or
+ * -EAGAIN if leases are still out.
+ */
+struct p2m_file_lease_break_struct {
+	char	filename[MAX_FILENAME_LENGTH];
+};
+void handle_p2m_file_lease_break(struct p2m_file_lease_break_struct *payload,
+				 struct common_header *hdr, struct thpool_buffer *tb);
+
+/*
+ * P2M_WRITE and P2M_RENAME return -EAGAIN if other processors still
+ * hold leases on the file. Memory grants no new ones meanwhile, the
+ * requester sends it again a bit later.
+ */
+#define P2M_LEASE_RETRY_MSEC	1
+
 /*
  * P2M_READ
  * P2M_WRITE
  */
 
 /*
- * We need pass the filename, uid, flags, len, offset
- * and virtual address of user buffer to memory component
+ * We need pass the file token, len, offset and virtual
+ * address of user buffer to memory component.
  * Also we need nid and pid to convert user virtual address
  * to coresponding kernel virtual address.
  */
@@ -100,12 +279,17 @@ struct p2m_read_write_payload {
 	u32	pid;
 	u32	tgid;
 	char __user *buf;
-	int	uid;
-	char	filename[MAX_FILENAME_LENGTH];
-	int	flags;
+	struct lego_file_token token;
 	ssize_t	len;
 	loff_t	offset;
 };
+
+/*
+ * Larger reads and writes are split into chunks of this size, several
+ * of them in flight. Memory's rx buffer limits a write chunk.
+ */
+#define P2M_RW_CHUNK_SIZE	(16 * PAGE_SIZE)
+
 void handle_p2m_read(struct p2m_read_write_payload *payload,
 		     struct common_header *hdr, struct thpool_buffer *tb);
 void handle_p2m_write(struct p2m_read_write_payload *payload,
@@ -113,11 +297,18 @@ void handle_p2m_write(struct p2m_read_write_payload *payload,
 
 /*
  * P2M_CLOSE
+ * Tokens of files whose last reference went away.
+ * Reply is an int, the number of tokens released.
  */
-struct p2m_close_struct {
-	__u32 pid;
+#define P2M_CLOSE_BATCH_MAX	32
+
+struct p2m_close_msg {
+	struct common_header	header;
+	__u32			nr_tokens;
+	__u32			reserved;
+	struct lego_file_token	tokens[0];
 };
-int handle_p2m_close(struct p2m_close_struct *, u64, struct common_header *);
+void handle_p2m_close(struct p2m_close_msg *msg, struct thpool_buffer *tb);
 
 /*
  * P2M_FORK
@@ -306,8 +497,7 @@ void handle_p2m_drop_page_cache(struct common_header *hdr, struct thpool_buffer
 
 #ifdef CONFIG_MEM_PAGE_CACHE
 struct p2m_lseek_struct {
-	char filename[MAX_FILENAME_LENGTH];
-	__u32 storage_node;
+	struct lego_file_token token;
 };
 int handle_p2m_lseek(struct p2m_lseek_struct *payload,
 		     struct common_header *hdr, struct thpool_buffer *tb);
@@ -328,11 +518,16 @@ struct p2m_stat_struct {
 };
 int handle_p2m_stat(struct p2m_stat_struct *payload,
 		    struct common_header *hdr, struct thpool_buffer *tb);
+
+struct p2m_fstat_struct {
+	struct lego_file_token token;
+};
+int handle_p2m_fstat(struct p2m_fstat_struct *payload,
+		     struct common_header *hdr, struct thpool_buffer *tb);
 #endif /* CONFIG_MEM_PAGE_CACHE */
 
 struct p2m_fsync_struct {
-	char filename[MAX_FILENAME_LENGTH];
-	__u32 storage_node;
+	struct lego_file_token token;
 };
 
 #endif /* _LEGO_RPC_STRUCT_P2M_H */
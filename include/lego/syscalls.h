@@ -85,7 +85,24 @@ static inline int syscall_filename(const char __user *pathname)
 #define SYSCALL_DEFINEx(x, sname, ...)				\
 	__SYSCALL_DEFINEx(x, sname, __VA_ARGS__)
 
+/*
+ * sys_xxx is an alias of SyS_xxx, which takes all arguments as long
+ * and casts them back. gcc 8+ warns about the type mismatch of every
+ * such alias, silence it for the wrapper only.
+ */
+#if defined(__GNUC__) && __GNUC__ >= 8
+#define __SYSCALL_ALIAS_DIAG_PUSH					\
+	_Pragma("GCC diagnostic push")					\
+	_Pragma("GCC diagnostic ignored \"-Wattribute-alias\"")
+#define __SYSCALL_ALIAS_DIAG_POP					\
+	_Pragma("GCC diagnostic pop")
+#else
+#define __SYSCALL_ALIAS_DIAG_PUSH
+#define __SYSCALL_ALIAS_DIAG_POP
+#endif
+
 #define __SYSCALL_DEFINEx(x, name, ...)					\
+	__SYSCALL_ALIAS_DIAG_PUSH					\
 	asmlinkage long sys##name(__MAP(x,__SC_DECL,__VA_ARGS__))	\
 		__attribute__((alias(__stringify(SyS##name))));		\
 	static inline long SYSC##name(__MAP(x,__SC_DECL,__VA_ARGS__));	\
@@ -96,6 +113,7 @@ static inline int syscall_filename(const char __user *pathname)
 		__MAP(x,__SC_TEST,__VA_ARGS__);				\
 		return ret;						\
 	}								\
+	__SYSCALL_ALIAS_DIAG_POP					\
 	static inline long SYSC##name(__MAP(x,__SC_DECL,__VA_ARGS__))
 
 asmlinkage long sys_read(unsigned int fd, char __user *buf, size_t count);
@@ -110,6 +128,12 @@ asmlinkage long sys_pwrite64(unsigned int fd, const char __user *buf,
 asmlinkage long sys_writev(unsigned long fd,
 			   const struct iovec __user *vec,
 			   unsigned long vlen);
+asmlinkage long sys_preadv(unsigned long fd, const struct iovec __user *vec,
+			   unsigned long vlen, unsigned long pos_l,
+			   unsigned long pos_h);
+asmlinkage long sys_pwritev(unsigned long fd, const struct iovec __user *vec,
+			    unsigned long vlen, unsigned long pos_l,
+			    unsigned long pos_h);
 asmlinkage long sys_open(const char __user *filename, int flags, umode_t mode);
 asmlinkage long sys_openat(int dfd, const char __user *filename,
 			int flags, umode_t mode);
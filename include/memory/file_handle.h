@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2016-2018 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _LEGO_MEMORY_FILE_HANDLE_H_
+#define _LEGO_MEMORY_FILE_HANDLE_H_
+
+#include <lego/atomic.h>
+#include <lego/kernel.h>
+#include <lego/rpc/struct_common.h>
+
+struct lego_pgcache_file;
+
+/*
+ * A file opened by processor, found by the token that
+ * P2M_OPEN returned. Thus file messages do not carry the name,
+ * and we do not hash it for each read and write.
+ */
+struct memory_fh {
+	char			filename[MAX_FILENAME_LENGTH];
+	unsigned int		storage_node;
+	atomic_t		refcount;
+
+#ifdef CONFIG_MEM_PAGE_CACHE
+	/* pgcache files are never freed */
+	struct lego_pgcache_file *pgfile;
+#else
+	/* Storage handle, invalid if storage did not give us one */
+	struct lego_file_token	storage_token;
+#endif
+};
+
+struct memory_fh *memory_fh_get(struct lego_file_token *token);
+void memory_fh_put(struct memory_fh *fh);
+
+#endif /* _LEGO_MEMORY_FILE_HANDLE_H_ */
@@ -10,6 +10,7 @@
 #ifndef _LEGO_MEMORY_FILE_OPS_H_
 #define _LEGO_MEMORY_FILE_OPS_H_
 
+#include <lego/comp_common.h>
 #include <memory/task.h>
 #include <memory/file_types.h>
 
@@ -32,9 +33,25 @@ ssize_t storage_read(struct lego_task_struct *tsk,
 			    char *buf, size_t count, loff_t *pos);
 
 ssize_t __storage_read(struct lego_task_struct *tsk, char *f_name,
+		       struct lego_file_token *token,
 		       char __user *buf, size_t count, loff_t *pos);
 
 ssize_t __storage_write(struct lego_task_struct *tsk, char *f_name,
+			struct lego_file_token *token,
 			const char *buf, size_t count, loff_t *pos);
 
+/* M2S handles, see m2s_read_write.c */
+int m2s_open(char *f_name, unsigned int storage_node,
+	     struct lego_file_token *token);
+void m2s_close(unsigned int storage_node, struct lego_file_token *token);
+
+/* Longest header of an M2S read or write, the by-name one */
+#define M2S_RW_HDR_MAX	(sizeof(u32) + sizeof(struct m2s_read_write_payload))
+
+u32 m2s_rw_header(void *msg, bool write, char *f_name,
+		  struct lego_file_token *token, size_t len, loff_t offset);
+ssize_t m2s_rw_send(unsigned int storage_node, void *msg, u32 hdr_len,
+		    size_t count, void *retbuf, u32 len_ret,
+		    char *f_name, struct lego_file_token *token);
+
 #endif /* _LEGO_MEMORY_FILE_OPS_H_ */
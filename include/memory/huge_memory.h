@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2016-2018 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Transparent huge page backing at memory manager
+ *
+ * Large anonymous VMAs are backed by 2MB blocks, mapped by a single
+ * huge pmd, which holds the kernel virtual address of the block, same
+ * as ptes do. Processor still sees 4KB pages: a pcache miss is served
+ * with the 4KB page inside the block.
+ *
+ * A huge pmd is split into 512 ptes whenever an operation only covers
+ * part of it (partial munmap, unaligned mremap).
+ */
+
+#ifndef _LEGO_MEMORY_HUGE_MEMORY_H_
+#define _LEGO_MEMORY_HUGE_MEMORY_H_
+
+#include <asm/pgtable.h>
+#include <memory/vm.h>
+
+#define HPAGE_PMD_SHIFT		PMD_SHIFT
+#define HPAGE_PMD_SIZE		PMD_SIZE
+#define HPAGE_PMD_MASK		PMD_MASK
+#define HPAGE_PMD_ORDER		(HPAGE_PMD_SHIFT - PAGE_SHIFT)
+#define HPAGE_PMD_NR		(1 << HPAGE_PMD_ORDER)
+
+#ifdef CONFIG_MEM_THP
+static inline bool lego_pmd_trans_huge(pmd_t pmd)
+{
+	return pmd_large(pmd);
+}
+
+static inline bool lego_pmd_write(pmd_t pmd)
+{
+	return pmd_flags(pmd) & _PAGE_RW;
+}
+
+/* Kernel virtual address of the 2MB block */
+static inline unsigned long lego_pmd_huge_vaddr(pmd_t pmd)
+{
+	return (unsigned long)pmd_val(pmd) & HPAGE_PMD_MASK;
+}
+
+/* Kernel virtual address of the 4KB page that @address falls into */
+static inline unsigned long lego_pmd_huge_page(pmd_t pmd, unsigned long address)
+{
+	return lego_pmd_huge_vaddr(pmd) + (address & ~HPAGE_PMD_MASK & PAGE_MASK);
+}
+
+bool lego_thp_suitable(struct vm_area_struct *vma, unsigned long address);
+int do_huge_pmd_anonymous_page(struct vm_area_struct *vma,
+			       unsigned long address, pmd_t *pmd);
+
+int lego_split_huge_pmd(struct lego_mm_struct *mm, pmd_t *pmd);
+void lego_zap_huge_pmd(struct lego_mm_struct *mm, pmd_t *pmd);
+void lego_copy_huge_pmd(struct lego_mm_struct *dst_mm, struct lego_mm_struct *src_mm,
+			pmd_t *dst_pmd, pmd_t *src_pmd, struct vm_area_struct *vma);
+bool lego_move_huge_pmd(struct lego_mm_struct *mm, unsigned long new_addr,
+			pmd_t *old_pmd, pmd_t *new_pmd);
+#else
+static inline bool lego_pmd_trans_huge(pmd_t pmd) { return false; }
+static inline bool lego_pmd_write(pmd_t pmd) { return false; }
+static inline unsigned long lego_pmd_huge_vaddr(pmd_t pmd) { return 0; }
+static inline unsigned long lego_pmd_huge_page(pmd_t pmd, unsigned long address)
+{
+	return 0;
+}
+
+static inline bool lego_thp_suitable(struct vm_area_struct *vma, unsigned long address)
+{
+	return false;
+}
+
+static inline int do_huge_pmd_anonymous_page(struct vm_area_struct *vma,
+					     unsigned long address, pmd_t *pmd)
+{
+	return -ENOMEM;
+}
+
+static inline int lego_split_huge_pmd(struct lego_mm_struct *mm, pmd_t *pmd)
+{
+	return 0;
+}
+
+static inline void lego_zap_huge_pmd(struct lego_mm_struct *mm, pmd_t *pmd) { }
+static inline void lego_copy_huge_pmd(struct lego_mm_struct *dst_mm,
+				      struct lego_mm_struct *src_mm,
+				      pmd_t *dst_pmd, pmd_t *src_pmd,
+				      struct vm_area_struct *vma) { }
+static inline bool lego_move_huge_pmd(struct lego_mm_struct *mm, unsigned long new_addr,
+				      pmd_t *old_pmd, pmd_t *new_pmd)
+{
+	return false;
+}
+#endif /* CONFIG_MEM_THP */
+
+#endif /* _LEGO_MEMORY_HUGE_MEMORY_H_ */
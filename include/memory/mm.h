@@ -14,6 +14,7 @@
 #include <lego/rbtree.h>
 #include <lego/rwsem.h>
 #include <lego/auxvec.h>
+#include <lego/seqlock.h>
 #include <lego/spinlock.h>
 #include <lego/hashtable.h>
 
@@ -103,6 +104,7 @@ struct vma_tree {
 struct lego_mm_struct {
 	struct vm_area_struct *mmap;
 	struct rb_root mm_rb;
+	struct vm_area_struct *vmacache;	/* last find_vma() result */
 	unsigned long highest_vm_end;
 
 	unsigned long (*get_unmapped_area)(struct lego_task_struct *p,
@@ -139,6 +141,12 @@ struct lego_mm_struct {
 	struct rw_semaphore mmap_sem;
 	struct lego_task_struct *task;
 
+	/*
+	 * Bumped around pgtable teardown, pte moves and fork's write
+	 * protect. Lets pcache miss walk pgtable without mmap_sem.
+	 */
+	seqcount_t pgtable_seq;
+
 #ifdef CONFIG_DISTRIBUTED_VMA_MEMORY
 	/*
 	 * distributed vma range limit management array. Unlike processor side, size of 
@@ -167,6 +175,24 @@ struct lego_mm_struct {
 #endif /* CONFIG_DISTRIBUTED_VMA_MEMORY */
 };
 
+static inline void vmacache_invalidate(struct lego_mm_struct *mm,
+				       struct vm_area_struct *vma)
+{
+	if (mm->vmacache == vma)
+		WRITE_ONCE(mm->vmacache, NULL);
+}
+
+/* Caller holds mmap_sem for write, or mm has no other user */
+static inline void lego_pgtable_write_begin(struct lego_mm_struct *mm)
+{
+	write_seqcount_begin(&mm->pgtable_seq);
+}
+
+static inline void lego_pgtable_write_end(struct lego_mm_struct *mm)
+{
+	write_seqcount_end(&mm->pgtable_seq);
+}
+
 static inline unsigned long lego_pte_to_virt(pte_t pte)
 {
 	return pte_val(pte) & PTE_VFN_MASK;
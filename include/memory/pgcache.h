@@ -12,6 +12,8 @@
 
 #include <lego/kernel.h>
 #include <lego/slab.h>
+#include <lego/rwsem.h>
+#include <lego/radixtree.h>
 #include <lego/comp_memory.h>
 #include <lego/comp_common.h>
 #include <memory/task.h>
@@ -29,10 +31,11 @@ static inline void pgcache_debug(const char *fmt, ...) {  }
 #define PGCACHE_HASH_BITS	10
 #define PGCACHE_PREFETCH_ORDER	6 /* How many pages to read to page cache while cache miss */
 
+#define CL_SHIFT		(PAGE_SHIFT + PGCACHE_PREFETCH_ORDER)
 #define CL_SIZE			(PAGE_SIZE*(1 << PGCACHE_PREFETCH_ORDER))
-#define POS_MASK		~(CL_SIZE - 1)
-#define aligned_pos(x)		x & POS_MASK
-#define chunk_offset(x)		x & (~POS_MASK)
+#define POS_MASK		(~(CL_SIZE - 1))
+#define aligned_pos(x)		((x) & POS_MASK)
+#define chunk_offset(x)		((x) & (~POS_MASK))
 
 struct lego_pgcache_struct {
 
@@ -40,13 +43,14 @@ struct lego_pgcache_struct {
 	char 			filepath[MAX_FILENAME_LENGTH];
 	u32 			real_len;	/* real length is likely to be smaller than
 						 * cacheline size if file size is small */
-	spinlock_t 		lock;		/* lock to protect lego_pgcache_struct */
+	spinlock_t 		lock;		/* lock to protect lego_pgcache_struct,
+						 * cached_pages is freed under it */
 	bool 			dirty;
 	bool 			hir;		/* this cacheline is HIR */
 
 	unsigned int 		storage_node;	/* cached result of storage node of this cacheline */
 
-	struct hlist_node 	link;
+	struct lego_pgcache_file *file;		/* the file this cacheline belongs to */
 	
 	struct list_head 	dirtylist;
 	
@@ -67,50 +71,128 @@ struct lego_pgcache_file {
 	spinlock_t 		dirtylist_lock;
 
 	unsigned int 		storage_node;		/* will be used later */
+	struct lego_file_token	storage_token;		/* storage's handle, or invalid */
+
+	/* cachelines of this file, indexed by pos >> CL_SHIFT */
+	spinlock_t		tree_lock;
+	struct radix_tree_root	tree;
+
+	/*
+	 * Readers, writers, fsync and background daemons (write behind,
+	 * read ahead) hold it for read while they use lines of this file,
+	 * drop holds it for write while it frees them.
+	 */
+	struct rw_semaphore	drop_sem;
+
+	/* leases to processors' file caches, see lease.c */
+	u64			file_id;
+	spinlock_t		lease_lock;
+	u32			version;	/* bumped after each change */
+	unsigned long		lease_expire;	/* jiffies, latest one granted */
+	int			lease_nid;	/* the only holder, or -1 */
+	unsigned long		lease_hold;	/* jiffies, grant none until then */
+	int			nr_lease_writers;
+
+#ifdef CONFIG_MEM_PAGE_CACHE_READAHEAD
+	/* sequential read detection, in line index */
+	spinlock_t		ra_lock;
+	unsigned long		ra_last;	/* last accessed line */
+	unsigned long		ra_next;	/* first line not read ahead yet */
+	unsigned int		ra_window;	/* nr of lines to read ahead */
+#endif
 };
 
 /* alloc.c */
-struct lego_pgcache_struct *__alloc_pgcache(char *filepath, loff_t pos,
-		unsigned int storage_node);
+struct lego_pgcache_struct *__alloc_pgcache(struct lego_pgcache_file *file,
+		loff_t pos);
 void __free_pgcache_locked(struct lego_pgcache_struct *pgc);
 void __free_pgcache_struct(struct lego_pgcache_struct *pgc);
 
 /* hlist.c */
-int ht_insert_lego_pgcache_struct(struct lego_pgcache_struct *pgc);
-void ht_remove_lego_pgcache_struct(struct lego_pgcache_struct *pgc);
+struct lego_pgcache_struct *
+insert_lego_pgcache_struct(struct lego_pgcache_struct *pgc);
+void remove_lego_pgcache_struct(struct lego_pgcache_struct *pgc);
 void free_lego_pgcache_struct(struct lego_pgcache_struct *pgc);
 struct lego_pgcache_struct *							\
-	find_lego_pgcache_struct(char *filepath, loff_t pos);
+	find_lego_pgcache_struct(struct lego_pgcache_file *file, loff_t pos);
+void rename_lego_pgcache_structs(struct lego_pgcache_file *file, char *newname);
+void drop_lego_pgcache_structs(struct lego_pgcache_file *file);
 int drop_pgcache(void);
 
 /* dirtylist.c */
 struct lego_pgcache_file *lego_pgcache_file_open(char *filepath,		\
 		unsigned int storage_node);
+struct lego_pgcache_file *find_or_open_lego_pgcache_file(char *filepath,	\
+		unsigned int storage_node);
+int pgcache_flush_file(struct lego_pgcache_file *file);
+void pgcache_for_each_file(void (*fn)(struct lego_pgcache_file *file));
 
 int ht_insert_lego_pgcache_file(struct lego_pgcache_file *file);
 void ht_remove_lego_pgcache_file(struct lego_pgcache_file *file);
 void free_lego_pgcache_file(struct lego_pgcache_file *file);
 struct lego_pgcache_file *find_lego_pgcache_file(char *filepath);
 
-void mark_lego_pgcache_dirty(struct lego_pgcache_struct *pgc,			\
+void mark_lego_pgcache_dirty_locked(struct lego_pgcache_struct *pgc,		\
 			struct lego_pgcache_file *file);
 void make_lego_pgcache_clean(struct lego_pgcache_struct *pgc);
-int handle_p2m_fsync(char *payload, struct common_header *hdr, 			\
-		     struct thpool_buffer *tb);
+void make_lego_pgcache_clean_locked(struct lego_pgcache_struct *pgc);
+int handle_p2m_fsync(struct p2m_fsync_struct *payload,				\
+		     struct common_header *hdr, struct thpool_buffer *tb);
 
 /* read_write.c */
+ssize_t pgcache_read_storage(struct lego_pgcache_file *file,
+		loff_t pos, u32 count, void *retbuf);
+struct lego_pgcache_struct *
+install_cacheline(struct lego_pgcache_struct *pgc);
 ssize_t flush_one_cacheline_locked(struct lego_pgcache_struct *pgc);
-ssize_t lego_pgcache_read(struct lego_task_struct *tsk, char *f_name,		\
-		unsigned int storage_node, char __user *buf,			\
+ssize_t lego_pgcache_read(struct lego_task_struct *tsk,			\
+		struct lego_pgcache_file *file, char __user *buf,		\
 		size_t count, loff_t *pos);
 
-ssize_t lego_pgcache_write(struct lego_task_struct *tsk, char *f_name,	\
-		unsigned int storage_node, char __user *buf,			\
+ssize_t lego_pgcache_write(struct lego_task_struct *tsk,			\
+		struct lego_pgcache_file *file, char __user *buf,		\
 		size_t count, loff_t *pos);
 
 /* eviction.c */
 void update_lirs_structure(struct lego_pgcache_struct *pgc);
 void pgcache_evict_one(void);
+void pgcache_lirs_forget_file(struct lego_pgcache_file *file);
+
+#ifdef CONFIG_MEM_PAGE_CACHE
+void __init pgcache_init(void);
+#else
+static inline void pgcache_init(void) { }
+#endif
+
+/* lease.c */
+#define PGCACHE_LEASE_MSEC	20
+
+void pgcache_lease_file_init(struct lego_pgcache_file *file);
+u32 pgcache_lease_grant(struct lego_pgcache_file *file, unsigned int nid,
+			u32 *version);
+int pgcache_lease_write_begin(struct lego_pgcache_file *file, unsigned int nid);
+void pgcache_lease_write_end(struct lego_pgcache_file *file);
+int pgcache_lease_break(struct lego_pgcache_file *file);
+
+/* readahead.c */
+#ifdef CONFIG_MEM_PAGE_CACHE_READAHEAD
+void pgcache_readahead_file_init(struct lego_pgcache_file *file);
+void pgcache_readahead(struct lego_pgcache_file *file, loff_t pos, size_t count);
+void __init pgcache_readahead_init(void);
+#else
+static inline void pgcache_readahead_file_init(struct lego_pgcache_file *file) { }
+static inline void
+pgcache_readahead(struct lego_pgcache_file *file, loff_t pos, size_t count) { }
+static inline void pgcache_readahead_init(void) { }
+#endif
+
+/* writeback.c */
+#ifdef CONFIG_MEM_PAGE_CACHE_WRITE_BEHIND
+int pgcache_writeback_file(struct lego_pgcache_file *file);
+void __init pgcache_writeback_init(void);
+#else
+static inline void pgcache_writeback_init(void) { }
+#endif
 
 ssize_t get_file_size_from_storage(char *filepath, unsigned int storage_node);
 
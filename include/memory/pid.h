@@ -12,6 +12,7 @@
 
 #include <memory/task.h>
 
+void __init lego_task_hash_init(void);
 void free_lego_task(struct lego_task_struct *tsk);
 
 int __must_check ht_insert_lego_task(struct lego_task_struct *tsk);
@@ -15,8 +15,12 @@
 enum memory_manager_stat_item {
 	/* Handler */
 	HANDLE_PCACHE_MISS,
+	HANDLE_PCACHE_MISS_BATCH,
+	HANDLE_PCACHE_PREFETCH,
 	HANDLE_PCACHE_FLUSH,
+	HANDLE_PCACHE_FLUSH_BATCH,
 	HANDLE_PCACHE_REPLICA,
+	HANDLE_PCACHE_REPLICA_BATCH,
 	HANDLE_P2M_MMAP,
 	HANDLE_P2M_MUNMAP,
 	HANDLE_P2M_BRK,
@@ -27,6 +31,29 @@ enum memory_manager_stat_item {
 	HANDLE_WRITE,
 
 	NR_BATCHED_LOG_FLUSH,
+	NR_REPLICA_FLUSH_MSG,
+	NR_REPLICA_FLUSH_LOGS,
+	NR_REPLICA_FLUSH_NS,
+
+	/* pgcache */
+	NR_PGCACHE_READAHEAD,
+	NR_PGCACHE_READAHEAD_LINES,
+	NR_PGCACHE_WRITEBACK,
+	NR_PGCACHE_WRITEBACK_LINES,
+
+	/* Thpool backpressure */
+	NR_THPOOL_RING_FULL,
+	NR_THPOOL_BUFFER_FULL,
+
+	/* Miss path */
+	NR_VMACACHE_HIT,
+	NR_PCACHE_MISS_FAST,
+	NR_PCACHE_MISS_FAST_RACE,
+
+	/* THP */
+	NR_THP_FAULT,
+	NR_THP_FAULT_FALLBACK,
+	NR_THP_SPLIT,
 
 	NR_MEMORY_MANAGER_STAT_ITEMS,
 };
@@ -48,9 +75,15 @@ static inline void inc_mm_stat(enum memory_manager_stat_item i)
 	atomic_long_inc(&memory_manager_stats.stat[i]);
 }
 
+static inline void add_mm_stat(enum memory_manager_stat_item i, long nr)
+{
+	atomic_long_add(nr, &memory_manager_stats.stat[i]);
+}
+
 void print_memory_manager_stats(void);
 #else
 static inline void inc_mm_stat(enum memory_manager_stat_item i) { }
+static inline void add_mm_stat(enum memory_manager_stat_item i, long nr) { }
 static inline void print_memory_manager_stats(void) { }
 #endif
 
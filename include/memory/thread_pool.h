@@ -13,6 +13,7 @@
 #include <lego/list.h>
 #include <lego/sched.h>
 #include <lego/spinlock.h>
+#include <lego/fit_ibapi.h>
 #include <lego/comp_common.h>
 
 /*
@@ -23,6 +24,9 @@
 
 #define NR_THPOOL_BUFFER	(256)
 
+/* Maximum RDMA WRITEs a handler can push before its reply */
+#define THPOOL_MAX_RDMA_WRITES	(64)
+
 #define NR_THPOOL_WORKERS	CONFIG_THPOOL_NR_WORKERS
 
 struct thpool_buffer;
@@ -36,32 +40,79 @@ struct tw_padding {
 #define QUEUING_STAT_STRIDE_NS	(QUEUING_STAT_STRIDE_US*1000)
 #define QUEUING_STAT_ENTRIES	(40)
 
+/*
+ * Requests are classified by opcode. If CONFIG_THPOOL_CLASSES is
+ * enabled, each class is served by its own set of workers, so that
+ * pcache misses will not wait behind fork or file I/O.
+ * Queuing stats are always reported per class.
+ */
+enum thpool_class {
+	THPOOL_CLASS_LATENCY,	/* pcache miss, flush, zerofill */
+	THPOOL_CLASS_VM,	/* mmap, munmap, brk, etc. */
+	THPOOL_CLASS_SLOW,	/* file I/O, fork, execve, checkpoint */
+
+	NR_THPOOL_CLASSES,
+};
+
+#ifdef CONFIG_THPOOL_CLASSES
+/* Leave at least one worker to each of the following classes */
+#define NR_THPOOL_LATENCY_WORKERS					\
+	(CONFIG_THPOOL_NR_LATENCY_WORKERS < NR_THPOOL_WORKERS - 2 ?	\
+	 CONFIG_THPOOL_NR_LATENCY_WORKERS : NR_THPOOL_WORKERS - 2)
+#define NR_THPOOL_VM_WORKERS						\
+	(CONFIG_THPOOL_NR_VM_WORKERS <					\
+	 NR_THPOOL_WORKERS - NR_THPOOL_LATENCY_WORKERS - 1 ?		\
+	 CONFIG_THPOOL_NR_VM_WORKERS :					\
+	 NR_THPOOL_WORKERS - NR_THPOOL_LATENCY_WORKERS - 1)
+#define NR_THPOOL_SLOW_WORKERS		\
+	(NR_THPOOL_WORKERS - NR_THPOOL_LATENCY_WORKERS - NR_THPOOL_VM_WORKERS)
+#endif
+
+struct thpool_class_stat {
+	unsigned long		nr_handled;
+	unsigned long		total_queuing_delay_ns;
+	unsigned long		max_queuing_delay_ns;
+
+	/* us: [0, 5), [5, 10) ... [195, 200) */
+	unsigned long		queuing_stats[QUEUING_STAT_ENTRIES];
+};
+
+/*
+ * Each worker has a ring of pending requests. The FIT polling thread is the
+ * only producer, it moves @head. Consumers are the owner worker and, if
+ * work stealing is enabled, other idle workers. They race on @tail by
+ * cmpxchg. Both indexes only go up, slot is (index & THPOOL_RING_MASK).
+ */
+#define THPOOL_RING_SIZE	(64)
+#define THPOOL_RING_MASK	(THPOOL_RING_SIZE - 1)
+
 /* This structure describes a worker thread */
 struct thpool_worker {
 	/*
-	 * This counter is updated while the list
-	 * is updated. And they are updated under @lock.
-	 * Thus a simple int will do.
-	 *
-	 * Besides, the top three fields will always be
-	 * updated together, so aggregate them into one
-	 * standalone cache line.
+	 * Producer side, only updated by polling thread.
+	 * Besides, these fields are always read together
+	 * by polling thread, so put them into one line.
 	 */
+	unsigned long		head;
 	int			cpu;
-	int			nr_queued;
-	spinlock_t		lock;
-	struct list_head	work_head;
+	int			class;
 	struct task_struct	*task;
 	TW_PADDING(_pad1);
 
+	/* Consumer side */
+	unsigned long		tail;
+	TW_PADDING(_pad2);
+
+	struct thpool_buffer	*ring[THPOOL_RING_SIZE];
+
 	/* for debug usage */
 	unsigned long		nr_handled;
+	unsigned long		nr_stolen;
 	unsigned long		total_queuing_delay_ns;
 	unsigned long		max_queuing_delay_ns;
 	unsigned long		min_queuing_delay_ns;
 
-	/* us: [0, 5), [5, 10) ... [195, 200) */
-	unsigned long		queuing_stats[QUEUING_STAT_ENTRIES];
+	struct thpool_class_stat	class_stats[NR_THPOOL_CLASSES];
 	int			max_nr_queued;
 	unsigned long		flags;
 	struct thpool_buffer	*wip_buffer;
@@ -79,17 +130,54 @@ static inline int cpu_thpool_worker(struct thpool_worker *tw)
 
 static inline int nr_queued_thpool_worker(struct thpool_worker *tw)
 {
-	return tw->nr_queued;
+	return (int)(READ_ONCE(tw->head) - READ_ONCE(tw->tail));
+}
+
+static inline bool thpool_worker_ring_full(struct thpool_worker *tw)
+{
+	return nr_queued_thpool_worker(tw) >= THPOOL_RING_SIZE;
 }
 
-static inline void inc_queued_thpool_worker(struct thpool_worker *tw)
+/*
+ * Called by the polling thread only.
+ * Caller must make sure the ring is not full.
+ */
+static inline void
+thpool_worker_ring_push(struct thpool_worker *tw, struct thpool_buffer *tb)
 {
-	tw->nr_queued++;
+	unsigned long head = tw->head;
+
+	tw->ring[head & THPOOL_RING_MASK] = tb;
+
+	/* Slot must be visible before consumers see the new head */
+	smp_wmb();
+	WRITE_ONCE(tw->head, head + 1);
 }
 
-static inline void dec_queued_thpool_worker(struct thpool_worker *tw)
+/*
+ * Called by any worker. Return NULL if the ring is empty.
+ * The slot is read before we claim it. If someone else claimed it
+ * in the middle, we simply retry. Producer never reuses the slot
+ * until tail moves past it.
+ */
+static inline struct thpool_buffer *
+thpool_worker_ring_pop(struct thpool_worker *tw)
 {
-	tw->nr_queued--;
+	struct thpool_buffer *tb;
+	unsigned long tail;
+
+	for (;;) {
+		tail = READ_ONCE(tw->tail);
+		if (tail == READ_ONCE(tw->head))
+			return NULL;
+
+		/* Pairs with smp_wmb() in push */
+		smp_rmb();
+		tb = READ_ONCE(tw->ring[tail & THPOOL_RING_MASK]);
+		if (likely(cmpxchg(&tw->tail, tail, tail + 1) == tail))
+			return tb;
+		cpu_relax();
+	}
 }
 
 struct tb_padding {
@@ -99,6 +187,7 @@ struct tb_padding {
 
 struct thpool_buffer {
 	unsigned long		flags;
+	int			class;
 	unsigned long		time_enqueue_ns;
 	unsigned long		time_dequeue_ns;
 	struct list_head	next;
@@ -116,6 +205,13 @@ struct thpool_buffer {
 	void			*private_tx;
 	int			tx_size;
 
+	/*
+	 * Handler supplied RDMA WRITEs, pushed to requester before reply
+	 * Only valid if rdmaWrite flag is set
+	 */
+	int			nr_rdma_writes;
+	struct fit_rdma_write_entry rdma_writes[THPOOL_MAX_RDMA_WRITES];
+
 	THPOOL_PADDING(_pad1);
 	char			tx[THPOOL_TX_SIZE];
 };
@@ -124,6 +220,7 @@ enum thpool_buffer_flags {
 	THPOOL_BUFFER_used,
 	THPOOL_BUFFER_noreply,
 	THPOOL_BUFFER_privateTX,
+	THPOOL_BUFFER_rdmaWrite,
 
 	NR_THPOOL_BUFFER_FLAGS,
 };
@@ -168,6 +265,7 @@ static inline void __ClearThpoolBuffer##uname(struct thpool_buffer *p)	\
 THPOOL_BUFFER_FLAGS(Used, used)
 THPOOL_BUFFER_FLAGS(Noreply, noreply)
 THPOOL_BUFFER_FLAGS(PrivateTX, privateTX)
+THPOOL_BUFFER_FLAGS(RdmaWrite, rdmaWrite)
 
 static inline void tb_set_tx_size(struct thpool_buffer *tb, int size)
 {
@@ -197,6 +295,31 @@ static inline void tb_reset_private_tx(struct thpool_buffer *tb)
 	__ClearThpoolBufferPrivateTX(tb);
 }
 
+/*
+ * Queue @size bytes at @local to be RDMA written to @remote_addr of the
+ * requester, before the reply goes out. @local must stay valid until then.
+ * If any write fails, FIT sends an int RET_EAGAIN instead of the reply.
+ */
+static inline void tb_add_rdma_write(struct thpool_buffer *tb, void *local,
+				     u64 remote_addr, u32 size)
+{
+	struct fit_rdma_write_entry *entry;
+
+	BUG_ON(tb->nr_rdma_writes >= THPOOL_MAX_RDMA_WRITES);
+
+	entry = &tb->rdma_writes[tb->nr_rdma_writes++];
+	entry->local_addr = local;
+	entry->remote_addr = remote_addr;
+	entry->size = size;
+	__SetThpoolBufferRdmaWrite(tb);
+}
+
+static inline void tb_reset_rdma_writes(struct thpool_buffer *tb)
+{
+	tb->nr_rdma_writes = 0;
+	__ClearThpoolBufferRdmaWrite(tb);
+}
+
 static inline void *thpool_buffer_rx(struct thpool_buffer *tb)
 {
 	return tb->fit_rx;
@@ -233,8 +356,10 @@ static inline int max_queued_thpool_worker(struct thpool_worker *tw)
 
 static inline void update_max_queued_thpool_worker(struct thpool_worker *tw)
 {
-	if (tw->nr_queued > tw->max_nr_queued)
-		tw->max_nr_queued = tw->nr_queued;
+	int nr_queued = nr_queued_thpool_worker(tw);
+
+	if (nr_queued > tw->max_nr_queued)
+		tw->max_nr_queued = nr_queued;
 }
 
 static inline void
@@ -270,8 +395,11 @@ static inline unsigned long thpool_buffer_queuing_delay(struct thpool_buffer *tb
 	return tb->time_dequeue_ns - tb->time_enqueue_ns;
 }
 
-static inline void add_thpool_worker_total_queuing(struct thpool_worker *tw, unsigned long diff_ns)
+static inline void add_thpool_worker_total_queuing(struct thpool_worker *tw,
+						   struct thpool_buffer *tb,
+						   unsigned long diff_ns)
 {
+	struct thpool_class_stat *cs = &tw->class_stats[tb->class];
 	int i;
 
 	tw->total_queuing_delay_ns += diff_ns;
@@ -281,14 +409,25 @@ static inline void add_thpool_worker_total_queuing(struct thpool_worker *tw, uns
 	if (diff_ns < tw->min_queuing_delay_ns)
 		tw->min_queuing_delay_ns = diff_ns;
 
+	cs->total_queuing_delay_ns += diff_ns;
+	if (diff_ns > cs->max_queuing_delay_ns)
+		cs->max_queuing_delay_ns = diff_ns;
+
 	i = (diff_ns / QUEUING_STAT_STRIDE_NS);
 	if (i < QUEUING_STAT_ENTRIES)
-		tw->queuing_stats[i]++;
+		cs->queuing_stats[i]++;
 }
 
-static inline void inc_thpool_worker_nr_handled(struct thpool_worker *tw)
+static inline void inc_thpool_worker_nr_handled(struct thpool_worker *tw,
+						struct thpool_buffer *tb)
 {
 	tw->nr_handled++;
+	tw->class_stats[tb->class].nr_handled++;
+}
+
+static inline void inc_thpool_worker_nr_stolen(struct thpool_worker *tw)
+{
+	tw->nr_stolen++;
 }
 
 #else
@@ -307,9 +446,13 @@ wip_buffer_thpool_worker(struct thpool_worker *tw) { return NULL; }
 static inline unsigned long thpool_buffer_queuing_delay(struct thpool_buffer *tb) { return 0; }
 static inline void thpool_buffer_dequeue_time(struct thpool_buffer *tb) { }
 static inline void thpool_buffer_enqueue_time(struct thpool_buffer *tb) { }
-static inline void add_thpool_worker_total_queuing(struct thpool_worker *tw, unsigned long diff_ns) { }
+static inline void add_thpool_worker_total_queuing(struct thpool_worker *tw,
+						   struct thpool_buffer *tb,
+						   unsigned long diff_ns) { }
 
-static inline void inc_thpool_worker_nr_handled(struct thpool_worker *tw) { }
+static inline void inc_thpool_worker_nr_handled(struct thpool_worker *tw,
+						struct thpool_buffer *tb) { }
+static inline void inc_thpool_worker_nr_stolen(struct thpool_worker *tw) { }
 #endif /* CONFIG_COUNTER_THPOOL */
 
 void fit_ack_reply_callback(struct thpool_buffer *b);
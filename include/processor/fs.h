@@ -59,6 +59,30 @@ static inline int default_file_open(struct file *f, char *f_name)
 
 void do_close_on_exec(struct files_struct *files);
 
+void __init file_token_init(void);
+
+struct p2m_file_lease;
+#ifdef CONFIG_PROCESSOR_FILE_CACHE
+ssize_t file_cache_read(struct file *f, char __user *buf, size_t count,
+			loff_t *pos);
+void file_cache_invalidate(struct file *f);
+void file_cache_open(struct file *f, struct p2m_file_lease *lease,
+		     unsigned long t_sent);
+void file_cache_release(struct file *f);
+void file_cache_break_lease(const char *name);
+#else
+static inline ssize_t file_cache_read(struct file *f, char __user *buf,
+				      size_t count, loff_t *pos)
+{
+	return -EAGAIN;
+}
+static inline void file_cache_invalidate(struct file *f) { }
+static inline void file_cache_open(struct file *f, struct p2m_file_lease *lease,
+				   unsigned long t_sent) { }
+static inline void file_cache_release(struct file *f) { }
+static inline void file_cache_break_lease(const char *name) { }
+#endif
+
 /* common llseeks */
 loff_t dev_llseek(struct file *file, loff_t offset, int whence);
 loff_t no_llseek(struct file *file, loff_t offset, int whence);
@@ -19,6 +19,7 @@
 #include <processor/pcache_types.h>
 #include <processor/pcache_stat.h>
 #include <processor/pcache_debug.h>
+#include <processor/pcache_lock.h>
 #include <uapi/processor/pcache.h>
 
 extern u64 pcache_registered_start;
@@ -40,6 +41,11 @@ extern u64 phys_start_cacheline;
 extern u64 phys_start_metadata;
 extern u64 virt_start_cacheline;
 
+#ifdef CONFIG_PCACHE_FILL_RDMA_WRITE
+/* DMA address of cachelines, registered to FIT once at boot */
+extern u64 dma_start_cacheline;
+#endif
+
 /* Address bits usage */
 extern u64 nr_bits_cacheline;
 extern u64 nr_bits_set;
@@ -51,6 +57,9 @@ extern u64 pcache_tag_mask;
 
 extern u64 pcache_way_cache_stride;
 
+extern int pcache_nid;
+void * __init pcache_memblock_alloc(u64 size);
+
 /* pcache_set and pcache_meta array base */
 extern struct pcache_set *pcache_set_map;
 extern struct pcache_meta *pcache_meta_map;
@@ -358,6 +367,22 @@ static inline void *pcache_meta_to_kva(struct pcache_meta *pcm)
 	return (void *) (virt_start_cacheline + offset * PCACHE_LINE_SIZE);
 }
 
+/**
+ * pcache_kva_to_dma
+ * @kva: kernel virtual address of a pcache data line
+ *
+ * Return the DMA address memory can RDMA write @kva with,
+ * or 0 if @kva is not a pcache line or this is not configured.
+ */
+static inline u64 pcache_kva_to_dma(void *kva)
+{
+#ifdef CONFIG_PCACHE_FILL_RDMA_WRITE
+	if (likely(kva_is_pcache((unsigned long)kva)))
+		return dma_start_cacheline + ((unsigned long)kva - virt_start_cacheline);
+#endif
+	return 0;
+}
+
 /**
  * pa_to_pcache_meta
  * @address: physical address of the pcache data line
@@ -463,6 +488,14 @@ static inline unsigned long pcache_meta_to_pfn(struct pcache_meta *pcm)
 	return ((unsigned long)pcache_meta_to_pa(pcm)) >> PCACHE_LINE_SIZE_SHIFT;
 }
 
+/*
+ * pgprot of user lines established by fills. vmas and their protection
+ * live at memory, and mprotect() does not reach processor. Thus lines
+ * are mapped rw and executable, and write protection is only used for
+ * fork() COW.
+ */
+#define PCACHE_LINE_PGPROT	PAGE_SHARED_EXEC
+
 static inline pte_t pcache_mk_pte(struct pcache_meta *pcm, pgprot_t pgprot)
 {
 	return pfn_pte(pcache_meta_to_pfn(pcm), pgprot);
@@ -550,12 +583,28 @@ enum piggyback_options {
 /* Allocate one pcache line from the pset @address maps to */
 struct pcache_meta *pcache_alloc(unsigned long address,
 				 enum piggyback_options piggyback);
+struct pcache_meta *pcache_alloc_nowait(unsigned long address);
+bool pcache_alloc_need_evict(unsigned long address);
 
 int pcache_flush_one(struct pcache_meta *pcm);
 void clflush_one(struct task_struct *tsk, unsigned long user_va, void *cache_addr);
 void __clflush_one(pid_t tgid, unsigned long user_va,
 		   unsigned int m_nid, unsigned int rep_nid, void *cache_addr);
 
+struct p2m_flush_batch_msg;
+
+/* One line of __clflush_batch(), same info as __clflush_one() takes */
+struct clflush_batch_entry {
+	pid_t			tgid;
+	unsigned long		user_va;
+	unsigned int		m_nid;
+	unsigned int		rep_nid;
+	void			*cache_addr;
+};
+
+void __clflush_batch(struct clflush_batch_entry *entries, int nr,
+		     struct p2m_flush_batch_msg *msg);
+
 /* eviction */
 int pcache_evict_line(struct pcache_set *pset, unsigned long address,
 		      enum piggyback_options piggyback);
@@ -657,7 +706,16 @@ int common_do_fill_page(struct mm_struct *mm, unsigned long address,
 			unsigned long flags, fill_func_t fill_func, void *arg,
 			enum rmap_caller caller, enum piggyback_options piggyback);
 
+#ifdef CONFIG_PCACHE_FILL_BATCH
+int pcache_fill_batch(int nid, unsigned long address,
+		      unsigned long flags, void *va_cache);
+void __init pcache_fill_batch_post_init(void);
+#else
+static inline void pcache_fill_batch_post_init(void) { }
+#endif
+
 #include <processor/pcache_victim.h>
 #include <processor/pcache_evict.h>
+#include <processor/pcache_prefetch.h>
 
 #endif /* _LEGO_PROCESSOR_PCACHE_H_ */
@@ -11,6 +11,8 @@
 #define _LEGO_PROCESSOR_PCACHE_SWEEP_H_
 
 #include <processor/pcache_types.h>
+#include <processor/pcache_stat.h>
+#include <processor/pcache_lock.h>
 
 enum evict_status {
 	PCACHE_EVICT_SUCCEED,
@@ -31,10 +33,32 @@ static inline int evict_sweep_init(void) { return 0; }
 #endif
 
 /*
- * Eviction Algorithm
+ * Background eviction daemon, used to overlap
+ * eviction with remote pcache fill.
+ */
+#ifdef CONFIG_PCACHE_FILL_OVERLAP_EVICTION
+void pcache_evict_async(unsigned long address);
+void __init evict_async_init(void);
+#else
+static inline void pcache_evict_async(unsigned long address) { }
+static inline void evict_async_init(void) { }
+#endif
+
+/*
+ * Eviction Algorithms that are based on pset->lru_list:
  * 	Least Recently Used
+ * 	CLOCK
+ * 	Adaptive
  */
-#ifdef CONFIG_PCACHE_EVICT_LRU
+enum pcache_evict_policy {
+	PCACHE_EVICT_POLICY_LRU,
+	PCACHE_EVICT_POLICY_CLOCK,
+	PCACHE_EVICT_POLICY_RANDOM,
+
+	NR_PCACHE_EVICT_POLICIES
+};
+
+#ifdef CONFIG_PCACHE_EVICT_LRU_LIST
 static inline void dec_pset_nr_lru(struct pcache_set *pset)
 {
 	atomic_dec(&pset->nr_lru);
@@ -57,12 +81,47 @@ __add_to_lru_list(struct pcache_meta *pcm, struct pcache_set *pset)
 	inc_pset_nr_lru(pset);
 }
 
+/*
+ * Move staged lines to lru_list, caller holds lru_lock.
+ * Oldest staged line is moved first, thus newest ends up at head.
+ */
+static inline void __drain_lru_add(struct pcache_set *pset)
+{
+	struct pcache_meta *pcm, *n;
+
+	/* Racy, missed ones are drained next time */
+	if (list_empty(&pset->lru_add_list))
+		return;
+
+	spin_lock(&pset->lru_add_lock);
+	list_for_each_entry_safe(pcm, n, &pset->lru_add_list, lru) {
+		ClearPcacheLruStaged(pcm);
+		list_move(&pcm->lru, &pset->lru_list);
+		inc_pset_nr_lru(pset);
+	}
+	spin_unlock(&pset->lru_add_lock);
+}
+
+/*
+ * Eviction and sweep hold lru_lock while they walk the list.
+ * Allocation should not wait for them, if lru_lock is busy,
+ * stage the line in lru_add_list.
+ */
 static inline void
 add_to_lru_list(struct pcache_meta *pcm, struct pcache_set *pset)
 {
-	spin_lock(&pset->lru_lock);
-	__add_to_lru_list(pcm, pset);
-	spin_unlock(&pset->lru_lock);
+	if (pset_trylock(pset, PSET_LOCK_LRU)) {
+		__drain_lru_add(pset);
+		__add_to_lru_list(pcm, pset);
+		pset_unlock(pset, PSET_LOCK_LRU);
+		return;
+	}
+
+	spin_lock(&pset->lru_add_lock);
+	SetPcacheLruStaged(pcm);
+	list_add_tail(&pcm->lru, &pset->lru_add_list);
+	spin_unlock(&pset->lru_add_lock);
+	inc_pcache_event(PCACHE_LRU_ADD_STAGED);
 }
 
 static inline void
@@ -75,9 +134,20 @@ __del_from_lru_list(struct pcache_meta *pcm, struct pcache_set *pset)
 static inline void
 del_from_lru_list(struct pcache_meta *pcm, struct pcache_set *pset)
 {
-	spin_lock(&pset->lru_lock);
+	/* Staged lines never go back once drained */
+	if (PcacheLruStaged(pcm)) {
+		spin_lock(&pset->lru_add_lock);
+		if (TestClearPcacheLruStaged(pcm)) {
+			list_del(&pcm->lru);
+			spin_unlock(&pset->lru_add_lock);
+			return;
+		}
+		spin_unlock(&pset->lru_add_lock);
+	}
+
+	pset_lock(pset, PSET_LOCK_LRU);
 	__del_from_lru_list(pcm, pset);
-	spin_unlock(&pset->lru_lock);
+	pset_unlock(pset, PSET_LOCK_LRU);
 }
 
 static inline void attach_to_lru(struct pcache_meta *pcm)
@@ -101,10 +171,20 @@ static inline void init_pcache_lru(struct pcache_meta *pcm)
 	INIT_LIST_HEAD(&pcm->lru);
 }
 
+/* Scan lru_list and find a pcache line to evict, with @policy */
+struct pcache_meta *
+evict_find_line_list(struct pcache_set *pset, enum pcache_evict_policy policy);
+
 /* Callback: find a pcache line to evict */
-struct pcache_meta *evict_find_line_lru(struct pcache_set *pset);
+static inline struct pcache_meta *evict_find_line_lru(struct pcache_set *pset)
+{
+	return evict_find_line_list(pset, PCACHE_EVICT_POLICY_LRU);
+}
 
-void kevict_sweepd_lru(void);
+static inline struct pcache_meta *evict_find_line_clock(struct pcache_set *pset)
+{
+	return evict_find_line_list(pset, PCACHE_EVICT_POLICY_CLOCK);
+}
 
 #else
 static inline void
@@ -123,12 +203,34 @@ evict_find_line_lru(struct pcache_set *pset)
 	BUG();
 }
 
+static inline struct pcache_meta *
+evict_find_line_clock(struct pcache_set *pset)
+{
+	BUG();
+}
+#endif /* EVICT_LRU_LIST */
+
+#ifdef CONFIG_PCACHE_EVICT_GENERIC_SWEEP
+void kevict_sweepd_lru(void);
+#else
 static inline void kevict_sweepd_lru(void)
 {
 	BUG();
 }
+#endif
 
-#endif /* EVICT_LRU */
+/*
+ * Eviction Algorithm
+ * 	Adaptive, per-set policy selected by set dueling
+ */
+#ifdef CONFIG_PCACHE_EVICT_ADAPTIVE
+struct pcache_meta *evict_find_line_adaptive(struct pcache_set *pset);
+void print_pcache_evict_duel(void);
+#else
+static inline struct pcache_meta *
+evict_find_line_adaptive(struct pcache_set *pset) { BUG(); }
+static inline void print_pcache_evict_duel(void) { }
+#endif /* EVICT_ADAPTIVE */
 
 /*
  * Eviction Algorithm
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2016-2018 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * pcache set locks
+ *
+ * All pset locks should be taken through pset_lock() and friends.
+ * With CONFIG_PCACHE_LOCK_STAT, each lock of each set counts how many
+ * times it was taken, how many of them had to spin, and a histogram of
+ * hold time. Counters are updated while holding the lock itself, so
+ * they are plain integers.
+ */
+
+#ifndef _LEGO_PROCESSOR_PCACHE_LOCK_H_
+#define _LEGO_PROCESSOR_PCACHE_LOCK_H_
+
+#include <lego/log2.h>
+#include <lego/sched.h>
+#include <lego/spinlock.h>
+#include <processor/pcache_types.h>
+#include <uapi/processor/pcache.h>
+
+static inline spinlock_t *
+pset_lockptr(struct pcache_set *pset, enum pset_lock_item item)
+{
+	switch (item) {
+	case PSET_LOCK_FREE:
+		return &pset->free_lock;
+#ifdef CONFIG_PCACHE_EVICT_LRU_LIST
+	case PSET_LOCK_LRU:
+		return &pset->lru_lock;
+#endif
+#ifdef CONFIG_PCACHE_EVICTION_PERSET_LIST
+	case PSET_LOCK_EVICTION_LIST:
+		return &pset->eviction_list_lock;
+#endif
+	default:
+		BUG();
+	}
+}
+
+#ifdef CONFIG_PCACHE_LOCK_STAT
+/* Bucket 0 is < 256ns, each following one doubles */
+#define PSET_LOCK_HIST_SHIFT	8
+
+static inline int pset_lock_hist_bucket(unsigned long long ns)
+{
+	int bucket;
+
+	if (ns < (1ULL << PSET_LOCK_HIST_SHIFT))
+		return 0;
+
+	bucket = ilog2(ns) - PSET_LOCK_HIST_SHIFT + 1;
+	return min(bucket, PCACHE_LOCK_HIST_BUCKETS - 1);
+}
+
+static inline void __pset_lock_acquired(struct pcache_set *pset,
+					enum pset_lock_item item, bool contended)
+{
+	struct pset_lock_stat *stat = &pset->lock_stat[item];
+
+	stat->nr_acquired++;
+	if (contended)
+		stat->nr_contended++;
+	stat->hold_start = sched_clock();
+}
+
+static inline void pset_lock(struct pcache_set *pset, enum pset_lock_item item)
+{
+	spinlock_t *lock = pset_lockptr(pset, item);
+	bool contended = false;
+
+	if (!spin_trylock(lock)) {
+		spin_lock(lock);
+		contended = true;
+	}
+	__pset_lock_acquired(pset, item, contended);
+}
+
+static inline bool pset_trylock(struct pcache_set *pset, enum pset_lock_item item)
+{
+	if (!spin_trylock(pset_lockptr(pset, item)))
+		return false;
+
+	__pset_lock_acquired(pset, item, false);
+	return true;
+}
+
+static inline void pset_unlock(struct pcache_set *pset, enum pset_lock_item item)
+{
+	struct pset_lock_stat *stat = &pset->lock_stat[item];
+
+	stat->hold_hist[pset_lock_hist_bucket(sched_clock() - stat->hold_start)]++;
+	spin_unlock(pset_lockptr(pset, item));
+}
+
+void fill_pset_lock_stat(struct pcache_stat *kstat);
+#else
+static inline void pset_lock(struct pcache_set *pset, enum pset_lock_item item)
+{
+	spin_lock(pset_lockptr(pset, item));
+}
+
+static inline bool pset_trylock(struct pcache_set *pset, enum pset_lock_item item)
+{
+	return spin_trylock(pset_lockptr(pset, item));
+}
+
+static inline void pset_unlock(struct pcache_set *pset, enum pset_lock_item item)
+{
+	spin_unlock(pset_lockptr(pset, item));
+}
+
+static inline void fill_pset_lock_stat(struct pcache_stat *kstat) { }
+#endif /* CONFIG_PCACHE_LOCK_STAT */
+
+#endif /* _LEGO_PROCESSOR_PCACHE_LOCK_H_ */
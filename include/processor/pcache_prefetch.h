@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2016-2018 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _LEGO_PROCESSOR_PCACHE_PREFETCH_H_
+#define _LEGO_PROCESSOR_PCACHE_PREFETCH_H_
+
+#include <lego/sched.h>
+#include <processor/pcache_types.h>
+#include <processor/pcache_stat.h>
+
+#ifdef CONFIG_PCACHE_PREFETCH
+
+#define PCACHE_PREFETCH_NR_LINES	CONFIG_PCACHE_PREFETCH_NR_LINES
+
+void pcache_prefetch_on_miss(unsigned long address, unsigned long flags);
+void pcache_prefetch_thread_exit(struct task_struct *tsk);
+void pcache_prefetch_fork(struct task_struct *new);
+void pcache_prefetch_block(struct mm_struct *mm);
+void pcache_prefetch_unblock(struct mm_struct *mm);
+void __init pcache_prefetch_post_init(void);
+
+/*
+ * Called when a prefetched pcache line is going away, either
+ * evicted or zapped. Account whether it was ever touched.
+ * Caller must lock @pcm.
+ */
+static inline void
+pcache_prefetch_account(struct pcache_meta *pcm, bool referenced)
+{
+	if (likely(!TestClearPcachePrefetched(pcm)))
+		return;
+
+	if (referenced)
+		inc_pcache_event(PCACHE_PREFETCH_USEFUL);
+	else
+		inc_pcache_event(PCACHE_PREFETCH_WASTED);
+}
+
+#else
+static inline void pcache_prefetch_on_miss(unsigned long address, unsigned long flags) { }
+static inline void pcache_prefetch_thread_exit(struct task_struct *tsk) { }
+static inline void pcache_prefetch_fork(struct task_struct *new) { }
+static inline void pcache_prefetch_block(struct mm_struct *mm) { }
+static inline void pcache_prefetch_unblock(struct mm_struct *mm) { }
+static inline void pcache_prefetch_post_init(void) { }
+static inline void
+pcache_prefetch_account(struct pcache_meta *pcm, bool referenced) { }
+#endif /* CONFIG_PCACHE_PREFETCH */
+
+#endif /* _LEGO_PROCESSOR_PCACHE_PREFETCH_H_ */
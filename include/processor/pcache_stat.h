@@ -32,6 +32,16 @@ enum pcache_event_item {
 	PCACHE_CLFLUSH_CLEAN_SKIPPED,
 	PCACHE_CLFLUSH_FAIL,
 	PCACHE_CLFLUSH_PIGGYBACK_FB,
+	PCACHE_CLFLUSH_BATCH,		/* nr of P2M_PCACHE_FLUSH_BATCH sent */
+
+	/*
+	 * Replication pipeline
+	 */
+	PCACHE_REPLICA_LINE,		/* nr of lines queued for replication */
+	PCACHE_REPLICA_BATCH,		/* nr of P2M_PCACHE_REPLICA_BATCH sent */
+	PCACHE_REPLICA_FAIL,		/* nr of lines not appended by remote */
+	PCACHE_REPLICA_WINDOW_FULL,	/* nr of lines sent synchronously */
+	PCACHE_REPLICA_BARRIER,		/* nr of replication_barrier() calls */
 
 	/*
 	 * Write-protection fault
@@ -46,7 +56,13 @@ enum pcache_event_item {
 	PCACHE_FAULT_FILL_FROM_MEMORY,	/* nr of pcache fill from remote memory */
 	PCACHE_FAULT_FILL_FROM_MEMORY_PIGGYBACK,
 	PCACHE_FAULT_FILL_FROM_MEMORY_PIGGYBACK_FB,
+	PCACHE_FAULT_FILL_FROM_MEMORY_BATCH,	/* nr of batched miss requests */
+	PCACHE_FAULT_FILL_FROM_MEMORY_BATCHED,	/* nr of lines filled by batches */
+	PCACHE_FAULT_FILL_RDMA_WRITE,	/* nr of lines RDMA written by memory */
+	PCACHE_FAULT_FILL_RDMA_WRITE_FAIL,	/* nr of batches memory failed to write */
 	PCACHE_FAULT_FILL_FROM_VICTIM,	/* nr of pcache fill from victim cache */
+	PCACHE_FAULT_FILL_OVERLAP,	/* nr of fills overlapped with eviction */
+	PCACHE_FAULT_FILL_OVERLAP_FB,	/* nr of overlapped fills that evicted on their own */
 
 	/*
 	 * pcache eviction stat
@@ -64,6 +80,8 @@ enum pcache_event_item {
 	PCACHE_EVICTION_FAILURE_EVICT,
 	PCACHE_EVICTION_SUCCEED,
 
+	PCACHE_LRU_ADD_STAGED,		/* nr of lines staged as lru_lock was busy */
+
 	PCACHE_PSET_LIST_LOOKUP,
 	PCACHE_PSET_LIST_HIT,
 
@@ -97,6 +115,9 @@ enum pcache_event_item {
 	PCACHE_SWEEP_NR_PSET,		/* nr of pset that have been sweeped */
 	PCACHE_SWEEP_NR_MOVED_PCM,	/* nr of moved pcache lines */
 
+	PCACHE_CLOCK_SECOND_CHANCE,	/* nr of referenced lines rotated by CLOCK */
+	PCACHE_DUEL_SWITCH,		/* nr of times followers changed policy */
+
 	PCACHE_MREMAP_PSET_SAME,
 	PCACHE_MREMAP_PSET_DIFF,
 
@@ -110,6 +131,16 @@ enum pcache_event_item {
 	PCACHE_PEE_FREE,
 	PCACHE_PEE_FREE_KMALLOC,
 
+	/*
+	 * Prefetch counters, in unit of pcache lines
+	 * issued: lines asked from remote memory
+	 * useful: prefetched lines touched before eviction/unmap
+	 * wasted: prefetched lines never touched, or dropped due to race
+	 */
+	PCACHE_PREFETCH_ISSUED,
+	PCACHE_PREFETCH_USEFUL,
+	PCACHE_PREFETCH_WASTED,
+
 	NR_PCACHE_EVENT_ITEMS,
 };
 
@@ -132,6 +163,11 @@ static inline void inc_pcache_event_cond(enum pcache_event_item item, bool doit)
 		inc_pcache_event(item);
 }
 
+static inline void add_pcache_event(enum pcache_event_item item, long nr)
+{
+	atomic_long_add(nr, &pcache_event_stats.event[item]);
+}
+
 static inline unsigned long pcache_event(enum pcache_event_item item)
 {
 	return atomic_long_read(&pcache_event_stats.event[item]);
@@ -179,6 +215,7 @@ static inline long pcache_used(void)
 #else
 static inline void inc_pcache_event(enum pcache_event_item i) { }
 static inline void inc_pcache_event_cond(enum pcache_event_item item, bool doit) { }
+static inline void add_pcache_event(enum pcache_event_item item, long nr) { }
 static inline unsigned long pcache_event(enum pcache_event_item i) { return 0; }
 static inline void mod_pset_event(int i, struct pcache_set *pset,
 				  enum pcache_set_stat_item item) { }
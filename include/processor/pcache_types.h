@@ -16,6 +16,7 @@
 #include <lego/spinlock.h>
 
 #include <processor/pcache_config.h>
+#include <uapi/processor/pcache.h>
 
 struct pcache_meta;
 
@@ -30,6 +31,24 @@ enum pcache_set_stat_item {
 	NR_PSET_STAT_ITEMS
 };
 
+enum pset_lock_item {
+	PSET_LOCK_FREE,
+	PSET_LOCK_LRU,
+	PSET_LOCK_EVICTION_LIST,
+
+	NR_PSET_LOCKS
+};
+
+#ifdef CONFIG_PCACHE_LOCK_STAT
+/* Updated with the lock held, see pcache_lock.h */
+struct pset_lock_stat {
+	unsigned long		nr_acquired;
+	unsigned long		nr_contended;
+	unsigned long long	hold_start;
+	unsigned int		hold_hist[PCACHE_LOCK_HIST_BUCKETS];
+};
+#endif
+
 #ifdef CONFIG_PCACHE_EVICTION_PERSET_LIST
 struct pset_eviction_entry {
 	unsigned long		flags;
@@ -114,12 +133,19 @@ struct pcache_set {
 	 * Eviction Algorithms Specific
 	 */
 
-#ifdef CONFIG_PCACHE_EVICT_LRU
+#ifdef CONFIG_PCACHE_EVICT_LRU_LIST
 	struct list_head	lru_list;
 	atomic_t		nr_lru;
 
 	PSET_PADDING(_pad_lru_lock)
 	spinlock_t		lru_lock;
+
+	/*
+	 * Lines allocated while lru_lock is held by eviction or sweep.
+	 * They are moved to lru_list by next lru_lock holder.
+	 */
+	spinlock_t		lru_add_lock;
+	struct list_head	lru_add_list;
 #endif
 
 	/*
@@ -142,26 +168,18 @@ struct pcache_set {
 	atomic_t		nr_eviction_entries;
 #endif
 
-	atomic_t		stat[NR_PSET_STAT_ITEMS];
-} ____cacheline_aligned;
-
-static inline void lock_pset(struct pcache_set *pset)
-{
-#ifdef CONFIG_PCACHE_EVICT_LRU
-	spin_lock(&pset->lru_lock);
-#elif defined (CONFIG_PCACHE_EVICTION_PERSET_LIST)
-	spin_lock(&pset->eviction_list_lock);
+#ifdef CONFIG_PCACHE_FILL_OVERLAP_EVICTION
+	/* Queued to async eviction daemon, see evict_async.c */
+	struct list_head	async_evict_list;
+	unsigned long		async_evict_address;
 #endif
-}
 
-static inline void unlock_pset(struct pcache_set *pset)
-{
-#ifdef CONFIG_PCACHE_EVICT_LRU
-	spin_unlock(&pset->lru_lock);
-#elif defined (CONFIG_PCACHE_EVICTION_PERSET_LIST)
-	spin_unlock(&pset->eviction_list_lock);
+	atomic_t		stat[NR_PSET_STAT_ITEMS];
+
+#ifdef CONFIG_PCACHE_LOCK_STAT
+	struct pset_lock_stat	lock_stat[NR_PSET_LOCKS];
 #endif
-}
+} ____cacheline_aligned;
 
 /*
  * Necessary piggyback information cooked by perset eviction, used by pgfault
@@ -218,7 +236,7 @@ struct pcache_meta {
 	struct task_struct	*locker;
 #endif
 
-#ifdef CONFIG_PCACHE_EVICT_LRU
+#ifdef CONFIG_PCACHE_EVICT_LRU_LIST
 	struct list_head	lru;
 #endif
 } ____cacheline_aligned;
@@ -230,6 +248,7 @@ enum rmap_caller {
 	RMAP_COW,
 	RMAP_FORK,
 	RMAP_MREMAP_SLOWPATH,
+	RMAP_PREFETCH,
 
 	NR_RMAP_CALLER,
 };
@@ -308,6 +327,7 @@ RMAP_FLAGS(Used, used)
 enum pcache_set_flags {
 	PCACHE_SET_evicting,		/* pset is under eviction now */
 	PCACHE_SET_sweeping,		/* Sweep thread is scaning this set now */
+	PCACHE_SET_async_evict,		/* Async eviction is pending for this set */
 
 	NR_PCACHE_SET_FLAGS
 };
@@ -324,6 +344,12 @@ static inline void SetPset##uname(struct pcache_set *p)		\
 	set_bit(PCACHE_SET_##lname, &p->flags);			\
 }
 
+#define TEST_SET_PSET_FLAGS(uname, lname)			\
+static inline int TestSetPset##uname(struct pcache_set *p)	\
+{								\
+	return test_and_set_bit(PCACHE_SET_##lname, &p->flags);	\
+}
+
 #define __SET_PSET_FLAGS(uname, lname)				\
 static inline void __SetPset##uname(struct pcache_set *p)	\
 {								\
@@ -345,12 +371,14 @@ static inline void __ClearPset##uname(struct pcache_set *p)	\
 #define PSET_FLAGS(uname, lname)				\
 	TEST_PSET_FLAGS(uname, lname)				\
 	SET_PSET_FLAGS(uname, lname)				\
+	TEST_SET_PSET_FLAGS(uname, lname)			\
 	CLEAR_PSET_FLAGS(uname, lname)				\
 	__SET_PSET_FLAGS(uname, lname)				\
 	__CLEAR_PSET_FLAGS(uname, lname)
 
 PSET_FLAGS(Evicting, evicting)
 PSET_FLAGS(Sweeping, sweeping)
+PSET_FLAGS(AsyncEvict, async_evict)
 
 /*
  * struct pcache_meta bits
@@ -380,6 +408,12 @@ PSET_FLAGS(Sweeping, sweeping)
  * 			A following pcache_alloc from the same CPU, with
  * 			ENABLE_PIGGYBACK will get it. Check piggyback.h
  *
+ * PC_prefetched:	Pcacheline was filled by prefetch daemon, and has not
+ * 			been accounted as useful or wasted yet. Check prefetch.c
+ *
+ * PC_lru_staged:	Pcacheline is on pset->lru_add_list instead of lru_list.
+ * 			Check pcache_evict.h
+ *
  * Hack: remember to update the pcacheflag_names array in debug file.
  *
  * 1) PC_valid is more like the traditional cache valid bit. It is set when
@@ -393,6 +427,8 @@ enum pcache_meta_bits {
 	PC_writeback,
 	PC_piggyback,
 	PC_piggyback_cached,
+	PC_prefetched,
+	PC_lru_staged,
 
 	__NR_PCLBITS,
 };
@@ -469,6 +505,8 @@ PCACHE_META_BITS(Reclaim, reclaim)
 PCACHE_META_BITS(Writeback, writeback)
 PCACHE_META_BITS(Piggyback, piggyback)
 PCACHE_META_BITS(PiggybackCached, piggyback_cached)
+PCACHE_META_BITS(Prefetched, prefetched)
+PCACHE_META_BITS(LruStaged, lru_staged)
 
 /*
  * Flags checked when a pcache is freed.
@@ -477,6 +515,7 @@ PCACHE_META_BITS(PiggybackCached, piggyback_cached)
  */
 #define PCACHE_FLAGS_CHECK_AT_FREE					\
 	(1UL << PC_locked | 1UL << PC_valid | 1UL << PC_dirty |		\
-	 1UL << PC_reclaim | 1UL << PC_writeback | 1UL << PC_piggyback)
+	 1UL << PC_reclaim | 1UL << PC_writeback | 1UL << PC_piggyback |	\
+	 1UL << PC_lru_staged)
 
 #endif /* _LEGO_PROCESSOR_PCACHE_TYPES_H_ */
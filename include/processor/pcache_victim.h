@@ -52,8 +52,11 @@ struct pcache_victim_meta {
 	struct pcache_set	*pset;		/* pset this victim belongs to */
 	struct list_head	hits;		/* history pid+addr users */
 
-	/* Link to next allocated victim cache */
-	struct list_head	next;
+	/*
+	 * Allocation order. Eviction picks the oldest usable victim,
+	 * there is no list of allocated victims to keep the order.
+	 */
+	u64			seq;
 
 } ____cacheline_aligned_in_smp;
 
@@ -153,8 +156,8 @@ extern struct pcache_victim_meta pcache_victim_meta_map[VICTIM_NR_ENTRIES];
 extern void *pcache_victim_data_map;
 
 /*
- * Only allocation routine can use this macro.
- * Others have to use allocated victim list.
+ * Walk the whole victim map. Users other than the allocation routine
+ * must grab a reference and check Usable before touching a victim.
  */
 #define for_each_victim(victim, index)				\
 	for (index = 0, victim = pcache_victim_meta_map;	\
@@ -402,6 +405,7 @@ static inline bool victim_is_filling(struct pcache_victim_meta *victim)
 
 void __init victim_cache_early_init(void);
 void __init victim_cache_post_init(void);
+void __init victim_cache_init_alloc_hint(void);
 
 extern atomic_t nr_flush_jobs;
 extern spinlock_t victim_flush_lock;
@@ -21,6 +21,20 @@
 
 #ifdef CONFIG_COMP_PROCESSOR
 
+#ifdef CONFIG_PCACHE_PREFETCH
+/*
+ * Per-thread stride detector used by pcache prefetch.
+ * Only updated by the faulting thread itself, thus no locking.
+ * @nr_inflight is shared with the prefetch daemon.
+ */
+struct pcache_prefetch_info {
+	unsigned long	last_address;	/* line aligned uva of last miss */
+	long		stride;		/* bytes between last two misses */
+	int		confidence;	/* nr of times @stride repeated */
+	atomic_t	nr_inflight;	/* queued or running prefetch jobs */
+};
+#endif
+
 /*
  * If you add anything to structure, please check if these fields
  * need to be initlizaed in the init_task.c
@@ -52,6 +66,10 @@ struct processor_manager {
 #endif
 
 	struct vnode_struct *virtual_node;
+
+#ifdef CONFIG_PCACHE_PREFETCH
+	struct pcache_prefetch_info prefetch;
+#endif
 };
 
 #define UNSET_HOME_NODE		(INT_MAX)
@@ -10,12 +10,18 @@
 #ifndef _LEGO_PROCESSOR_REPLICATION_H_
 #define _LEGO_PROCESSOR_REPLICATION_H_
 
+#include <lego/init.h>
+
 #ifdef CONFIG_REPLICATION_MEMORY
 void replicate(pid_t tgid, unsigned long user_va,
 	       unsigned int m_nid, unsigned int rep_nid, void *cache_addr);
+int replication_barrier(void);
+void __init replication_init(void);
 #else
 static inline void replicate(pid_t tgid, unsigned long user_va,
 	       unsigned int m_nid, unsigned int rep_nid, void *cache_addr) { }
+static inline int replication_barrier(void) { return 0; }
+static inline void replication_init(void) { }
 #endif
 
 #endif /* _LEGO_PROCESSOR_REPLICATION_H_ */
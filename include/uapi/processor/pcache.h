@@ -10,6 +10,9 @@
 #ifndef _LEGO_UAPI_PROCESSOR_PCACHE_H_
 #define _LEGO_UAPI_PROCESSOR_PCACHE_H_
 
+#define PCACHE_NR_SET_LOCKS		3
+#define PCACHE_LOCK_HIST_BUCKETS	8
+
 struct pcache_stat {
 	/*
 	 * nr_cachelines = nr_cachesets * associativity;
@@ -28,6 +31,20 @@ struct pcache_stat {
 	unsigned long	nr_pgfault_code;
 	unsigned long	nr_flush;
 	unsigned long	nr_eviction;
+
+	/*
+	 * Pcache set lock stats, summed over all sets.
+	 * Only filled if kernel has CONFIG_PCACHE_LOCK_STAT.
+	 * Locks: free list, LRU list, per-set eviction list
+	 * Hold time histogram: < 256ns, < 512ns, ..., >= 16us
+	 */
+	unsigned long	lock_nr_acquired[PCACHE_NR_SET_LOCKS];
+	unsigned long	lock_nr_contended[PCACHE_NR_SET_LOCKS];
+	unsigned long	lock_hold_hist[PCACHE_NR_SET_LOCKS][PCACHE_LOCK_HIST_BUCKETS];
+
+	/* The set that had most contention, and its count */
+	unsigned long	lock_max_contended_set[PCACHE_NR_SET_LOCKS];
+	unsigned long	lock_max_contended[PCACHE_NR_SET_LOCKS];
 };
 
 #endif /* _LEGO_UAPI_PROCESSOR_PCACHE_H_ */
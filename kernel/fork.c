@@ -340,6 +340,10 @@ static struct mm_struct *mm_init(struct mm_struct *mm, struct task_struct *p)
 	mm_init_cpumask(mm);
 	spin_lock_init(&mm->page_table_lock);
 	init_rwsem(&mm->mmap_sem);
+#ifdef CONFIG_PCACHE_PREFETCH
+	atomic_set(&mm->prefetch_blocked, 0);
+	atomic_set(&mm->nr_prefetch_inflight, 0);
+#endif
 
 	/*
 	 * pgd_alloc() will duplicate the identity kernel mapping
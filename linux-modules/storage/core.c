@@ -19,14 +19,131 @@
 #include <linux/dcache.h>
 #include <linux/mutex.h>
 #include <linux/mm.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/math64.h>
 
 #include "../fit/fit_config.h"
 #include "storage.h"
 #include "common.h"
+#include "replica.h"
 #include "stat.h"
 
 #define MAX_RXBUF_SIZE	(512 * PAGE_SIZE)
 
+/*
+ * Storage dispatcher
+ *
+ * lego-storaged only receives requests. Each request is queued into one
+ * lane, and handled by the worker threads of that lane:
+ *  - META: open, stat, access, getdents and friends. They are cheap,
+ *    and should not wait behind multi-MB reads or writes.
+ *  - DATA: M2S read and write. Each worker has its own queue, and all
+ *    requests of one file go to the same worker, by name or by token.
+ *    Thus requests of one file are served in the order they arrived,
+ *    a write behind and an eviction flush of the same line can not
+ *    land out of order. A worker also takes the queued requests that
+ *    continue where its request stops (same file, same direction), and
+ *    serves all of them with one vectored I/O.
+ *  - REPLICA: replica log appends. One worker only, logs are appended
+ *    in the order they arrived, same as before. It takes everything
+ *    queued as one batch, and group commits it, see replica.c.
+ *
+ * Receive buffers come from a preallocated pool, a request is handled
+ * in the same buffer it was received into. No extra copy.
+ *
+ * The number of META and DATA workers are module parameters, e.g.
+ *	insmod storage.ko nr_meta_workers=4 nr_data_workers=16
+ */
+#define STORAGE_MAX_META_WORKERS	8
+#define STORAGE_MAX_DATA_WORKERS	32
+#define STORAGE_NR_REPLICA_WORKERS	1
+
+#define STORAGE_MAX_WORKERS						\
+	(STORAGE_MAX_META_WORKERS + STORAGE_MAX_DATA_WORKERS +		\
+	 STORAGE_NR_REPLICA_WORKERS)
+
+/* One for each worker, plus a few to receive while all are busy */
+#define STORAGE_NR_SPARE_RXBUFS	4
+#define STORAGE_MAX_RXBUFS	(STORAGE_MAX_WORKERS + STORAGE_NR_SPARE_RXBUFS)
+
+/* Max replica messages group committed together */
+#define STORAGE_REPLICA_BATCH_MAX	STORAGE_MAX_RXBUFS
+
+static int nr_meta_workers = 2;
+module_param(nr_meta_workers, int, 0444);
+MODULE_PARM_DESC(nr_meta_workers, "Number of META lane workers (1-8)");
+
+static int nr_data_workers = 8;
+module_param(nr_data_workers, int, 0444);
+MODULE_PARM_DESC(nr_data_workers, "Number of DATA lane workers (1-32)");
+
+/* Set by init_storage_workers() */
+static int nr_storage_workers;
+static int nr_storage_rxbufs;
+
+enum storage_lane_type {
+	STORAGE_LANE_META,
+	STORAGE_LANE_DATA,
+	STORAGE_LANE_REPLICA,
+
+	NR_STORAGE_LANES,
+};
+
+static const char *const storage_lane_text[NR_STORAGE_LANES] = {
+	[STORAGE_LANE_META]	= "meta",
+	[STORAGE_LANE_DATA]	= "data",
+	[STORAGE_LANE_REPLICA]	= "replica",
+};
+
+static inline int storage_lane_nr_workers(int lane)
+{
+	switch (lane) {
+	case STORAGE_LANE_META:
+		return nr_meta_workers;
+	case STORAGE_LANE_DATA:
+		return nr_data_workers;
+	default:
+		return STORAGE_NR_REPLICA_WORKERS;
+	}
+}
+
+struct storage_work {
+	void			*msg;
+	uintptr_t		desc;
+	u32			key;		/* file of M2S read/write */
+	u64			enqueue_ns;
+	struct list_head	list;
+};
+
+struct storage_lane {
+	spinlock_t		lock;
+	struct list_head	queue;
+	wait_queue_head_t	wq;
+};
+
+/* Only updated by the worker itself */
+struct storage_worker {
+	struct task_struct	*tsk;
+	int			lane;
+	int			id;
+	unsigned long		nr_handled;
+	u64			total_delay_ns;
+	u64			max_delay_ns;
+};
+
+static struct storage_lane storage_lanes[NR_STORAGE_LANES];
+
+/* DATA lane has one queue per worker, instead of storage_lanes[] */
+static struct storage_lane storage_data_queues[STORAGE_MAX_DATA_WORKERS];
+static struct storage_worker storage_workers[STORAGE_MAX_WORKERS];
+
+static struct storage_work storage_works[STORAGE_MAX_RXBUFS];
+static LIST_HEAD(free_works);
+static DEFINE_SPINLOCK(free_works_lock);
+static DECLARE_WAIT_QUEUE_HEAD(free_works_wq);
+
 struct info_struct {
 	uintptr_t desc;
 	char msg[MAX_RXBUF_SIZE];
@@ -73,12 +190,20 @@ static void storage_dispatch(void *msg, uintptr_t desc)
 		break;
 
 	case M2S_READ:
+	case M2S_READ_FH:
 		inc_storage_stat(HANDLE_REPLICA_READ);
-		handle_read_request(payload, desc);
+		handle_read_request(msg, desc);
 		break;
 	case M2S_WRITE:
+	case M2S_WRITE_FH:
 		inc_storage_stat(HANDLE_REPLICA_WRITE);
-		handle_write_request(payload, desc);
+		handle_write_request(msg, desc);
+		break;
+	case M2S_OPEN:
+		handle_m2s_open(payload, desc);
+		break;
+	case M2S_CLOSE:
+		handle_m2s_close(payload, desc);
 		break;
 	case P2S_OPEN:
 		handle_open_request(payload, desc);
@@ -124,16 +249,16 @@ static void storage_dispatch(void *msg, uintptr_t desc)
 }
 
 #if 1
-static bool in_handler;
+static atomic_t in_handler = ATOMIC_INIT(0);
 
 static inline void set_in_handler(void)
 {
-	in_handler = true;
+	atomic_inc(&in_handler);
 }
 
 static inline void clear_in_handler(void)
 {
-	in_handler = false;
+	atomic_dec(&in_handler);
 }
 
 static int storage_self_monitor(void *unused)
@@ -142,7 +267,7 @@ static int storage_self_monitor(void *unused)
 
 	interval_sec = 30;
 	while (1) {
-		pr_info("%s(): in_handler=%d\n", __func__, in_handler);
+		pr_info("%s(): in_handler=%d\n", __func__, atomic_read(&in_handler));
 		print_storage_manager_stats();
 
 		set_current_state(TASK_UNINTERRUPTIBLE);
@@ -175,7 +300,403 @@ static inline int init_self_monitor(void)
 }
 #endif
 
+static inline int opcode_to_lane(u32 opcode)
+{
+	switch (opcode) {
+	case M2S_REPLICA_FLUSH:
+	case M2S_REPLICA_VMA:
+		return STORAGE_LANE_REPLICA;
+	case M2S_READ:
+	case M2S_WRITE:
+	case M2S_READ_FH:
+	case M2S_WRITE_FH:
+		return STORAGE_LANE_DATA;
+	default:
+		return STORAGE_LANE_META;
+	}
+}
+
+static struct storage_work *get_free_work(void)
+{
+	struct storage_work *work = NULL;
+
+	wait_event(free_works_wq, !list_empty_careful(&free_works));
+
+	spin_lock(&free_works_lock);
+	if (likely(!list_empty(&free_works))) {
+		work = list_first_entry(&free_works, struct storage_work, list);
+		list_del(&work->list);
+	}
+	spin_unlock(&free_works_lock);
+
+	/* Only the receiver takes from free list */
+	BUG_ON(!work);
+	return work;
+}
+
+static void put_free_work(struct storage_work *work)
+{
+	spin_lock(&free_works_lock);
+	list_add(&work->list, &free_works);
+	spin_unlock(&free_works_lock);
+
+	wake_up(&free_works_wq);
+}
+
+static u32 rw_file_key(void *msg)
+{
+	struct m2s_fh_read_write_payload *pf;
+	struct m2s_read_write_payload *p;
+
+	if (m2s_rw_by_handle(msg)) {
+		pf = msg + sizeof(u32);
+		return storage_fh_token_key(&pf->token);
+	}
+
+	p = msg + sizeof(u32);
+	return storage_fh_name_key(p->filename);
+}
+
+static void enqueue_work(struct storage_work *work)
+{
+	struct storage_lane *lane;
+	int type;
+
+	type = opcode_to_lane(*(u32 *)work->msg);
+	if (type == STORAGE_LANE_DATA) {
+		work->key = rw_file_key(work->msg);
+		lane = &storage_data_queues[work->key % nr_data_workers];
+	} else
+		lane = &storage_lanes[type];
+	work->enqueue_ns = sched_clock();
+
+	spin_lock(&lane->lock);
+	list_add_tail(&work->list, &lane->queue);
+	spin_unlock(&lane->lock);
+
+	wake_up(&lane->wq);
+}
+
+static struct storage_work *dequeue_work(struct storage_lane *lane)
+{
+	struct storage_work *work = NULL;
+
+	spin_lock(&lane->lock);
+	if (!list_empty(&lane->queue)) {
+		work = list_first_entry(&lane->queue, struct storage_work, list);
+		list_del(&work->list);
+	}
+	spin_unlock(&lane->lock);
+	return work;
+}
+
+static inline bool rw_same_file(void *prev, void *next)
+{
+	struct m2s_fh_read_write_payload *pf, *nf;
+	struct m2s_read_write_payload *p, *n;
+
+	if (m2s_rw_by_handle(prev)) {
+		pf = prev + sizeof(u32);
+		nf = next + sizeof(u32);
+		return nf->token.fid == pf->token.fid &&
+		       nf->token.gen == pf->token.gen;
+	}
+
+	p = prev + sizeof(u32);
+	n = next + sizeof(u32);
+	return n->flags == p->flags && !strcmp(n->filename, p->filename);
+}
+
+static inline bool rw_adjacent(struct storage_work *prev, struct storage_work *next)
+{
+	size_t len;
+
+	if (*(u32 *)prev->msg != *(u32 *)next->msg)
+		return false;
+
+	/* A read longer than one chunk returns short */
+	len = m2s_rw_len(prev->msg);
+	if (!m2s_rw_is_write(prev->msg) && len > M2S_READ_MAX_CHUNK)
+		return false;
+
+	return m2s_rw_offset(next->msg) == m2s_rw_offset(prev->msg) + len &&
+	       rw_same_file(prev->msg, next->msg);
+}
+
+/*
+ * @works[0] is an M2S read or write. Take queued requests that
+ * continue it from @lane, up to @max in total. Return the number.
+ *
+ * Stop at the first request of the same file that does not continue
+ * it, a later one must not be served before that one.
+ */
+static int dequeue_adjacent_works(struct storage_lane *lane,
+				  struct storage_work **works, int max)
+{
+	struct storage_work *work, *tmp;
+	int nr = 1;
+
+	spin_lock(&lane->lock);
+	list_for_each_entry_safe(work, tmp, &lane->queue, list) {
+		if (nr == max)
+			break;
+		if (!rw_adjacent(works[nr - 1], work)) {
+			if (work->key == works[0]->key)
+				break;
+			continue;
+		}
+
+		list_del(&work->list);
+		works[nr++] = work;
+	}
+	spin_unlock(&lane->lock);
+	return nr;
+}
+
+static void storage_dispatch_rw_batch(struct storage_work **works, int nr)
+{
+	void *msgs[STORAGE_RW_BATCH_MAX];
+	uintptr_t descs[STORAGE_RW_BATCH_MAX];
+	bool write;
+	int i;
+
+	write = m2s_rw_is_write(works[0]->msg);
+	for (i = 0; i < nr; i++) {
+		msgs[i] = works[i]->msg;
+		descs[i] = works[i]->desc;
+		inc_storage_stat(write ? HANDLE_REPLICA_WRITE : HANDLE_REPLICA_READ);
+		inc_storage_stat(STORAGE_RW_MERGED);
+	}
+	handle_read_write_batch(msgs, descs, nr);
+}
+
+/* Take all queued works of @lane, up to @max in total */
+static int dequeue_more_works(struct storage_lane *lane,
+			      struct storage_work **works, int max)
+{
+	int nr = 1;
+
+	spin_lock(&lane->lock);
+	while (nr < max && !list_empty(&lane->queue)) {
+		works[nr] = list_first_entry(&lane->queue, struct storage_work, list);
+		list_del(&works[nr]->list);
+		nr++;
+	}
+	spin_unlock(&lane->lock);
+	return nr;
+}
+
+static void storage_dispatch_replica_batch(struct storage_work **works, int nr)
+{
+	void *msgs[STORAGE_REPLICA_BATCH_MAX];
+	uintptr_t descs[STORAGE_REPLICA_BATCH_MAX];
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		msgs[i] = works[i]->msg;
+		descs[i] = works[i]->desc;
+		if (*(u32 *)msgs[i] == M2S_REPLICA_FLUSH)
+			inc_storage_stat(HANDLE_REPLICA_FLUSH);
+		else
+			inc_storage_stat(HANDLE_REPLICA_VMA);
+	}
+	handle_replica_batch(msgs, descs, nr);
+}
+
+static void account_queue_delay(struct storage_worker *worker,
+				struct storage_work *work)
+{
+	u64 delay;
+
+	delay = sched_clock() - work->enqueue_ns;
+	worker->nr_handled++;
+	worker->total_delay_ns += delay;
+	if (delay > worker->max_delay_ns)
+		worker->max_delay_ns = delay;
+}
+
+static int storage_worker_func(void *_worker)
+{
+	struct storage_worker *worker = _worker;
+	struct storage_lane *lane = &storage_lanes[worker->lane];
+	struct storage_work *works[STORAGE_REPLICA_BATCH_MAX];
+	struct storage_work *work;
+	int i, nr;
+
+	BUILD_BUG_ON(STORAGE_RW_BATCH_MAX > STORAGE_REPLICA_BATCH_MAX);
+
+	if (worker->lane == STORAGE_LANE_DATA)
+		lane = &storage_data_queues[worker->id];
+
+	while (1) {
+		wait_event(lane->wq, (work = dequeue_work(lane)) != NULL ||
+				     kthread_should_stop());
+		if (!work)
+			break;
+
+		works[0] = work;
+		nr = 1;
+		if (worker->lane == STORAGE_LANE_DATA)
+			nr = dequeue_adjacent_works(lane, works, STORAGE_RW_BATCH_MAX);
+		else if (worker->lane == STORAGE_LANE_REPLICA)
+			nr = dequeue_more_works(lane, works, STORAGE_REPLICA_BATCH_MAX);
+
+		for (i = 0; i < nr; i++)
+			account_queue_delay(worker, works[i]);
+
+		set_in_handler();
+		if (worker->lane == STORAGE_LANE_REPLICA)
+			storage_dispatch_replica_batch(works, nr);
+		else if (nr == 1)
+			storage_dispatch(work->msg, work->desc);
+		else
+			storage_dispatch_rw_batch(works, nr);
+		clear_in_handler();
+
+		for (i = 0; i < nr; i++)
+			put_free_work(works[i]);
+	}
+	return 0;
+}
+
+void print_storage_worker_stats(void)
+{
+	struct storage_worker *worker;
+	unsigned long nr;
+	int i;
+
+	for (i = 0; i < nr_storage_workers; i++) {
+		worker = &storage_workers[i];
+		nr = worker->nr_handled;
+
+		pr_crit("worker %s/%d: handled: %lu avg_qdelay_ns: %llu max_qdelay_ns: %llu\n",
+			storage_lane_text[worker->lane], worker->id, nr,
+			nr ? div64_u64(worker->total_delay_ns, nr) : 0,
+			worker->max_delay_ns);
+	}
+}
+
+static void init_storage_lane(struct storage_lane *lane)
+{
+	spin_lock_init(&lane->lock);
+	INIT_LIST_HEAD(&lane->queue);
+	init_waitqueue_head(&lane->wq);
+}
+
+static void free_storage_rxbufs(void)
+{
+	int i;
+
+	INIT_LIST_HEAD(&free_works);
+	for (i = 0; i < nr_storage_rxbufs; i++) {
+		kfree(storage_works[i].msg);
+		storage_works[i].msg = NULL;
+	}
+	nr_storage_rxbufs = 0;
+}
+
+/* Workers only stop when their queue is empty */
+static void stop_storage_workers(void)
+{
+	int i;
+
+	for (i = 0; i < nr_storage_workers; i++) {
+		kthread_stop(storage_workers[i].tsk);
+		storage_workers[i].tsk = NULL;
+	}
+	nr_storage_workers = 0;
+}
+
+static int init_storage_workers(void)
+{
+	struct storage_worker *worker;
+	struct task_struct *tsk;
+	int i, ret, lane, id;
+
+	if (nr_meta_workers < 1 || nr_meta_workers > STORAGE_MAX_META_WORKERS ||
+	    nr_data_workers < 1 || nr_data_workers > STORAGE_MAX_DATA_WORKERS) {
+		pr_err("ERROR: nr_meta_workers must be 1-%d, nr_data_workers 1-%d\n",
+			STORAGE_MAX_META_WORKERS, STORAGE_MAX_DATA_WORKERS);
+		return -EINVAL;
+	}
+
+	for (lane = 0; lane < NR_STORAGE_LANES; lane++)
+		init_storage_lane(&storage_lanes[lane]);
+	for (i = 0; i < nr_data_workers; i++)
+		init_storage_lane(&storage_data_queues[i]);
+
+	/* Only data workers serve reads, spare ones let them merge reads */
+	ret = init_storage_reply_bufs(nr_data_workers * 2);
+	if (ret)
+		goto out_reply_bufs;
+
+	for (i = 0; i < nr_meta_workers + nr_data_workers +
+			STORAGE_NR_REPLICA_WORKERS + STORAGE_NR_SPARE_RXBUFS; i++) {
+		storage_works[i].msg = kmalloc(MAX_RXBUF_SIZE, GFP_KERNEL);
+		if (!storage_works[i].msg) {
+			ret = -ENOMEM;
+			goto out_rxbufs;
+		}
+		list_add(&storage_works[i].list, &free_works);
+		nr_storage_rxbufs++;
+	}
+
+	for (lane = 0; lane < NR_STORAGE_LANES; lane++) {
+		for (id = 0; id < storage_lane_nr_workers(lane); id++) {
+			worker = &storage_workers[nr_storage_workers];
+			worker->lane = lane;
+			worker->id = id;
+
+			tsk = kthread_run(storage_worker_func, worker, "lego-storaged-%s/%d",
+					  storage_lane_text[lane], id);
+			if (IS_ERR(tsk)) {
+				pr_err("ERROR: Fail to create storage worker\n");
+				ret = PTR_ERR(tsk);
+				goto out_workers;
+			}
+			worker->tsk = tsk;
+			nr_storage_workers++;
+		}
+	}
+	return 0;
+
+out_workers:
+	stop_storage_workers();
+out_rxbufs:
+	free_storage_rxbufs();
+out_reply_bufs:
+	free_storage_reply_bufs();
+	return ret;
+}
+
 static int storage_manager(void *unused)
+{
+	int retlen, reply;
+	struct storage_work *work;
+
+	while(1) {
+		work = get_free_work();
+		retlen = ibapi_receive_message(0, work->msg, MAX_RXBUF_SIZE, &work->desc);
+
+		if (unlikely(retlen >= MAX_RXBUF_SIZE)) {
+			WARN(1, "retlen=%d MAX_RETBUF_SIZE=%lu", retlen, MAX_RXBUF_SIZE);
+			reply = -EFAULT;
+			ibapi_reply_message(&reply, sizeof(reply), work->desc);
+			put_free_work(work);
+			continue;
+		}
+
+		enqueue_work(work);
+	}
+	return 0;
+}
+
+#ifdef STORAGE_BYPASS_PAGE_CACHE
+/*
+ * Handlers use the ubuf mapping of the insmod thread,
+ * they have to run inline in that thread.
+ */
+static int storage_manager_inline(void *unused)
 {
 	int retlen, reply;
 	void *msg;
@@ -194,6 +715,7 @@ static int storage_manager(void *unused)
 			WARN(1, "retlen=%d MAX_RETBUF_SIZE=%lu", retlen, MAX_RXBUF_SIZE);
 			reply = -EFAULT;
 			ibapi_reply_message(&reply, sizeof(reply), desc);
+			continue;
 		}
 
 		set_in_handler();
@@ -202,6 +724,7 @@ static int storage_manager(void *unused)
 	}
 	return 0;
 }
+#endif
 
 extern int fit_state;
 
@@ -224,15 +747,28 @@ static int __init init_storage_server(void)
 	}
 
 #ifndef STORAGE_BYPASS_PAGE_CACHE
+	ret = init_storage_workers();
+	if (ret) {
+		pr_err("ERROR: Fail to init storage workers\n");
+		return ret;
+	}
+
 	tsk = kthread_run(storage_manager, NULL, "lego-storaged");
 	if (IS_ERR(tsk)) {
 		pr_err("ERROR: Fail to create lego_storaged\n");
+		stop_storage_workers();
+		free_storage_rxbufs();
+		free_storage_reply_bufs();
 		return PTR_ERR(tsk);
 	}
 #else
+	ret = init_storage_reply_bufs(1);
+	if (ret)
+		return ret;
+
 	ubuf = (char __user *)do_mmap_pgoff(NULL, 0, MAX_RXBUF_SIZE,
 			PROT_READ | PROT_WRITE, MAP_SHARED, 0, &populate);
-	storage_manager(NULL);
+	storage_manager_inline(NULL);
 #endif
 
 	ret = init_self_monitor();
@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2016-2018 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Open file handle cache
+ *
+ * M2S_READ and M2S_WRITE used to open and close the file for every
+ * request, which means a full path walk and a struct file allocation
+ * for each pgcache line. Here we keep recently used handles open,
+ * keyed by (filename, flags). Handles are reference counted: the cache
+ * holds one reference, each user holds one. The file is closed when the
+ * last reference goes away, thus eviction and invalidation never close
+ * a file that is being read or written.
+ *
+ * Unlink, rename and truncate invalidate all handles of that name, and of
+ * every name below it if it is a directory, both before and after the
+ * namespace operation. A request running in
+ * parallel may have opened the old file in between, thus each
+ * invalidation bumps fh_inval_seq, and a handle opened across a bump is
+ * reopened instead of being cached or handed out as a token.
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/jhash.h>
+#include <linux/spinlock.h>
+#include <linux/hashtable.h>
+
+#include "storage.h"
+#include "common.h"
+#include "stat.h"
+
+#define STORAGE_FH_HASH_BITS	6
+#define STORAGE_FH_MAX		64
+
+/* Open flags that have side effects, never cached */
+#define STORAGE_FH_NOCACHE_FLAGS	(O_CREAT | O_EXCL | O_TRUNC)
+
+static DEFINE_HASHTABLE(fh_ht, STORAGE_FH_HASH_BITS);
+static LIST_HEAD(fh_lru);
+static DEFINE_SPINLOCK(fh_lock);
+static int nr_cached_fh;
+
+/* Bumped by each invalidation, protected by fh_lock */
+static unsigned long fh_inval_seq;
+
+static inline u32 fh_hash(const char *name, int flags)
+{
+	return jhash(name, strlen(name), flags);
+}
+
+static inline bool fh_match(struct storage_fh *fh, const char *name, int flags)
+{
+	return fh->flags == flags && !strcmp(fh->name, name);
+}
+
+/*
+ * Is @fname @name itself, or a path below it? Renaming a directory
+ * moves every file under it, so handles opened by the old paths must go.
+ */
+static bool fh_name_covered(const char *fname, const char *name)
+{
+	size_t len = strlen(name);
+
+	/* "/a/b/" covers the same files as "/a/b" */
+	while (len > 1 && name[len - 1] == '/')
+		len--;
+
+	if (!len || strncmp(fname, name, len))
+		return false;
+	return fname[len] == '\0' || fname[len] == '/' || name[len - 1] == '/';
+}
+
+static void __put_storage_fh(struct storage_fh *fh)
+{
+	local_file_close(fh->filp);
+	kfree(fh);
+}
+
+void storage_fh_put(struct storage_fh *fh)
+{
+	if (atomic_dec_and_test(&fh->refcount))
+		__put_storage_fh(fh);
+}
+
+/* Caller holds fh_lock, and drops the cache's reference later */
+static inline void __unhash_storage_fh(struct storage_fh *fh)
+{
+	hash_del(&fh->hlist);
+	list_del(&fh->lru);
+	nr_cached_fh--;
+}
+
+static struct storage_fh *__lookup_storage_fh(const char *name, int flags, u32 key)
+{
+	struct storage_fh *fh;
+
+	hash_for_each_possible(fh_ht, fh, hlist, key) {
+		if (fh_match(fh, name, flags)) {
+			atomic_inc(&fh->refcount);
+			list_move(&fh->lru, &fh_lru);
+			return fh;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take the least recently used idle handle out of cache,
+ * return NULL if all of them are in use.
+ */
+static struct storage_fh *__evict_storage_fh(void)
+{
+	struct storage_fh *fh;
+
+	list_for_each_entry_reverse(fh, &fh_lru, lru) {
+		if (atomic_read(&fh->refcount) == 1) {
+			__unhash_storage_fh(fh);
+			return fh;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * storage_fh_get
+ * @rq: the request, only fileName and flags are used
+ *
+ * Return a referenced handle of the file, or ERR_PTR on failure.
+ * Release it by storage_fh_put().
+ */
+struct storage_fh *storage_fh_get(request *rq)
+{
+	struct storage_fh *fh, *old, *victim = NULL;
+	struct file *filp;
+	unsigned long seq;
+	u32 key;
+
+	key = fh_hash(rq->fileName, rq->flags);
+
+retry:
+	spin_lock(&fh_lock);
+	fh = __lookup_storage_fh(rq->fileName, rq->flags, key);
+	seq = fh_inval_seq;
+	spin_unlock(&fh_lock);
+	if (fh) {
+		inc_storage_stat(STORAGE_FH_HIT);
+		return fh;
+	}
+
+	inc_storage_stat(STORAGE_FH_MISS);
+
+	fh = kmalloc(sizeof(*fh), GFP_KERNEL);
+	if (unlikely(!fh))
+		return ERR_PTR(-ENOMEM);
+
+	filp = local_file_open(rq);
+	if (IS_ERR(filp)) {
+		kfree(fh);
+		return ERR_CAST(filp);
+	}
+
+	strncpy(fh->name, rq->fileName, MAX_FILE_NAME);
+	fh->name[MAX_FILE_NAME - 1] = '\0';
+	fh->flags = rq->flags;
+	fh->filp = filp;
+	INIT_HLIST_NODE(&fh->hlist);
+	INIT_LIST_HEAD(&fh->lru);
+
+	/* Private handle, closed once caller is done */
+	if (rq->flags & STORAGE_FH_NOCACHE_FLAGS) {
+		atomic_set(&fh->refcount, 1);
+		return fh;
+	}
+
+	spin_lock(&fh_lock);
+	/* Renamed, unlinked or truncated meanwhile, may be the old file */
+	if (unlikely(fh_inval_seq != seq)) {
+		spin_unlock(&fh_lock);
+		__put_storage_fh(fh);
+		goto retry;
+	}
+
+	/* Someone else opened it meanwhile */
+	old = __lookup_storage_fh(rq->fileName, rq->flags, key);
+	if (old) {
+		spin_unlock(&fh_lock);
+		__put_storage_fh(fh);
+		return old;
+	}
+
+	if (nr_cached_fh >= STORAGE_FH_MAX)
+		victim = __evict_storage_fh();
+
+	/* One for cache, one for caller */
+	atomic_set(&fh->refcount, 2);
+	hash_add(fh_ht, &fh->hlist, key);
+	list_add(&fh->lru, &fh_lru);
+	nr_cached_fh++;
+	spin_unlock(&fh_lock);
+
+	if (victim)
+		storage_fh_put(victim);
+	return fh;
+}
+
+/*
+ * Handles opened by M2S_OPEN
+ *
+ * Memory managers keep a file open across requests, and send the token
+ * instead of the name. Each slot holds one reference of a cached handle,
+ * thus the file stays open even if the cache evicts it. Invalidation
+ * drops the slots too, later requests with those tokens get -ESTALE.
+ */
+#define STORAGE_NR_TOKENS	1024
+
+struct storage_fh_slot {
+	u32			gen;
+	struct storage_fh	*fh;
+};
+
+static struct storage_fh_slot fh_slots[STORAGE_NR_TOKENS];
+static DEFINE_SPINLOCK(fh_slots_lock);
+static unsigned int fh_next_slot;
+
+/**
+ * storage_fh_open_token
+ * @rq: the request, only fileName and flags are used
+ * @token: filled with the token on success
+ *
+ * Open the file and keep it open until storage_fh_close_token().
+ */
+int storage_fh_open_token(request *rq, struct lego_file_token *token)
+{
+	struct storage_fh_slot *slot;
+	struct storage_fh *fh;
+	unsigned int i, fid;
+	unsigned long seq;
+
+	/* Would be a private handle */
+	if (rq->flags & STORAGE_FH_NOCACHE_FLAGS)
+		return -EINVAL;
+
+retry:
+	spin_lock(&fh_lock);
+	seq = fh_inval_seq;
+	spin_unlock(&fh_lock);
+
+	fh = storage_fh_get(rq);
+	if (IS_ERR(fh))
+		return PTR_ERR(fh);
+
+	spin_lock(&fh_slots_lock);
+	/*
+	 * Invalidation bumps the seq before it scans the slots,
+	 * a token installed after the scan would outlive it.
+	 */
+	if (unlikely(READ_ONCE(fh_inval_seq) != seq)) {
+		spin_unlock(&fh_slots_lock);
+		storage_fh_put(fh);
+		goto retry;
+	}
+
+	for (i = 0; i < STORAGE_NR_TOKENS; i++) {
+		fid = (fh_next_slot + i) % STORAGE_NR_TOKENS;
+		slot = &fh_slots[fid];
+		if (!slot->fh)
+			goto found;
+	}
+	spin_unlock(&fh_slots_lock);
+
+	storage_fh_put(fh);
+	return -ENFILE;
+
+found:
+	/* gen 0 is never valid */
+	if (unlikely(++slot->gen == 0))
+		slot->gen = 1;
+	slot->fh = fh;
+	fh_next_slot = fid + 1;
+
+	/* Requester knows where we are */
+	token->nid = 0;
+	token->fid = fid;
+	token->gen = slot->gen;
+	spin_unlock(&fh_slots_lock);
+	return 0;
+}
+
+static inline struct storage_fh_slot *
+token_to_slot(struct lego_file_token *token)
+{
+	struct storage_fh_slot *slot;
+
+	if (unlikely(token->fid >= STORAGE_NR_TOKENS))
+		return NULL;
+
+	slot = &fh_slots[token->fid];
+	if (!slot->fh || slot->gen != token->gen)
+		return NULL;
+	return slot;
+}
+
+/**
+ * storage_fh_lookup_token
+ * @token: token returned by storage_fh_open_token()
+ *
+ * Return a referenced handle, or ERR_PTR(-ESTALE) if it was closed or
+ * invalidated. Release it by storage_fh_put().
+ */
+struct storage_fh *storage_fh_lookup_token(struct lego_file_token *token)
+{
+	struct storage_fh_slot *slot;
+	struct storage_fh *fh = ERR_PTR(-ESTALE);
+
+	spin_lock(&fh_slots_lock);
+	slot = token_to_slot(token);
+	if (slot) {
+		fh = slot->fh;
+		atomic_inc(&fh->refcount);
+	}
+	spin_unlock(&fh_slots_lock);
+	return fh;
+}
+
+/* Key of a file name, used to keep requests of one file in order */
+u32 storage_fh_name_key(const char *name)
+{
+	return jhash(name, strlen(name), 0);
+}
+
+/**
+ * storage_fh_token_key
+ * @token: token returned by storage_fh_open_token()
+ *
+ * Return the key of the name @token was opened by, so requests by name
+ * and by token of the same file get the same key. A stale token fails
+ * anyway, any key does.
+ */
+u32 storage_fh_token_key(struct lego_file_token *token)
+{
+	struct storage_fh_slot *slot;
+	u32 key = token->fid;
+
+	spin_lock(&fh_slots_lock);
+	slot = token_to_slot(token);
+	if (slot)
+		key = storage_fh_name_key(slot->fh->name);
+	spin_unlock(&fh_slots_lock);
+	return key;
+}
+
+int storage_fh_close_token(struct lego_file_token *token)
+{
+	struct storage_fh_slot *slot;
+	struct storage_fh *fh = NULL;
+
+	spin_lock(&fh_slots_lock);
+	slot = token_to_slot(token);
+	if (slot) {
+		fh = slot->fh;
+		slot->fh = NULL;
+	}
+	spin_unlock(&fh_slots_lock);
+
+	if (!fh)
+		return -ESTALE;
+	storage_fh_put(fh);
+	return 0;
+}
+
+static void storage_fh_invalidate_tokens(const char *name)
+{
+	struct storage_fh *dead[16];
+	int i, nr;
+
+again:
+	nr = 0;
+	spin_lock(&fh_slots_lock);
+	for (i = 0; i < STORAGE_NR_TOKENS && nr < ARRAY_SIZE(dead); i++) {
+		if (!fh_slots[i].fh || !fh_name_covered(fh_slots[i].fh->name, name))
+			continue;
+		dead[nr++] = fh_slots[i].fh;
+		fh_slots[i].fh = NULL;
+	}
+	spin_unlock(&fh_slots_lock);
+
+	for (i = 0; i < nr; i++)
+		storage_fh_put(dead[i]);
+	if (nr == ARRAY_SIZE(dead))
+		goto again;
+}
+
+/**
+ * storage_fh_invalidate
+ * @name: the file name
+ *
+ * Drop all cached handles of @name and of files below it, whatever flags
+ * they were opened with, and their tokens. Users that still hold a handle
+ * can finish with it. Call it both before and after changing @name in the
+ * namespace.
+ */
+void storage_fh_invalidate(const char *name)
+{
+	struct storage_fh *fh;
+	struct hlist_node *tmp;
+	LIST_HEAD(dead);
+	int bkt;
+
+	spin_lock(&fh_lock);
+	fh_inval_seq++;
+	hash_for_each_safe(fh_ht, bkt, tmp, fh, hlist) {
+		if (!fh_name_covered(fh->name, name))
+			continue;
+		__unhash_storage_fh(fh);
+		list_add(&fh->lru, &dead);
+	}
+	spin_unlock(&fh_lock);
+
+	while (!list_empty(&dead)) {
+		fh = list_first_entry(&dead, struct storage_fh, lru);
+		list_del(&fh->lru);
+		storage_fh_put(fh);
+	}
+
+	storage_fh_invalidate_tokens(name);
+}
@@ -177,6 +177,78 @@ ssize_t local_file_read(struct file *file, char __user *buf, ssize_t len, loff_t
 	return ret;
 }
 
+/*
+ * local_file_writev
+ * local_file_readv
+ *
+ * Vectored version of local_file_write/read, @iov points to kernel buffers.
+ * Return the total number of bytes, or -errno.
+ */
+#ifndef STORAGE_BYPASS_PAGE_CACHE
+ssize_t local_file_writev(struct file *file, const struct iovec *iov,
+			  unsigned long nr, loff_t *pos)
+{
+	ssize_t ret;
+	mm_segment_t old_fs;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	ret = vfs_writev(file, (const struct iovec __user *)iov, nr, pos);
+	set_fs(old_fs);
+	return ret;
+}
+
+ssize_t local_file_readv(struct file *file, const struct iovec *iov,
+			 unsigned long nr, loff_t *pos)
+{
+	ssize_t ret;
+	mm_segment_t old_fs;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	ret = vfs_readv(file, (const struct iovec __user *)iov, nr, pos);
+	set_fs(old_fs);
+	return ret;
+}
+#else
+/* Bounce through ubuf one by one */
+ssize_t local_file_writev(struct file *file, const struct iovec *iov,
+			  unsigned long nr, loff_t *pos)
+{
+	ssize_t ret, total = 0;
+	unsigned long i;
+
+	for (i = 0; i < nr; i++) {
+		ret = local_file_write(file, iov[i].iov_base, iov[i].iov_len, pos);
+		if (ret < 0)
+			return total ? total : ret;
+		total += ret;
+		*pos += ret;
+		if (ret < iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+ssize_t local_file_readv(struct file *file, const struct iovec *iov,
+			 unsigned long nr, loff_t *pos)
+{
+	ssize_t ret, total = 0;
+	unsigned long i;
+
+	for (i = 0; i < nr; i++) {
+		ret = local_file_read(file, iov[i].iov_base, iov[i].iov_len, pos);
+		if (ret < 0)
+			return total ? total : ret;
+		total += ret;
+		*pos += ret;
+		if (ret < iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+#endif /* STORAGE_BYPASS_PAGE_CACHE */
+
 /*
  * local_fsync
  *
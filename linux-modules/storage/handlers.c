@@ -13,6 +13,8 @@
 #include <linux/mutex.h>
 #include <linux/mm.h>
 #include <linux/namei.h>
+#include <linux/wait.h>
+#include <linux/list.h>
 
 request constuct_request(int uid, char *fileName, fmode_t permission, ssize_t len, 
 		loff_t offset, int flags){
@@ -26,43 +28,133 @@ request constuct_request(int uid, char *fileName, fmode_t permission, ssize_t le
 	return rq;
 }
 
-ssize_t handle_read_request(void *payload, uintptr_t desc)
+/*
+ * Read reply buffers
+ *
+ * Preallocated at init time, each holds the retval and up to
+ * M2S_READ_MAX_CHUNK bytes of content. local_file_read() fills them
+ * directly, and the reply is sent from the same buffer. Requests larger
+ * than one chunk get a short read, requester continues from there.
+ */
+#define STORAGE_REPLY_BUF_SIZE	(sizeof(ssize_t) + M2S_READ_MAX_CHUNK)
+
+struct storage_reply_buf {
+	struct list_head	list;
+	void			*buf;
+};
+
+static LIST_HEAD(free_reply_bufs);
+static DEFINE_SPINLOCK(free_reply_bufs_lock);
+static DECLARE_WAIT_QUEUE_HEAD(free_reply_bufs_wq);
+
+static struct storage_reply_buf *__get_reply_buf(void)
 {
+	struct storage_reply_buf *rb = NULL;
+
+	spin_lock(&free_reply_bufs_lock);
+	if (!list_empty(&free_reply_bufs)) {
+		rb = list_first_entry(&free_reply_bufs, struct storage_reply_buf, list);
+		list_del(&rb->list);
+	}
+	spin_unlock(&free_reply_bufs_lock);
+	return rb;
+}
+
+static struct storage_reply_buf *get_reply_buf(void)
+{
+	struct storage_reply_buf *rb;
+
+	wait_event(free_reply_bufs_wq, (rb = __get_reply_buf()) != NULL);
+	return rb;
+}
+
+static void put_reply_buf(struct storage_reply_buf *rb)
+{
+	spin_lock(&free_reply_bufs_lock);
+	list_add(&rb->list, &free_reply_bufs);
+	spin_unlock(&free_reply_bufs_lock);
+
+	wake_up(&free_reply_bufs_wq);
+}
+
+int init_storage_reply_bufs(int nr)
+{
+	struct storage_reply_buf *rb;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		rb = kmalloc(sizeof(*rb), GFP_KERNEL);
+		if (!rb)
+			return -ENOMEM;
+
+		/* Exact pages, kmalloc would round 2MB+8 up to 4MB */
+		rb->buf = alloc_pages_exact(STORAGE_REPLY_BUF_SIZE, GFP_KERNEL);
+		if (!rb->buf) {
+			kfree(rb);
+			return -ENOMEM;
+		}
+		put_reply_buf(rb);
+	}
+	return 0;
+}
+
+/* Free all reply buffers, none may be in use */
+void free_storage_reply_bufs(void)
+{
+	struct storage_reply_buf *rb;
+
+	while ((rb = __get_reply_buf())) {
+		free_pages_exact(rb->buf, STORAGE_REPLY_BUF_SIZE);
+		kfree(rb);
+	}
+}
+
+/*
+ * The handle an M2S read or write goes to, found by token or opened
+ * by name. Return a referenced handle, or ERR_PTR on failure.
+ */
+static struct storage_fh *m2s_rw_get_fh(void *msg)
+{
+	struct m2s_fh_read_write_payload *fh_rq;
 	struct m2s_read_write_payload *m2s_rq;
+	request rq;
+
+	if (m2s_rw_by_handle(msg)) {
+		fh_rq = msg + sizeof(u32);
+		return storage_fh_lookup_token(&fh_rq->token);
+	}
+
+	m2s_rq = msg + sizeof(u32);
+	rq = constuct_request(m2s_rq->uid, m2s_rq->filename, 0, m2s_rq->len,
+			m2s_rq->offset, m2s_rq->flags);
+	return storage_fh_get(&rq);
+}
+
+ssize_t handle_read_request(void *msg, uintptr_t desc)
+{
 	//int metadata_entry, user_entry;
 	ssize_t ret;
 	ssize_t *retval;
 	char *readbuf;
 	void *retbuf;
-	int len_retbuf = 0;
-	struct file *filp;
-	request rq;
-
-	m2s_rq = (struct m2s_read_write_payload *) payload;
-	len_retbuf = m2s_rq->len + sizeof(ssize_t);
-	rq = constuct_request(m2s_rq->uid, m2s_rq->filename, 0, m2s_rq->len, 
-			m2s_rq->offset, m2s_rq->flags);
+	struct storage_reply_buf *rb;
+	struct storage_fh *fh;
+	size_t len;
+	loff_t offset;
 
-	if (unlikely(m2s_rq->len > 512*BLK_SIZE)) {
-		pr_info("read request is too large, request [%lu].\n", m2s_rq->len);
-		ret = -ENOMEM;
-		goto err;
-	}
+	/* Large reads are streamed chunk by chunk */
+	len = min_t(size_t, m2s_rw_len(msg), M2S_READ_MAX_CHUNK);
+	offset = m2s_rw_offset(msg);
 
-	retbuf = kmalloc(len_retbuf, GFP_KERNEL);
-	if (unlikely(!retbuf)) {
-		pr_info("No memory for read retbuf, request [%lu].\n", m2s_rq->len);
-		ret = -ENOMEM;
-		goto err;
-	}
+	rb = get_reply_buf();
+	retbuf = rb->buf;
 
 	retval = (ssize_t *) retbuf;
 	readbuf = (char *) (retbuf + sizeof(ssize_t));
 
 #ifdef DEBUG_STORAGE
-	pr_info("%s:() uid: %d, filename: %s, len: %lu, offset: %Lu, flags: %o\n",	\
-			__func__, m2s_rq->uid, m2s_rq->filename, m2s_rq->len,
-			m2s_rq->offset, m2s_rq->flags);
+	pr_info("%s:() opcode: %#x, len: %lu, offset: %Lu\n",
+			__func__, *(u32 *)msg, len, offset);
 #endif /* DEBUG_STORAGE */
 
 	/* *retval = grant_access(&rq, &metadata_entry, &user_entry);
@@ -71,48 +163,40 @@ ssize_t handle_read_request(void *payload, uintptr_t desc)
 	} */ /*enable in future*/
 	*retval = 0;
 
-	filp = local_file_open(&rq);
-	if (IS_ERR(filp)){
-		*retval = PTR_ERR(filp);
+	fh = m2s_rw_get_fh(msg);
+	if (IS_ERR(fh)){
+		*retval = PTR_ERR(fh);
 		goto out_reply;
 	}
 
-	*retval = local_file_read(filp, (char __user *)readbuf, rq.len, &rq.offset);
-	local_file_close(filp);
+	*retval = local_file_read(fh->filp, (char __user *)readbuf, len, &offset);
+	storage_fh_put(fh);
 	//yield_access(metadata_entry, user_entry); //enable in future
 	//pr_info("Content in readbuf is [%s]\n", readbuf);
 
 out_reply:
 	ret = *retval;
-	ibapi_reply_message(retbuf, len_retbuf, desc);
-	kfree(retbuf);
-	return ret;
 
-err:
-	ibapi_reply_message(&ret, sizeof(ret), desc);
+	/* Only the bytes that were read */
+	ibapi_reply_message(retbuf, sizeof(ssize_t) + max_t(ssize_t, ret, 0), desc);
+	put_reply_buf(rb);
 	return ret;
-	
 }
 
-ssize_t handle_write_request(void *payload, uintptr_t desc)
+ssize_t handle_write_request(void *msg, uintptr_t desc)
 {
-	struct m2s_read_write_payload *m2s_wq;
 	//int metadata_entry, user_entry;
 	ssize_t retval;
 	char *writebuf;
-	struct file *filp;
-	request rq;
+	struct storage_fh *fh;
+	loff_t offset;
 
-	m2s_wq = (struct m2s_read_write_payload *) payload;
-	rq = constuct_request(m2s_wq->uid, m2s_wq->filename, 0, m2s_wq->len, 
-			m2s_wq->offset, m2s_wq->flags);
-
-	writebuf = (char *) (payload + sizeof(struct m2s_read_write_payload));
+	offset = m2s_rw_offset(msg);
+	writebuf = m2s_rw_content(msg);
 
 #ifdef DEBUG_STORAGE
-	pr_info("%s:() uid: %d, filename: %s, len: %lu, offset: %Lu, flags: %o\n",			\
-			__func__, m2s_wq->uid, m2s_wq->filename, m2s_wq->len,
-			m2s_wq->offset, m2s_wq->flags);
+	pr_info("%s:() opcode: %#x, len: %lu, offset: %Lu\n",
+			__func__, *(u32 *)msg, m2s_rw_len(msg), offset);
 #endif
 	/*retval = grant_access(&rq, &metadata_entry, &user_entry);
 	if (retval){
@@ -120,13 +204,14 @@ ssize_t handle_write_request(void *payload, uintptr_t desc)
 	}*/ //enable in future
 	retval = 0;
 
-	filp = local_file_open(&rq);
-	if (IS_ERR(filp)){
-		retval = PTR_ERR(filp);
+	fh = m2s_rw_get_fh(msg);
+	if (IS_ERR(fh)){
+		retval = PTR_ERR(fh);
 		goto out_reply;
 	}
-	retval = local_file_write(filp, (const char __user *)writebuf, rq.len, &rq.offset);
-	local_file_close(filp);
+	retval = local_file_write(fh->filp, (const char __user *)writebuf,
+				  m2s_rw_len(msg), &offset);
+	storage_fh_put(fh);
 	//yield_access(metadata_entry, user_entry); //enable in future
 
 out_reply:
@@ -135,6 +220,149 @@ out_reply:
 	
 }
 
+/*
+ * Bytes that belong to a request of @len, when a vectored I/O
+ * returned @total and previous requests took @done bytes.
+ */
+static inline ssize_t rw_batch_retval(ssize_t total, size_t len, size_t *done)
+{
+	ssize_t ret;
+
+	if (total < 0)
+		return total;
+
+	ret = min_t(ssize_t, len, max_t(ssize_t, total - *done, 0));
+	*done += len;
+	return ret;
+}
+
+static void handle_write_batch(void **msgs, uintptr_t *descs, int nr)
+{
+	struct iovec iov[STORAGE_RW_BATCH_MAX];
+	struct storage_fh *fh;
+	ssize_t total, retval;
+	size_t done = 0;
+	loff_t offset;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		iov[i].iov_base = m2s_rw_content(msgs[i]);
+		iov[i].iov_len = m2s_rw_len(msgs[i]);
+	}
+
+	offset = m2s_rw_offset(msgs[0]);
+	fh = m2s_rw_get_fh(msgs[0]);
+	if (IS_ERR(fh)) {
+		total = PTR_ERR(fh);
+	} else {
+		total = local_file_writev(fh->filp, iov, nr, &offset);
+		storage_fh_put(fh);
+	}
+
+	for (i = 0; i < nr; i++) {
+		retval = rw_batch_retval(total, iov[i].iov_len, &done);
+		ibapi_reply_message(&retval, sizeof(retval), descs[i]);
+	}
+}
+
+static void handle_read_batch(void **msgs, uintptr_t *descs, int nr)
+{
+	struct storage_reply_buf *rbs[STORAGE_RW_BATCH_MAX];
+	struct iovec iov[STORAGE_RW_BATCH_MAX];
+	struct storage_fh *fh;
+	ssize_t total, *retval;
+	size_t done = 0;
+	loff_t offset;
+	int i, nr_vec;
+
+	/*
+	 * Only wait for the first buffer. Waiting for more while holding
+	 * some could deadlock with other workers.
+	 */
+	rbs[0] = get_reply_buf();
+	for (nr_vec = 1; nr_vec < nr; nr_vec++) {
+		rbs[nr_vec] = __get_reply_buf();
+		if (!rbs[nr_vec])
+			break;
+	}
+
+	for (i = 0; i < nr_vec; i++) {
+		iov[i].iov_base = rbs[i]->buf + sizeof(ssize_t);
+		iov[i].iov_len = min_t(size_t, m2s_rw_len(msgs[i]), M2S_READ_MAX_CHUNK);
+	}
+
+	offset = m2s_rw_offset(msgs[0]);
+	fh = m2s_rw_get_fh(msgs[0]);
+	if (IS_ERR(fh)) {
+		total = PTR_ERR(fh);
+	} else {
+		total = local_file_readv(fh->filp, iov, nr_vec, &offset);
+		storage_fh_put(fh);
+	}
+
+	for (i = 0; i < nr_vec; i++) {
+		retval = rbs[i]->buf;
+		*retval = rw_batch_retval(total, iov[i].iov_len, &done);
+		ibapi_reply_message(rbs[i]->buf,
+				    sizeof(ssize_t) + max_t(ssize_t, *retval, 0), descs[i]);
+		put_reply_buf(rbs[i]);
+	}
+
+	/* Ran out of buffers, serve the rest one by one */
+	for (i = nr_vec; i < nr; i++)
+		handle_read_request(msgs[i], descs[i]);
+}
+
+/**
+ * handle_read_write_batch
+ * @msgs: M2S read or write messages, starting with opcode
+ * @descs: reply descriptors
+ * @nr: number of requests
+ *
+ * Serve adjacent requests of one file with one vectored I/O. Caller
+ * made sure they have the same opcode and file, and each one starts
+ * where the previous one stops. Each request gets its own reply.
+ */
+void handle_read_write_batch(void **msgs, uintptr_t *descs, int nr)
+{
+	BUG_ON(nr > STORAGE_RW_BATCH_MAX);
+
+	if (m2s_rw_is_write(msgs[0]))
+		handle_write_batch(msgs, descs, nr);
+	else
+		handle_read_batch(msgs, descs, nr);
+}
+
+/*
+ * M2S_OPEN
+ * Keep the file open for a memory manager, reply a token.
+ */
+int handle_m2s_open(void *payload, uintptr_t desc)
+{
+	struct m2s_open_payload *op = payload;
+	struct m2s_open_reply reply;
+	request rq;
+
+	memset(&reply, 0, sizeof(reply));
+	rq = constuct_request(0, op->filename, 0, 0, 0, op->flags);
+	reply.retval = storage_fh_open_token(&rq, &reply.token);
+
+	ibapi_reply_message(&reply, sizeof(reply), desc);
+	return reply.retval;
+}
+
+/* M2S_CLOSE */
+int handle_m2s_close(void *payload, uintptr_t desc)
+{
+	struct m2s_close_payload *cl = payload;
+	int ret;
+
+	ret = storage_fh_close_token(&cl->token);
+
+	ibapi_reply_message(&ret, sizeof(ret), desc);
+	return ret;
+}
+
 /* Open request from processor directly */
 int handle_open_request(void *payload, uintptr_t desc)
 {
@@ -204,6 +432,7 @@ long handle_truncate_request(void *payload, uintptr_t desc)
 		goto reply;
 	}
 
+	storage_fh_invalidate(trunc->filename);
 retry:
 	//ret = user_path_at(AT_FDCWD, trunc->filename, lookup_flags, &path);
 	ret = kern_path(trunc->filename, lookup_flags, &path);
@@ -215,6 +444,7 @@ retry:
 		lookup_flags |= LOOKUP_REVAL;
 		goto retry;
 	}
+	storage_fh_invalidate(trunc->filename);
 
 reply:
 	ibapi_reply_message(&ret, sizeof(ret), desc);
@@ -226,7 +456,9 @@ long handle_unlink_request(void *payload, uintptr_t desc)
 	struct p2s_unlink_struct *unlink = payload;
 	long ret;
 
+	storage_fh_invalidate(unlink->filename);
 	ret = do_unlink(unlink->filename);
+	storage_fh_invalidate(unlink->filename);
 
 	ibapi_reply_message(&ret, sizeof(ret), desc);
 	return ret;
@@ -355,7 +587,11 @@ long handle_rename_request(void *payload, uintptr_t desc)
 	struct p2s_rename_struct *__payload = payload;
 	long ret;
 
+	storage_fh_invalidate(__payload->oldname);
+	storage_fh_invalidate(__payload->newname);
 	ret = do_rename(__payload->oldname, __payload->newname);
+	storage_fh_invalidate(__payload->oldname);
+	storage_fh_invalidate(__payload->newname);
 
 	ibapi_reply_message(&ret, sizeof(ret), desc);
 	return ret;
@@ -15,6 +15,8 @@
 #include <linux/mm.h>
 #include <linux/kthread.h>
 #include <linux/hashtable.h>
+#include <linux/sched.h>
+#include <linux/math64.h>
 
 #include "../fit/fit_config.h"
 #include "storage.h"
@@ -175,83 +177,174 @@ unlock:
 	return r;
 }
 
-static int append_replica(struct replica_log_info *r,
-			  struct replica_log *log_array, int nr_log)
+#if 0
+#define dp(fmt, ...)		\
+	pr_crit("%s(): " fmt "\n", __func__, __VA_ARGS__)
+#else
+#define dp(fmt, ...) do { } while (0)
+#endif
+
+/*
+ * Group commit
+ *
+ * The replica worker takes all queued M2S_REPLICA_FLUSH and
+ * M2S_REPLICA_VMA messages as one batch. Records are gathered per
+ * replica_log_info first, each log file then gets one vectored append
+ * and one fsync. Acks go out after the whole batch is durable, and
+ * replica_commit_stats tracks throughput and latency.
+ *
+ * Since memory side may pack logs of several processes into one
+ * M2S_REPLICA_FLUSH, logs are split by their own (pid, vnode_id).
+ */
+struct replica_commit_stat {
+	unsigned long		nr_batches;
+	unsigned long		nr_msgs;
+	unsigned long		nr_records;
+	unsigned long		nr_bytes;
+	unsigned long		nr_fsync;
+	u64			total_ns;
+	u64			max_ns;
+};
+
+static struct replica_commit_stat replica_commit_stats;
+
+static int write_iov(struct file *f, struct iovec *iov, unsigned int nr,
+		     loff_t *pos)
 {
-	struct file *f;
-	size_t count;
 	ssize_t written;
+	size_t count = 0;
+	unsigned int i;
 
-	f = r->filp_replica;
-	count = nr_log * (sizeof(*log_array));
+	for (i = 0; i < nr; i++)
+		count += iov[i].iov_len;
 
-	written = local_file_write(f, (char *)log_array, count, &r->HEAD_REPLICA);
+	written = local_file_writev(f, iov, nr, pos);
 	if (written != count)
 		return -EFAULT;
+
+	replica_commit_stats.nr_bytes += count;
 	return 0;
 }
 
-static inline int append_mmap(struct replica_log_info *r,
-			      struct replica_vma_log *log)
+static void write_replica_iov(struct replica_log_info *r)
 {
-	struct file *f;
-	size_t count;
-	ssize_t written;
+	int ret;
 
-	f = r->filp_mmap;
-	count = sizeof(*log);
+	if (!r->nr_log_iov)
+		return;
 
-	written = local_file_write(f, (char *)log, count, &r->HEAD_MMAP);
-	if (written != count)
-		return -EFAULT;
-	return 0;
+	ret = write_iov(r->filp_replica, r->log_iov, r->nr_log_iov, &r->HEAD_REPLICA);
+	if (ret && !r->commit_ret)
+		r->commit_ret = ret;
+	r->nr_log_iov = 0;
 }
 
-#if 0
-#define dp(fmt, ...)		\
-	pr_crit("%s(): " fmt "\n", __func__, __VA_ARGS__)
-#else
-#define dp(fmt, ...) do { } while (0)
-#endif
+static void write_mmap_iov(struct replica_log_info *r)
+{
+	int ret;
+
+	if (!r->nr_mmap_iov)
+		return;
+
+	ret = write_iov(r->filp_mmap, r->mmap_iov, r->nr_mmap_iov, &r->HEAD_MMAP);
+	if (ret && !r->commit_ret)
+		r->commit_ret = ret;
+	r->nr_mmap_iov = 0;
+}
+
+static inline void join_commit(struct replica_log_info *r,
+			       struct list_head *commit_list)
+{
+	if (r->in_commit)
+		return;
+
+	r->in_commit = true;
+	r->commit_ret = 0;
+	list_add_tail(&r->commit_list, commit_list);
+}
+
+static void buffer_replica(struct replica_log_info *r,
+			   struct replica_log *log_array, int nr_log)
+{
+	if (r->nr_log_iov == REPLICA_COMMIT_MAX_IOV)
+		write_replica_iov(r);
+
+	r->log_iov[r->nr_log_iov].iov_base = log_array;
+	r->log_iov[r->nr_log_iov].iov_len = nr_log * sizeof(*log_array);
+	r->nr_log_iov++;
+	replica_commit_stats.nr_records += nr_log;
+}
+
+static void buffer_mmap(struct replica_log_info *r, struct replica_vma_log *log)
+{
+	if (r->nr_mmap_iov == REPLICA_COMMIT_MAX_IOV)
+		write_mmap_iov(r);
+
+	r->mmap_iov[r->nr_mmap_iov].iov_base = log;
+	r->mmap_iov[r->nr_mmap_iov].iov_len = sizeof(*log);
+	r->nr_mmap_iov++;
+	replica_commit_stats.nr_records++;
+}
+
+/* Number of logs from @run on that belong to the same process */
+static unsigned int replica_run_len(struct replica_log *run, unsigned int nr_left)
+{
+	unsigned int nr_run;
+
+	for (nr_run = 1; nr_run < nr_left; nr_run++) {
+		if (run[nr_run].meta.pid != run->meta.pid ||
+		    run[nr_run].meta.vnode_id != run->meta.vnode_id)
+			break;
+	}
+	return nr_run;
+}
 
 /*
- * Handle memory replication flush from Secondary Memory
+ * Split logs into runs of the same process, buffer each run.
+ *
+ * A message is gathered as a whole or not at all: memory resends it on
+ * error, thus none of its logs may be written then. Log files of all
+ * runs are found or created first, nothing is buffered if one fails.
+ * Once created they stay in replica_ht, the second lookup can not fail.
  */
-void handle_replica_flush(void *_msg, u64 desc)
+static int gather_replica_flush(struct m2s_replica_flush_msg *msg,
+				struct list_head *commit_list)
 {
-	struct m2s_replica_flush_msg *msg = _msg;
 	struct replica_log_info *r;
-	struct replica_log *log_array;
-	unsigned int nr_log;
-	unsigned int pid, vnode_id;
-	int reply;
+	struct replica_log *log_array, *run;
+	unsigned int i, nr_log, nr_run;
 
 	nr_log = msg->nr_log;
 	log_array = (struct replica_log *)(&msg->log);
 
-	pid = log_array->meta.pid;
-	vnode_id = log_array->meta.vnode_id;
+	for (i = 0; i < nr_log; i += nr_run) {
+		run = &log_array[i];
+		nr_run = replica_run_len(run, nr_log - i);
 
-	r = find_or_alloc_replica_log_info(pid, vnode_id);
-	if (!r) {
-		reply = -ENOMEM;
-		goto out;
+		r = find_or_alloc_replica_log_info(run->meta.pid, run->meta.vnode_id);
+		if (!r)
+			return -ENOMEM;
 	}
 
-	reply = append_replica(r, log_array, nr_log);
-out:
-	ibapi_reply_message(&reply, sizeof(reply), desc);
+	for (i = 0; i < nr_log; i += nr_run) {
+		run = &log_array[i];
+		nr_run = replica_run_len(run, nr_log - i);
+
+		r = find_or_alloc_replica_log_info(run->meta.pid, run->meta.vnode_id);
+		if (WARN_ON_ONCE(!r))
+			return -ENOMEM;
+
+		join_commit(r, commit_list);
+		buffer_replica(r, run, nr_run);
+	}
+	return 0;
 }
 
-/*
- * Handle VMA replication from Primary Memory
- */
-void handle_replica_vma(void *_msg, u64 desc)
+static int gather_replica_vma(struct m2s_replica_vma_msg *msg,
+			      struct list_head *commit_list)
 {
-	struct m2s_replica_vma_msg *msg = _msg;
 	struct replica_vma_log *log = &msg->log;
 	struct replica_log_info *r;
-	int reply = 0;
 
 	dp("pid: %d vnode_id: %d action: %d [%#lx-%#lx], [%#lx-%#lx]\n",
 		log->pid, log->vnode_id, log->action,
@@ -259,12 +352,124 @@ void handle_replica_vma(void *_msg, u64 desc)
 		log->old_addr, log->old_addr + log->old_len);
 
 	r = find_or_alloc_replica_log_info(log->pid, log->vnode_id);
-	if (!r) {
+	if (!r)
+		return -ENOMEM;
+
+	join_commit(r, commit_list);
+	buffer_mmap(r, log);
+	return 0;
+}
+
+/* Write out and fsync every file touched by this batch */
+static int commit_replicas(struct list_head *commit_list)
+{
+	struct replica_log_info *r, *tmp;
+	int ret = 0;
+
+	list_for_each_entry_safe(r, tmp, commit_list, commit_list) {
+		if (r->nr_log_iov) {
+			write_replica_iov(r);
+			if (!r->commit_ret)
+				r->commit_ret = local_fsync(r->filp_replica);
+			replica_commit_stats.nr_fsync++;
+		}
+		if (r->nr_mmap_iov) {
+			write_mmap_iov(r);
+			if (!r->commit_ret)
+				r->commit_ret = local_fsync(r->filp_mmap);
+			replica_commit_stats.nr_fsync++;
+		}
+
+		if (r->commit_ret && !ret)
+			ret = r->commit_ret;
+
+		list_del(&r->commit_list);
+		r->in_commit = false;
+	}
+	return ret;
+}
+
+/**
+ * handle_replica_batch
+ * @msgs: M2S_REPLICA_FLUSH or M2S_REPLICA_VMA messages, in arrival order
+ * @descs: reply descriptors
+ * @nr: number of messages
+ *
+ * Group commit all of them. A message that failed to gather is acked
+ * with that error, and none of its logs are written. Others are acked
+ * with the result of the whole commit.
+ */
+void handle_replica_batch(void **msgs, uintptr_t *descs, int nr)
+{
+	LIST_HEAD(commit_list);
+	int i, ret, reply;
+	int *errs;
+	u64 start, delta;
+
+	start = sched_clock();
+
+	errs = kcalloc(nr, sizeof(*errs), GFP_KERNEL);
+	if (!errs) {
 		reply = -ENOMEM;
-		goto out;
+		for (i = 0; i < nr; i++)
+			ibapi_reply_message(&reply, sizeof(reply), descs[i]);
+		return;
 	}
 
-	reply = append_mmap(r, log);
-out:
-	ibapi_reply_message(&reply, sizeof(reply), desc);
+	for (i = 0; i < nr; i++) {
+		unsigned int opcode = *(unsigned int *)msgs[i];
+
+		if (opcode == M2S_REPLICA_FLUSH)
+			errs[i] = gather_replica_flush(msgs[i], &commit_list);
+		else if (opcode == M2S_REPLICA_VMA)
+			errs[i] = gather_replica_vma(msgs[i], &commit_list);
+		else
+			errs[i] = -EINVAL;
+	}
+
+	ret = commit_replicas(&commit_list);
+
+	for (i = 0; i < nr; i++) {
+		reply = errs[i] ? errs[i] : ret;
+		ibapi_reply_message(&reply, sizeof(reply), descs[i]);
+	}
+	kfree(errs);
+
+	delta = sched_clock() - start;
+	replica_commit_stats.nr_batches++;
+	replica_commit_stats.nr_msgs += nr;
+	replica_commit_stats.total_ns += delta;
+	if (delta > replica_commit_stats.max_ns)
+		replica_commit_stats.max_ns = delta;
+}
+
+/*
+ * Handle memory replication flush from Secondary Memory
+ */
+void handle_replica_flush(void *_msg, u64 desc)
+{
+	uintptr_t __desc = desc;
+
+	handle_replica_batch(&_msg, &__desc, 1);
+}
+
+/*
+ * Handle VMA replication from Primary Memory
+ */
+void handle_replica_vma(void *_msg, u64 desc)
+{
+	uintptr_t __desc = desc;
+
+	handle_replica_batch(&_msg, &__desc, 1);
+}
+
+void print_replica_commit_stats(void)
+{
+	struct replica_commit_stat *s = &replica_commit_stats;
+
+	pr_crit("replica commit: batches: %lu msgs: %lu records: %lu bytes: %lu fsync: %lu\n",
+		s->nr_batches, s->nr_msgs, s->nr_records, s->nr_bytes, s->nr_fsync);
+	pr_crit("replica commit: avg_ns: %llu max_ns: %llu\n",
+		s->nr_batches ? div64_u64(s->total_ns, s->nr_batches) : 0,
+		s->max_ns);
 }
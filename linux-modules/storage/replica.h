@@ -25,6 +25,9 @@
 
 #define	REPLICA_LOG_MAX_FILENAME	128
 
+/* Max buffered runs per log file before writing them out */
+#define REPLICA_COMMIT_MAX_IOV		16
+
 struct replica_log_info {
 	unsigned int		pid;
 	unsigned int		vnode_id;
@@ -41,6 +44,18 @@ struct replica_log_info {
 	spinlock_t		lock;
 
 	struct hlist_node	hlist;
+
+	/*
+	 * Group commit state.
+	 * Only touched by the single replica worker, no lock needed.
+	 */
+	bool			in_commit;
+	int			commit_ret;
+	struct list_head	commit_list;
+	unsigned int		nr_log_iov;
+	unsigned int		nr_mmap_iov;
+	struct iovec		log_iov[REPLICA_COMMIT_MAX_IOV];
+	struct iovec		mmap_iov[REPLICA_COMMIT_MAX_IOV];
 };
 
 static inline void get_replica_log_info(struct replica_log_info *r)
@@ -61,4 +76,7 @@ static inline void put_replica_log_info(struct replica_log_info *r)
 		__put_replica_log_info(r);
 }
 
+void handle_replica_batch(void **msgs, uintptr_t *descs, int nr);
+void print_replica_commit_stats(void);
+
 #endif /* _LEGO_LINUX_STORAGE_REPLICA_H_ */
@@ -29,6 +29,9 @@ static const char *const storage_manager_stat_text[] = {
 	"handle_replica_vma",
 	"handle_replica_read",
 	"handle_replica_write",
+	"storage_fh_hit",
+	"storage_fh_miss",
+	"storage_rw_merged",
 };
 
 void print_storage_manager_stats(void)
@@ -41,4 +44,7 @@ void print_storage_manager_stats(void)
 		pr_crit("%s: %lu\n", storage_manager_stat_text[i],
 			atomic_long_read(&storage_manager_stats.stat[i]));
 	}
+
+	print_storage_worker_stats();
+	print_replica_commit_stats();
 }
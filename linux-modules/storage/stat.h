@@ -15,6 +15,9 @@ enum storage_manager_stat_item {
 	HANDLE_REPLICA_VMA,
 	HANDLE_REPLICA_READ,
 	HANDLE_REPLICA_WRITE,
+	STORAGE_FH_HIT,
+	STORAGE_FH_MISS,
+	STORAGE_RW_MERGED,
 
 	NR_STORAGE_MANAGER_STAT_ITEMS,
 };
@@ -32,4 +35,7 @@ static inline void inc_storage_stat(enum storage_manager_stat_item i)
 
 void print_storage_manager_stats(void);
 
+/* core.c */
+void print_storage_worker_stats(void);
+
 #endif /* _LEGO_STORAGE_STAT_H_ */
@@ -13,6 +13,7 @@
 #include <linux/fs.h>
 #include <linux/mutex.h>
 #include <linux/stat.h>
+#include <linux/uio.h>
 
 #include <asm/uaccess.h>
 #include <asm/mman.h>
@@ -29,6 +30,9 @@
 
 #define MAX_SIZE		2 
 
+/* Max adjacent M2S reads or writes served by one vectored I/O */
+#define STORAGE_RW_BATCH_MAX	8
+
 
 struct linux_dirent;
 
@@ -51,6 +55,56 @@ typedef struct {
 	int 		flags;
 } request;
 
+/* Cached open file handle, see fhcache.c */
+struct storage_fh {
+	char			name[MAX_FILE_NAME];
+	int			flags;
+	struct file		*filp;
+	atomic_t		refcount;
+	struct hlist_node	hlist;
+	struct list_head	lru;
+};
+
+/*
+ * M2S reads and writes come by name (M2S_READ, M2S_WRITE)
+ * or by handle (M2S_READ_FH, M2S_WRITE_FH). @msg starts with opcode.
+ */
+static inline bool m2s_rw_by_handle(void *msg)
+{
+	u32 opcode = *(u32 *)msg;
+
+	return opcode == M2S_READ_FH || opcode == M2S_WRITE_FH;
+}
+
+static inline bool m2s_rw_is_write(void *msg)
+{
+	u32 opcode = *(u32 *)msg;
+
+	return opcode == M2S_WRITE || opcode == M2S_WRITE_FH;
+}
+
+static inline size_t m2s_rw_len(void *msg)
+{
+	if (m2s_rw_by_handle(msg))
+		return ((struct m2s_fh_read_write_payload *)(msg + sizeof(u32)))->len;
+	return ((struct m2s_read_write_payload *)(msg + sizeof(u32)))->len;
+}
+
+static inline loff_t m2s_rw_offset(void *msg)
+{
+	if (m2s_rw_by_handle(msg))
+		return ((struct m2s_fh_read_write_payload *)(msg + sizeof(u32)))->offset;
+	return ((struct m2s_read_write_payload *)(msg + sizeof(u32)))->offset;
+}
+
+/* Content of a write follows the payload */
+static inline void *m2s_rw_content(void *msg)
+{
+	if (m2s_rw_by_handle(msg))
+		return msg + sizeof(u32) + sizeof(struct m2s_fh_read_write_payload);
+	return msg + sizeof(u32) + sizeof(struct m2s_read_write_payload);
+}
+
 /* init.c */
 extern struct metadata global_metadata[MAX_SIZE];
 extern struct mutex metadata_lock;
@@ -71,6 +125,8 @@ struct file *local_file_open (request *);
 int local_file_close(struct file *);
 ssize_t local_file_write(struct file *, const char __user *, ssize_t, loff_t *);
 ssize_t local_file_read(struct file *, char __user *, ssize_t, loff_t *);
+ssize_t local_file_writev(struct file *, const struct iovec *, unsigned long, loff_t *);
+ssize_t local_file_readv(struct file *, const struct iovec *, unsigned long, loff_t *);
 int local_fsync(struct file *);
 int kernel_fs_stat(const char *, struct kstat *, int);
 int faccessat_root(const char __user *, int);
@@ -83,10 +139,25 @@ long do_getdents(const char *pathname, struct linux_dirent *dirent,
 long do_readlink(const char *pathname, char *buf, int bufsiz);
 long do_rename(char *oldname, char *newname);
 
+/* fhcache.c */
+struct storage_fh *storage_fh_get(request *);
+void storage_fh_put(struct storage_fh *);
+void storage_fh_invalidate(const char *name);
+int storage_fh_open_token(request *rq, struct lego_file_token *token);
+int storage_fh_close_token(struct lego_file_token *token);
+struct storage_fh *storage_fh_lookup_token(struct lego_file_token *token);
+u32 storage_fh_name_key(const char *name);
+u32 storage_fh_token_key(struct lego_file_token *token);
+
 /* handler.c */
+int init_storage_reply_bufs(int nr);
+void free_storage_reply_bufs(void);
 int handle_open_request(void *, uintptr_t);
-ssize_t handle_write_request(void *, uintptr_t);
-ssize_t handle_read_request(void *, uintptr_t);
+int handle_m2s_open(void *, uintptr_t);
+int handle_m2s_close(void *, uintptr_t);
+ssize_t handle_write_request(void *msg, uintptr_t);
+ssize_t handle_read_request(void *msg, uintptr_t);
+void handle_read_write_batch(void **msgs, uintptr_t *descs, int nr);
 int handle_stat_request(void *, uintptr_t);
 int handle_access_request(void *, uintptr_t);
 long handle_truncate_request(void *, uintptr_t);
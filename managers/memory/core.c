@@ -45,9 +45,25 @@ void handle_bad_request(struct common_header *hdr, u64 desc)
 }
 
 struct thpool_worker thpool_worker_map[NR_THPOOL_WORKERS];
-static int TW_HEAD __cacheline_aligned;
 static DEFINE_COMPLETION(thpool_init_completion);
 
+/*
+ * Workers serving a request class are [start, start + nr).
+ * TW_HEAD is the per-class round-robin cursor.
+ */
+struct thpool_class_desc {
+	int			start;
+	int			nr;
+	int			TW_HEAD;
+	const char		*name;
+} ____cacheline_aligned;
+
+static struct thpool_class_desc thpool_class_map[NR_THPOOL_CLASSES] = {
+	[THPOOL_CLASS_LATENCY]	= { .name = "latency",	},
+	[THPOOL_CLASS_VM]	= { .name = "vm",	},
+	[THPOOL_CLASS_SLOW]	= { .name = "slow",	},
+};
+
 /*
  * Pre-allocated thpool buffer
  * TB_HEAD points the current available buffer
@@ -65,56 +81,40 @@ static inline int thpool_buffer_ix(struct thpool_buffer *buffer)
 	return buffer - thpool_buffer_map;
 }
 
-static inline void
-enqueue_tail_thpool_worker(struct thpool_worker *worker, struct thpool_buffer *buffer)
-{
-	spin_lock(&worker->lock);
-	list_add_tail(&buffer->next, &worker->work_head);
-	/*
-	 * This is not necessary but will do no harm.
-	 * Since we are running on x86 TSO.
-	 *
-	 * We want to make sure the update of above list
-	 * fields can be _seen_ by others before the counter
-	 * is seen by others. Because the worker thread check
-	 * the counter first, then check/dequeue list.
-	 */
-	smp_wmb();
-	inc_queued_thpool_worker(worker);
-	update_max_queued_thpool_worker(worker);
-	spin_unlock(&worker->lock);
-}
-
-static inline struct thpool_buffer *
-__dequeue_head_thpool_worker(struct thpool_worker *worker)
-{
-	struct thpool_buffer *buffer;
-
-	buffer = list_entry(worker->work_head.next, struct thpool_buffer, next);
-	list_del(&buffer->next);
-	dec_queued_thpool_worker(worker);
-
-	return buffer;
-}
-
+/*
+ * Buffer allocation is a ring with a cursor.
+ * Buffers are returned out of order, so do not wait on the next
+ * slot if it is still in use by a slow handler: skip to the next
+ * free one. If all buffers are in use, keep scanning the ring and
+ * take whichever one is returned first.
+ */
 static inline struct thpool_buffer *
 alloc_thpool_buffer(void)
 {
 	struct thpool_buffer *tb;
-	int idx;
-
-	idx = TB_HEAD % NR_THPOOL_BUFFER;
-	tb = thpool_buffer_map + idx;
-	TB_HEAD++;
-
-	/*
-	 * Buffer allocation is a simple ring.
-	 * If the warning is triggered, it basically means:
-	 * - buffer is not big enough
-	 * - handler are too slow
-	 */
-	while (ThpoolBufferUsed(tb)) {
-		WARN_ON_ONCE(1);
+	bool full = false;
+	int scanned = 0;
+
+	for (;;) {
+		tb = thpool_buffer_map + (TB_HEAD % NR_THPOOL_BUFFER);
+		TB_HEAD++;
+
+		if (likely(!ThpoolBufferUsed(tb)))
+			break;
+
+		if (++scanned < NR_THPOOL_BUFFER)
+			continue;
+
+		/*
+		 * All buffers are in use, which basically means
+		 * handlers are too slow. We stop polling until
+		 * someone finishes, remote will be throttled.
+		 */
+		if (!full) {
+			inc_mm_stat(NR_THPOOL_BUFFER_FULL);
+			full = true;
+		}
+		scanned = 0;
 		cpu_relax();
 	}
 
@@ -122,19 +122,79 @@ alloc_thpool_buffer(void)
 	return tb;
 }
 
+static inline enum thpool_class thpool_opcode_class(u32 opcode)
+{
+	switch (opcode) {
+	case P2M_TEST:
+	case P2M_TEST_NOREPLY:
+	case P2M_PCACHE_MISS:
+	case P2M_PCACHE_MISS_BATCH:
+	case P2M_PCACHE_PREFETCH:
+	case P2M_PCACHE_FLUSH:
+	case P2M_PCACHE_FLUSH_BATCH:
+	case P2M_PCACHE_ZEROFILL:
+	case P2M_PCACHE_REPLICA:
+	case P2M_PCACHE_REPLICA_BATCH:
+		return THPOOL_CLASS_LATENCY;
+
+	case P2M_MMAP:
+	case P2M_MPROTECT:
+	case P2M_MUNMAP:
+	case P2M_MREMAP:
+	case P2M_BRK:
+	case P2M_MSYNC:
+	case M2M_MMAP:
+	case M2M_MUNMAP:
+	case M2M_FINDVMA:
+	case M2M_MREMAP_GROW:
+	case M2M_MREMAP_MOVE:
+	case M2M_MREMAP_MOVE_SPLIT:
+	case M2M_MSYNC:
+		return THPOOL_CLASS_VM;
+
+	/* File I/O, fork, execve, checkpoint, and unknown ones */
+	default:
+		return THPOOL_CLASS_SLOW;
+	}
+}
+
 /*
- * Choose a worker based on request types
+ * Choose a worker for a new request.
+ * Round-robin among the workers of its class. If the chosen one is full,
+ * fall back to the least loaded worker of the same class. If all of them
+ * are full, wait until there is a free slot.
+ * Only the polling thread calls this, so TW_HEAD is safe.
  */
 static inline struct thpool_worker *
 select_thpool_worker(struct thpool_buffer *r)
 {
-	struct thpool_worker *tw;
-	int idx;
+	struct thpool_class_desc *desc = &thpool_class_map[r->class];
+	struct thpool_worker *tw, *min_tw;
+	int i, idx, nr, min_nr;
 
-	idx = TW_HEAD % NR_THPOOL_WORKERS;
+	idx = desc->start + desc->TW_HEAD % desc->nr;
 	tw = thpool_worker_map + idx;
-	TW_HEAD++;
-	return tw;
+	desc->TW_HEAD++;
+
+	if (likely(!thpool_worker_ring_full(tw)))
+		return tw;
+
+	inc_mm_stat(NR_THPOOL_RING_FULL);
+	for (;;) {
+		min_tw = NULL;
+		min_nr = THPOOL_RING_SIZE;
+		for (i = desc->start; i < desc->start + desc->nr; i++) {
+			tw = thpool_worker_map + i;
+			nr = nr_queued_thpool_worker(tw);
+			if (nr < min_nr) {
+				min_nr = nr;
+				min_tw = tw;
+			}
+		}
+		if (min_tw)
+			return min_tw;
+		cpu_relax();
+	}
 }
 
 static void thpool_worker_handler(struct thpool_worker *worker,
@@ -177,13 +237,29 @@ static void thpool_worker_handler(struct thpool_worker *worker,
 		inc_mm_stat(HANDLE_PCACHE_MISS);
 		handle_p2m_pcache_miss(msg, buffer);
 		break;
+	case P2M_PCACHE_MISS_BATCH:
+		inc_mm_stat(HANDLE_PCACHE_MISS_BATCH);
+		handle_p2m_pcache_miss_batch(msg, buffer);
+		break;
+	case P2M_PCACHE_PREFETCH:
+		inc_mm_stat(HANDLE_PCACHE_PREFETCH);
+		handle_p2m_pcache_prefetch(msg, buffer);
+		break;
 	case P2M_PCACHE_FLUSH:
 		inc_mm_stat(HANDLE_PCACHE_FLUSH);
 		handle_p2m_flush_one(msg, buffer);
 		break;
+	case P2M_PCACHE_FLUSH_BATCH:
+		inc_mm_stat(HANDLE_PCACHE_FLUSH_BATCH);
+		handle_p2m_flush_batch(msg, buffer);
+		break;
 	case P2M_PCACHE_ZEROFILL:
 		handle_p2m_zerofill(msg, buffer);
 		break;
+	case P2M_PCACHE_REPLICA_BATCH:
+		inc_mm_stat(HANDLE_PCACHE_REPLICA_BATCH);
+		handle_p2m_replica_batch(msg, buffer);
+		break;
 
 /* SYSCALL */
 	case P2M_READ:
@@ -196,6 +272,21 @@ static void thpool_worker_handler(struct thpool_worker *worker,
 		handle_p2m_write(payload, hdr, buffer);
 		break;
 
+	case P2M_OPEN:
+		handle_p2m_open(payload, hdr, buffer);
+		break;
+
+	case P2M_CLOSE:
+		handle_p2m_close(msg, buffer);
+		break;
+
+	case P2M_FILE_LEASE:
+		handle_p2m_file_lease(payload, hdr, buffer);
+		break;
+	case P2M_FILE_LEASE_BREAK:
+		handle_p2m_file_lease_break(payload, hdr, buffer);
+		break;
+
 	case P2M_DROP_CACHE:
 		handle_p2m_drop_page_cache(hdr, buffer);
 		break;
@@ -212,15 +303,14 @@ static void thpool_worker_handler(struct thpool_worker *worker,
 	case P2M_STAT:
 		handle_p2m_stat(payload, hdr, buffer);
 		break;
+	case P2M_FSTAT:
+		handle_p2m_fstat(payload, hdr, buffer);
+		break;
 	case P2M_FSYNC:
 		handle_p2m_fsync(payload, hdr, buffer);
 		break;
 #endif
 
-	case P2M_CLOSE:
-		handle_p2m_close(payload, desc, hdr);
-		break;
-
 	case P2M_MMAP:
 		inc_mm_stat(HANDLE_P2M_MMAP);
 		handle_p2m_mmap(payload, hdr, buffer);
@@ -323,6 +413,53 @@ static void thpool_worker_handler(struct thpool_worker *worker,
 	}
 }
 
+#ifdef CONFIG_THPOOL_WORK_STEALING
+/*
+ * Our own ring is empty, help the most loaded worker. Requests queued
+ * behind a slow handler (e.g. fork, execve) would otherwise wait until
+ * that handler returns.
+ *
+ * With request classes, a worker only steals from its own class or more
+ * latency-critical ones. A latency worker must never pick up a slow one.
+ */
+static struct thpool_buffer *thpool_worker_steal(struct thpool_worker *self)
+{
+	struct thpool_worker *tw, *victim = NULL;
+	struct thpool_buffer *b;
+	int i, nr, max_nr = 0;
+
+	for (i = 0; i < NR_THPOOL_WORKERS; i++) {
+		tw = thpool_worker_map + i;
+		if (tw == self)
+			continue;
+#ifdef CONFIG_THPOOL_CLASSES
+		if (tw->class > self->class)
+			continue;
+#endif
+
+		nr = nr_queued_thpool_worker(tw);
+		if (nr > max_nr) {
+			max_nr = nr;
+			victim = tw;
+		}
+	}
+
+	if (!victim)
+		return NULL;
+
+	b = thpool_worker_ring_pop(victim);
+	if (b)
+		inc_thpool_worker_nr_stolen(self);
+	return b;
+}
+#else
+static inline struct thpool_buffer *
+thpool_worker_steal(struct thpool_worker *self)
+{
+	return NULL;
+}
+#endif
+
 DEFINE_PROFILE_POINT(thpool_worker_handler)
 DEFINE_PROFILE_POINT(thpool_worker_fit_ack_reply)
 
@@ -357,62 +494,61 @@ static int thpool_worker_func(void *_worker)
 
 	preempt_disable();
 	while (1) {
-		/* Check comments on enqueue */
-		while (!nr_queued_thpool_worker(w))
-			cpu_relax();
-
-		spin_lock(&w->lock);
-		while (!list_empty(&w->work_head)) {
-			b = __dequeue_head_thpool_worker(w);
-			spin_unlock(&w->lock);
-
-			/*
-			 * Update queuing stats
-			 *
-			 * HACK!!! The operations below except thpool_worker_handler()
-			 * are for debugging/tracing purpose. The will be compiled
-			 * away if disable CONFIG_COUNTER_THPOOL.
-			 */
-			thpool_buffer_dequeue_time(b);
-			queuing_delay = thpool_buffer_queuing_delay(b);
-			add_thpool_worker_total_queuing(w, queuing_delay);
-
-			set_in_handler_thpool_worker(w);
-			set_wip_buffer_thpool_worker(w, b);
-
-			PROFILE_START(thpool_worker_handler);
-
-			/* Invoke the real handler */
-			tb_reset_tx_size(b);
-			tb_reset_private_tx(b);
-			thpool_worker_handler(w, b);
-
-			/*
-			 * Leave this BUG_ON checking to catch
-			 * buggy handlers.
-			 */
-			BUG_ON(!b->tx_size);
-			PROFILE_LEAVE(thpool_worker_handler);
-
-			/*
-			 * Callback to FIT layer to perform the
-			 * last two steps: ACK, and REPLY.
-			 */
-			PROFILE_START(thpool_worker_fit_ack_reply);
-			fit_ack_reply_callback(b);
-			PROFILE_LEAVE(thpool_worker_fit_ack_reply);
-
-			clear_wip_buffer_thpool_worker(w);
-			clear_in_handler_thpool_worker(w);
-
-			/* Return buffer to free pool */
-			__ClearThpoolBufferNoreply(b);
-			__ClearThpoolBufferUsed(b);
-
-			inc_thpool_worker_nr_handled(w);
-			spin_lock(&w->lock);
+		b = thpool_worker_ring_pop(w);
+		if (!b) {
+			b = thpool_worker_steal(w);
+			if (!b) {
+				cpu_relax();
+				continue;
+			}
 		}
-		spin_unlock(&w->lock);
+
+		/*
+		 * Update queuing stats
+		 *
+		 * HACK!!! The operations below except thpool_worker_handler()
+		 * are for debugging/tracing purpose. The will be compiled
+		 * away if disable CONFIG_COUNTER_THPOOL.
+		 */
+		thpool_buffer_dequeue_time(b);
+		queuing_delay = thpool_buffer_queuing_delay(b);
+		add_thpool_worker_total_queuing(w, b, queuing_delay);
+
+		set_in_handler_thpool_worker(w);
+		set_wip_buffer_thpool_worker(w, b);
+
+		PROFILE_START(thpool_worker_handler);
+
+		/* Invoke the real handler */
+		tb_reset_tx_size(b);
+		tb_reset_private_tx(b);
+		tb_reset_rdma_writes(b);
+		thpool_worker_handler(w, b);
+
+		/*
+		 * Leave this BUG_ON checking to catch
+		 * buggy handlers.
+		 */
+		BUG_ON(!b->tx_size);
+		PROFILE_LEAVE(thpool_worker_handler);
+
+		/*
+		 * Callback to FIT layer to perform the
+		 * last two steps: ACK, and REPLY.
+		 */
+		PROFILE_START(thpool_worker_fit_ack_reply);
+		fit_ack_reply_callback(b);
+		PROFILE_LEAVE(thpool_worker_fit_ack_reply);
+
+		clear_wip_buffer_thpool_worker(w);
+		clear_in_handler_thpool_worker(w);
+
+		/* Return buffer to free pool */
+		__ClearThpoolBufferNoreply(b);
+		smp_wmb();
+		__ClearThpoolBufferUsed(b);
+
+		inc_thpool_worker_nr_handled(w, b);
 	}
 	preempt_enable();
 
@@ -438,6 +574,7 @@ void thpool_callback(void *fit_ctx, void *fit_imm,
 	b->fit_imm = fit_imm;
 	b->fit_offset = fit_offset;
 	b->fit_node_id = node_id;
+	b->class = thpool_opcode_class(to_common_header(rx)->opcode);
 
 	/*
 	 * Select a worker thread and pass the buffer
@@ -445,10 +582,63 @@ void thpool_callback(void *fit_ctx, void *fit_imm,
 	 */
 	thpool_buffer_enqueue_time(b);
 	w = select_thpool_worker(b);
-	enqueue_tail_thpool_worker(w, b);
+	thpool_worker_ring_push(w, b);
+	update_max_queued_thpool_worker(w);
 	nr_thpool_reqs++;
 }
 
+#ifdef CONFIG_THPOOL_CLASSES
+static void __init thpool_init_classes(void)
+{
+	struct thpool_class_desc *desc;
+
+	BUILD_BUG_ON(NR_THPOOL_SLOW_WORKERS < 1);
+
+	thpool_class_map[THPOOL_CLASS_LATENCY].start = 0;
+	thpool_class_map[THPOOL_CLASS_LATENCY].nr = NR_THPOOL_LATENCY_WORKERS;
+	thpool_class_map[THPOOL_CLASS_VM].start = NR_THPOOL_LATENCY_WORKERS;
+	thpool_class_map[THPOOL_CLASS_VM].nr = NR_THPOOL_VM_WORKERS;
+	thpool_class_map[THPOOL_CLASS_SLOW].start =
+		NR_THPOOL_LATENCY_WORKERS + NR_THPOOL_VM_WORKERS;
+	thpool_class_map[THPOOL_CLASS_SLOW].nr = NR_THPOOL_SLOW_WORKERS;
+
+	for (desc = thpool_class_map;
+	     desc < thpool_class_map + NR_THPOOL_CLASSES; desc++) {
+		desc->TW_HEAD = 0;
+		pr_info("thpool: class %-8s workers [%d - %d]\n",
+			desc->name, desc->start, desc->start + desc->nr - 1);
+	}
+}
+
+static int __init thpool_worker_class(int id)
+{
+	int i;
+
+	for (i = 0; i < NR_THPOOL_CLASSES; i++) {
+		if (id < thpool_class_map[i].start + thpool_class_map[i].nr)
+			return i;
+	}
+	BUG();
+}
+#else
+/* All workers serve all classes */
+static void __init thpool_init_classes(void)
+{
+	int i;
+
+	for (i = 0; i < NR_THPOOL_CLASSES; i++) {
+		thpool_class_map[i].start = 0;
+		thpool_class_map[i].nr = NR_THPOOL_WORKERS;
+		thpool_class_map[i].TW_HEAD = 0;
+	}
+}
+
+static inline int thpool_worker_class(int id)
+{
+	return THPOOL_CLASS_SLOW;
+}
+#endif /* CONFIG_THPOOL_CLASSES */
+
 /* Create worker and polling threads */
 void __init thpool_init(void)
 {
@@ -456,20 +646,22 @@ void __init thpool_init(void)
 	struct task_struct *p;
 	struct thpool_worker *worker;
 
-	TW_HEAD = 0;
+	thpool_init_classes();
 	for (i = 0; i < NR_THPOOL_WORKERS; i++) {
 		worker = &thpool_worker_map[i];
 
-		worker->nr_queued = 0;
+		worker->head = 0;
+		worker->tail = 0;
 		worker->max_nr_queued = 0;
 		worker->flags = 0;
 		worker->nr_handled = 0;
+		worker->nr_stolen = 0;
 		worker->total_queuing_delay_ns = 0;
 		worker->max_queuing_delay_ns = 0;
 		worker->min_queuing_delay_ns = ULONG_MAX;
-		INIT_LIST_HEAD(&worker->work_head);
-		spin_lock_init(&worker->lock);
-		memset(worker->queuing_stats, 0, sizeof(worker->queuing_stats));
+		memset(worker->ring, 0, sizeof(worker->ring));
+		memset(worker->class_stats, 0, sizeof(worker->class_stats));
+		worker->class = thpool_worker_class(i);
 
 		init_completion(&thpool_init_completion);
 
@@ -490,10 +682,12 @@ void __init memory_component_init(void)
 		hlt();
 #endif
 
+	lego_task_hash_init();
 	gmm_init();
 
 	/* Register exec binary handlers */
 	exec_init();
+	pgcache_init();
 	thpool_init();
 
 	init_memory_flush_thread();
@@ -595,7 +789,7 @@ void print_thpool_stats(void)
 	struct thpool_worker *tw;
 
 	for (i = 0; i < NR_THPOOL_WORKERS; i++) {
-		int j;
+		int j, k;
 		u64 p_i, p_re;
 		char p_re_buf[32];
 
@@ -604,22 +798,37 @@ void print_thpool_stats(void)
 		pr_info("Watchdog:\n"
 			"    worker[%d]\n"
 			"        max_nr_queued=%d current_nr_queued=%d in_handler=%s\n"
-			"        nr_handled=%lu nr_thpool_reqs=%lu\n"
+			"        nr_handled=%lu nr_stolen=%lu nr_thpool_reqs=%lu\n"
 			"        total_queuing_ns: %lu avg_queuing_ns:%lu max_queuing_ns: %lu min_queuing_ns: %lu\n",
-			i, max_queued_thpool_worker(tw), tw->nr_queued, thpool_worker_in_handler(tw) ? "YES" : "NO",
-			tw->nr_handled, nr_thpool_reqs,
+			i, max_queued_thpool_worker(tw), nr_queued_thpool_worker(tw),
+			thpool_worker_in_handler(tw) ? "YES" : "NO",
+			tw->nr_handled, tw->nr_stolen, nr_thpool_reqs,
 			tw->total_queuing_delay_ns, tw->nr_handled ? (tw->total_queuing_delay_ns / tw->nr_handled) : 0,
 			tw->max_queuing_delay_ns, tw->min_queuing_delay_ns);
 
-		for (j = 0; j < QUEUING_STAT_ENTRIES; j++) {
-			if (!tw->queuing_stats[i])
+		for (k = 0; k < NR_THPOOL_CLASSES; k++) {
+			struct thpool_class_stat *cs = &tw->class_stats[k];
+
+			if (!cs->nr_handled)
 				continue;
-			p_i = div64_u64_rem(tw->queuing_stats[j] * 100UL, tw->nr_handled, &p_re);
-			scnprintf(p_re_buf, 8, "%0Lu", p_re);
 
-			pr_info("        [%3d, %3d)    %Lu.%s%%\n",
-				j * QUEUING_STAT_STRIDE_US, (j + 1) * QUEUING_STAT_STRIDE_US,
-				p_i, p_re_buf);
+			pr_info("        class %s: nr_handled=%lu avg_queuing_ns:%lu max_queuing_ns: %lu\n",
+				thpool_class_map[k].name, cs->nr_handled,
+				cs->total_queuing_delay_ns / cs->nr_handled,
+				cs->max_queuing_delay_ns);
+
+			for (j = 0; j < QUEUING_STAT_ENTRIES; j++) {
+				if (!cs->queuing_stats[j])
+					continue;
+				p_i = div64_u64_rem(cs->queuing_stats[j] * 100UL,
+						    cs->nr_handled, &p_re);
+				scnprintf(p_re_buf, 8, "%0Lu", p_re);
+
+				pr_info("          [%3d, %3d)    %Lu.%s%%\n",
+					j * QUEUING_STAT_STRIDE_US,
+					(j + 1) * QUEUING_STAT_STRIDE_US,
+					p_i, p_re_buf);
+			}
 		}
 
 		ht_check_worker(i, tw, &hb_cached_data[i]);
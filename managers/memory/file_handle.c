@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2016-2018 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Handle table of files opened by processors
+ *
+ * P2M_OPEN installs the file into a free slot, and returns the slot
+ * index plus its generation as token. P2M_READ, P2M_WRITE and friends
+ * find the file by indexing the table, rather than hashing the name.
+ * Each slot has its own lock, lookups of different files never contend.
+ */
+
+#include <lego/slab.h>
+#include <lego/kernel.h>
+#include <lego/spinlock.h>
+#include <lego/comp_memory.h>
+
+#include <memory/file_ops.h>
+#include <memory/file_handle.h>
+#include <memory/pgcache.h>
+#include <memory/thread_pool.h>
+
+#define NR_MEMORY_FH		(1 << 14)
+
+struct memory_fh_slot {
+	spinlock_t		lock;
+	u32			gen;
+	struct memory_fh	*fh;
+};
+
+static struct memory_fh_slot fh_table[NR_MEMORY_FH] = {
+	[0 ... NR_MEMORY_FH - 1] = {
+		.lock	= __SPIN_LOCK_UNLOCKED(fh_table.lock),
+	}
+};
+
+/* Serialize slot allocation, and where to look for a free one next */
+static DEFINE_SPINLOCK(fh_alloc_lock);
+static unsigned int fh_next_fid;
+
+static void __memory_fh_free(struct memory_fh *fh)
+{
+#ifndef CONFIG_MEM_PAGE_CACHE
+	m2s_close(fh->storage_node, &fh->storage_token);
+#endif
+	kfree(fh);
+}
+
+void memory_fh_put(struct memory_fh *fh)
+{
+	if (atomic_dec_and_test(&fh->refcount))
+		__memory_fh_free(fh);
+}
+
+/**
+ * memory_fh_get
+ * @token: token returned by P2M_OPEN
+ *
+ * Return a referenced file, or NULL if @token is stale.
+ * Release it by memory_fh_put().
+ */
+struct memory_fh *memory_fh_get(struct lego_file_token *token)
+{
+	struct memory_fh_slot *slot;
+	struct memory_fh *fh = NULL;
+
+	if (unlikely(token->nid != LEGO_LOCAL_NID || token->fid >= NR_MEMORY_FH))
+		return NULL;
+
+	slot = &fh_table[token->fid];
+	spin_lock(&slot->lock);
+	if (likely(slot->fh && slot->gen == token->gen)) {
+		fh = slot->fh;
+		atomic_inc(&fh->refcount);
+	}
+	spin_unlock(&slot->lock);
+	return fh;
+}
+
+/* The table takes over the reference of @fh */
+static int memory_fh_install(struct memory_fh *fh, struct lego_file_token *token)
+{
+	struct memory_fh_slot *slot;
+	unsigned int i, fid;
+
+	spin_lock(&fh_alloc_lock);
+	for (i = 0; i < NR_MEMORY_FH; i++) {
+		fid = (fh_next_fid + i) % NR_MEMORY_FH;
+		slot = &fh_table[fid];
+
+		spin_lock(&slot->lock);
+		if (!slot->fh)
+			goto found;
+		spin_unlock(&slot->lock);
+	}
+	spin_unlock(&fh_alloc_lock);
+	return -ENFILE;
+
+found:
+	/* gen 0 is never valid */
+	if (unlikely(++slot->gen == 0))
+		slot->gen = 1;
+	slot->fh = fh;
+
+	token->nid = LEGO_LOCAL_NID;
+	token->fid = fid;
+	token->gen = slot->gen;
+	spin_unlock(&slot->lock);
+
+	fh_next_fid = fid + 1;
+	spin_unlock(&fh_alloc_lock);
+	return 0;
+}
+
+static struct memory_fh *memory_fh_remove(struct lego_file_token *token)
+{
+	struct memory_fh_slot *slot;
+	struct memory_fh *fh = NULL;
+
+	if (unlikely(token->nid != LEGO_LOCAL_NID || token->fid >= NR_MEMORY_FH))
+		return NULL;
+
+	slot = &fh_table[token->fid];
+	spin_lock(&slot->lock);
+	if (likely(slot->fh && slot->gen == token->gen)) {
+		fh = slot->fh;
+		slot->fh = NULL;
+	}
+	spin_unlock(&slot->lock);
+	return fh;
+}
+
+/*
+ * Leases only exist on pgcache files. Without pgcache, reads go to
+ * storage, which has no idea of processor caches: grant none.
+ */
+static void memory_fh_lease(struct memory_fh *fh, unsigned int nid,
+			    struct p2m_file_lease *lease)
+{
+#ifdef CONFIG_MEM_PAGE_CACHE
+	lease->file_id = fh->pgfile->file_id;
+	lease->lease_msec = pgcache_lease_grant(fh->pgfile, nid, &lease->version);
+#endif
+}
+
+/*
+ * OPCODE: P2M_OPEN
+ * Storage has opened the file already, we only remember it.
+ */
+void handle_p2m_open(struct p2m_open_struct *payload,
+		     struct common_header *hdr, struct thpool_buffer *tb)
+{
+	struct p2m_open_reply *reply;
+	struct memory_fh *fh;
+	int ret;
+
+	reply = thpool_buffer_tx(tb);
+	tb_set_tx_size(tb, sizeof(*reply));
+
+	fh = kmalloc(sizeof(*fh), GFP_KERNEL);
+	if (unlikely(!fh)) {
+		reply->retval = -ENOMEM;
+		return;
+	}
+
+	strlcpy(fh->filename, payload->filename, MAX_FILENAME_LENGTH);
+	fh->storage_node = payload->storage_node;
+	atomic_set(&fh->refcount, 1);
+
+#ifdef CONFIG_MEM_PAGE_CACHE
+	fh->pgfile = find_or_open_lego_pgcache_file(fh->filename, fh->storage_node);
+	if (unlikely(IS_ERR(fh->pgfile))) {
+		reply->retval = PTR_ERR(fh->pgfile);
+		kfree(fh);
+		return;
+	}
+#else
+	/* Go on with the name if storage can not give us a handle */
+	m2s_open(fh->filename, fh->storage_node, &fh->storage_token);
+#endif
+
+	ret = memory_fh_install(fh, &reply->token);
+	if (unlikely(ret)) {
+		memory_fh_put(fh);
+		reply->retval = ret;
+		return;
+	}
+
+	memset(&reply->lease, 0, sizeof(reply->lease));
+	if (payload->want_lease)
+		memory_fh_lease(fh, hdr->src_nid, &reply->lease);
+	reply->retval = 0;
+}
+
+/*
+ * OPCODE: P2M_FILE_LEASE
+ * Processor's file cache lease has expired, grant a new one.
+ */
+void handle_p2m_file_lease(struct p2m_file_lease_struct *payload,
+			   struct common_header *hdr, struct thpool_buffer *tb)
+{
+	struct p2m_file_lease_reply *reply;
+	struct memory_fh *fh;
+
+	reply = thpool_buffer_tx(tb);
+	tb_set_tx_size(tb, sizeof(*reply));
+	memset(&reply->lease, 0, sizeof(reply->lease));
+
+	fh = memory_fh_get(&payload->token);
+	if (unlikely(!fh)) {
+		reply->retval = -EBADF;
+		return;
+	}
+
+	memory_fh_lease(fh, hdr->src_nid, &reply->lease);
+	memory_fh_put(fh);
+	reply->retval = 0;
+}
+
+/*
+ * OPCODE: P2M_FILE_LEASE_BREAK
+ * Processor truncated or unlinked the file at storage.
+ */
+void handle_p2m_file_lease_break(struct p2m_file_lease_break_struct *payload,
+				 struct common_header *hdr, struct thpool_buffer *tb)
+{
+#ifdef CONFIG_MEM_PAGE_CACHE
+	struct lego_pgcache_file *file;
+#endif
+	int *retval;
+
+	retval = thpool_buffer_tx(tb);
+	tb_set_tx_size(tb, sizeof(*retval));
+	*retval = 0;
+
+#ifdef CONFIG_MEM_PAGE_CACHE
+	/* Never opened through us, nobody holds a lease */
+	file = find_lego_pgcache_file(payload->filename);
+	if (file)
+		*retval = pgcache_lease_break(file);
+#endif
+}
+
+/*
+ * OPCODE: P2M_CLOSE
+ * Requests that still hold a file finish with it.
+ */
+void handle_p2m_close(struct p2m_close_msg *msg, struct thpool_buffer *tb)
+{
+	struct memory_fh *fh;
+	int *reply, i, nr = 0;
+
+	reply = thpool_buffer_tx(tb);
+	tb_set_tx_size(tb, sizeof(*reply));
+
+	if (unlikely(msg->nr_tokens > P2M_CLOSE_BATCH_MAX)) {
+		*reply = -EINVAL;
+		return;
+	}
+
+	for (i = 0; i < msg->nr_tokens; i++) {
+		fh = memory_fh_remove(&msg->tokens[i]);
+		if (unlikely(!fh))
+			continue;
+		memory_fh_put(fh);
+		nr++;
+	}
+	*reply = nr;
+}
@@ -21,6 +21,7 @@
 #include <memory/vm.h>
 #include <memory/pid.h>
 #include <memory/file_ops.h>
+#include <memory/file_handle.h>
 #include <memory/pgcache.h>
 #include <memory/thread_pool.h>
 
@@ -52,19 +53,25 @@ void handle_p2m_read(struct p2m_read_write_payload *payload,
 	void *buf;
 	struct p2m_read_reply *retbuf;
 	struct lego_task_struct *tsk;
+	struct memory_fh *fh;
 
-	file_debug("pid: %u tgid: %u buf: %p len: %zu, f_name: %s count: %zu",
+	file_debug("pid: %u tgid: %u buf: %p len: %zu, fid: %u count: %zu",
 		payload->pid, payload->tgid, payload->buf, payload->len,
-		payload->filename, count);
+		payload->token.fid, count);
 
 	/*
 	 * read() is dangerous here, because it may need a
 	 * very large tx buffer. Currently, we have two insurance:
-	 * - P side will chunk the read() based on THPOOL_TX_SIZE
-	 * - tb_set_tx_size() will check against THPOOL_TX_SIZE
+	 * - P side will chunk the read() by P2M_RW_CHUNK_SIZE
+	 * - we reject anything that does not fit THPOOL_TX_SIZE
 	 */
 	retbuf = thpool_buffer_tx(tb);
 	buf = (char *)retbuf + sizeof(retval);
+	if (unlikely(count < 0 || sizeof(retval) + count >= THPOOL_TX_SIZE)) {
+		tb_set_tx_size(tb, sizeof(retval));
+		retbuf->retval = -EINVAL;
+		return;
+	}
 	tb_set_tx_size(tb, sizeof(retval) + count);
 
 	tsk = find_lego_task_by_pid(hdr->src_nid, payload->tgid);
@@ -73,11 +80,19 @@ void handle_p2m_read(struct p2m_read_write_payload *payload,
 		return;
 	}
 
+	fh = memory_fh_get(&payload->token);
+	if (unlikely(!fh)) {
+		retbuf->retval = -EBADF;
+		return;
+	}
+
 #ifndef CONFIG_MEM_PAGE_CACHE
-	retval = __storage_read(tsk, payload->filename, buf, count, &pos);
+	retval = __storage_read(tsk, fh->filename, &fh->storage_token,
+				buf, count, &pos);
 #else
-	retval = lego_pgcache_read(NULL, payload->filename, STORAGE_NODE, buf, count, &pos);
+	retval = lego_pgcache_read(NULL, fh->pgfile, buf, count, &pos);
 #endif
+	memory_fh_put(fh);
 
 	/*
 	 * retval is the number of bytes be read
@@ -98,13 +113,14 @@ void handle_p2m_write(struct p2m_read_write_payload *payload,
 		      struct common_header *hdr, struct thpool_buffer *tb)
 {
 	struct lego_task_struct *tsk;
+	struct memory_fh *fh;
 	ssize_t *retval;
 	loff_t offset = payload->offset;
 	void *content = (void *)payload + sizeof(*payload);
 
-	file_debug("pid: %u tgid: %u buf: %p len: %zu, f_name: %s",
+	file_debug("pid: %u tgid: %u buf: %p len: %zu, fid: %u",
 		payload->pid, payload->tgid, payload->buf, payload->len,
-		payload->filename);
+		payload->token.fid);
 
 	retval = thpool_buffer_tx(tb);
 	tb_set_tx_size(tb, sizeof(*retval));
@@ -115,21 +131,24 @@ void handle_p2m_write(struct p2m_read_write_payload *payload,
 		return;
 	}
 
+	fh = memory_fh_get(&payload->token);
+	if (unlikely(!fh)) {
+		*retval = -EBADF;
+		return;
+	}
+
 #ifndef CONFIG_MEM_PAGE_CACHE
-	*retval = __storage_write(tsk, payload->filename,
+	*retval = __storage_write(tsk, fh->filename, &fh->storage_token,
 				  content, payload->len, &offset);
 #else
-	*retval = lego_pgcache_write(NULL, payload->filename,
-				     STORAGE_NODE, content,
-				     payload->len, &offset);
+	*retval = pgcache_lease_write_begin(fh->pgfile, hdr->src_nid);
+	if (likely(!*retval)) {
+		*retval = lego_pgcache_write(NULL, fh->pgfile, content,
+					     payload->len, &offset);
+		pgcache_lease_write_end(fh->pgfile);
+	}
 #endif
-}
-
-int handle_p2m_close(struct p2m_close_struct *payload, u64 desc,
-		struct common_header *hdr)
-{
-	WARN_ON(1);
-	return 0;
+	memory_fh_put(fh);
 }
 
 void handle_p2m_drop_page_cache(struct common_header *hdr, struct thpool_buffer *tb)
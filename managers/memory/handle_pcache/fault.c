@@ -21,6 +21,9 @@
 #include <lego/comp_storage.h>
 #include <memory/vm.h>
 #include <memory/pid.h>
+#include <memory/stat.h>
+#include <memory/vm-pgtable.h>
+#include <memory/huge_memory.h>
 #include <memory/thread_pool.h>
 #include <processor/pcache.h>
 
@@ -78,24 +81,27 @@ static void pcache_miss_error(u32 retval, struct lego_task_struct *p,
  */
 DEFINE_PROFILE_POINT(pcache_miss_find_vma)
 
-static int common_handle_p2m_miss(struct lego_task_struct *p,
-				  u64 vaddr, u32 flags, unsigned long *new_page)
+/*
+ * Caller must hold mmap_sem.
+ * @speculative: prefetch, which may run past a vma. Do not complain,
+ * and do not grow the stack for it.
+ */
+static int __common_handle_p2m_miss(struct lego_task_struct *p,
+				    u64 vaddr, u32 flags, unsigned long *new_page,
+				    bool speculative)
 {
 	struct vm_area_struct *vma;
 	struct lego_mm_struct *mm = p->mm;
-	int ret;
 	PROFILE_POINT_TIME(pcache_miss_find_vma)
 
-	down_read(&mm->mmap_sem);
-
 	PROFILE_START(pcache_miss_find_vma);
 	vma = find_vma(mm, vaddr);
 	PROFILE_LEAVE(pcache_miss_find_vma);
 
 	if (unlikely(!vma)) {
-		pr_info("fail to find vma\n");
-		ret = VM_FAULT_SIGSEGV;
-		goto unlock;
+		if (!speculative)
+			pr_info("fail to find vma\n");
+		return VM_FAULT_SIGSEGV;
 	}
 
 	/* VMAs except stack */
@@ -104,15 +110,17 @@ static int common_handle_p2m_miss(struct lego_task_struct *p,
 
 	/* stack? */
 	if (unlikely(!(vma->vm_flags & VM_GROWSDOWN))) {
-		pr_info("not a stack\n");
-		ret = VM_FAULT_SIGSEGV;
-		goto unlock;
+		if (!speculative)
+			pr_info("not a stack\n");
+		return VM_FAULT_SIGSEGV;
 	}
 
+	if (speculative)
+		return VM_FAULT_SIGSEGV;
+
 	if (unlikely(expand_stack(vma, vaddr))) {
 		pr_info("fail to expand stack\n");
-		ret = VM_FAULT_SIGSEGV;
-		goto unlock;
+		return VM_FAULT_SIGSEGV;
 	}
 
 	/*
@@ -122,8 +130,103 @@ static int common_handle_p2m_miss(struct lego_task_struct *p,
 	 * own choice of mapping: pgtable, segment etc.
 	 */
 good_area:
-	ret = handle_lego_mm_fault(vma, vaddr, flags, new_page, NULL);
-unlock:
+	return handle_lego_mm_fault(vma, vaddr, flags, new_page, NULL);
+}
+
+#ifdef CONFIG_MEM_PCACHE_MISS_FAST_PATH
+/*
+ * Speculative miss, without mmap_sem.
+ *
+ * Most misses come back for pages that are already populated, e.g. lines
+ * evicted by processor earlier. For those, a pgtable walk is all we need.
+ * Pgtable pages are only freed, and ptes only cleared or moved, within
+ * mm->pgtable_seq write sections. Each entry is read once and validated
+ * against the sequence before the pointer in it is followed. Freed pgtable
+ * pages stay mapped in kernel, thus a racing walk reads stale data at worst,
+ * and is thrown away.
+ *
+ * Return true and set @new_page if served. Otherwise caller falls back
+ * to the slow path, which handles not-present ptes and COW.
+ */
+static bool pcache_miss_fast(struct lego_mm_struct *mm, u64 vaddr,
+			     u32 flags, unsigned long *new_page)
+{
+	pgd_t pgd;
+	pud_t pud;
+	pmd_t pmd;
+	pte_t pte;
+	unsigned int seq;
+
+	seq = raw_read_seqcount(&mm->pgtable_seq);
+	if (unlikely(seq & 1))
+		goto race;
+
+	pgd = READ_ONCE(*lego_pgd_offset(mm, vaddr));
+	if (pgd_none(pgd))
+		return false;
+	if (read_seqcount_retry(&mm->pgtable_seq, seq))
+		goto race;
+
+	pud = READ_ONCE(*((pud_t *)lego_pgd_page_vaddr(pgd) + lego_pud_index(vaddr)));
+	if (pud_none(pud))
+		return false;
+	if (read_seqcount_retry(&mm->pgtable_seq, seq))
+		goto race;
+
+	pmd = READ_ONCE(*((pmd_t *)lego_pud_page_vaddr(pud) + lego_pmd_index(vaddr)));
+	if (pmd_none(pmd))
+		return false;
+	if (lego_pmd_trans_huge(pmd)) {
+		if ((flags & FAULT_FLAG_WRITE) && !lego_pmd_write(pmd))
+			return false;
+		if (read_seqcount_retry(&mm->pgtable_seq, seq))
+			goto race;
+		*new_page = lego_pmd_huge_page(pmd, vaddr);
+		inc_mm_stat(NR_PCACHE_MISS_FAST);
+		return true;
+	}
+	if (read_seqcount_retry(&mm->pgtable_seq, seq))
+		goto race;
+
+	pte = READ_ONCE(*((pte_t *)lego_pmd_page_vaddr(pmd) + lego_pte_index(vaddr)));
+	if (!pte_present(pte))
+		return false;
+	if ((flags & FAULT_FLAG_WRITE) && !pte_write(pte))
+		return false;
+	if (read_seqcount_retry(&mm->pgtable_seq, seq))
+		goto race;
+
+	*new_page = pte_val(pte) & PTE_VFN_MASK;
+	inc_mm_stat(NR_PCACHE_MISS_FAST);
+	return true;
+
+race:
+	inc_mm_stat(NR_PCACHE_MISS_FAST_RACE);
+	return false;
+}
+#else
+static inline bool pcache_miss_fast(struct lego_mm_struct *mm, u64 vaddr,
+				    u32 flags, unsigned long *new_page)
+{
+	return false;
+}
+#endif
+
+static int common_handle_p2m_miss(struct lego_task_struct *p,
+				  u64 vaddr, u32 flags, unsigned long *new_page)
+{
+	struct lego_mm_struct *mm = p->mm;
+	unsigned long page;
+	int ret;
+
+	if (pcache_miss_fast(mm, vaddr, flags, &page)) {
+		if (new_page)
+			*new_page = page;
+		return 0;
+	}
+
+	down_read(&mm->mmap_sem);
+	ret = __common_handle_p2m_miss(p, vaddr, flags, new_page, false);
 	up_read(&mm->mmap_sem);
 	return ret;
 }
@@ -206,6 +309,50 @@ out:
 	PROFILE_LEAVE(handle_flush);
 }
 
+/*
+ * Processor counterpart: __clflush_batch().
+ * Lines are independent, a failed one does not stop others.
+ */
+void handle_p2m_flush_batch(struct p2m_flush_batch_msg *msg,
+			    struct thpool_buffer *tb)
+{
+	struct p2m_flush_batch_entry *entry;
+	struct lego_task_struct *p = NULL;
+	void *lines = msg + 1;
+	unsigned long dst_page;
+	unsigned int src_nid, nr_entries, i;
+	int ret, nr_failed = 0;
+
+	src_nid = to_common_header(msg)->src_nid;
+	nr_entries = min_t(unsigned int, msg->nr_entries, P2M_PCACHE_FLUSH_BATCH_MAX);
+
+	for (i = 0; i < nr_entries; i++) {
+		entry = &msg->entries[i];
+
+		/* Most likely all entries are from the same process */
+		if (!p || p->pid != entry->pid)
+			p = find_lego_task_by_pid(src_nid, entry->pid);
+		if (unlikely(!p)) {
+			nr_failed++;
+			continue;
+		}
+
+		down_read(&p->mm->mmap_sem);
+		ret = get_user_pages(p, entry->user_va, 1, 0, &dst_page, NULL);
+		up_read(&p->mm->mmap_sem);
+		if (unlikely(ret != 1)) {
+			nr_failed++;
+			continue;
+		}
+
+		memcpy((void *)dst_page, lines + i * PCACHE_LINE_SIZE,
+		       PCACHE_LINE_SIZE);
+	}
+
+	*(int *)thpool_buffer_tx(tb) = nr_failed;
+	tb_set_tx_size(tb, sizeof(int));
+}
+
 /*
  * Processor counterpart: __pcache_do_fill_page().
  * Check how we fill the information.
@@ -285,6 +432,73 @@ void handle_p2m_pcache_miss(struct p2m_pcache_miss_msg *msg,
 		src_nid, msg->pid, tgid, flags, vaddr);
 }
 
+/*
+ * Processor counterpart: pcache_fill_batch().
+ *
+ * Entries are handled one by one, and each of them gets its own status.
+ * A failed entry does not affect others, its line slot is left untouched.
+ * Entries with line_addr are RDMA written into processor pcache directly,
+ * only the others have a slot in reply.
+ */
+void handle_p2m_pcache_miss_batch(struct p2m_pcache_miss_batch_msg *msg,
+				  struct thpool_buffer *tb)
+{
+	struct p2m_pcache_miss_batch_reply *reply = thpool_buffer_tx(tb);
+	struct p2m_pcache_miss_batch_entry *entry;
+	struct lego_task_struct *p = NULL;
+	unsigned int src_nid, nr_entries, i, slot = 0;
+	unsigned long new_page;
+	void *data;
+	int ret;
+
+	src_nid = to_common_header(msg)->src_nid;
+	nr_entries = min_t(unsigned int, msg->nr_entries, P2M_PCACHE_MISS_BATCH_MAX);
+
+	for (i = 0; i < nr_entries; i++) {
+		entry = &msg->entries[i];
+
+		data = NULL;
+		if (!entry->line_addr)
+			data = reply->data + slot++ * PCACHE_LINE_SIZE;
+
+		handle_pcache_debug("I nid:%u pid:%u tgid:%u flags:%x vaddr:%#Lx",
+			src_nid, entry->pid, entry->tgid, entry->flags,
+			entry->missing_vaddr);
+
+		/* Most likely all entries are from the same process */
+		if (!p || p->pid != entry->tgid)
+			p = find_lego_task_by_pid(src_nid, entry->tgid);
+		if (unlikely(!p)) {
+			reply->status[i] = RET_ESRCH;
+			continue;
+		}
+
+		if (unlikely(fault_in_kernel_space(entry->missing_vaddr))) {
+			reply->status[i] = RET_EFAULT;
+			continue;
+		}
+
+		ret = common_handle_p2m_miss(p, entry->missing_vaddr,
+					     entry->flags, &new_page);
+		if (unlikely(ret & VM_FAULT_ERROR)) {
+			if (ret & VM_FAULT_OOM)
+				reply->status[i] = RET_ENOMEM;
+			else
+				reply->status[i] = RET_ESIGSEGV;
+			continue;
+		}
+
+		if (data)
+			memcpy(data, (void *)new_page, PCACHE_LINE_SIZE);
+		else
+			tb_add_rdma_write(tb, (void *)new_page, entry->line_addr,
+					  PCACHE_LINE_SIZE);
+		reply->status[i] = 0;
+	}
+
+	tb_set_tx_size(tb, sizeof(*reply) + slot * PCACHE_LINE_SIZE);
+}
+
 void handle_p2m_zerofill(struct p2m_zerofill_msg *msg,
 			 struct thpool_buffer *tb)
 {
@@ -317,3 +531,84 @@ void handle_p2m_zerofill(struct p2m_zerofill_msg *msg,
 	handle_zerofill_debug("O nid:%u pid:%u tgid:%u flags:%x vaddr:%#Lx",
 		src_nid, msg->pid, tgid, flags, vaddr);
 }
+
+/*
+ * Processor counterpart: do_prefetch() in processor pcache.
+ *
+ * Fault in up to @nr_lines lines starting from @start_vaddr, each @stride
+ * bytes apart, and copy them back to back into the reply. We stop at the
+ * first line that fails, processor will only install what it got.
+ * Processor treats a reply shorter than one line as an error.
+ *
+ * In RDMA write mode, lines go straight into processor pcache lines,
+ * and the reply only tells how many of them are valid.
+ */
+void handle_p2m_pcache_prefetch(struct p2m_pcache_prefetch_msg *msg,
+				struct thpool_buffer *tb)
+{
+	struct lego_task_struct *p;
+	unsigned int src_nid, nr_lines, i;
+	unsigned long new_page;
+	void *reply = thpool_buffer_tx(tb);
+	bool rdma_write;
+	u64 vaddr;
+	int ret;
+
+	BUILD_BUG_ON(P2M_PCACHE_PREFETCH_MAX_LINES > THPOOL_MAX_RDMA_WRITES);
+	BUILD_BUG_ON(P2M_PCACHE_MISS_BATCH_MAX > THPOOL_MAX_RDMA_WRITES);
+
+	src_nid = to_common_header(msg)->src_nid;
+	nr_lines = min_t(unsigned int, msg->nr_lines, P2M_PCACHE_PREFETCH_MAX_LINES);
+	rdma_write = msg->mode & P2M_PREFETCH_RDMA_WRITE;
+
+	/*
+	 * Prefetch is only a hint, processor has to handle failure anyway.
+	 * Do not complain loudly as pcache_miss_error() does.
+	 */
+	p = find_lego_task_by_pid(src_nid, msg->tgid);
+	if (unlikely(!p)) {
+		if (rdma_write) {
+			i = 0;
+			goto out;
+		}
+		*(int *)reply = RET_ESRCH;
+		tb_set_tx_size(tb, sizeof(int));
+		return;
+	}
+
+	down_read(&p->mm->mmap_sem);
+	for (i = 0; i < nr_lines; i++) {
+		vaddr = msg->start_vaddr + (s64)i * msg->stride;
+		if (unlikely(fault_in_kernel_space(vaddr)))
+			break;
+
+		ret = __common_handle_p2m_miss(p, vaddr, msg->flags, &new_page, true);
+		if (unlikely(ret & VM_FAULT_ERROR))
+			break;
+
+		if (rdma_write)
+			tb_add_rdma_write(tb, (void *)new_page, msg->line_addr[i],
+					  PCACHE_LINE_SIZE);
+		else
+			memcpy(reply + i * PCACHE_LINE_SIZE, (void *)new_page,
+			       PCACHE_LINE_SIZE);
+	}
+	up_read(&p->mm->mmap_sem);
+
+out:
+	if (rdma_write) {
+		struct p2m_pcache_prefetch_rdma_reply *r = reply;
+
+		r->status = 0;
+		r->nr_lines = i;
+		tb_set_tx_size(tb, sizeof(*r));
+		return;
+	}
+
+	if (unlikely(!i)) {
+		*(int *)reply = RET_EFAULT;
+		tb_set_tx_size(tb, sizeof(int));
+		return;
+	}
+	tb_set_tx_size(tb, i * PCACHE_LINE_SIZE);
+}
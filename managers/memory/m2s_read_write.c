@@ -18,6 +18,7 @@
 #include <memory/pid.h>
 #include <memory/vm.h>
 #include <memory/file_types.h>
+#include <memory/file_ops.h>
 
 #ifdef CONFIG_DEBUG_M2S_READ_WRITE
 #define m2s_debug(fmt, ...)					\
@@ -27,60 +28,215 @@
 static inline void m2s_debug(const char *fmt, ...) { }
 #endif
 
+/**
+ * m2s_open
+ * @f_name: the file
+ * @storage_node: where the file is
+ * @token: filled with storage's token, or invalid on failure
+ *
+ * Ask storage to keep @f_name open. Callers go on with the name
+ * if this fails, so the error is informational.
+ */
+int m2s_open(char *f_name, unsigned int storage_node,
+	     struct lego_file_token *token)
+{
+	struct {
+		u32			opcode;
+		struct m2s_open_payload	payload;
+	} *msg;
+	struct m2s_open_reply reply;
+	int retlen;
+
+	memset(token, 0, sizeof(*token));
+
+	msg = kmalloc(sizeof(*msg), GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	msg->opcode = M2S_OPEN;
+	strlcpy(msg->payload.filename, f_name, MAX_FILENAME_LENGTH);
+	msg->payload.flags = O_RDWR;
+
+	retlen = ibapi_send_reply_imm(storage_node, msg, sizeof(*msg),
+				      &reply, sizeof(reply), false);
+	kfree(msg);
+
+	if (unlikely(retlen != sizeof(reply)))
+		return -EIO;
+	if (reply.retval)
+		return reply.retval;
+
+	*token = reply.token;
+	token->nid = storage_node;
+	return 0;
+}
+
+void m2s_close(unsigned int storage_node, struct lego_file_token *token)
+{
+	struct {
+		u32			opcode;
+		struct m2s_close_payload payload;
+	} msg;
+	int retval;
+
+	if (!file_token_valid(token))
+		return;
+
+	msg.opcode = M2S_CLOSE;
+	msg.payload.token = *token;
+	ibapi_send_reply_imm(storage_node, &msg, sizeof(msg),
+			     &retval, sizeof(retval), false);
+}
+
+/**
+ * m2s_rw_header
+ * @msg: at least M2S_RW_HDR_MAX bytes
+ * @write: M2S write or read
+ * @f_name: the file
+ * @token: storage's token of @f_name, or NULL
+ *
+ * Build the header of an M2S read or write at @msg: by handle if @token
+ * is valid, by name otherwise. Return the header length, content of a
+ * write follows right after it.
+ */
+u32 m2s_rw_header(void *msg, bool write, char *f_name,
+		  struct lego_file_token *token, size_t len, loff_t offset)
+{
+	struct m2s_fh_read_write_payload *fh_payload;
+	struct m2s_read_write_payload *payload;
+	struct lego_file_token t;
+	u32 *opcode = msg;
+
+	if (token) {
+		t.nid = token->nid;
+		t.fid = token->fid;
+		t.gen = READ_ONCE(token->gen);
+	}
+
+	if (token && file_token_valid(&t)) {
+		*opcode = write ? M2S_WRITE_FH : M2S_READ_FH;
+		fh_payload = msg + sizeof(*opcode);
+		fh_payload->token = t;
+		fh_payload->len = len;
+		fh_payload->offset = offset;
+		return sizeof(*opcode) + sizeof(*fh_payload);
+	}
+
+	*opcode = write ? M2S_WRITE : M2S_READ;
+	payload = msg + sizeof(*opcode);
+	payload->uid = current_uid();
+	payload->flags = write ? O_WRONLY : O_RDONLY;
+	payload->len = len;
+	payload->offset = offset;
+	strlcpy(payload->filename, f_name, MAX_FILENAME_LENGTH);
+	return sizeof(*opcode) + sizeof(*payload);
+}
+
+/**
+ * m2s_rw_send
+ * @storage_node: where the file is
+ * @msg: built by m2s_rw_header(), M2S_RW_HDR_MAX + @count bytes
+ * @hdr_len: returned by m2s_rw_header()
+ * @count: bytes of content that follow the header, 0 for reads
+ * @retbuf, @len_ret: reply buffer, starts with the ssize_t retval
+ *
+ * Send an M2S read or write. If storage has dropped the handle, mark
+ * @token stale and send it again by name. Return the retval.
+ */
+ssize_t m2s_rw_send(unsigned int storage_node, void *msg, u32 hdr_len,
+		    size_t count, void *retbuf, u32 len_ret,
+		    char *f_name, struct lego_file_token *token)
+{
+	struct m2s_fh_read_write_payload *fh_payload;
+	ssize_t retval;
+	u32 new_len;
+	int retlen;
+
+	retlen = ibapi_send_reply_imm(storage_node, msg, hdr_len + count,
+				      retbuf, len_ret, false);
+	if (unlikely(retlen < (int)sizeof(retval)))
+		return -EIO;
+
+	retval = *(ssize_t *)retbuf;
+	if (likely(retval != -ESTALE) || hdr_len == M2S_RW_HDR_MAX)
+		return retval;
+
+	/* Renamed, unlinked or truncated. The name is what we have now */
+	if (token)
+		WRITE_ONCE(token->gen, 0);
+
+	fh_payload = msg + sizeof(u32);
+	memmove(msg + M2S_RW_HDR_MAX, msg + hdr_len, count);
+	new_len = m2s_rw_header(msg, *(u32 *)msg == M2S_WRITE_FH, f_name, NULL,
+				fh_payload->len, fh_payload->offset);
+
+	retlen = ibapi_send_reply_imm(storage_node, msg, new_len + count,
+				      retbuf, len_ret, false);
+	if (unlikely(retlen < (int)sizeof(retval)))
+		return -EIO;
+	return *(ssize_t *)retbuf;
+}
+
+/*
+ * perform m2s read
+ * Large reads are streamed: storage returns at most M2S_READ_MAX_CHUNK
+ * bytes per M2S_READ, we keep asking until @count bytes are read, or
+ * storage returns a short read (EOF) or error.
+ * @token: storage's token of @f_name, or NULL
+ * return value: nrbytes read, -errno on fail
+ */
 ssize_t __storage_read(struct lego_task_struct *tsk, char *f_name,
+		       struct lego_file_token *token,
 		       char __user *buf, size_t count, loff_t *pos)
 {
-	u32 len_msg, len_ret, *opcode;
+	u32 len_ret, hdr_len;
 	void *msg, *retbuf, *content;
-	ssize_t retval, *retval_ptr;
-	struct m2s_read_write_payload *payload;
+	ssize_t retval = 0;
+	size_t chunk, done = 0;
 
-	len_msg = sizeof(*opcode) + sizeof(*payload);
-	msg = kmalloc(len_msg, GFP_KERNEL);
+	msg = kmalloc(M2S_RW_HDR_MAX, GFP_KERNEL);
 	if (!msg)
 		return -ENOMEM;
 
-	/* retbuf = retval + content */
-	len_ret = sizeof(retval) + count;
+	/* retbuf = retval + content, reused by all chunks */
+	len_ret = sizeof(retval) + min_t(size_t, count, M2S_READ_MAX_CHUNK);
 	retbuf = kmalloc(len_ret, GFP_KERNEL);
 	if(!retbuf) {
 		kfree(msg);
 		return -ENOMEM;
 	}
 
-	opcode = msg;
-	*opcode = M2S_READ;
+	content = retbuf + sizeof(retval);
 
-	payload = msg + sizeof(*opcode);
-	payload->uid = current_uid();
-	payload->flags = O_RDONLY;
-	payload->len = count;
-	payload->offset = *pos;
-	strncpy(payload->filename, f_name, MAX_FILENAME_LENGTH);
+	do {
+		chunk = min_t(size_t, count - done, M2S_READ_MAX_CHUNK);
+		hdr_len = m2s_rw_header(msg, false, f_name, token,
+					chunk, *pos + done);
 
-	m2s_debug("f_name:[%s] len:%#lx offset:%#Lx",
-		payload->filename, payload->len, payload->offset);
+		m2s_debug("f_name:[%s] len:%#lx offset:%#Lx",
+			f_name, chunk, *pos + done);
 
-	ibapi_send_reply_imm(STORAGE_NODE, msg, len_msg, retbuf, len_ret, false);
+		retval = m2s_rw_send(STORAGE_NODE, msg, hdr_len, 0, retbuf,
+				     sizeof(retval) + chunk, f_name, token);
 
-	/* The first 8 bytes are the nr of bytes been read */
-	retval_ptr = retbuf;
-	retval = *retval_ptr;
+		m2s_debug("2 retval: %zu", retval);
 
-	m2s_debug("2 retval: %zu", retval);
+		if (retval <= 0)
+			break;
 
-	/* The left is the content itself */
-	content = retbuf + sizeof(*retval_ptr);
-
-	/*
-	 * buf can point to a kernel virtual address or user
-	 * virual address. lego_copy_to_user will take care.
-	 */
-	lego_copy_to_user(tsk, buf, content, count);
+		/*
+		 * buf can point to a kernel virtual address or user
+		 * virual address. lego_copy_to_user will take care.
+		 */
+		lego_copy_to_user(tsk, buf + done, content, retval);
+		done += retval;
+	} while (retval == chunk && done < count);
 
 	kfree(msg);
 	kfree(retbuf);
-	return retval;
+
+	/* Report error only if nothing was read */
+	return done ? done : retval;
 }
 
 ssize_t storage_read(struct lego_task_struct *tsk,
@@ -88,55 +244,40 @@ ssize_t storage_read(struct lego_task_struct *tsk,
 		     char *buf, size_t count, loff_t *pos)
 {
 	BUG_ON(!file->filename);
-	return __storage_read(tsk, file->filename, buf, count, pos);
+	return __storage_read(tsk, file->filename, NULL, buf, count, pos);
 }
 
 /*
  * perform m2s write
  * @tsk: unused
  * @f_name: filename to write to
+ * @token: storage's token of @f_name, or NULL
  * @count: nrbytes of write
  * @pos: offset where nrbytes write start
  * return value: nrbytes no success, -errno on fail
  */
 ssize_t __storage_write(struct lego_task_struct *tsk, char *f_name,
+			struct lego_file_token *token,
 			const char *buf, size_t count, loff_t *pos)
 {
-	u32 len_msg, *opcode;
-	void *msg, *content;
+	void *msg;
 	ssize_t retval;
-	struct m2s_read_write_payload *payload;
-	int retlen;
+	u32 hdr_len;
 
 	/* msg = opcode + payload + send_buffer */
-	len_msg = sizeof(*opcode) + sizeof(*payload) + count;
-	msg = kmalloc(len_msg, GFP_KERNEL);
+	msg = kmalloc(M2S_RW_HDR_MAX + count, GFP_KERNEL);
 	if (!msg)
 		return -ENOMEM;
 
-	opcode = msg;
-	*opcode = M2S_WRITE;
-
-	payload = msg + sizeof(*opcode);
-	payload->uid = current_uid();
-	payload->flags = O_WRONLY;
-	payload->len = count;
-	payload->offset = *pos;
-	strncpy(payload->filename, f_name, MAX_FILENAME_LENGTH);
-
-	content = msg + sizeof(*opcode) + sizeof(*payload);
+	hdr_len = m2s_rw_header(msg, true, f_name, token, count, *pos);
 
 	//lego_copy_from_user(tsk, content, buf, count);
-	memcpy(content, buf, count);
-
-	m2s_debug("f_name:[%s] len:%#lx offset:%#Lx",
-		payload->filename, payload->len, payload->offset);
+	memcpy(msg + hdr_len, buf, count);
 
-	retlen = ibapi_send_reply_imm(STORAGE_NODE, msg, len_msg,
-				&retval, sizeof(retval), false);
+	m2s_debug("f_name:[%s] len:%#lx offset:%#Lx", f_name, count, *pos);
 
-	if (unlikely(retlen != sizeof(retval)))
-		retval = -EIO;
+	retval = m2s_rw_send(STORAGE_NODE, msg, hdr_len, count,
+			     &retval, sizeof(retval), f_name, token);
 
 	m2s_debug("2 retval: %zu", retval);
 
@@ -149,7 +290,7 @@ static ssize_t storage_write(struct lego_task_struct *tsk, struct lego_file *fil
 		const char *buf, size_t count, loff_t *pos)
 {
 	BUG_ON(!file->filename);
-	return __storage_write(tsk, file->filename, buf, count, pos);
+	return __storage_write(tsk, file->filename, NULL, buf, count, pos);
 }
 
 static int storage_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
@@ -10,8 +10,8 @@
 #include <lego/slab.h>
 #include <memory/pgcache.h>
 
-struct lego_pgcache_struct *__alloc_pgcache(char *filepath, loff_t pos,
-		unsigned int storage_node)
+struct lego_pgcache_struct *__alloc_pgcache(struct lego_pgcache_file *file,
+		loff_t pos)
 {
 	struct lego_pgcache_struct *pgc;
 
@@ -20,9 +20,11 @@ struct lego_pgcache_struct *__alloc_pgcache(char *filepath, loff_t pos,
 		return ERR_PTR(-ENOMEM);
 	}
 
-	strcpy(pgc->filepath, filepath);
+	strcpy(pgc->filepath, file->filepath);
 	pgc->pos = aligned_pos(pos);
-	pgc->storage_node = storage_node;
+	pgc->storage_node = file->storage_node;
+	pgc->file = file;
+	pgc->hir = false;
 
 	/* mark new allocated pgcache as empty */
 	pgc->real_len = 0;
@@ -37,6 +39,10 @@ struct lego_pgcache_struct *__alloc_pgcache(char *filepath, loff_t pos,
 
 	pgc->cached_pages = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
 			PGCACHE_PREFETCH_ORDER);
+	if (unlikely(!pgc->cached_pages)) {
+		kfree(pgc);
+		return ERR_PTR(-ENOMEM);
+	}
 
 	pgcache_debug("pgc:%p, pos:%Ld, pages:%p, filepath: %s",		\
 			pgc, pgc->pos, pgc->cached_pages, pgc->filepath);
@@ -44,8 +50,11 @@ struct lego_pgcache_struct *__alloc_pgcache(char *filepath, loff_t pos,
 	return pgc;
 }
 
+/* Free cached pages only, caller holds pgc->lock */
 void __free_pgcache_locked(struct lego_pgcache_struct *pgc)
 {
+	if (unlikely(!pgc->cached_pages))
+		return;
 	free_pages((unsigned long)pgc->cached_pages, PGCACHE_PREFETCH_ORDER);
 	pgc->cached_pages = NULL;
 	//kfree(pgc);
@@ -53,6 +62,7 @@ void __free_pgcache_locked(struct lego_pgcache_struct *pgc)
 
 void __free_pgcache_struct(struct lego_pgcache_struct *pgc)
 {
-	free_pages((unsigned long)pgc->cached_pages, PGCACHE_PREFETCH_ORDER);
+	if (pgc->cached_pages)
+		free_pages((unsigned long)pgc->cached_pages, PGCACHE_PREFETCH_ORDER);
 	kfree(pgc);
 }
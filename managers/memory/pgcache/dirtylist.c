@@ -11,13 +11,28 @@
 #include <lego/spinlock.h>
 #include <lego/timer.h>
 #include <memory/pgcache.h>
+#include <memory/file_ops.h>
+#include <memory/file_handle.h>
 #include <lego/hashtable.h>
 #include <lego/fit_ibapi.h>
 
-/* lock to protect pgcache dirtylist struct */
+/*
+ * Files are hashed by filepath. Each bucket has its own lock,
+ * so lookups of different files rarely contend.
+ */
+struct pgcache_file_bucket {
+	spinlock_t		lock;
+	struct hlist_head	chain;
+} ____cacheline_aligned;
 
-static DEFINE_SPINLOCK(hash_dirtylists_lock);
-static DEFINE_HASHTABLE(hash_dirtylists, PGCACHE_HASH_BITS);
+#define NR_PGCACHE_FILE_BUCKETS	(1 << PGCACHE_HASH_BITS)
+
+static struct pgcache_file_bucket hash_dirtylists[NR_PGCACHE_FILE_BUCKETS] = {
+	[0 ... NR_PGCACHE_FILE_BUCKETS - 1] = {
+		.lock	= __SPIN_LOCK_UNLOCKED(hash_dirtylists.lock),
+		.chain	= HLIST_HEAD_INIT,
+	}
+};
 
 static unsigned int get_key(char *str)
 {
@@ -31,6 +46,11 @@ static unsigned int get_key(char *str)
 	return hash & 0x7fffffff;
 }
 
+static inline struct pgcache_file_bucket *filepath_to_bucket(char *filepath)
+{
+	return &hash_dirtylists[hash_32(get_key(filepath), PGCACHE_HASH_BITS)];
+}
+
 struct lego_pgcache_file *lego_pgcache_file_open(char *filepath,
 		unsigned int storage_node)
 {
@@ -49,105 +69,166 @@ struct lego_pgcache_file *lego_pgcache_file_open(char *filepath,
 	if (likely(tmp_file_size >= 0))
 		file->f_size = tmp_file_size;
 
+	/* Lines go by name if storage can not give us a handle */
+	m2s_open(filepath, storage_node, &file->storage_token);
+
 	INIT_LIST_HEAD(&file->head);
 	spin_lock_init(&file->dirtylist_lock);
 
+	spin_lock_init(&file->tree_lock);
+	INIT_RADIX_TREE(&file->tree, GFP_KERNEL);
+	init_rwsem(&file->drop_sem);
+
+	pgcache_readahead_file_init(file);
+	pgcache_lease_file_init(file);
+
 	return file;
 }
 
 int ht_insert_lego_pgcache_file(struct lego_pgcache_file *file)
 {
+	struct pgcache_file_bucket *bucket;
 	struct lego_pgcache_file *p;
-	unsigned int key;
 
 	BUG_ON(!file || strlen(file->filepath) == 0);
 
 	pgcache_debug("filepath: %s", file->filepath);
 
-	key = get_key(file->filepath);
+	bucket = filepath_to_bucket(file->filepath);
 
-	spin_lock(&hash_dirtylists_lock);
-	hash_for_each_possible(hash_dirtylists, p, hlink, key) {
+	spin_lock(&bucket->lock);
+	hlist_for_each_entry(p, &bucket->chain, hlink) {
 		if (unlikely(strcmp(p->filepath, file->filepath) == 0)) {
-			spin_unlock(&hash_dirtylists_lock);
+			spin_unlock(&bucket->lock);
 			return -EEXIST;
 		}
 	}
-	hash_add(hash_dirtylists, &file->hlink, key);
-	spin_unlock(&hash_dirtylists_lock);
+	hlist_add_head(&file->hlink, &bucket->chain);
+	spin_unlock(&bucket->lock);
 
 	return 0;
 }
 
 void ht_remove_lego_pgcache_file(struct lego_pgcache_file *file)
 {
+	struct pgcache_file_bucket *bucket;
+
 	BUG_ON(!file || strlen(file->filepath) == 0);
-	spin_lock(&hash_dirtylists_lock);
-	hash_del(&file->hlink);
-	spin_unlock(&hash_dirtylists_lock);
+
+	bucket = filepath_to_bucket(file->filepath);
+	spin_lock(&bucket->lock);
+	hlist_del_init(&file->hlink);
+	spin_unlock(&bucket->lock);
 }
 
 // should not be called
 void free_lego_pgcache_file(struct lego_pgcache_file *file)
 {
+	struct pgcache_file_bucket *bucket;
 	struct lego_pgcache_file *p;
-	unsigned int key;
 
 	BUG_ON(!file || strlen(file->filepath) == 0);
 
-	key = get_key(file->filepath);
+	bucket = filepath_to_bucket(file->filepath);
 
-	spin_lock(&hash_dirtylists_lock);
-	hash_for_each_possible(hash_dirtylists, p, hlink, key) {
+	spin_lock(&bucket->lock);
+	hlist_for_each_entry(p, &bucket->chain, hlink) {
 		if (likely(strcmp(p->filepath, file->filepath) == 0)) {
 
-			hash_del(&p->hlink);
+			hlist_del(&p->hlink);
 			kfree(p);
-			spin_unlock(&hash_dirtylists_lock);
+			spin_unlock(&bucket->lock);
 			return;
 		}
 	}
-	spin_unlock(&hash_dirtylists_lock);
+	spin_unlock(&bucket->lock);
 	WARN(1, "Fail to find file->(filepath:%s)\n", file->filepath);
 	return;
 }
 
 struct lego_pgcache_file *find_lego_pgcache_file(char *filepath)
 {
+	struct pgcache_file_bucket *bucket;
 	struct lego_pgcache_file *file;
-	unsigned int key;
 
 	if (unlikely(strlen(filepath) == 0))
 		return NULL;
 
-	key = get_key(filepath);
+	bucket = filepath_to_bucket(filepath);
 
-	spin_lock(&hash_dirtylists_lock);
-	hash_for_each_possible(hash_dirtylists, file, hlink, key) {
+	spin_lock(&bucket->lock);
+	hlist_for_each_entry(file, &bucket->chain, hlink) {
 		if (likely(strcmp(file->filepath, filepath) == 0)) {
-			spin_unlock(&hash_dirtylists_lock);
+			spin_unlock(&bucket->lock);
 
 			pgcache_debug("file: %p", file);
 
 			return file;
 		}
 	}
-	spin_unlock(&hash_dirtylists_lock);
+	spin_unlock(&bucket->lock);
 
 	return NULL;
 }
 
-void mark_lego_pgcache_dirty(struct lego_pgcache_struct *pgc,
+/*
+ * Return the pgcache file of @filepath, open it if it is not cached yet.
+ * Concurrent openers race to insert, losers use the winner's.
+ */
+struct lego_pgcache_file *find_or_open_lego_pgcache_file(char *filepath,
+		unsigned int storage_node)
+{
+	struct lego_pgcache_file *file;
+
+	file = find_lego_pgcache_file(filepath);
+	if (likely(file))
+		return file;
+
+	file = lego_pgcache_file_open(filepath, storage_node);
+	if (unlikely(IS_ERR(file)))
+		return file;
+
+	if (unlikely(ht_insert_lego_pgcache_file(file))) {
+		m2s_close(file->storage_node, &file->storage_token);
+		kfree(file);
+		file = find_lego_pgcache_file(filepath);
+		BUG_ON(!file);
+	}
+	return file;
+}
+
+/*
+ * Callback @fn for each cached file.
+ * Files are never freed, thus it is safe to drop the bucket lock.
+ */
+void pgcache_for_each_file(void (*fn)(struct lego_pgcache_file *file))
+{
+	struct pgcache_file_bucket *bucket;
+	struct lego_pgcache_file *file;
+	int i;
+
+	for (i = 0; i < NR_PGCACHE_FILE_BUCKETS; i++) {
+		bucket = &hash_dirtylists[i];
+
+		spin_lock(&bucket->lock);
+		hlist_for_each_entry(file, &bucket->chain, hlink) {
+			spin_unlock(&bucket->lock);
+			fn(file);
+			spin_lock(&bucket->lock);
+		}
+		spin_unlock(&bucket->lock);
+	}
+}
+
+/* Caller holds pgc->lock */
+void mark_lego_pgcache_dirty_locked(struct lego_pgcache_struct *pgc,
 		struct lego_pgcache_file *file)
 {
 	BUG_ON(!pgc || !file || IS_ERR(file));
 
-	spin_lock(&pgc->lock);
 	/* already marked as dirty */
-	if (pgc->dirty) {
-		spin_unlock(&pgc->lock);
+	if (pgc->dirty)
 		return;
-	}
 
 	spin_lock(&file->dirtylist_lock);
 	/* mark as dirty cacheline*/
@@ -158,31 +239,20 @@ void mark_lego_pgcache_dirty(struct lego_pgcache_struct *pgc,
 			pgc, &file->head, pgc->dirtylist.next);
 
 	spin_unlock(&file->dirtylist_lock);
-
-	spin_unlock(&pgc->lock);
-	return;
 }
 
 /*
  * make one lego pgcache line clean, flush on dirty
- * should be call on eviction
+ * should be call on eviction. Caller holds pgc->lock.
  */
-void make_lego_pgcache_clean(struct lego_pgcache_struct *pgc)
+void make_lego_pgcache_clean_locked(struct lego_pgcache_struct *pgc)
 {
 	struct lego_pgcache_file *file;
 
-	spin_lock(&pgc->lock);
-	if (!pgc->dirty) {
-		spin_unlock(&pgc->lock);
-		return;
-	}
-
-	file = find_lego_pgcache_file(pgc->filepath);
+	file = pgc->file;
 	BUG_ON(!file);
 
 	spin_lock(&file->dirtylist_lock);
-
-	/* check again */
 	if (!pgc->dirty) {
 		spin_unlock(&file->dirtylist_lock);
 		return;
@@ -192,27 +262,43 @@ void make_lego_pgcache_clean(struct lego_pgcache_struct *pgc)
 	spin_unlock(&file->dirtylist_lock);
 
 	flush_one_cacheline_locked(pgc);
+}
 
+void make_lego_pgcache_clean(struct lego_pgcache_struct *pgc)
+{
+	spin_lock(&pgc->lock);
+	make_lego_pgcache_clean_locked(pgc);
 	spin_unlock(&pgc->lock);
-	return;
 }
 
 int pgcache_flush_file(struct lego_pgcache_file *file)
 {
 	struct lego_pgcache_struct *pos;
 
+#ifdef CONFIG_MEM_PAGE_CACHE_WRITE_BEHIND
+	int ret;
+
+	/* Coalesce contiguous dirty lines, fall back only if out of memory */
+	ret = pgcache_writeback_file(file);
+	if (likely(ret != -ENOMEM))
+		return ret;
+#endif
+
+	/*
+	 * pgc->lock goes before dirtylist_lock. Pick the next line, then
+	 * clean it under its lock, someone may have cleaned it meanwhile.
+	 * Lines are not freed under us, caller holds drop_sem.
+	 */
 	spin_lock(&file->dirtylist_lock);
 	while(!list_empty(&file->head)) {
 		pos = list_entry(file->head.next,
 				struct lego_pgcache_struct, dirtylist);
-		pos->dirty = false;
-		list_del_init(&pos->dirtylist);
 		spin_unlock(&file->dirtylist_lock);
 
 		pgcache_debug("pgc: %p, head: %p, pgc->next: %p, sid: %u",		\
 			pos, &file->head, pos->dirtylist.next, pos->storage_node);
 
-		flush_one_cacheline_locked(pos);
+		make_lego_pgcache_clean(pos);
 
 		spin_lock(&file->dirtylist_lock);
 	}
@@ -225,25 +311,28 @@ struct p2m_fsync_reply {
 	long		retval;
 };
 
-int handle_p2m_fsync(char *payload, struct common_header *hdr, struct thpool_buffer *tb)
+int handle_p2m_fsync(struct p2m_fsync_struct *payload, struct common_header *hdr,
+		     struct thpool_buffer *tb)
 {
-	char *filepath = payload;
 	struct p2m_fsync_reply *retbuf;
-	struct lego_pgcache_file *file;
-
-	pgcache_debug("filepath: %s", filepath);
+	struct memory_fh *fh;
 
 	retbuf = thpool_buffer_tx(tb);
 	tb_set_tx_size(tb, sizeof(*retbuf));
-	file = find_lego_pgcache_file(filepath);
 
-	/* not accessed yet */
-	if (!file) {
-		retbuf->retval = 0;
+	fh = memory_fh_get(&payload->token);
+	if (unlikely(!fh)) {
+		retbuf->retval = -EBADF;
 		goto out;
 	}
 
-	retbuf->retval = pgcache_flush_file(file);
+	pgcache_debug("filepath: %s", fh->pgfile->filepath);
+
+	/* Lines collected off the dirty list are used unlocked */
+	down_read(&fh->pgfile->drop_sem);
+	retbuf->retval = pgcache_flush_file(fh->pgfile);
+	up_read(&fh->pgfile->drop_sem);
+	memory_fh_put(fh);
 out:
 	return retbuf->retval;
 }
@@ -8,6 +8,7 @@
  */
 
 #include <lego/list.h>
+#include <lego/percpu.h>
 #include <lego/spinlock.h>
 #include <memory/pgcache.h>
 
@@ -23,6 +24,21 @@ static DEFINE_SPINLOCK(pgcache_lirs_lock);
 static LIST_HEAD(lirs_stack_s); /* list of stack s of access history */
 static LIST_HEAD(lirs_stack_q); /* list of stack q of victim candidate */
 
+/*
+ * Accesses are recorded into per-cpu batches first, and applied to
+ * the LIRS stacks once a batch is full. Thus the hit path only takes
+ * the local batch lock, and pgcache_lirs_lock is taken once per batch.
+ */
+#define LIRS_BATCH_SIZE		16
+
+struct lirs_batch {
+	spinlock_t			lock;
+	unsigned int			nr;
+	struct lego_pgcache_struct	*pgcs[LIRS_BATCH_SIZE];
+} ____cacheline_aligned;
+
+static DEFINE_PER_CPU(struct lirs_batch, lirs_batches);
+
 #define IN_QUEUE(pgc, member)					\
 ((pgc->member.next != &pgc->member)				\
 	&& (pgc->member.prev != &pgc->member))
@@ -93,24 +109,28 @@ void pgcache_evict_one(void)
 	pgcache_debug("victim: %p, filepath: %s, pos: %Lx",		\
 		victim, victim->filepath, victim->pos);
 
-	/* flush the dirty cacheline */
-	make_lego_pgcache_clean(victim);
+	/*
+	 * flush the dirty cacheline and free the cached pages,
+	 * both under victim->lock: readers and writers check
+	 * cached_pages under it before they touch the pages.
+	 */
+	spin_lock(&victim->lock);
+	make_lego_pgcache_clean_locked(victim);
+	__free_pgcache_locked(victim);
+	spin_unlock(&victim->lock);
 
-	/* free the cached pages
-	 * remove from pgcache HIRS stack Q
+	/* remove from pgcache HIRS stack Q
 	 * the victim still marked as HIR in
 	 * Stack S before accessed or cut
 	 */
-	__free_pgcache_locked(victim);
 	remove_from_stack_q_locked(victim);
 }
 
-void update_lirs_structure(struct lego_pgcache_struct *pgc)
+/* Caller must hold pgcache_lirs_lock */
+static void __update_lirs_structure(struct lego_pgcache_struct *pgc)
 {
 	struct lego_pgcache_struct *cur_bottom_s;
 
-	spin_lock(&pgcache_lirs_lock);
-
 	/* page blocks that are not in stack S now
 	 */
 	if (!IN_QUEUE(pgc, stack_s)) {
@@ -178,6 +198,90 @@ eviction:
 		atomic_dec(&hir_credit);
 	}
 unlock:
-	spin_unlock(&pgcache_lirs_lock);
 	return;
 }
+
+static void flush_lirs_batch_locked(struct lirs_batch *batch)
+{
+	int i;
+
+	spin_lock(&pgcache_lirs_lock);
+	for (i = 0; i < batch->nr; i++)
+		__update_lirs_structure(batch->pgcs[i]);
+	spin_unlock(&pgcache_lirs_lock);
+
+	batch->nr = 0;
+}
+
+void update_lirs_structure(struct lego_pgcache_struct *pgc)
+{
+	struct lirs_batch *batch;
+
+	batch = this_cpu_ptr(&lirs_batches);
+
+	spin_lock(&batch->lock);
+
+	/* Sequential accesses hit the same cacheline over and over */
+	if (batch->nr && batch->pgcs[batch->nr - 1] == pgc)
+		goto unlock;
+
+	batch->pgcs[batch->nr++] = pgc;
+	if (batch->nr == LIRS_BATCH_SIZE)
+		flush_lirs_batch_locked(batch);
+unlock:
+	spin_unlock(&batch->lock);
+}
+
+/*
+ * Forget LIRS history of @file, including pending per-cpu batches.
+ * Called before cachelines of @file are freed. Caller holds drop_sem
+ * of @file for write, no new access to them can be recorded meanwhile.
+ */
+void pgcache_lirs_forget_file(struct lego_pgcache_file *file)
+{
+	struct lego_pgcache_struct *pgc, *n;
+	struct lirs_batch *batch;
+	int cpu, i, nr;
+
+	for_each_possible_cpu(cpu) {
+		batch = per_cpu_ptr(&lirs_batches, cpu);
+		spin_lock(&batch->lock);
+		for (i = 0, nr = 0; i < batch->nr; i++) {
+			if (batch->pgcs[i]->file != file)
+				batch->pgcs[nr++] = batch->pgcs[i];
+		}
+		batch->nr = nr;
+		spin_unlock(&batch->lock);
+	}
+
+	spin_lock(&pgcache_lirs_lock);
+	list_for_each_entry_safe(pgc, n, &lirs_stack_s, stack_s) {
+		if (pgc->file != file)
+			continue;
+		if (!HIR(pgc))
+			atomic_dec(&lir_credit);
+		list_del_init(&pgc->stack_s);
+	}
+	list_for_each_entry_safe(pgc, n, &lirs_stack_q, stack_q) {
+		if (pgc->file != file)
+			continue;
+		atomic_dec(&hir_credit);
+		list_del_init(&pgc->stack_q);
+	}
+	spin_unlock(&pgcache_lirs_lock);
+}
+
+void __init pgcache_init(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct lirs_batch *batch = per_cpu_ptr(&lirs_batches, cpu);
+
+		spin_lock_init(&batch->lock);
+		batch->nr = 0;
+	}
+
+	pgcache_readahead_init();
+	pgcache_writeback_init();
+}
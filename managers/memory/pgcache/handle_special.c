@@ -11,6 +11,7 @@
 #include <lego/hashtable.h>
 #include <lego/fit_ibapi.h>
 #include <memory/pgcache.h>
+#include <memory/file_handle.h>
 
 static long do_m2s_rename(char *oldname, char *newname, __u32 storage_node)
 {
@@ -48,28 +49,14 @@ out:
 
 static void __do_page_cache_rename(char *oldname, char *newname)
 {
-	size_t len = 0;
-	loff_t curr = 0;
 	struct lego_pgcache_file *pgfile = find_lego_pgcache_file(oldname);
-	loff_t stride = 1 << PGCACHE_PREFETCH_ORDER;
 
 	/* file has not been touched yet */
 	if (unlikely(!pgfile))
 		return;
 
-	len = file_size_read(pgfile);
-	while (curr < len) {
-		struct lego_pgcache_struct *pgc =
-				find_lego_pgcache_struct(oldname, curr);
-
-		if (pgc) {
-			ht_remove_lego_pgcache_struct(pgc);
-			memset(pgc->filepath, 0, MAX_FILENAME_LENGTH);
-			strncpy(pgc->filepath, newname, MAX_FILENAME_LENGTH);
-			ht_insert_lego_pgcache_struct(pgc);
-		}
-		curr += stride;
-	}
+	/* cachelines are indexed within pgfile, only names change */
+	rename_lego_pgcache_structs(pgfile, newname);
 
 	/*
 	 * rename pgfile
@@ -83,10 +70,33 @@ static void __do_page_cache_rename(char *oldname, char *newname)
 int handle_p2m_rename(struct p2m_rename_struct *payload, struct common_header *hdr,
 		      struct thpool_buffer *tb)
 {
+	struct lego_pgcache_file *oldfile, *newfile;
 	long *retval;
 
 	retval = thpool_buffer_tx(tb);
 	tb_set_tx_size(tb, sizeof(*retval));
+
+	/* Both may be cached by processors, the target is replaced */
+	oldfile = find_lego_pgcache_file(payload->oldname);
+	newfile = find_lego_pgcache_file(payload->newname);
+	if (newfile == oldfile)
+		newfile = NULL;
+
+	if (oldfile) {
+		*retval = pgcache_lease_write_begin(oldfile, hdr->src_nid);
+		if (*retval)
+			return *retval;
+	}
+	if (newfile) {
+		*retval = pgcache_lease_write_begin(newfile, hdr->src_nid);
+		if (*retval) {
+			/* Nothing changed, the new version only drops caches */
+			if (oldfile)
+				pgcache_lease_write_end(oldfile);
+			return *retval;
+		}
+	}
+
 	*retval = do_m2s_rename(payload->oldname,
 			payload->newname, payload->storage_node);
 	/*
@@ -97,6 +107,10 @@ int handle_p2m_rename(struct p2m_rename_struct *payload, struct common_header *h
 
 	__do_page_cache_rename(payload->oldname, payload->newname);
 out:
+	if (newfile)
+		pgcache_lease_write_end(newfile);
+	if (oldfile)
+		pgcache_lease_write_end(oldfile);
 	return *retval;
 }
 
@@ -132,23 +146,19 @@ int handle_p2m_lseek(struct p2m_lseek_struct *payload, struct common_header *hdr
 		     struct thpool_buffer *tb)
 {
 	ssize_t *retval;
-	struct lego_pgcache_file *file;
+	struct memory_fh *fh;
 
 	retval = thpool_buffer_tx(tb);
 	tb_set_tx_size(tb, sizeof(*retval));
-	file = find_lego_pgcache_file(payload->filename);
 
-	/*
-	 * file has never been read/write before
-	 * directly invoking storage component to get file size
-	 */
-	if (unlikely(!file)) {
-		*retval = get_file_size_from_storage(payload->filename,
-						    payload->storage_node);
+	fh = memory_fh_get(&payload->token);
+	if (unlikely(!fh)) {
+		*retval = -EBADF;
 		goto out;
 	}
 
-	*retval = file_size_read(file);
+	*retval = file_size_read(fh->pgfile);
+	memory_fh_put(fh);
 
 out:
 	return *retval;
@@ -220,3 +230,29 @@ int handle_p2m_stat(struct p2m_stat_struct *payload, struct common_header *hdr,
 out:
 	return ret;
 }
+
+int handle_p2m_fstat(struct p2m_fstat_struct *payload, struct common_header *hdr,
+		     struct thpool_buffer *tb)
+{
+	int ret;
+	struct p2s_stat_ret_struct *retbuf;
+	struct memory_fh *fh;
+
+	retbuf = thpool_buffer_tx(tb);
+	tb_set_tx_size(tb, sizeof(*retbuf));
+
+	fh = memory_fh_get(&payload->token);
+	if (unlikely(!fh)) {
+		ret = retbuf->retval = -EBADF;
+		goto out;
+	}
+
+	/* Name may change by rename, pgfile has the latest one */
+	ret = do_m2s_stat(fh->pgfile->filepath, retbuf, 0, fh->storage_node);
+	if (ret == 0)
+		retbuf->statbuf.size = file_size_read(fh->pgfile);
+	memory_fh_put(fh);
+
+out:
+	return ret;
+}
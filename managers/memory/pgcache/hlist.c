@@ -7,157 +7,167 @@
  * (at your option) any later version.
  */
 
-#include <lego/hashtable.h>
+/*
+ * Each lego_pgcache_file has its own radix tree of cachelines,
+ * indexed by pos >> CL_SHIFT, and protected by file->tree_lock.
+ * Thus lookups into different files never contend with each other,
+ * and we do not hash the filename for every lookup.
+ */
+
 #include <lego/spinlock.h>
+#include <lego/radixtree.h>
 #include <lego/comp_memory.h>
 #include <memory/pgcache.h>
 
-/* lock to protect pgcache hashtable struct */
-static DEFINE_SPINLOCK(pgcache_hash_lock);
-static DEFINE_HASHTABLE(pgcache_hash, PGCACHE_HASH_BITS);
-static unsigned int lookups = 0;
-static unsigned int walks = 0;
-
-static unsigned int BKDRHash(char *str)
-{
-	unsigned int seed = 131;
-	unsigned int hash = 0;
-
-	while (*str) {
-		hash = hash*seed + (*str++);
-	}
-
-	return hash & 0x7fffffff;
-}
-
-/*
- * TODO: replace with correct key function
- * DONE
- */
-static unsigned int get_key(char *filename, loff_t _aligned_pos)
+static inline unsigned long pgcache_index(loff_t pos)
 {
-	unsigned int key = 0;
-
-	key = BKDRHash(filename);
-	key += (_aligned_pos) >> (PAGE_SHIFT + PGCACHE_PREFETCH_ORDER);
-
-	return key;
+	return (unsigned long)pos >> CL_SHIFT;
 }
 
 /*
- * when this func is invoked, the caller is responsible to do sanity
- * check if pgc is already exist, we avoid reductant check here
- * for performance reasons
+ * Insert @pgc into its file. Concurrent misses on the same line may both
+ * load it. If someone else inserted first, the existing one is returned,
+ * and the caller should free @pgc. Return ERR_PTR on failure.
  */
-int ht_insert_lego_pgcache_struct(struct lego_pgcache_struct *pgc)
+struct lego_pgcache_struct *
+insert_lego_pgcache_struct(struct lego_pgcache_struct *pgc)
 {
-	unsigned int key;
+	struct lego_pgcache_file *file = pgc->file;
+	struct lego_pgcache_struct *p;
+	int ret;
 
-	BUG_ON(!pgc || strlen(pgc->filepath) == 0);
+	BUG_ON(!pgc || !file);
 
 	pgcache_debug("pgc:%p, pos:%Ld, pages:%p, filepath: %s",		\
 			pgc, pgc->pos, pgc->cached_pages, pgc->filepath);
 
-	key = get_key(pgc->filepath, pgc->pos);
-
-	spin_lock(&pgcache_hash_lock);
-	hash_add(pgcache_hash, &pgc->link, key);
-	spin_unlock(&pgcache_hash_lock);
-
-	return 0;
+	spin_lock(&file->tree_lock);
+	ret = radix_tree_insert(&file->tree, pgcache_index(pgc->pos), pgc);
+	if (likely(!ret))
+		p = pgc;
+	else if (ret == -EEXIST)
+		p = radix_tree_lookup(&file->tree, pgcache_index(pgc->pos));
+	else
+		p = ERR_PTR(ret);
+	spin_unlock(&file->tree_lock);
+
+	return p;
 }
 
-void ht_remove_lego_pgcache_struct(struct lego_pgcache_struct *pgc)
+void remove_lego_pgcache_struct(struct lego_pgcache_struct *pgc)
 {
-	BUG_ON(!pgc || strlen(pgc->filepath) == 0);
-	spin_lock(&pgcache_hash_lock);
-	hash_del(&pgc->link);
-	spin_unlock(&pgcache_hash_lock);
+	struct lego_pgcache_file *file = pgc->file;
+
+	BUG_ON(!pgc || !file);
+
+	spin_lock(&file->tree_lock);
+	radix_tree_delete_item(&file->tree, pgcache_index(pgc->pos), pgc);
+	spin_unlock(&file->tree_lock);
 }
 
 void free_lego_pgcache_struct(struct lego_pgcache_struct *pgc)
 {
-	struct lego_pgcache_struct *p;
-	unsigned int key;
-
-	BUG_ON(!pgc || strlen(pgc->filepath) == 0);
-
-	key = get_key(pgc->filepath, pgc->pos);
-
-	spin_lock(&pgcache_hash_lock);
-	hash_for_each_possible(pgcache_hash, p, link, key) {
-		if (likely(p->pos == pgc->pos &&
-			strcmp(p->filepath, pgc->filepath) == 0)) {
-			hash_del(&p->link);
-			spin_unlock(&pgcache_hash_lock);
-			/* TODO:
-			 * finish implementing __free_pgcache
-			 */
-			__free_pgcache_struct(p);
-			return;
-		}
-	}
-	spin_unlock(&pgcache_hash_lock);
-	WARN(1, "Fail to find pgc->(filepath:%s,pos:%Ld)\n", pgc->filepath, pgc->pos);
-	return;
+	remove_lego_pgcache_struct(pgc);
+	/* TODO:
+	 * finish implementing __free_pgcache
+	 */
+	__free_pgcache_struct(pgc);
 }
 
 struct lego_pgcache_struct *
-	find_lego_pgcache_struct(char *filepath, loff_t pos)
+	find_lego_pgcache_struct(struct lego_pgcache_file *file, loff_t pos)
 {
-	loff_t _aligned_pos;
 	struct lego_pgcache_struct *pgc;
-	unsigned int key;
 
-	if (unlikely(strlen(filepath) == 0))
-		return NULL;
+	spin_lock(&file->tree_lock);
+	pgc = radix_tree_lookup(&file->tree, pgcache_index(pos));
+	spin_unlock(&file->tree_lock);
 
-	_aligned_pos = aligned_pos(pos);
-	key = get_key(filepath, _aligned_pos);
+	if (pgc)
+		pgcache_debug("pgc:%p, pos:%Ld, pages:%p, filepath: %s",	\
+			pgc, pgc->pos, pgc->cached_pages, pgc->filepath);
+
+	return pgc;
+}
 
-	spin_lock(&pgcache_hash_lock);
-	lookups++;
-	hash_for_each_possible(pgcache_hash, pgc, link, key) {
-		walks++;
-		if (likely(pgc->pos == _aligned_pos &&
-			strcmp(pgc->filepath, filepath) == 0)) {
-			spin_unlock(&pgcache_hash_lock);
+/*
+ * Cachelines stay in the same tree across rename,
+ * only the name used to flush them back changes.
+ */
+void rename_lego_pgcache_structs(struct lego_pgcache_file *file, char *newname)
+{
+	struct lego_pgcache_struct *pgc;
+	struct radix_tree_iter iter;
+	void **slot;
 
-			pgcache_debug("pgc:%p, pos:%Ld, pages:%p, filepath: %s",		\
-				pgc, pgc->pos, pgc->cached_pages, pgc->filepath);
+	spin_lock(&file->tree_lock);
+	radix_tree_for_each_slot(slot, &file->tree, &iter, 0) {
+		pgc = *slot;
 
-			return pgc;
-		}
+		spin_lock(&pgc->lock);
+		memset(pgc->filepath, 0, MAX_FILENAME_LENGTH);
+		strncpy(pgc->filepath, newname, MAX_FILENAME_LENGTH - 1);
+		spin_unlock(&pgc->lock);
 	}
-	spin_unlock(&pgcache_hash_lock);
-
-	return NULL;
+	spin_unlock(&file->tree_lock);
 }
 
-int drop_pgcache(void)
+/* Free all cachelines of @file, caller must flush dirty ones first */
+void drop_lego_pgcache_structs(struct lego_pgcache_file *file)
 {
-	int bkt;
 	struct lego_pgcache_struct *pgc;
-	struct hlist_node *tmp;
+	struct radix_tree_iter iter;
+	void **slot;
+
+	spin_lock(&file->tree_lock);
+	for (;;) {
+		/* Deletion may free tree nodes, restart from scratch */
+		pgc = NULL;
+		radix_tree_for_each_slot(slot, &file->tree, &iter, 0) {
+			pgc = *slot;
+			break;
+		}
+		if (!pgc)
+			break;
+
+		radix_tree_delete(&file->tree, pgcache_index(pgc->pos));
 
-	spin_lock(&pgcache_hash_lock);
-	pr_info("lookups = %u, walks = %u\n", lookups, walks);
-	hash_for_each_safe(pgcache_hash, bkt, tmp, pgc, link) {
-		hash_del(&pgc->link);
+		/* Dirtied again after the flush, do not leave it listed */
+		spin_lock(&pgc->lock);
+		spin_lock(&file->dirtylist_lock);
+		if (pgc->dirty) {
+			pgc->dirty = false;
+			list_del_init(&pgc->dirtylist);
+		}
+		spin_unlock(&file->dirtylist_lock);
+		spin_unlock(&pgc->lock);
 
 		/*
 		 * free lines one by one
 		 */
 		__free_pgcache_struct(pgc);
 	}
-	lookups = 0;
-	walks = 0;
-	spin_unlock(&pgcache_hash_lock);
-
-	if (likely(hash_empty(pgcache_hash))) {
-		pr_info("Successfully drop lego pgcache.\n");
-	} else {
-		pr_warn("Lego pgcache is not dropped entirely");
-	}
+	spin_unlock(&file->tree_lock);
+}
+
+/*
+ * Everyone who uses lines of @file holds drop_sem for read, wait for them
+ * before freeing. LIRS history is cleared under the same write lock, so
+ * no per-cpu batch is left pointing at freed lines.
+ */
+static void drop_pgcache_file(struct lego_pgcache_file *file)
+{
+	down_write(&file->drop_sem);
+	pgcache_flush_file(file);
+	pgcache_lirs_forget_file(file);
+	drop_lego_pgcache_structs(file);
+	up_write(&file->drop_sem);
+}
+
+int drop_pgcache(void)
+{
+	pgcache_for_each_file(drop_pgcache_file);
+
+	pr_info("Successfully drop lego pgcache.\n");
 	return 0;
 }
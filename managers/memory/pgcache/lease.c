@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2016-2018 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Leases to processor file caches
+ *
+ * A processor may serve reads of a file from its own cache for
+ * PGCACHE_LEASE_MSEC after it was granted a lease. A change to the file
+ * (write, rename) can only start once all leases of other nodes have
+ * expired. No lease is granted while it runs, and the version is bumped
+ * once done. The next lease tells holders to drop what they have cached.
+ *
+ * Thpool workers never wait for leases. If some are still out, the
+ * change is refused with -EAGAIN, and no new lease is granted until a
+ * bit after the old ones expire. The requester sends it again, and finds
+ * the file free by then.
+ *
+ * The writer's own node is not waited for: it drops its cache around
+ * the write. So a node that both reads and writes a file it alone
+ * holds leases on does not pay for the lease.
+ *
+ * Truncate and unlink go to storage directly. The processor breaks
+ * leases afterwards, which waits for all of them, the requester's too.
+ */
+
+#include <lego/jiffies.h>
+#include <lego/kernel.h>
+#include <lego/spinlock.h>
+#include <lego/comp_memory.h>
+#include <memory/pgcache.h>
+
+static atomic64_t pgcache_file_ids = ATOMIC64_INIT(0);
+
+void pgcache_lease_file_init(struct lego_pgcache_file *file)
+{
+	file->file_id = atomic64_inc_return(&pgcache_file_ids);
+	spin_lock_init(&file->lease_lock);
+	file->version = 0;
+	file->lease_expire = jiffies;
+	file->lease_nid = -1;
+	file->lease_hold = jiffies;
+	file->nr_lease_writers = 0;
+}
+
+static inline bool lease_out_locked(struct lego_pgcache_file *file)
+{
+	return time_before_eq(jiffies, file->lease_expire);
+}
+
+/*
+ * Leases are out, grant none until they expire. Plus one more lease
+ * length, so the requester that is told to come back is not starved
+ * by readers renewing them.
+ */
+static inline void lease_hold_locked(struct lego_pgcache_file *file)
+{
+	file->lease_hold = file->lease_expire +
+			   msecs_to_jiffies(PGCACHE_LEASE_MSEC);
+}
+
+/**
+ * pgcache_lease_grant
+ * @file: the file
+ * @nid: processor asking for the lease
+ * @version: filled with the current version of @file
+ *
+ * Return the length of the lease in ms,
+ * or 0 if a change is on its way and no lease is granted.
+ */
+u32 pgcache_lease_grant(struct lego_pgcache_file *file, unsigned int nid,
+			u32 *version)
+{
+	unsigned long expire;
+	u32 msec = 0;
+
+	spin_lock(&file->lease_lock);
+	*version = file->version;
+	if (likely(!file->nr_lease_writers &&
+		   time_after(jiffies, file->lease_hold))) {
+		/* One more tick, the processor counts from before it asked */
+		expire = jiffies + msecs_to_jiffies(PGCACHE_LEASE_MSEC) + 1;
+
+		if (time_after(jiffies, file->lease_expire))
+			file->lease_nid = nid;
+		else if (file->lease_nid != nid)
+			file->lease_nid = -1;
+
+		if (time_after(expire, file->lease_expire))
+			file->lease_expire = expire;
+		msec = PGCACHE_LEASE_MSEC;
+	}
+	spin_unlock(&file->lease_lock);
+
+	return msec;
+}
+
+/**
+ * pgcache_lease_write_begin
+ * @file: the file
+ * @nid: processor that is about to change @file
+ *
+ * Return 0 if no other node can serve @file from its cache, and none
+ * will until pgcache_lease_write_end(). Return -EAGAIN if leases are
+ * still out, the change should be sent again later.
+ */
+int pgcache_lease_write_begin(struct lego_pgcache_file *file, unsigned int nid)
+{
+	int ret = 0;
+
+	spin_lock(&file->lease_lock);
+	if (file->lease_nid != nid && lease_out_locked(file)) {
+		lease_hold_locked(file);
+		ret = -EAGAIN;
+	} else
+		file->nr_lease_writers++;
+	spin_unlock(&file->lease_lock);
+
+	return ret;
+}
+
+void pgcache_lease_write_end(struct lego_pgcache_file *file)
+{
+	spin_lock(&file->lease_lock);
+	file->version++;
+	file->nr_lease_writers--;
+	spin_unlock(&file->lease_lock);
+}
+
+/**
+ * pgcache_lease_break
+ * @file: the file
+ *
+ * @file was changed behind memory's back. Once no lease is out,
+ * bump the version, so holders drop their caches when they renew.
+ * Return 0 on success, -EAGAIN if leases are still out.
+ */
+int pgcache_lease_break(struct lego_pgcache_file *file)
+{
+	int ret = 0;
+
+	spin_lock(&file->lease_lock);
+	if (lease_out_locked(file)) {
+		lease_hold_locked(file);
+		ret = -EAGAIN;
+	} else
+		file->version++;
+	spin_unlock(&file->lease_lock);
+
+	return ret;
+}
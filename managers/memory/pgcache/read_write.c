@@ -20,90 +20,87 @@
 
 #include <memory/pgcache.h>
 
-ssize_t pgcache_load(char *f_name, struct lego_pgcache_struct *pgc)
+/*
+ * Read @count bytes at @pos of @file from storage. @retbuf must have room
+ * for the leading retval, the content follows it. Return nr of bytes read.
+ */
+ssize_t pgcache_read_storage(struct lego_pgcache_file *file,
+		loff_t pos, u32 count, void *retbuf)
 {
-	u32 len_msg, len_ret, *opcode;
-	void *msg, *retbuf, *content;
-	ssize_t retval, *retval_ptr;
-	struct m2s_read_write_payload *payload;
-	u32 count = 0;
+	void *msg;
+	ssize_t retval;
+	u32 hdr_len;
 
-	len_msg = sizeof(*opcode) + sizeof(*payload);
-	msg = kmalloc(len_msg, GFP_KERNEL);
+	msg = kmalloc(M2S_RW_HDR_MAX, GFP_KERNEL);
 	if (!msg)
 		return -ENOMEM;
 
+	hdr_len = m2s_rw_header(msg, false, file->filepath, &file->storage_token,
+				count, pos);
+	retval = m2s_rw_send(file->storage_node, msg, hdr_len, 0, retbuf,
+			     sizeof(retval) + count, file->filepath,
+			     &file->storage_token);
+
+	BUG_ON(retval > count);
+
+	kfree(msg);
+	return retval;
+}
+
+ssize_t pgcache_load(struct lego_pgcache_struct *pgc)
+{
+	u32 len_ret;
+	void *retbuf, *content;
+	ssize_t retval;
+	u32 count = 0;
+
 	/* retbuf = retval + content */
 	count = CL_SIZE;
 	len_ret = sizeof(retval) + count;
 	retbuf = kmalloc(len_ret, GFP_KERNEL);
-	if(!retbuf) {
-		kfree(msg);
+	if(!retbuf)
 		return -ENOMEM;
-	}
 
 	pgcache_debug("pages:%p, offset:%Lx, count:%u, f_name: %s",					\
-				pgc->cached_pages, pgc->pos, count, f_name);
-
-	opcode = msg;
-	*opcode = M2S_READ;
-
-	payload = msg + sizeof(*opcode);
-	payload->uid = 0;		/* legacy, unused */
-	payload->flags = O_RDONLY;
-	payload->len = count;
-	payload->offset = pgc->pos;
-	strcpy(payload->filename, f_name);
+				pgc->cached_pages, pgc->pos, count, pgc->filepath);
 
-	ibapi_send_reply_imm(pgc->storage_node, msg, len_msg, retbuf, len_ret, false);
-	/* The first 8 bytes are the nr of bytes been read */
-	retval_ptr = retbuf;
-	retval = *retval_ptr;
-
-	BUG_ON(retval > count);
+	retval = pgcache_read_storage(pgc->file, pgc->pos, count, retbuf);
+	if (unlikely(retval < 0))
+		goto out;
 
 	/* The left is the content itself */
-	content = retbuf + sizeof(*retval_ptr);
+	content = retbuf + sizeof(retval);
 
 	spin_lock(&pgc->lock);
 	memcpy(pgc->cached_pages, content, retval);
 	pgc->real_len = retval;
 	spin_unlock(&pgc->lock);
 
-	kfree(msg);
+out:
 	kfree(retbuf);
-
 	return retval;
 }
 
 ssize_t flush_one_cacheline_locked(struct lego_pgcache_struct *pgc)
 {
-	u32 len_msg, *opcode;
-	void *msg, *content;
+	struct lego_pgcache_file *file = pgc->file;
+	void *msg;
 	ssize_t retval;
-	struct m2s_read_write_payload *payload;
+	u32 hdr_len;
 
-	len_msg = sizeof(*opcode) + sizeof(*payload) + pgc->real_len;
-	msg = kmalloc(len_msg, GFP_KERNEL);
+	msg = kmalloc(M2S_RW_HDR_MAX + pgc->real_len, GFP_KERNEL);
 	if (!msg)
 		return -ENOMEM;
 
-	opcode = msg;
-	*opcode = M2S_WRITE;
-
-	payload = msg + sizeof(*opcode);
-	payload->uid = 0;
-	payload->flags = O_WRONLY;
-	payload->len = pgc->real_len;
-	payload->offset = pgc->pos;
-	strcpy(payload->filename, pgc->filepath);
-
-	content = msg + sizeof(*opcode) + sizeof(*payload);
+	hdr_len = m2s_rw_header(msg, true, pgc->filepath, &file->storage_token,
+				pgc->real_len, pgc->pos);
 
 	/* COPY content of page cache to payload */
-	memcpy(content, pgc->cached_pages, payload->len);
+	memcpy(msg + hdr_len, pgc->cached_pages, pgc->real_len);
 
-	ibapi_send_reply_imm(pgc->storage_node, msg, len_msg, &retval, sizeof(retval), false);
+	retval = m2s_rw_send(pgc->storage_node, msg, hdr_len, pgc->real_len,
+			     &retval, sizeof(retval), pgc->filepath,
+			     &file->storage_token);
 
 	kfree(msg);
 	return retval;
@@ -128,137 +125,135 @@ static unsigned int __nr_cachelines(loff_t pos, size_t count)
 	return nr_cachelines;
 }
 
-/* prepare one cacheline
- * return pgc
+/*
+ * Insert a newly allocated @pgc. If someone else inserted
+ * the same cacheline in the meantime, drop ours and use theirs.
  */
-static struct lego_pgcache_struct *
-prepare_cacheline(struct lego_pgcache_file *file, loff_t pos, ssize_t *retval)
+struct lego_pgcache_struct *
+install_cacheline(struct lego_pgcache_struct *pgc)
 {
-	struct lego_pgcache_struct *pgc;
-	char *f_name = file->filepath;
+	struct lego_pgcache_struct *p;
 
-	pgc = find_lego_pgcache_struct(f_name, pos);
-	if (!pgc) {
-		pgc = __alloc_pgcache(f_name, pos, file->storage_node);
-		if (unlikely(!pgc))
-			return NULL;
+	p = insert_lego_pgcache_struct(pgc);
+	if (likely(p == pgc))
+		return pgc;
 
-		pgcache_debug("alloc cachedline: %p", pgc->cached_pages);
+	__free_pgcache_struct(pgc);
+	if (unlikely(IS_ERR(p)))
+		return NULL;
+	return p;
+}
 
-		*retval = pgcache_load(f_name, pgc);
-		ht_insert_lego_pgcache_struct(pgc);
-		return pgc;
-	}
+/*
+ * @pgc was evicted, give it pages again. They are loaded from storage
+ * first unless @load is false, and published under pgc->lock. If someone
+ * else reloaded it meanwhile, ours are freed.
+ */
+static ssize_t reload_cacheline(struct lego_pgcache_struct *pgc, bool load)
+{
+	void *pages, *retbuf = NULL;
+	ssize_t retval = CL_SIZE;
 
-	/* no-residental HIR pages */
-	if (!pgc->cached_pages) {
-		pgc->cached_pages = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,	\
-			PGCACHE_PREFETCH_ORDER);
-		*retval = pgcache_load(f_name, pgc);
+	pages = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+					 PGCACHE_PREFETCH_ORDER);
+	if (unlikely(!pages))
+		return -ENOMEM;
+
+	if (load) {
+		retbuf = kmalloc(sizeof(retval) + CL_SIZE, GFP_KERNEL);
+		if (unlikely(!retbuf)) {
+			retval = -ENOMEM;
+			goto out;
+		}
+
+		retval = pgcache_read_storage(pgc->file, pgc->pos, CL_SIZE, retbuf);
+		if (unlikely(retval < 0))
+			goto out;
+		memcpy(pages, retbuf + sizeof(retval), retval);
 	}
 
-	pgcache_debug("f_name: %s, cacheline:%p", f_name, pgc->cached_pages);
+	spin_lock(&pgc->lock);
+	if (likely(!pgc->cached_pages)) {
+		pgc->cached_pages = pages;
+		pgc->real_len = load ? retval : 0;
+		pages = NULL;
+	}
+	spin_unlock(&pgc->lock);
 
-	return pgc;
+out:
+	if (pages)
+		free_pages((unsigned long)pages, PGCACHE_PREFETCH_ORDER);
+	kfree(retbuf);
+	return retval;
 }
 
 /*
- * paper one cacheline without loading
- * allow to do so if pos is cacheline aligned, and size = cacheline_size
+ * Find or load the cacheline of @pos. If @load is false, the caller is
+ * going to overwrite the whole line, a new one is not read from storage.
+ *
+ * Eviction may free its pages again as soon as we return. Callers must
+ * check cached_pages under pgc->lock, and come back here if it is gone.
  */
 static struct lego_pgcache_struct *
-prepare_cacheline_fast(struct lego_pgcache_file *file, loff_t pos, ssize_t *retval)
+prepare_cacheline(struct lego_pgcache_file *file, loff_t pos, bool load)
 {
 	struct lego_pgcache_struct *pgc;
-	char *f_name = file->filepath;
 
-	printk_once("%s()\n", __func__);
-	pgc = find_lego_pgcache_struct(f_name, pos);
+	pgc = find_lego_pgcache_struct(file, pos);
 	if (!pgc) {
-		pgc = __alloc_pgcache(f_name, pos, file->storage_node);
-		if (unlikely(!pgc))
+		pgc = __alloc_pgcache(file, pos);
+		if (unlikely(IS_ERR(pgc)))
 			return NULL;
 
-		pgcache_debug("alloc cachedline fast: %p", pgc->cached_pages);
+		pgcache_debug("alloc cachedline: %p", pgc->cached_pages);
 
-		*retval = CL_SIZE;
-		ht_insert_lego_pgcache_struct(pgc);
-		return pgc;
+		if (load)
+			pgcache_load(pgc);
+		return install_cacheline(pgc);
 	}
 
 	/* no-residental HIR pages */
-	if (!pgc->cached_pages) {
-		pgc->cached_pages = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,	\
-			PGCACHE_PREFETCH_ORDER);
-		*retval = CL_SIZE;
+	if (!READ_ONCE(pgc->cached_pages)) {
+		if (unlikely(reload_cacheline(pgc, load) < 0))
+			return NULL;
 	}
 
-	pgcache_debug("f_name: %s, cacheline:%p", f_name, pgc->cached_pages);
+	pgcache_debug("f_name: %s, cacheline:%p", file->filepath, pgc->cached_pages);
 
 	return pgc;
 }
 
-/* prepare for 2 cachelines, that write/read across cacheline boundaries */
-static int prepare_two_cachelines(struct lego_pgcache_file *file, loff_t pos, ssize_t *retval,
-		struct lego_pgcache_struct **pgc1, struct lego_pgcache_struct **pgc2)
-{
-	char *f_name = file->filepath;
-
-	*pgc1 = find_lego_pgcache_struct(f_name, pos);
-	if (!(*pgc1)) {
-		*pgc1 = __alloc_pgcache(f_name, pos, file->storage_node);
-		if (unlikely(!(*pgc1)))
-			return -ENOMEM;
-
-		*retval = pgcache_load(f_name, *pgc1);
-		ht_insert_lego_pgcache_struct(*pgc1);
-	}
-
-	*pgc2 = find_lego_pgcache_struct(f_name, pos);
-	if (!(*pgc2)) {
-		*pgc2 = __alloc_pgcache(f_name, pos, file->storage_node);
-		if (unlikely(!(*pgc2)))
-			return -ENOMEM;
-
-		*retval = pgcache_load(f_name, *pgc2);
-		ht_insert_lego_pgcache_struct(*pgc2);
-	}
-
-	return 0;
-}
-
 ssize_t __read_from_one_cacheline(struct lego_task_struct *tsk,
 	struct lego_pgcache_file *file, char __user *buf, size_t count, loff_t *pos)
 {
 	struct lego_pgcache_struct *pgc;
 	loff_t ckoff;
-	ssize_t retval;
 	size_t len = count;
 	char *f_name = file->filepath;
 
-	pgc = prepare_cacheline(file, *pos, &retval);
 	ckoff = chunk_offset(*pos);
-
-	/* read count cannot be satified */
-	if (unlikely(ckoff + count > pgc->real_len))
-		len = pgc->real_len - ckoff;
+retry:
+	pgc = prepare_cacheline(file, *pos, true);
 
 	/* NOMEM for caching */
 	if (unlikely(!pgc))
-		return __storage_read(tsk, f_name, buf, count, pos);
-
+		return __storage_read(tsk, f_name, &file->storage_token, buf, count, pos);
 
-	pgcache_debug("pgcache vaddr: %p, content: [%s]", pgc->cached_pages + ckoff,
-			(char *) pgc->cached_pages + ckoff);
+	/* Eviction frees cached_pages under pgc->lock */
+	spin_lock(&pgc->lock);
+	if (unlikely(!pgc->cached_pages)) {
+		spin_unlock(&pgc->lock);
+		goto retry;
+	}
 
+	/* read count cannot be satified */
+	if (unlikely(ckoff >= pgc->real_len))
+		len = 0;
+	else if (unlikely(ckoff + count > pgc->real_len))
+		len = pgc->real_len - ckoff;
 
-	/*
-	 * comment: currently reader does not grab lock, since in memory component
-	 * all read/write are handled by one thread, and actually there is no race condition
-	 * on concurrent read/write, if we decided one-thread model, later all page cache locks
-	 * can be removed
-	 */
 	memcpy(buf, pgc->cached_pages + ckoff, len);
+	spin_unlock(&pgc->lock);
 
 	update_lirs_structure(pgc);
 
@@ -271,96 +266,55 @@ ssize_t __read_from_one_cacheline(struct lego_task_struct *tsk,
 ssize_t __read_from_two_cachelines(struct lego_task_struct *tsk,
 	struct lego_pgcache_file *file, char __user *buf, size_t count, loff_t *pos)
 {
-	/* Not userful at this time */
-	struct lego_pgcache_struct *pgc1, *pgc2;
-	ssize_t retval;
-	int ret;
-	loff_t ckoff_1;
-	size_t len_1, len_2, cl_size;
-	char *f_name = file->filepath;
-
-	ret = prepare_two_cachelines(file, *pos, &retval, &pgc1, &pgc2);
-
-	pgcache_debug("pgc1:%p, pgc2:%p, cacheline1:%p, cacheline2:%p",		\
-			pgc1, pgc2, pgc1->cached_pages, pgc2->cached_pages);
-
-	/* NOMEM for allocating cachelines */
-	if(unlikely(!ret)) {
-		return __storage_read(tsk, f_name, buf, count, pos);
-	}
-
-	BUG_ON(!pgc1 || !pgc2 || !pgc1->cached_pages || !pgc2->cached_pages);
-
-	/* read from cacheline 1 */
-	ckoff_1 = chunk_offset(*pos);
-	cl_size = CL_SIZE;
-	len_1 = cl_size - ckoff_1;
+	loff_t pos_2;
+	size_t len_1;
+	ssize_t ret_1, ret_2;
 
+	len_1 = CL_SIZE - chunk_offset(*pos);
 	BUG_ON(len_1 >= count);
 
-	memcpy(buf, pgc1->cached_pages + ckoff_1, len_1);
-	update_lirs_structure(pgc1);
+	ret_1 = __read_from_one_cacheline(tsk, file, buf, len_1, pos);
+	if (ret_1 < (ssize_t)len_1)
+		return ret_1;
 
-	/* read from cacheline 2 */
-	len_2 = count - len_1;
-	memcpy(buf + len_1, pgc2->cached_pages, len_2);
-	update_lirs_structure(pgc2);
-
-	/* marshalling return value */
-	if (pgc1->real_len < cl_size) {
-		if (likely(pgc2->real_len == 0)) {
-			retval = pgc1->real_len - ckoff_1;
-			goto out;
-		}
-	} else {
-		retval = len_1;
-		if (likely(pgc2->real_len > len_2)) {
-			retval += len_2;
-			goto out;
-		}
-		retval += pgc2->real_len;
-	}
-
-out:
-	return retval;
+	pos_2 = *pos + len_1;
+	ret_2 = __read_from_one_cacheline(tsk, file, buf + len_1,
+					  count - len_1, &pos_2);
+	if (ret_2 < 0)
+		return ret_1;
+	return ret_1 + ret_2;
 }
 
 /*
  * lego_pgcache_read: load from storage side, perform pgcache read
  * caller: handle_p2m_read
  * @tsk: legacy, not useful, handle_p2m_read pass NULL
- * @f_name: full pathname of targetted file
- * @storage_node: hosted storage homenode
+ * @file: the file, opened by P2M_OPEN
  * @buf: actually is from kernel space, is part of IB reply buffer
  * @pos: offset within the file
  * return value: read size.
  */
-ssize_t lego_pgcache_read(struct lego_task_struct *tsk, char *f_name,
-		unsigned int storage_node, char __user *buf, size_t count, loff_t *pos)
+ssize_t lego_pgcache_read(struct lego_task_struct *tsk, struct lego_pgcache_file *file,
+		char __user *buf, size_t count, loff_t *pos)
 {
 	unsigned int nr_cachelines;
-	struct lego_pgcache_file *file;
+	ssize_t ret;
 
 	nr_cachelines = __nr_cachelines(*pos, count);
 
 	BUG_ON(nr_cachelines > 2);
 
-	file = find_lego_pgcache_file(f_name);
-	if (!file) {
-		file = lego_pgcache_file_open(f_name, storage_node);
-		/* NO memory for allocating file struct and page cache */
-		if (unlikely(IS_ERR(file))) {
-			return -ENOMEM;
-		}
-		ht_insert_lego_pgcache_file(file);
-	}
+	pgcache_readahead(file, *pos, count);
 
-	if (likely(nr_cachelines == 1)) {
-		return __read_from_one_cacheline(tsk, file, buf, count, pos);
-	}
+	/* Keep drop_pgcache() from freeing lines under us */
+	down_read(&file->drop_sem);
+	if (likely(nr_cachelines == 1))
+		ret = __read_from_one_cacheline(tsk, file, buf, count, pos);
+	else
+		ret = __read_from_two_cachelines(tsk, file, buf, count, pos);
+	up_read(&file->drop_sem);
 
-	/* two cachelines case */
-	return __read_from_two_cachelines(tsk, file, buf, count, pos);
+	return ret;
 }
 
 /* Write operations */
@@ -370,33 +324,40 @@ ssize_t __write_to_one_cacheline(struct lego_task_struct *tsk,
 {
 	struct lego_pgcache_struct *pgc;
 	loff_t ckoff;
-	ssize_t retval;
+	bool load;
 	char *f_name = file->filepath;
 
-	if (likely((*pos) % CL_SIZE == 0 && count == CL_SIZE))
-		pgc = prepare_cacheline_fast(file, *pos, &retval);
-	else
-		pgc = prepare_cacheline(file, *pos, &retval);
+	/* Overwrite the whole line, no need to load it */
+	load = !((*pos) % CL_SIZE == 0 && count == CL_SIZE);
 	ckoff = chunk_offset(*pos);
+retry:
+	pgc = prepare_cacheline(file, *pos, load);
 
 	/* NOMEM for caching */
 	if (unlikely(!pgc))
-		return __storage_write(tsk, f_name, buf, count, pos);
+		return __storage_write(tsk, f_name, &file->storage_token, buf, count, pos);
 
+	/*
+	 * Eviction frees cached_pages under pgc->lock, and only flushes
+	 * lines that are dirty by then. Mark it dirty before unlock.
+	 */
 	spin_lock(&pgc->lock);
+	if (unlikely(!pgc->cached_pages)) {
+		spin_unlock(&pgc->lock);
+		goto retry;
+	}
+
 	memcpy(pgc->cached_pages + ckoff, buf, count);
 
 	/* Extend current real_len */
 	if (ckoff + count > pgc->real_len) {
 		pgc->real_len = ckoff + count;
 	}
-	spin_unlock(&pgc->lock);
-
-	pgcache_debug("pgcache vaddr: %p, content: [%s]", pgc->cached_pages + ckoff,
-			(char *) pgc->cached_pages + ckoff);
 
 	/* add to dirty list */
-	mark_lego_pgcache_dirty(pgc, file);
+	mark_lego_pgcache_dirty_locked(pgc, file);
+	spin_unlock(&pgc->lock);
+
 	update_lirs_structure(pgc);
 
 	/* update file size */
@@ -412,105 +373,52 @@ ssize_t __write_to_one_cacheline(struct lego_task_struct *tsk,
 ssize_t __write_to_two_cachelines(struct lego_task_struct *tsk,
 	struct lego_pgcache_file *file, char __user *buf, size_t count, loff_t *pos)
 {
-	struct lego_pgcache_struct *pgc1, *pgc2;
-	ssize_t retval;
-	int ret;
-	loff_t ckoff_1;
-	size_t len_1, len_2, cl_size;
-	char *f_name = file->filepath;
-
-	ret = prepare_two_cachelines(file, *pos, &retval, &pgc1, &pgc2);
-
-	pgcache_debug("pgc1:%p, pgc2:%p, cacheline1:%p, cacheline2:%p",		\
-			pgc1, pgc2, pgc1->cached_pages, pgc2->cached_pages);
-
-	/* NOMEM for allocating cachelines */
-	if(unlikely(!ret)) {
-		return __storage_write(tsk, f_name, buf, count, pos);
-	}
-
-	BUG_ON(!pgc1 || !pgc2 || !pgc1->cached_pages || !pgc2->cached_pages);
-
-	/* write to cacheline 1 */
-	ckoff_1 = chunk_offset(*pos);
-	cl_size = CL_SIZE;
-	len_1 = cl_size - ckoff_1;
+	loff_t pos_2;
+	size_t len_1;
+	ssize_t ret_1, ret_2;
 
+	len_1 = CL_SIZE - chunk_offset(*pos);
 	BUG_ON(len_1 >= count);
 
-	spin_lock(&pgc1->lock);
-	memcpy(pgc1->cached_pages + ckoff_1, buf, len_1);
-
-	/* extending pgc1 length to cl_size */
-	if (pgc1->real_len < cl_size) {
-		pgc1->real_len = cl_size;
-	}
-	spin_unlock(&pgc1->lock);
-
-	mark_lego_pgcache_dirty(pgc1, file);
-	update_lirs_structure(pgc1);
-
+	ret_1 = __write_to_one_cacheline(tsk, file, buf, len_1, pos);
+	if (ret_1 < (ssize_t)len_1)
+		return ret_1;
 
-	/* read from cacheline 2 */
-	len_2 = count - len_1;
-
-	spin_lock(&pgc2->lock);
-	memcpy(pgc2->cached_pages, buf + len_1, len_2);
-
-	/* extending pgc2 length to len_2 */
-	if (pgc2->real_len < len_2) {
-		pgc1->real_len = len_2;
-	}
-	spin_unlock(&pgc2->lock);
-
-	mark_lego_pgcache_dirty(pgc2, file);
-	update_lirs_structure(pgc2);
-
-	/* update file size */
-	spin_lock(&file->dirtylist_lock);
-	if (count + (*pos) > file->f_size) {
-		file->f_size = count + (*pos);
-	}
-	spin_unlock(&file->dirtylist_lock);
-
-	return count;
+	pos_2 = *pos + len_1;
+	ret_2 = __write_to_one_cacheline(tsk, file, buf + len_1,
+					 count - len_1, &pos_2);
+	if (ret_2 < 0)
+		return ret_1;
+	return ret_1 + ret_2;
 }
 
 /*
  * lego_pgcache_write: load from storage side, perform pgcache write
  * caller: handle_p2m_write
  * @tsk: legacy, not useful, handle_p2m_write pass NULL
- * @f_name: full pathname of targetted file
- * @storage_node: hosted storage homenode
+ * @file: the file, opened by P2M_OPEN
  * @buf: actually is from kernel space, is part of IB receive buffer
  * @pos: offset within the file
  * return value: write size.
  */
-ssize_t lego_pgcache_write(struct lego_task_struct *tsk, char *f_name,
-		unsigned int storage_node, char __user *buf, size_t count, loff_t *pos)
+ssize_t lego_pgcache_write(struct lego_task_struct *tsk, struct lego_pgcache_file *file,
+		char __user *buf, size_t count, loff_t *pos)
 {
 	unsigned int nr_cachelines;
-	struct lego_pgcache_file *file;
+	ssize_t ret;
 
 	printk_once("cl_size = %lu\n", CL_SIZE);
 	nr_cachelines = __nr_cachelines(*pos, count);
 
 	BUG_ON(nr_cachelines > 2);
 
-	file = find_lego_pgcache_file(f_name);
-	if (!file) {
-		file = lego_pgcache_file_open(f_name, storage_node);
-		/* NO memory for allocating file struct and page cache */
-		if (unlikely(IS_ERR(file))) {
-			return -ENOMEM;
-		}
-		ht_insert_lego_pgcache_file(file);
-	}
-
-	if (likely(nr_cachelines == 1)) {
-		return __write_to_one_cacheline(tsk, file, buf, count, pos);
-	}
+	/* Keep drop_pgcache() from freeing lines under us */
+	down_read(&file->drop_sem);
+	if (likely(nr_cachelines == 1))
+		ret = __write_to_one_cacheline(tsk, file, buf, count, pos);
+	else
+		ret = __write_to_two_cachelines(tsk, file, buf, count, pos);
+	up_read(&file->drop_sem);
 
-	/* two cachelines case */
-	return __write_to_two_cachelines(tsk, file, buf, count, pos);
+	return ret;
 }
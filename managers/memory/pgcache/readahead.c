@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2016-2018 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * pgcache read ahead
+ *
+ * Each file tracks the last line it was read from. Moving to the next
+ * line is a sequential access: a window of lines that follow is queued
+ * to kpgcache_rad, which loads them with large M2S_READs. The window
+ * starts at PGCACHE_RA_MIN_LINES and doubles every time the reader
+ * walks into a line that was read ahead. A new window is queued once
+ * the reader has consumed half of the current one.
+ */
+
+#include <lego/slab.h>
+#include <lego/kernel.h>
+#include <lego/kthread.h>
+#include <lego/spinlock.h>
+#include <lego/comp_memory.h>
+#include <memory/stat.h>
+#include <memory/pgcache.h>
+
+#define PGCACHE_RA_MIN_LINES	2
+#define PGCACHE_RA_MAX_LINES	CONFIG_MEM_PAGE_CACHE_READAHEAD_MAX_LINES
+
+/* Lines loaded per M2S_READ, storage limits one read to 2MB */
+#define PGCACHE_RA_BATCH_LINES	4
+
+struct pgcache_ra_job {
+	struct lego_pgcache_file	*file;
+	unsigned long			start;
+	unsigned int			nr_lines;
+	struct list_head		list;
+};
+
+static DEFINE_SPINLOCK(ra_queue_lock);
+static LIST_HEAD(ra_queue);
+static atomic_t nr_ra_jobs = ATOMIC_INIT(0);
+
+static struct task_struct *ra_task;
+
+/* Reply buffer, only used by read ahead daemon */
+static void *ra_retbuf;
+
+void pgcache_readahead_file_init(struct lego_pgcache_file *file)
+{
+	spin_lock_init(&file->ra_lock);
+	file->ra_last = ULONG_MAX;
+	file->ra_next = 0;
+	file->ra_window = 0;
+}
+
+static void submit_readahead(struct lego_pgcache_file *file,
+			     unsigned long start, unsigned int nr_lines)
+{
+	struct pgcache_ra_job *job;
+
+	job = kmalloc(sizeof(*job), GFP_KERNEL);
+	if (unlikely(!job))
+		return;
+
+	job->file = file;
+	job->start = start;
+	job->nr_lines = nr_lines;
+
+	spin_lock(&ra_queue_lock);
+	list_add_tail(&job->list, &ra_queue);
+	atomic_inc(&nr_ra_jobs);
+	spin_unlock(&ra_queue_lock);
+
+	wake_up_process(ra_task);
+}
+
+/**
+ * pgcache_readahead
+ * @file: the file being read
+ * @pos: start of this read
+ * @count: length of this read
+ *
+ * Called before each read is served. Update the sequential detector
+ * of @file, and queue a read ahead window if needed.
+ */
+void pgcache_readahead(struct lego_pgcache_file *file, loff_t pos, size_t count)
+{
+	unsigned long first, last, end, eof;
+	size_t f_size;
+	unsigned int nr = 0;
+
+	if (unlikely(!count))
+		return;
+
+	first = (unsigned long)pos >> CL_SHIFT;
+	last = (unsigned long)(pos + count - 1) >> CL_SHIFT;
+
+	f_size = file_size_read(file);
+	if (!f_size)
+		return;
+	eof = (f_size - 1) >> CL_SHIFT;
+
+	spin_lock(&file->ra_lock);
+
+	/* Still within the same line, nothing to do */
+	if (first == file->ra_last && last == file->ra_last)
+		goto unlock;
+
+	if (first != file->ra_last && first != file->ra_last + 1) {
+		/* Random access, start over */
+		file->ra_window = 0;
+		file->ra_next = 0;
+		goto out;
+	}
+
+	if (!file->ra_window) {
+		file->ra_window = PGCACHE_RA_MIN_LINES;
+	} else if (last < file->ra_next) {
+		/* Walked into read ahead lines, grow */
+		file->ra_window = min(file->ra_window * 2,
+				      (unsigned int)PGCACHE_RA_MAX_LINES);
+	}
+
+	if (file->ra_next <= last)
+		file->ra_next = last + 1;
+
+	/* Less than half window left ahead of reader? */
+	if (file->ra_next - (last + 1) > file->ra_window / 2)
+		goto out;
+
+	end = min(last + 1 + file->ra_window, eof + 1);
+	if (end > file->ra_next) {
+		nr = end - file->ra_next;
+		submit_readahead(file, file->ra_next, nr);
+		file->ra_next = end;
+	}
+
+out:
+	file->ra_last = last;
+unlock:
+	spin_unlock(&file->ra_lock);
+}
+
+static inline bool line_cached(struct lego_pgcache_file *file, unsigned long index)
+{
+	return find_lego_pgcache_struct(file, (loff_t)index << CL_SHIFT) != NULL;
+}
+
+/*
+ * Load lines [@start, @start + @nr) with one M2S_READ, and install them.
+ * Lines that are present but not resident (HIR) are left to demand path.
+ */
+static void readahead_lines(struct lego_pgcache_file *file,
+			    unsigned long start, unsigned int nr)
+{
+	struct lego_pgcache_struct *pgc, *p;
+	ssize_t retval, len;
+	void *content;
+	loff_t pos;
+	int i;
+
+	pos = (loff_t)start << CL_SHIFT;
+	retval = pgcache_read_storage(file, pos, nr * CL_SIZE, ra_retbuf);
+	if (unlikely(retval <= 0))
+		return;
+
+	inc_mm_stat(NR_PGCACHE_READAHEAD);
+
+	content = ra_retbuf + sizeof(ssize_t);
+	for (i = 0; i < nr && retval > 0; i++, retval -= CL_SIZE) {
+		/* Someone else may have loaded it meanwhile */
+		if (line_cached(file, start + i))
+			continue;
+
+		pgc = __alloc_pgcache(file, pos + i * CL_SIZE);
+		if (unlikely(IS_ERR(pgc)))
+			break;
+
+		len = min_t(ssize_t, retval, CL_SIZE);
+		memcpy(pgc->cached_pages, content + i * CL_SIZE, len);
+		pgc->real_len = len;
+
+		p = install_cacheline(pgc);
+		if (p == pgc) {
+			update_lirs_structure(pgc);
+			inc_mm_stat(NR_PGCACHE_READAHEAD_LINES);
+		}
+	}
+}
+
+static void do_readahead(struct pgcache_ra_job *job)
+{
+	unsigned long index, start, end;
+	unsigned int nr = 0;
+
+	start = job->start;
+	end = job->start + job->nr_lines;
+
+	/* Installed lines are used afterwards, keep drop away */
+	down_read(&job->file->drop_sem);
+
+	/* Load runs of missing lines, up to PGCACHE_RA_BATCH_LINES each */
+	for (index = start; index < end; index++) {
+		if (line_cached(job->file, index)) {
+			if (nr)
+				readahead_lines(job->file, index - nr, nr);
+			nr = 0;
+			continue;
+		}
+
+		if (++nr == PGCACHE_RA_BATCH_LINES) {
+			readahead_lines(job->file, index + 1 - nr, nr);
+			nr = 0;
+		}
+	}
+	if (nr)
+		readahead_lines(job->file, end - nr, nr);
+
+	up_read(&job->file->drop_sem);
+}
+
+static int pgcache_rad(void *unused)
+{
+	struct pgcache_ra_job *job;
+
+	set_cpus_allowed_ptr(current, cpu_active_mask);
+
+	while (1) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!atomic_read(&nr_ra_jobs))
+			schedule();
+		__set_current_state(TASK_RUNNING);
+
+		spin_lock(&ra_queue_lock);
+		while (!list_empty(&ra_queue)) {
+			job = list_first_entry(&ra_queue, struct pgcache_ra_job, list);
+			list_del(&job->list);
+			atomic_dec(&nr_ra_jobs);
+			spin_unlock(&ra_queue_lock);
+
+			do_readahead(job);
+			kfree(job);
+
+			spin_lock(&ra_queue_lock);
+		}
+		spin_unlock(&ra_queue_lock);
+	}
+	BUG();
+	return 0;
+}
+
+void __init pgcache_readahead_init(void)
+{
+	ra_retbuf = kmalloc(sizeof(ssize_t) + PGCACHE_RA_BATCH_LINES * CL_SIZE,
+			    GFP_KERNEL);
+	if (!ra_retbuf)
+		panic("Fail to allocate pgcache read ahead buffer");
+
+	ra_task = kthread_run(pgcache_rad, NULL, "kpgcache_rad");
+	if (IS_ERR(ra_task))
+		panic("Fail to create kpgcache_rad");
+}
@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2016-2018 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * pgcache write behind
+ *
+ * kpgcache_wbd wakes up every PGCACHE_WB_INTERVAL_MSEC, and writes dirty
+ * lines of each file back to storage. Dirty lines are sorted by offset,
+ * contiguous ones are coalesced into one M2S_WRITE. Thus eviction and
+ * fsync mostly find clean lines, and storage sees large sequential writes.
+ *
+ * A line is cleaned before its content is copied out, writers that come
+ * later mark it dirty again. If the M2S_WRITE fails, the lines we cleaned
+ * are put back to the dirty list. New dirty lines are added at the head,
+ * so the oldest ones are written first, from the tail.
+ */
+
+#include <lego/slab.h>
+#include <lego/timer.h>
+#include <lego/kernel.h>
+#include <lego/kthread.h>
+#include <lego/spinlock.h>
+#include <lego/fit_ibapi.h>
+#include <lego/comp_memory.h>
+#include <lego/comp_storage.h>
+#include <memory/stat.h>
+#include <memory/pgcache.h>
+#include <memory/file_ops.h>
+
+#define PGCACHE_WB_INTERVAL_MSEC	CONFIG_MEM_PAGE_CACHE_WRITE_BEHIND_INTERVAL_MSEC
+
+/* Lines per M2S_WRITE, storage receive buffer is limited */
+#define PGCACHE_WB_BATCH_LINES		4
+
+/* Dirty lines collected from a file per round */
+#define PGCACHE_WB_SCAN_LINES		32
+
+#define PGCACHE_WB_MSG_SIZE					\
+	(M2S_RW_HDR_MAX + PGCACHE_WB_BATCH_LINES * CL_SIZE)
+
+static struct task_struct *wb_task;
+
+/* Message buffer, only used by write behind daemon */
+static void *wb_msg;
+
+static int cmp_pgcache_pos(const void *a, const void *b)
+{
+	const struct lego_pgcache_struct *pa = *(const struct lego_pgcache_struct **)a;
+	const struct lego_pgcache_struct *pb = *(const struct lego_pgcache_struct **)b;
+
+	if (pa->pos < pb->pos)
+		return -1;
+	return pa->pos > pb->pos;
+}
+
+/* Take @pgc off its file's dirty list, caller holds pgc->lock */
+static inline void clear_dirty_locked(struct lego_pgcache_struct *pgc,
+				      struct lego_pgcache_file *file)
+{
+	spin_lock(&file->dirtylist_lock);
+	if (pgc->dirty) {
+		pgc->dirty = false;
+		list_del_init(&pgc->dirtylist);
+	}
+	spin_unlock(&file->dirtylist_lock);
+}
+
+/*
+ * Put lines whose M2S_WRITE failed back to the dirty list, unless they
+ * are dirty again or have been evicted. At the tail, they are the oldest.
+ */
+static void redirty_lines(struct lego_pgcache_file *file,
+			  struct lego_pgcache_struct **pgcs, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		struct lego_pgcache_struct *pgc = pgcs[i];
+
+		spin_lock(&pgc->lock);
+		if (likely(pgc->cached_pages)) {
+			spin_lock(&file->dirtylist_lock);
+			if (!pgc->dirty) {
+				pgc->dirty = true;
+				list_add_tail(&pgc->dirtylist, &file->head);
+			}
+			spin_unlock(&file->dirtylist_lock);
+		}
+		spin_unlock(&pgc->lock);
+	}
+}
+
+/*
+ * Write @nr contiguous lines back with one M2S_WRITE.
+ * All but the last line are full, checked by caller.
+ * Return 0 on success, -errno otherwise.
+ */
+static int writeback_lines(struct lego_pgcache_file *file,
+			   struct lego_pgcache_struct **pgcs, int nr, void *msg)
+{
+	struct lego_file_token token;
+	void *content;
+	size_t len = 0;
+	ssize_t retval;
+	u32 hdr_len;
+	int i;
+
+	/* Both headers below must be of the same length */
+	token = file->storage_token;
+	hdr_len = m2s_rw_header(msg, true, pgcs[0]->filepath, &token,
+				0, pgcs[0]->pos);
+	content = msg + hdr_len;
+
+	for (i = 0; i < nr; i++) {
+		struct lego_pgcache_struct *pgc = pgcs[i];
+
+		/*
+		 * Eviction cleans and frees cached_pages under pgc->lock,
+		 * holding it keeps the pages here while we copy. The pgc
+		 * itself is only freed by drop, caller holds drop_sem.
+		 */
+		spin_lock(&pgc->lock);
+		/* Evicted meanwhile, eviction flushed it */
+		if (unlikely(!pgc->cached_pages)) {
+			spin_unlock(&pgc->lock);
+			break;
+		}
+
+		/*
+		 * Clear before copy, under pgc->lock. Writers that come
+		 * after us will mark it dirty again.
+		 */
+		clear_dirty_locked(pgc, file);
+		memcpy(content + len, pgc->cached_pages, pgc->real_len);
+		len += pgc->real_len;
+		spin_unlock(&pgc->lock);
+
+		/* Line shrank/grew since collected, the rest is not contiguous */
+		if (unlikely(len != (i + 1) * CL_SIZE)) {
+			i++;
+			break;
+		}
+	}
+
+	if (!len)
+		return 0;
+
+	/* Name may change by rename, take the latest one */
+	hdr_len = m2s_rw_header(msg, true, pgcs[0]->filepath, &token,
+				len, pgcs[0]->pos);
+	retval = m2s_rw_send(pgcs[0]->storage_node, msg, hdr_len, len,
+			     &retval, sizeof(retval), pgcs[0]->filepath,
+			     &file->storage_token);
+	if (unlikely(retval != len)) {
+		/* Lines [0, i) were cleaned by us */
+		redirty_lines(file, pgcs, i);
+		return retval < 0 ? retval : -EIO;
+	}
+
+	inc_mm_stat(NR_PGCACHE_WRITEBACK);
+	for (; i > 0; i--)
+		inc_mm_stat(NR_PGCACHE_WRITEBACK_LINES);
+	return 0;
+}
+
+/*
+ * Collect up to @max (at most PGCACHE_WB_SCAN_LINES) of the oldest dirty
+ * lines of @file, and write them back in coalesced batches.
+ * Return number of lines collected, or -errno if any write failed.
+ */
+static int writeback_file_round(struct lego_pgcache_file *file, void *msg,
+				int max)
+{
+	struct lego_pgcache_struct *pgcs[PGCACHE_WB_SCAN_LINES];
+	struct lego_pgcache_struct *pgc;
+	int i, start, ret, nr = 0;
+
+	max = min(max, PGCACHE_WB_SCAN_LINES);
+
+	spin_lock(&file->dirtylist_lock);
+	list_for_each_entry_reverse(pgc, &file->head, dirtylist) {
+		if (nr == max)
+			break;
+		pgcs[nr++] = pgc;
+	}
+	spin_unlock(&file->dirtylist_lock);
+
+	if (!nr)
+		return 0;
+
+	sort(pgcs, nr, sizeof(*pgcs), cmp_pgcache_pos, NULL);
+
+	for (start = 0, i = 1; i <= nr; i++) {
+		/* Extend the run if previous one is full and adjacent */
+		if (i < nr && i - start < PGCACHE_WB_BATCH_LINES &&
+		    pgcs[i - 1]->real_len == CL_SIZE &&
+		    pgcs[i]->pos == pgcs[i - 1]->pos + CL_SIZE)
+			continue;
+
+		ret = writeback_lines(file, pgcs + start, i - start, msg);
+		/* Lines after this run were not touched, still dirty */
+		if (unlikely(ret))
+			return ret;
+		start = i;
+	}
+	return nr;
+}
+
+static int nr_dirty_lines(struct lego_pgcache_file *file)
+{
+	struct list_head *pos;
+	int nr = 0;
+
+	spin_lock(&file->dirtylist_lock);
+	list_for_each(pos, &file->head)
+		nr++;
+	spin_unlock(&file->dirtylist_lock);
+
+	return nr;
+}
+
+/**
+ * pgcache_writeback_file
+ * @file: the file to write back
+ *
+ * Write lines of @file that were dirty when we started back, in coalesced
+ * batches. Lines dirtied meanwhile are left to the next fsync or to write
+ * behind, otherwise a busy writer could keep us here forever.
+ * Used by fsync, return 0 on success, -errno on the first failed write.
+ * Caller holds drop_sem of @file.
+ */
+int pgcache_writeback_file(struct lego_pgcache_file *file)
+{
+	void *msg;
+	int nr, ret = 0;
+
+	msg = kmalloc(PGCACHE_WB_MSG_SIZE, GFP_KERNEL);
+	if (unlikely(!msg))
+		return -ENOMEM;
+
+	nr = nr_dirty_lines(file);
+	while (nr > 0) {
+		ret = writeback_file_round(file, msg, nr);
+		if (ret <= 0)
+			break;
+		nr -= ret;
+	}
+
+	kfree(msg);
+	return ret < 0 ? ret : 0;
+}
+
+static void pgcache_wbd_file(struct lego_pgcache_file *file)
+{
+	/*
+	 * One round per file per wakeup, a file that is being
+	 * written heavily should not starve others. Failed lines
+	 * stay dirty and are retried next time.
+	 *
+	 * Lines collected off the dirty list are used after
+	 * dirtylist_lock is dropped, keep drop away meanwhile.
+	 */
+	down_read(&file->drop_sem);
+	writeback_file_round(file, wb_msg, PGCACHE_WB_SCAN_LINES);
+	up_read(&file->drop_sem);
+}
+
+static int pgcache_wbd(void *unused)
+{
+	set_cpus_allowed_ptr(current, cpu_active_mask);
+
+	while (1) {
+		msleep(PGCACHE_WB_INTERVAL_MSEC);
+		pgcache_for_each_file(pgcache_wbd_file);
+	}
+	BUG();
+	return 0;
+}
+
+void __init pgcache_writeback_init(void)
+{
+	wb_msg = kmalloc(PGCACHE_WB_MSG_SIZE, GFP_KERNEL);
+	if (!wb_msg)
+		panic("Fail to allocate pgcache write behind buffer");
+
+	wb_task = kthread_run(pgcache_wbd, NULL, "kpgcache_wbd");
+	if (IS_ERR(wb_task))
+		panic("Fail to create kpgcache_wbd");
+}
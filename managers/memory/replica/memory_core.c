@@ -344,36 +344,73 @@ static inline int append_replica_log(struct replica_struct *r,
 	return 0;
 }
 
-/* From ibapi_send() */
-void handle_p2m_replica(void *_msg, struct thpool_buffer *tb)
+/*
+ * Append @src_log to the replica_struct it belongs to.
+ * @cache remembers the last replica_struct, logs of a batch
+ * mostly come from the same process.
+ */
+static int handle_replica_log(struct replica_log *src_log,
+			      struct replica_struct **cache)
 {
-	struct p2m_replica_msg *msg;
-	struct replica_log *src_log;
-	struct replica_log_meta *src_meta;
-	struct replica_struct *replica;
+	struct replica_log_meta *src_meta = &src_log->meta;
+	struct replica_struct *replica = *cache;
 	unsigned int pid, vnode_id, nid_processor, nid_memory;
-	int reply = 0;
-
-	msg = _msg;
-	src_log = &msg->log;
-	src_meta = &src_log->meta;
 
 	pid = src_meta->pid;
 	vnode_id = src_meta->vnode_id;
 	nid_memory = src_meta->nid_memory;
 	nid_processor = src_meta->nid_processor;
 
-	replica = find_or_alloc_replica_struct(pid, vnode_id, nid_processor, nid_memory);
-	if (!replica) {
-		reply = -ENOMEM;
-		goto out;
+	if (!replica || !__same_replica(replica, pid, vnode_id)) {
+		replica = find_or_alloc_replica_struct(pid, vnode_id,
+						       nid_processor, nid_memory);
+		if (!replica)
+			return -ENOMEM;
+		*cache = replica;
 	}
 
 	/*
 	 * Append is not guranteed to succeed.
 	 * Our replication is doing the best-effort.
 	 */
-	reply = append_replica_log(replica, src_log);
+	return append_replica_log(replica, src_log);
+}
+
+/* From ibapi_send() */
+void handle_p2m_replica(void *_msg, struct thpool_buffer *tb)
+{
+	struct p2m_replica_msg *msg = _msg;
+	struct replica_struct *replica = NULL;
+	int reply;
+
+	reply = handle_replica_log(&msg->log, &replica);
+
+	*(int *)thpool_buffer_tx(tb) = reply;
+	tb_set_tx_size(tb, sizeof(int));
+}
+
+/*
+ * From P side replication pipeline, which waits for the reply to
+ * track completion. Reply the number of logs appended.
+ */
+void handle_p2m_replica_batch(struct p2m_replica_batch_msg *msg,
+			      struct thpool_buffer *tb)
+{
+	struct replica_struct *replica = NULL;
+	int i, nr, reply = 0;
+
+	nr = msg->nr_logs;
+	if (unlikely(nr > P2M_PCACHE_REPLICA_BATCH_MAX)) {
+		reply = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (!handle_replica_log(&msg->logs[i], &replica))
+			reply++;
+	}
+
+	replica_debug("nr_logs: %d appended: %d", nr, reply);
 out:
 	*(int *)thpool_buffer_tx(tb) = reply;
 	tb_set_tx_size(tb, sizeof(int));
@@ -46,35 +46,55 @@ void submit_replcia_flush_job(struct log_flush_job *job)
 DEFINE_PROFILE_POINT(m2s_replica_flush)
 
 /*
- * This code runs on Secondary Memory,
- * used to flush the batched log to Storage.
+ * Jobs dequeued by one log_flushd round. Logs of several jobs
+ * are packed into one M2S_REPLICA_FLUSH if they fit, storage
+ * group commits them with a single ack.
  */
-void flush_replica_struct(struct replica_struct *r)
+#define LOG_FLUSH_BATCH_MAX	16
+
+/* Staging buffer for multi-job messages, only used by log_flushd */
+static struct m2s_replica_flush_msg *batch_msg;
+
+static void send_replica_flush(void *msg, size_t msg_size, unsigned int nr_log)
 {
-	size_t msg_size;
 	int reply, storage_node;
-	struct m2s_replica_flush_msg *msg;
+	unsigned long start_ns;
 	PROFILE_POINT_TIME(m2s_replica_flush)
 
-	/*
-	 * The message is pre-cooked when we create
-	 * the in-memory cached log.
-	 */
-	msg = r->flush_msg;
-	msg_size = r->flush_msg_size;
 	storage_node = CONFIG_DEFAULT_STORAGE_NODE;;
 
+	start_ns = sched_clock();
 	PROFILE_START(m2s_replica_flush);
 	ibapi_send_reply_timeout(storage_node, msg, msg_size,
 				&reply, sizeof(reply), false, DEF_NET_TIMEOUT);
 	PROFILE_LEAVE(m2s_replica_flush);
+
+	inc_mm_stat(NR_REPLICA_FLUSH_MSG);
+	add_mm_stat(NR_REPLICA_FLUSH_LOGS, nr_log);
+	add_mm_stat(NR_REPLICA_FLUSH_NS, sched_clock() - start_ns);
 }
 
-static void __log_flushd(struct log_flush_job *job)
+/*
+ * This code runs on Secondary Memory,
+ * used to flush the batched log to Storage.
+ */
+void flush_replica_struct(struct replica_struct *r)
 {
-	struct replica_struct *r = job->r;
+	/*
+	 * The message is pre-cooked when we create
+	 * the in-memory cached log.
+	 */
+	send_replica_flush(r->flush_msg, r->flush_msg_size, r->nr_log);
+}
+
+static inline size_t replica_log_size(struct replica_struct *r)
+{
+	return r->nr_log * sizeof(struct replica_log);
+}
 
-	flush_replica_struct(r);
+static void finish_flush_job(struct log_flush_job *job)
+{
+	struct replica_struct *r = job->r;
 
 	/* Cleanup is always essential */
 	reset_replica_head(r);
@@ -84,8 +104,69 @@ static void __log_flushd(struct log_flush_job *job)
 	inc_mm_stat(NR_BATCHED_LOG_FLUSH);
 }
 
+/*
+ * Flush @jobs, packing as many as fit into one message.
+ * A job that goes alone is sent from its pre-cooked message.
+ */
+static void __log_flushd(struct log_flush_job **jobs, int nr)
+{
+	size_t size, max_size = M2S_REPLICA_FLUSH_MAX_SIZE;
+	int i, start, end;
+	void *dst;
+
+	for (start = 0; start < nr; start = end) {
+		size = sizeof(*batch_msg) + replica_log_size(jobs[start]->r);
+		for (end = start + 1; end < nr; end++) {
+			if (size + replica_log_size(jobs[end]->r) > max_size)
+				break;
+			size += replica_log_size(jobs[end]->r);
+		}
+
+		if (end - start == 1) {
+			flush_replica_struct(jobs[start]->r);
+		} else {
+			batch_msg->opcode = M2S_REPLICA_FLUSH;
+			batch_msg->nr_log = 0;
+			dst = batch_msg->log;
+
+			for (i = start; i < end; i++) {
+				struct replica_struct *r = jobs[i]->r;
+
+				memcpy(dst, r->log, replica_log_size(r));
+				dst += replica_log_size(r);
+				batch_msg->nr_log += r->nr_log;
+			}
+			send_replica_flush(batch_msg, size, batch_msg->nr_log);
+		}
+
+		for (i = start; i < end; i++)
+			finish_flush_job(jobs[i]);
+	}
+}
+
+static int dequeue_flush_jobs(struct log_flush_job **jobs, int max)
+{
+	int nr = 0;
+
+	spin_lock(&log_flushd_lock);
+	while (nr < max && !list_empty(&log_flushd_queue)) {
+		/* Dequeue from head */
+		jobs[nr] = list_entry(log_flushd_queue.next,
+				      struct log_flush_job, list);
+
+		list_del_init(&jobs[nr]->list);
+		atomic_dec(&nr_log_flushd_jobs);
+		nr++;
+	}
+	spin_unlock(&log_flushd_lock);
+	return nr;
+}
+
 static int log_flushd(void *_unused)
 {
+	struct log_flush_job *jobs[LOG_FLUSH_BATCH_MAX];
+	int nr;
+
 	set_cpus_allowed_ptr(current, cpu_active_mask);
 
 	while (1) {
@@ -94,23 +175,8 @@ static int log_flushd(void *_unused)
 			schedule();
 		__set_current_state(TASK_RUNNING);
 
-		spin_lock(&log_flushd_lock);
-		while (!list_empty(&log_flushd_queue)) {
-			struct log_flush_job *job;
-
-			/* Dequeue from head */
-			job = list_entry(log_flushd_queue.next,
-					 struct log_flush_job, list);
-
-			list_del_init(&job->list);
-			atomic_dec(&nr_log_flushd_jobs);
-			spin_unlock(&log_flushd_lock);
-
-			__log_flushd(job);
-
-			spin_lock(&log_flushd_lock);
-		}
-		spin_unlock(&log_flushd_lock);
+		while ((nr = dequeue_flush_jobs(jobs, LOG_FLUSH_BATCH_MAX)))
+			__log_flushd(jobs, nr);
 	}
 	BUG();
 	return 0;
@@ -118,6 +184,10 @@ static int log_flushd(void *_unused)
 
 void __init init_memory_flush_thread(void)
 {
+	batch_msg = kmalloc(M2S_REPLICA_FLUSH_MAX_SIZE, GFP_KERNEL);
+	if (!batch_msg)
+		panic("Fail to allocate log flush buffer");
+
 	log_flushd_task = kthread_run(log_flushd, NULL, "klog_flushd");
 	if (IS_ERR(log_flushd_task))
 		panic("Fail to create klog_flushed");
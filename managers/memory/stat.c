@@ -16,8 +16,12 @@ struct memory_manager_stat memory_manager_stats;
 static const char *const memory_manager_stat_text[] = {
 	/* Handler group */
 	"handle_pcache_miss",
+	"handle_pcache_miss_batch",
+	"handle_pcache_prefetch",
 	"handle_pcache_flush",
+	"handle_pcache_flush_batch",
 	"handle_pcache_replica",
+	"handle_pcache_replica_batch",
 	"handle_p2m_mmap",
 	"handle_p2m_munmap",
 	"handle_p2m_brk",
@@ -29,7 +33,29 @@ static const char *const memory_manager_stat_text[] = {
 	"handle_write",
 
 	/* replication */
-	"nr_batched_log_flush"
+	"nr_batched_log_flush",
+	"nr_replica_flush_msg",
+	"nr_replica_flush_logs",
+	"nr_replica_flush_ns",
+
+	/* pgcache */
+	"nr_pgcache_readahead",
+	"nr_pgcache_readahead_lines",
+	"nr_pgcache_writeback",
+	"nr_pgcache_writeback_lines",
+
+	/* thpool backpressure */
+	"nr_thpool_ring_full",
+	"nr_thpool_buffer_full",
+
+	/* miss path */
+	"nr_vmacache_hit",
+	"nr_pcache_miss_fast",
+	"nr_pcache_miss_fast_race",
+
+	"nr_thp_fault",
+	"nr_thp_fault_fallback",
+	"nr_thp_split",
 };
 
 #ifdef CONFIG_COUNTER_MEMORY_HANDLER
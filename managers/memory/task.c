@@ -18,36 +18,61 @@
 #include <memory/task.h>
 
 #define PID_ARRAY_HASH_BITS	10
+#define PID_ARRAY_HASH_SIZE	(1 << PID_ARRAY_HASH_BITS)
 
-static DEFINE_HASHTABLE(node_pid_hash, PID_ARRAY_HASH_BITS);
-static DEFINE_SPINLOCK(hashtable_lock);
+/*
+ * Every pcache miss looks up its task here. Each bucket has its own lock,
+ * so misses from different processes do not contend on a global lock.
+ */
+struct lego_task_bucket {
+	spinlock_t		lock;
+	struct hlist_head	head;
+} ____cacheline_aligned;
+
+static struct lego_task_bucket node_pid_hash[PID_ARRAY_HASH_SIZE];
 
 static int getKey(unsigned int node, unsigned int pid)
 {
         return node*10000+pid*10;
 }
 
+static inline struct lego_task_bucket *
+lego_task_bucket(unsigned int node, unsigned int pid)
+{
+	return &node_pid_hash[hash_32(getKey(node, pid), PID_ARRAY_HASH_BITS)];
+}
+
+void __init lego_task_hash_init(void)
+{
+	int i;
+
+	for (i = 0; i < PID_ARRAY_HASH_SIZE; i++) {
+		spin_lock_init(&node_pid_hash[i].lock);
+		INIT_HLIST_HEAD(&node_pid_hash[i].head);
+	}
+}
+
 int __must_check ht_insert_lego_task(struct lego_task_struct *tsk)
 {
 	struct lego_task_struct *p;
-	unsigned int key;
+	struct lego_task_bucket *b;
 	unsigned int node, pid;
 
 	BUG_ON(!tsk || !tsk->pid);
 
 	pid = tsk->pid;
 	node = tsk->node;
-	key = getKey(node, pid);
+	b = lego_task_bucket(node, pid);
 
-	spin_lock(&hashtable_lock);
-	hash_for_each_possible(node_pid_hash, p, link, key) {
+	spin_lock(&b->lock);
+	hlist_for_each_entry(p, &b->head, link) {
 		if (unlikely(p->pid == pid && p->node ==node)) {
-			spin_unlock(&hashtable_lock);
+			spin_unlock(&b->lock);
 			return -EEXIST;
 		}
 	}
-	hash_add(node_pid_hash, &tsk->link, key);
-	spin_unlock(&hashtable_lock);
+	hlist_add_head(&tsk->link, &b->head);
+	spin_unlock(&b->lock);
 
 	return 0;
 }
@@ -75,26 +100,27 @@ void free_lego_task_struct(struct lego_task_struct *tsk)
 
 void free_lego_task(struct lego_task_struct *tsk)
 {
-	unsigned int node, pid, key;
+	unsigned int node, pid;
 	struct lego_task_struct *p;
+	struct lego_task_bucket *b;
 
 	BUG_ON(!tsk);
 	BUG_ON(!hash_hashed(&tsk->link));
 
 	node = tsk->node;
 	pid = tsk->pid;
-	key = getKey(node, pid);
+	b = lego_task_bucket(node, pid);
 
-	spin_lock(&hashtable_lock);
-	hash_for_each_possible(node_pid_hash, p, link, key) {
+	spin_lock(&b->lock);
+	hlist_for_each_entry(p, &b->head, link) {
 		if (likely(p->node == node && p->pid == pid)) {
 			hash_del(&p->link);
-			spin_unlock(&hashtable_lock);
+			spin_unlock(&b->lock);
 			kfree(tsk);
 			return;
 		}
 	}
-	spin_unlock(&hashtable_lock);
+	spin_unlock(&b->lock);
 	WARN(1, "fail to find tsk->(node:%u,pid:%u)\n", node, pid);
 }
 
@@ -102,20 +128,20 @@ struct lego_task_struct *
 find_lego_task_by_pid(unsigned int node, unsigned int pid)
 {
 	struct lego_task_struct *tsk;
-	unsigned int key;
+	struct lego_task_bucket *b;
 
 	if (unlikely(!pid))
 		return NULL;
 
-	key = getKey(node, pid);
-	spin_lock(&hashtable_lock);
-	hash_for_each_possible(node_pid_hash, tsk, link, key) {
+	b = lego_task_bucket(node, pid);
+	spin_lock(&b->lock);
+	hlist_for_each_entry(tsk, &b->head, link) {
 		if (likely(tsk->pid == pid && tsk->node == node)) {
-			spin_unlock(&hashtable_lock);
+			spin_unlock(&b->lock);
 			return tsk;
 		}
-        }
-        spin_unlock(&hashtable_lock);
+	}
+	spin_unlock(&b->lock);
 
 	return NULL;
 }
@@ -123,14 +149,19 @@ find_lego_task_by_pid(unsigned int node, unsigned int pid)
 void dump_lego_tasks(void)
 {
 	struct lego_task_struct *p;
+	struct lego_task_bucket *b;
 	int i;
 
-	spin_lock(&hashtable_lock);
 	pr_info("----- Start Dump Tasks\n");
-	hash_for_each(node_pid_hash, i, p, link) {
-		pr_info("  node:%u comm: %s pid: %u vnode_id: %u parent_pid:%u home_node: %u\n",
-			p->node, p->comm, p->pid, p->vnode_id, p->parent_pid, p->home_node);
+	for (i = 0; i < PID_ARRAY_HASH_SIZE; i++) {
+		b = &node_pid_hash[i];
+
+		spin_lock(&b->lock);
+		hlist_for_each_entry(p, &b->head, link) {
+			pr_info("  node:%u comm: %s pid: %u vnode_id: %u parent_pid:%u home_node: %u\n",
+				p->node, p->comm, p->pid, p->vnode_id, p->parent_pid, p->home_node);
+		}
+		spin_unlock(&b->lock);
 	}
 	pr_info("----- Finish Dump Tasks\n");
-	spin_unlock(&hashtable_lock);
 }
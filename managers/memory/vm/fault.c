@@ -16,8 +16,10 @@
 #include <lego/comp_storage.h>
 
 #include <memory/vm.h>
+#include <memory/stat.h>
 #include <memory/file_ops.h>
 #include <memory/vm-pgtable.h>
+#include <memory/huge_memory.h>
 
 static int do_wp_page(struct vm_area_struct *vma, unsigned long address,
 		      unsigned int flags, pte_t *ptep, pmd_t *pmd, pte_t entry,
@@ -122,6 +124,56 @@ unlock:
 	return 0;
 }
 
+#ifdef CONFIG_MEM_THP
+/*
+ * Back the whole 2MB range around @address with one huge pmd,
+ * if it is anonymous and fully covered by @vma. Stack grows down
+ * and is moved around by exec, leave it with 4KB pages.
+ */
+bool lego_thp_suitable(struct vm_area_struct *vma, unsigned long address)
+{
+	unsigned long haddr = address & HPAGE_PMD_MASK;
+
+	if (!vma_is_anonymous(vma))
+		return false;
+	if (vma->vm_flags & VM_GROWSDOWN)
+		return false;
+	return haddr >= vma->vm_start && haddr + HPAGE_PMD_SIZE <= vma->vm_end;
+}
+
+int do_huge_pmd_anonymous_page(struct vm_area_struct *vma,
+			       unsigned long address, pmd_t *pmd)
+{
+	struct lego_mm_struct *mm = vma->vm_mm;
+	unsigned long vaddr;
+	spinlock_t *ptl;
+	pmd_t entry;
+
+	vaddr = __get_free_pages(GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN,
+				 HPAGE_PMD_ORDER);
+	if (!vaddr)
+		return -ENOMEM;
+
+	/* Kernel virtual address, same as do_anonymous_page */
+	entry = __pmd(vaddr | pgprot_val(vma->vm_page_prot) | _PAGE_PSE);
+	if (vma->vm_flags & VM_WRITE)
+		entry = pmd_mkwrite(pmd_mkdirty(entry));
+
+	ptl = lego_pmd_lock(mm, pmd);
+	if (unlikely(!pmd_none(*pmd))) {
+		/* Someone else populated it meanwhile */
+		spin_unlock(ptl);
+		free_pages(vaddr, HPAGE_PMD_ORDER);
+		return 0;
+	}
+	pmd_set(pmd, entry);
+	spin_unlock(ptl);
+
+	inc_mm_stat(NR_THP_FAULT);
+	return 0;
+}
+#endif
+
 DEFINE_PROFILE_POINT(anon_fault)
 DEFINE_PROFILE_POINT(file_fault)
 DEFINE_PROFILE_POINT(wp_fault)
@@ -245,6 +297,25 @@ int handle_lego_mm_fault(struct vm_area_struct *vma, unsigned long address,
 	pmd = lego_pmd_alloc(mm, pud, address);
 	if (!pmd)
 		return VM_FAULT_OOM;
+
+	if (pmd_none(*pmd) && lego_thp_suitable(vma, address)) {
+		/* Fall back to 4KB pages if no 2MB block available */
+		if (do_huge_pmd_anonymous_page(vma, address, pmd))
+			inc_mm_stat(NR_THP_FAULT_FALLBACK);
+	}
+
+	/*
+	 * Write to a write-protected huge pmd is a no-op,
+	 * same as do_wp_page() for ptes.
+	 */
+	if (lego_pmd_trans_huge(*pmd)) {
+		if (ret_va)
+			*ret_va = lego_pmd_huge_page(*pmd, address);
+		if (mapping_flags)
+			*mapping_flags = PCACHE_MAPPING_ANON;
+		return 0;
+	}
+
 	pte = lego_pte_alloc(mm, pmd, address);
 	if (!pte)
 		return VM_FAULT_OOM;
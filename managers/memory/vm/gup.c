@@ -11,6 +11,7 @@
 #include <lego/rwsem.h>
 #include <lego/kernel.h>
 #include <memory/vm.h>
+#include <memory/huge_memory.h>
 
 int faultin_page(struct vm_area_struct *vma, unsigned long start,
 		 unsigned long flags, unsigned long *kvaddr)
@@ -56,6 +57,9 @@ unsigned long find_page(struct vm_area_struct *vma, unsigned long address)
 	if (pmd_none(*pmd))
 		return 0;
 
+	if (lego_pmd_trans_huge(*pmd))
+		return lego_pmd_huge_page(*pmd, address);
+
 	pte = lego_pte_offset(pmd, address);
 	if (pte_none(*pte))
 		return 0;
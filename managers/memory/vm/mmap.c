@@ -23,6 +23,7 @@
 
 #include <memory/vm.h>
 #include <memory/pid.h>
+#include <memory/stat.h>
 #include <memory/vm-pgtable.h>
 #include <memory/distvm.h>
 #include <memory/file_types.h>
@@ -408,14 +409,31 @@ static __always_inline void vma_rb_erase(struct vm_area_struct *vma,
 	__vma_rb_erase(vma, root);
 }
 
-/* Find the first VMA which satisfies  addr < vm_end,  NULL if none. */
+/*
+ * Find the first VMA which satisfies  addr < vm_end,  NULL if none.
+ *
+ * Misses of one process mostly hit the same VMA, so the last result is
+ * cached in mm->vmacache. Readers under mmap_sem may update it at the
+ * same time, a cached VMA is always checked against @addr before use.
+ * It is cleared before the VMA goes away, which needs mmap_sem for write.
+ */
 struct vm_area_struct *find_vma(struct lego_mm_struct *mm, unsigned long addr)
 {
 	struct rb_node *rb_node = NULL;
 	struct vm_area_struct *vma = NULL;
 #ifdef CONFIG_DISTRIBUTED_VMA_MEMORY
-	struct vma_tree *root = get_vmatree_by_addr(mm, addr);
+	struct vma_tree *root;
+#endif
+
+	vma = READ_ONCE(mm->vmacache);
+	if (vma && vma->vm_start <= addr && vma->vm_end > addr) {
+		inc_mm_stat(NR_VMACACHE_HIT);
+		return vma;
+	}
+	vma = NULL;
 
+#ifdef CONFIG_DISTRIBUTED_VMA_MEMORY
+	root = get_vmatree_by_addr(mm, addr);
 	if (!root || !is_local(root->mnode))
 		return NULL;
 
@@ -439,6 +457,8 @@ struct vm_area_struct *find_vma(struct lego_mm_struct *mm, unsigned long addr)
 		}
 	}
 
+	if (vma)
+		WRITE_ONCE(mm->vmacache, vma);
 	return vma;
 }
 
@@ -622,6 +642,7 @@ static __always_inline void __vma_unlink_common(struct lego_mm_struct *mm,
 {
 	struct vm_area_struct *next;
 
+	vmacache_invalidate(mm, vma);
 	vma_rb_erase_ignore(vma, &mm->mm_rb, ignore);
 	next = vma->vm_next;
 	if (has_prev)
@@ -1136,6 +1157,7 @@ static struct vm_area_struct *remove_vma(struct vm_area_struct *vma)
 {
 	struct vm_area_struct *next = vma->vm_next;
 
+	vmacache_invalidate(vma->vm_mm, vma);
 	if (vma->vm_ops && vma->vm_ops->close)
 		vma->vm_ops->close(vma);
 	if (vma->vm_file)
@@ -2005,6 +2027,8 @@ lego_mm_init(struct lego_mm_struct *mm, struct lego_task_struct *p)
 	mm->task = p;
 	mm->mmap = NULL;
 	mm->mm_rb = RB_ROOT;
+	mm->vmacache = NULL;
+	seqcount_init(&mm->pgtable_seq);
 	atomic_set(&mm->mm_users, 1);
 	atomic_set(&mm->mm_count, 1);
 	init_rwsem(&mm->mmap_sem);
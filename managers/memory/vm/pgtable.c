@@ -11,7 +11,9 @@
 #include <lego/comp_memory.h>
 
 #include <memory/vm.h>
+#include <memory/stat.h>
 #include <memory/vm-pgtable.h>
+#include <memory/huge_memory.h>
 
 #define PGALLOC_GFP	(GFP_KERNEL | __GFP_ZERO)
 
@@ -178,6 +180,145 @@ int __lego_pte_alloc(struct lego_mm_struct *mm, pmd_t *pmd, unsigned long addres
 	return 0;
 }
 
+#ifdef CONFIG_MEM_THP
+/*
+ * Replace a huge pmd with a pte table of 512 entries.
+ * Caller holds mmap_sem for write, so nobody faults on it meanwhile.
+ *
+ * If we are the only user of the block, the tail pages are handed out
+ * one by one and the block is mapped in place. If the block is shared
+ * with others (by fork), we take a private copy of it.
+ */
+int lego_split_huge_pmd(struct lego_mm_struct *mm, pmd_t *pmd)
+{
+	unsigned long huge, page;
+	struct page *head;
+	pteval_t flags;
+	spinlock_t *ptl;
+	pte_t *pgtable;
+	pmd_t orig;
+	int i;
+
+	pgtable = lego_pte_alloc_one();
+	if (!pgtable)
+		return -ENOMEM;
+
+	orig = *pmd;
+	huge = lego_pmd_huge_vaddr(orig);
+	head = virt_to_page(huge);
+	flags = (pmd_val(orig) & ~HPAGE_PMD_MASK) & ~_PAGE_PSE;
+
+	if (page_ref_count(head) == 1) {
+		for (i = 1; i < HPAGE_PMD_NR; i++)
+			set_page_refcounted(head + i);
+		for (i = 0; i < HPAGE_PMD_NR; i++)
+			pgtable[i] = __pte((huge + i * PAGE_SIZE) | flags);
+	} else {
+		for (i = 0; i < HPAGE_PMD_NR; i++) {
+			page = __get_free_page(GFP_KERNEL);
+			if (!page)
+				goto nomem;
+			memcpy((void *)page, (void *)(huge + i * PAGE_SIZE), PAGE_SIZE);
+			pgtable[i] = __pte(page | flags);
+		}
+		/* Drop our reference to the shared block */
+		free_pages(huge, HPAGE_PMD_ORDER);
+	}
+
+	ptl = lego_pmd_lock(mm, pmd);
+	lego_pmd_populate(pmd, pgtable);
+	spin_unlock(ptl);
+
+	inc_mm_stat(NR_THP_SPLIT);
+	return 0;
+
+nomem:
+	while (--i >= 0)
+		free_page(lego_pte_to_virt(pgtable[i]));
+	lego_pte_free(pgtable);
+	return -ENOMEM;
+}
+
+void lego_zap_huge_pmd(struct lego_mm_struct *mm, pmd_t *pmd)
+{
+	spinlock_t *ptl;
+	pmd_t orig;
+
+	ptl = lego_pmd_lock(mm, pmd);
+	orig = *pmd;
+	pmd_clear(pmd);
+	spin_unlock(ptl);
+
+	free_pages(lego_pmd_huge_vaddr(orig), HPAGE_PMD_ORDER);
+}
+
+/*
+ * Same as lego_copy_one_pte, the block is shared by parent and child.
+ * A huge pmd may span two VMAs, only the first one copies it.
+ */
+void lego_copy_huge_pmd(struct lego_mm_struct *dst_mm, struct lego_mm_struct *src_mm,
+			pmd_t *dst_pmd, pmd_t *src_pmd, struct vm_area_struct *vma)
+{
+	spinlock_t *src_ptl, *dst_ptl;
+	pmd_t pmd;
+
+	dst_ptl = lego_pmd_lock(dst_mm, dst_pmd);
+	src_ptl = lego_pmd_lockptr(src_mm, src_pmd);
+	if (src_ptl != dst_ptl)
+		spin_lock(src_ptl);
+
+	if (!pmd_none(*dst_pmd))
+		goto unlock;
+
+	pmd = *src_pmd;
+	if (is_cow_mapping(vma->vm_flags)) {
+		pmd_set(src_pmd, pmd_wrprotect(pmd));
+		pmd = pmd_wrprotect(pmd);
+	}
+	if (vma->vm_flags & VM_SHARED)
+		pmd = pmd_mkclean(pmd);
+	pmd = pmd_mkold(pmd);
+
+	get_page(virt_to_page(lego_pmd_huge_vaddr(pmd)));
+	pmd_set(dst_pmd, pmd);
+
+unlock:
+	if (src_ptl != dst_ptl)
+		spin_unlock(src_ptl);
+	spin_unlock(dst_ptl);
+}
+
+/*
+ * Move a whole huge pmd to @new_addr, which must be 2MB aligned and
+ * not have a pte table yet. Return false if caller should split.
+ */
+bool lego_move_huge_pmd(struct lego_mm_struct *mm, unsigned long new_addr,
+			pmd_t *old_pmd, pmd_t *new_pmd)
+{
+	spinlock_t *old_ptl, *new_ptl;
+	bool moved = false;
+
+	if (new_addr & ~HPAGE_PMD_MASK)
+		return false;
+
+	old_ptl = lego_pmd_lock(mm, old_pmd);
+	new_ptl = lego_pmd_lockptr(mm, new_pmd);
+	if (new_ptl != old_ptl)
+		spin_lock(new_ptl);
+
+	if (pmd_none(*new_pmd)) {
+		pmd_set(new_pmd, *old_pmd);
+		pmd_clear(old_pmd);
+		moved = true;
+	}
+
+	if (new_ptl != old_ptl)
+		spin_unlock(new_ptl);
+	spin_unlock(old_ptl);
+	return moved;
+}
+#endif /* CONFIG_MEM_THP */
+
 static void free_pte_range(struct lego_mm_struct *mm,
 			   pmd_t *pmd, unsigned long addr)
 {
@@ -201,6 +342,11 @@ static inline void free_pmd_range(struct lego_mm_struct *mm, pud_t *pud,
 		next = pmd_addr_end(addr, end);
 		if (pmd_none(*pmd))
 			continue;
+		/* Should have been zapped already */
+		if (WARN_ON_ONCE(lego_pmd_trans_huge(*pmd))) {
+			pmd_clear(pmd);
+			continue;
+		}
 		free_pte_range(mm, pmd, addr);
 	} while (pmd++, addr = next, addr != end);
 
@@ -308,6 +454,7 @@ void lego_free_pgd_range(struct lego_mm_struct *mm,
 	if (addr > end - 1)
 		return;
 
+	lego_pgtable_write_begin(mm);
 	pgd = lego_pgd_offset(mm, addr);
 	do {
 		next = pgd_addr_end(addr, end);
@@ -315,6 +462,7 @@ void lego_free_pgd_range(struct lego_mm_struct *mm,
 			continue;
 		free_pud_range(mm, pgd, addr, next, floor, ceiling);
 	} while (pgd++, addr = next, addr != end);
+	lego_pgtable_write_end(mm);
 }
 
 void lego_free_pgtables(struct vm_area_struct *vma,
@@ -436,6 +584,10 @@ static inline int lego_copy_pmd_range(struct lego_mm_struct *dst_mm,
 		next = pmd_addr_end(addr, end);
 		if (pmd_none(*src_pmd))
 			continue;
+		if (lego_pmd_trans_huge(*src_pmd)) {
+			lego_copy_huge_pmd(dst_mm, src_mm, dst_pmd, src_pmd, vma);
+			continue;
+		}
 		if (lego_copy_pte_range(dst_mm, src_mm, dst_pmd, src_pmd,
 						vma, addr, next))
 			return -ENOMEM;
@@ -484,6 +636,9 @@ int lego_copy_page_range(struct lego_mm_struct *dst, struct lego_mm_struct *src,
 	ret = 0;
 	dst_pgd = lego_pgd_offset(dst, addr);
 	src_pgd = lego_pgd_offset(src, addr);
+
+	/* Parent ptes are write protected for COW */
+	lego_pgtable_write_begin(src);
 	do {
 		next = pgd_addr_end(addr, end);
 		if (pgd_none(*src_pgd))
@@ -494,6 +649,7 @@ int lego_copy_page_range(struct lego_mm_struct *dst, struct lego_mm_struct *src,
 			break;
 		}
 	} while (dst_pgd++, src_pgd++, addr = next, addr != end);
+	lego_pgtable_write_end(src);
 
 	return ret;
 }
@@ -552,6 +708,15 @@ zap_pmd_range(struct vm_area_struct *vma, pud_t *pud,
 		next = pmd_addr_end(addr, end);
 		if (pmd_none(*pmd))
 			continue;
+		if (lego_pmd_trans_huge(*pmd)) {
+			if (next - addr == HPAGE_PMD_SIZE) {
+				lego_zap_huge_pmd(vma->vm_mm, pmd);
+				continue;
+			}
+			/* Leave the whole block mapped if we can not split */
+			if (WARN_ON_ONCE(lego_split_huge_pmd(vma->vm_mm, pmd)))
+				continue;
+		}
 		next = zap_pte_range(vma, pmd, addr, next);
 	} while (pmd++, addr = next, addr != end);
 
@@ -583,6 +748,7 @@ void lego_unmap_page_range(struct vm_area_struct *vma,
 	unsigned long next;
 
 	BUG_ON(addr >= end);
+	lego_pgtable_write_begin(vma->vm_mm);
 	pgd = lego_pgd_offset(vma->vm_mm, addr);
 	do {
 		next = pgd_addr_end(addr, end);
@@ -590,6 +756,7 @@ void lego_unmap_page_range(struct vm_area_struct *vma,
 			continue;
 		next = zap_pud_range(vma, pgd, addr, next);
 	} while (pgd++, addr = next, addr != end);
+	lego_pgtable_write_end(vma->vm_mm);
 }
 
 static pmd_t *get_old_pmd(struct lego_mm_struct *mm, unsigned long addr)
@@ -677,6 +844,7 @@ unsigned long lego_move_page_tables(struct vm_area_struct *vma,
 
 	old_end = old_addr + len;
 
+	lego_pgtable_write_begin(vma->vm_mm);
 	for (; old_addr < old_end; old_addr += extent, new_addr += extent) {
 		next = (old_addr + PMD_SIZE) & PMD_MASK;
 
@@ -693,6 +861,14 @@ unsigned long lego_move_page_tables(struct vm_area_struct *vma,
 		if (!new_pmd)
 			break;
 
+		if (lego_pmd_trans_huge(*old_pmd)) {
+			if (extent == HPAGE_PMD_SIZE &&
+			    lego_move_huge_pmd(vma->vm_mm, new_addr, old_pmd, new_pmd))
+				continue;
+			if (lego_split_huge_pmd(vma->vm_mm, old_pmd))
+				break;
+		}
+
 		if (!lego_pte_alloc(new_vma->vm_mm, new_pmd, new_addr))
 			break;
 
@@ -705,6 +881,7 @@ unsigned long lego_move_page_tables(struct vm_area_struct *vma,
 		move_ptes(vma, old_pmd, old_addr, old_addr + extent, new_vma,
 			  new_pmd, new_addr);
 	}
+	lego_pgtable_write_end(vma->vm_mm);
 
 	return len + old_addr - old_end;	/* how much done */
 }
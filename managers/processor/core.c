@@ -21,6 +21,8 @@
 #include <processor/distvm.h>
 #include <processor/vnode.h>
 #include <processor/pcache.h>
+#include <processor/replication.h>
+#include <processor/fs.h>
 
 #include <monitor/gpm_handler.h>
 
@@ -130,6 +132,7 @@ static inline void common_header_check(void)
 	BUILD_BUG_ON((offsetof(type, member) % COMMON_HEADER_ALIGNMENT) != 0)
 
 	CHK(struct p2m_replica_msg, log);
+	CHK(struct p2m_replica_batch_msg, logs);
 
 #undef CHK
 }
@@ -157,6 +160,8 @@ void __init processor_manager_init(void)
 #endif
 	
 	gpm_handler_init();
+	replication_init();
+	file_token_init();
 
 	/* Create checkpointing restore thread */
 	checkpoint_init();
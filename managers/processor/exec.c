@@ -44,6 +44,7 @@ static int exec_mmap(void)
 	 * We should do this before changing mm,
 	 * because pcache_process_exit() needs old_mm to clean up
 	 */
+	pcache_thread_exit(tsk);
 	mmput(old_mm);
 
 	task_lock(tsk);
@@ -8,6 +8,7 @@
  */
 
 #include <lego/sched.h>
+#include <processor/pcache.h>
 #include <processor/processor.h>
 
 #ifdef CONFIG_DEBUG_FORK
@@ -163,4 +164,6 @@ void fork_processor_data(struct task_struct *new, struct task_struct *parent,
 		nid = get_storage_home_node(parent);
 		set_storage_home_node(new, nid);
 	}
+
+	pcache_prefetch_fork(new);
 }
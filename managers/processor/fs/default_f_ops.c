@@ -16,6 +16,7 @@
 #include <lego/comp_storage.h>
 #include <lego/seq_file.h>
 #include <lego/timer.h>
+#include <lego/jiffies.h>
 #include <lego/fit_ibapi.h>
 #include <lego/kernel.h>
 #include <processor/fs.h>
@@ -28,6 +29,48 @@
 static inline void file_debug(const char *fmt, ...) { }
 #endif
 
+/*
+ * p2m_open:
+ * Storage has opened the file, get a token from memory,
+ * that later reads and writes carry instead of the name.
+ */
+static int p2m_open(struct file *f)
+{
+	struct {
+		struct common_header	hdr;
+		struct p2m_open_struct	payload;
+	} *msg;
+	struct p2m_open_reply reply;
+	unsigned long t_sent;
+	int retlen;
+
+	msg = kmalloc(sizeof(*msg), GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	msg->hdr.opcode = P2M_OPEN;
+	msg->hdr.src_nid = LEGO_LOCAL_NID;
+	msg->hdr.length = sizeof(*msg);
+	strlcpy(msg->payload.filename, f->f_name, MAX_FILENAME_LENGTH);
+	msg->payload.flags = f->f_flags;
+	msg->payload.storage_node = current_storage_home_node();
+	msg->payload.want_lease = IS_ENABLED(CONFIG_PROCESSOR_FILE_CACHE);
+
+	t_sent = jiffies;
+	retlen = ibapi_send_reply_imm(current_pgcache_home_node(), msg, sizeof(*msg),
+				      &reply, sizeof(reply), false);
+	kfree(msg);
+
+	if (unlikely(retlen != sizeof(reply)))
+		return -EIO;
+	if (reply.retval)
+		return reply.retval;
+
+	f->f_token = reply.token;
+	file_cache_open(f, &reply.lease, t_sent);
+	return 0;
+}
+
 /*
  * p2s_open:
  * Send request to storage directly.
@@ -65,184 +108,319 @@ static int p2s_open(struct file *f)
 #endif
 
 	kfree(msg);
-	return retval;
+	if (retval)
+		return retval;
+	return p2m_open(f);
 }
 
 /*
- * p2m_read
- * Send request to memory manager
+ * Walk the user iovecs of a readv/writev,
+ * chunk boundaries do not have to match iovec boundaries.
  */
-static ssize_t p2m_read(struct file *f, char __user *buf, size_t count,
-			loff_t *off)
+struct iov_cursor {
+	const struct iovec	*iov;
+	unsigned long		nr_segs;
+	size_t			iov_offset;
+};
+
+static int iov_cursor_copy(struct iov_cursor *cur, void *kbuf, size_t len,
+			   bool to_user)
 {
-	ssize_t retval, retlen;
-	ssize_t *retval_ptr;
-	u32 len_retbuf, len_msg;
-	void *retbuf, *msg, *content;
-	struct common_header *hdr;
-	struct p2m_read_write_payload *payload;
-	int mem_node;	/* = pgcache_node if defined or memory homenode */
+	void __user *base;
+	size_t n;
+
+	while (len) {
+		if (WARN_ON_ONCE(!cur->nr_segs))
+			return -EFAULT;
+
+		n = min_t(size_t, len, cur->iov->iov_len - cur->iov_offset);
+		base = cur->iov->iov_base + cur->iov_offset;
+		if (to_user ? copy_to_user(base, kbuf, n) : copy_from_user(kbuf, base, n))
+			return -EFAULT;
+
+		kbuf += n;
+		len -= n;
+		cur->iov_offset += n;
+		if (cur->iov_offset == cur->iov->iov_len) {
+			cur->iov++;
+			cur->nr_segs--;
+			cur->iov_offset = 0;
+		}
+	}
+	return 0;
+}
 
-	len_retbuf = sizeof(ssize_t) + count;
-	retbuf = kmalloc(len_retbuf, GFP_KERNEL);
-	if (!retbuf)
-		return -ENOMEM;
+/*
+ * One chunk of a pipelined read or write
+ * msg:    [struct common_header][struct p2m_read_write_payload][write content]
+ * retbuf: [ssize_t retval][read content]
+ */
+struct p2m_rw_slot {
+	struct fit_pending_reply	*pr;
+	void				*msg;
+	void				*retbuf;
+	size_t				len;
+	unsigned int			nid;
+	u32				len_msg;
+	u32				len_retbuf;
+};
 
-	len_msg = sizeof(*hdr) + sizeof(*payload);
-	msg = kmalloc(len_msg, GFP_KERNEL);
-	if (!msg) {
-		kfree(retbuf);
-		return -ENOMEM;
+static int alloc_p2m_rw_slots(struct p2m_rw_slot *slots, int nr,
+			      size_t chunk, bool write)
+{
+	size_t len_msg, len_retbuf;
+	int i;
+
+	len_msg = sizeof(struct common_header) +
+		  sizeof(struct p2m_read_write_payload) + (write ? chunk : 0);
+	len_retbuf = sizeof(ssize_t) + (write ? 0 : chunk);
+
+	memset(slots, 0, nr * sizeof(*slots));
+	for (i = 0; i < nr; i++) {
+		slots[i].msg = kmalloc(len_msg, GFP_KERNEL);
+		slots[i].retbuf = kmalloc(len_retbuf, GFP_KERNEL);
+		if (!slots[i].msg || !slots[i].retbuf)
+			return -ENOMEM;
 	}
+	return 0;
+}
+
+static void free_p2m_rw_slots(struct p2m_rw_slot *slots, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		kfree(slots[i].msg);
+		kfree(slots[i].retbuf);
+	}
+}
+
+/*
+ * Build and post the chunk of @slot. For writes, the content is
+ * gathered from user iovecs right into the message.
+ */
+static int p2m_rw_post(struct file *f, struct p2m_rw_slot *slot,
+		       struct iov_cursor *cur, loff_t pos, bool write)
+{
+	struct common_header *hdr;
+	struct p2m_read_write_payload *payload;
+	u32 len_msg, len_retbuf;
 
-	/* Construct payload */
-	hdr = msg;
-	hdr->opcode = P2M_READ;
+	hdr = slot->msg;
+	hdr->opcode = write ? P2M_WRITE : P2M_READ;
 	hdr->src_nid = LEGO_LOCAL_NID;
 
-	payload = msg + sizeof(*hdr);
+	payload = slot->msg + sizeof(*hdr);
 	payload->pid = current->pid;
 	payload->tgid = current->tgid;
-	payload->buf = buf;
-	payload->uid = current_uid();
-	strncpy(payload->filename, f->f_name, MAX_FILENAME_LENGTH);
-	payload->flags = f->f_flags;
-	payload->len = count;
-	payload->offset = *off;
+	payload->buf = cur->iov->iov_base + cur->iov_offset;
+	payload->token = f->f_token;
+	payload->len = slot->len;
+	payload->offset = pos;
+
+	len_msg = sizeof(*hdr) + sizeof(*payload);
+	len_retbuf = sizeof(ssize_t);
+	if (write) {
+		if (iov_cursor_copy(cur, slot->msg + len_msg, slot->len, false))
+			return -EFAULT;
+		len_msg += slot->len;
+	} else
+		len_retbuf += slot->len;
+	hdr->length = len_msg;
+
+	slot->nid = f->f_token.nid;
+	slot->len_msg = len_msg;
+	slot->len_retbuf = len_retbuf;
+	slot->pr = ibapi_send_reply_post(slot->nid, slot->msg, len_msg,
+					 slot->retbuf, len_retbuf);
+	if (IS_ERR(slot->pr))
+		return PTR_ERR(slot->pr);
+	return 0;
+}
 
-	mem_node = current_pgcache_home_node();
-	retlen = ibapi_send_reply_imm(mem_node, msg, len_msg,
-				      retbuf, len_retbuf, false);
+/*
+ * Wait for @slot's reply. If it times out, the buffers are left
+ * to the late reply. A write refused because other processors
+ * still hold leases on the file is sent again.
+ */
+static ssize_t p2m_rw_wait(struct p2m_rw_slot *slot)
+{
+	struct common_header *hdr = slot->msg;
+	ssize_t retval;
+	int retlen;
 
-	if (retlen != len_retbuf) {
+again:
+	retlen = ibapi_wait_reply(slot->pr, 0);
+	if (unlikely(retlen < (int)sizeof(retval))) {
 		WARN_ON_ONCE(1);
-		retval = -EIO;
-		goto out;
+		if (retlen == -ETIMEDOUT)
+			slot->msg = slot->retbuf = NULL;
+		return -EIO;
 	}
 
-	/*
-	 * The first 8 bytes stores the nr of bytes been read
-	 * The left is the real content
-	 */
-	retval_ptr = retbuf;
-	retval = *retval_ptr;
-	content = retbuf + sizeof(ssize_t);
-
-	/* Either remote memory or storage is buggy */
-	BUG_ON(retval > count);
-
-	file_debug(" app wants to read: %zu, we read: %zu", count, retval);
+	retval = *(ssize_t *)slot->retbuf;
 
-	/* If success, we copy the content into user's cacheline */
-	if (likely(retval > 0)) {
-#ifdef CONFIG_DEBUG_FILE
-		print_hex_dump_bytes("Read Content: ", DUMP_PREFIX_ADDRESS, content, retval);
-#endif
-		*off += retval;
-		if (copy_to_user(buf, content, count)) {
-			retval = -EFAULT;
-			goto out;
-		}
+	if (unlikely(retval == -EAGAIN && hdr->opcode == P2M_WRITE)) {
+		msleep(P2M_LEASE_RETRY_MSEC);
+		slot->pr = ibapi_send_reply_post(slot->nid, slot->msg, slot->len_msg,
+						 slot->retbuf, slot->len_retbuf);
+		if (IS_ERR(slot->pr))
+			return PTR_ERR(slot->pr);
+		goto again;
 	}
 
-out:
-	file_debug("retval: %zu", retval);
-	kfree(msg);
-	kfree(retbuf);
+	/* Either remote memory or storage is buggy */
+	BUG_ON(retval > (ssize_t)slot->len);
 	return retval;
 }
 
-static ssize_t __p2m_write(struct file *f, const char __user *buf,
-				size_t count, loff_t *off)
+/*
+ * p2m_rw_iov
+ * Read or write a contiguous file range from/to user iovecs.
+ *
+ * The range is split into P2M_RW_CHUNK_SIZE chunks, and up to
+ * FIT_MAX_PENDING_REPLIES of them are in flight at once. So memory works
+ * on the next chunks while we copy the previous one to user, and a big
+ * transfer needs only a few chunk-sized buffers.
+ *
+ * Chunks are retired in order. Once one comes back short or failed, no
+ * more are posted, and those in flight are only drained. A failed write
+ * chunk may leave later chunks written, like a short write.
+ */
+static ssize_t p2m_rw_iov(struct file *f, const struct iovec *iov,
+			  unsigned long nr_segs, loff_t *off, bool write)
 {
-	ssize_t retval, retlen;
-	u32 len_msg;
-	void *msg, *content;
-	struct common_header *hdr;
-	struct p2m_read_write_payload *payload;
-	int mem_node;
+	struct p2m_rw_slot slots[FIT_MAX_PENDING_REPLIES], *slot;
+	struct iov_cursor cur = { .iov = iov, .nr_segs = nr_segs };
+	size_t count = 0, chunk, sent = 0, done = 0;
+	int nr_slots, head = 0, nr_inflight = 0;
+	ssize_t retval = 0, ret;
+	bool stop = false;
+	unsigned long i;
+
+	for (i = 0; i < nr_segs; i++)
+		count += iov[i].iov_len;
+	if (!count)
+		return 0;
+
+	chunk = min_t(size_t, count, P2M_RW_CHUNK_SIZE);
+	nr_slots = min_t(size_t, FIT_MAX_PENDING_REPLIES, DIV_ROUND_UP(count, chunk));
+	if (alloc_p2m_rw_slots(slots, nr_slots, chunk, write)) {
+		retval = -ENOMEM;
+		goto out;
+	}
 
-	len_msg = sizeof(*hdr) + sizeof(*payload) + count;
-	msg = kmalloc(len_msg, GFP_KERNEL);
-	if (!msg)
-		return -ENOMEM;
+	for (;;) {
+		/* Keep the pipe full */
+		while (!stop && sent < count && nr_inflight < nr_slots) {
+			slot = &slots[(head + nr_inflight) % nr_slots];
+			slot->len = min(count - sent, chunk);
+
+			ret = p2m_rw_post(f, slot, &cur, *off + sent, write);
+			if (ret) {
+				if (!done)
+					retval = ret;
+				stop = true;
+				break;
+			}
+			sent += slot->len;
+			nr_inflight++;
+		}
 
-	/* Construct payload */
-	hdr = (struct common_header *)msg;
-	hdr->opcode = P2M_WRITE;
-	hdr->src_nid = LEGO_LOCAL_NID;
+		if (!nr_inflight)
+			break;
 
-	payload = (struct p2m_read_write_payload *)(msg + sizeof(*hdr));
-	payload->pid = current->pid;
-	payload->tgid = current->tgid;
-	payload->buf = (char *)buf;
-	payload->uid = current_uid();
-	payload->flags = f->f_flags;
-	payload->len = count;
+		/* Retire the oldest */
+		slot = &slots[head];
+		head = (head + 1) % nr_slots;
+		nr_inflight--;
 
-	payload->offset = (*off);
-	strncpy(payload->filename, f->f_name, MAX_FILENAME_LENGTH);
+		ret = p2m_rw_wait(slot);
+		if (stop)
+			continue;
 
-	/* Copy the contents into the payload */
-	content = msg + sizeof(*hdr) + sizeof(*payload);
-	if (copy_from_user(content, buf, count)) {
-		retval = -EFAULT;
-		goto out;
-	}
+		if (ret < 0) {
+			if (!done)
+				retval = ret;
+			stop = true;
+			continue;
+		}
 
-	/* Send to memory home node */
-	mem_node = current_pgcache_home_node();
-	retlen = ibapi_send_reply_imm(mem_node, msg, len_msg,
-			&retval, sizeof(retval), false);
-	if (unlikely(retlen != sizeof(retval))) {
-		WARN_ON(1);
-		retval = -EIO;
-		goto out;
-	}
+		if (!write && ret > 0) {
+#ifdef CONFIG_DEBUG_FILE
+			print_hex_dump_bytes("Read Content: ", DUMP_PREFIX_ADDRESS,
+					     slot->retbuf + sizeof(ssize_t), ret);
+#endif
+			if (iov_cursor_copy(&cur, slot->retbuf + sizeof(ssize_t),
+					    ret, true)) {
+				if (!done)
+					retval = -EFAULT;
+				stop = true;
+				continue;
+			}
+		}
 
-	if (retval >= 0)
-		*off += retval;
+		done += ret;
+		if (ret < slot->len)
+			stop = true;
+	}
 
+	file_debug("app wants to %s: %zu, we did: %zu",
+		write ? "write" : "read", count, done);
+	*off += done;
 out:
-	file_debug("retval: %zu", retval);
-	kfree(msg);
-	return retval;
+	free_p2m_rw_slots(slots, nr_slots);
+	return done ? done : retval;
 }
 
 /*
- * XXX: chunk write size is limited by memory side rxbuf size
- *      later we may make it flexiable by consulting with memory node
+ * Pages we cached may be read back by others in the middle,
+ * thus drop them both before and after the write.
  */
-#define MAX_WRITE_SIZE	(16 * PAGE_SIZE)
+static ssize_t p2m_writev(struct file *f, const struct iovec *iov,
+			  unsigned long nr_segs, loff_t *off)
+{
+	ssize_t ret;
+
+	file_cache_invalidate(f);
+	ret = p2m_rw_iov(f, iov, nr_segs, off, true);
+	file_cache_invalidate(f);
+	return ret;
+}
+
+static ssize_t p2m_read(struct file *f, char __user *buf, size_t count,
+			loff_t *off)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	ssize_t ret;
+
+	/* Small reads of a leased file are served locally */
+	ret = file_cache_read(f, buf, count, off);
+	if (ret != -EAGAIN)
+		return ret;
+
+	return p2m_rw_iov(f, &iov, 1, off, false);
+}
 
 static ssize_t p2m_write(struct file *f, const char __user *buf,
 			 size_t count, loff_t *off)
 {
-	ssize_t retval = 0;
-	size_t remaining = count;
-	const char __user *curr = buf;
-
-	if (likely(count <= MAX_WRITE_SIZE))
-		return __p2m_write(f, buf, count, off);
+	struct iovec iov = { .iov_base = (void __user *)buf, .iov_len = count };
 
-	while (remaining) {
-		ssize_t ret;
-		size_t len = min(remaining, MAX_WRITE_SIZE);
+	return p2m_writev(f, &iov, 1, off);
+}
 
-		/* offset would automatic incr after write */
-		ret = __p2m_write(f, curr, len, off);
-		if (ret < 0) {
-			retval = ret;
-			goto out;
-		}
-		retval += ret;
-		curr += ret;
-		remaining -= ret;
-	}
-out:
-	return retval;
+/*
+ * readv/writev of a regular file is one contiguous range of the file,
+ * so it goes out as one (pipelined) transfer instead of one per iovec.
+ */
+static ssize_t p2m_readv(struct file *f, const struct iovec *iov,
+			 unsigned long nr_segs, loff_t *off)
+{
+	return p2m_rw_iov(f, iov, nr_segs, off, false);
 }
 
+
 static loff_t default_llseek(struct file *file, loff_t offset, int whence)
 {
 	long ret = -EINVAL;
@@ -250,7 +428,7 @@ static loff_t default_llseek(struct file *file, loff_t offset, int whence)
 	switch (whence) {
 	case SEEK_END:
 #ifdef CONFIG_MEM_PAGE_CACHE
-		ret = get_file_size(file->f_name);
+		ret = get_file_size(file);
 #endif
 		break;
 	case SEEK_CUR:
@@ -281,4 +459,6 @@ struct file_operations default_p2s_f_ops = {
 	.open	= p2s_open,
 	.read	= p2m_read,
 	.write	= p2m_write,
+	.readv	= p2m_readv,
+	.writev	= p2m_writev,
 };
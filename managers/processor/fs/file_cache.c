@@ -0,0 +1,451 @@
+/*
+ * Copyright (c) 2016-2018 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Processor side file data cache
+ *
+ * Small reads of regular files are served from pages cached here, so
+ * files that are read over and over cost a memcpy instead of a P2M_READ.
+ * Pages of a file are found by (memory node, file_id), file_id comes
+ * with P2M_OPEN and is the same for all opens of the file. Thus a file
+ * that is opened, read and closed again still finds its pages.
+ *
+ * Pages are only used while memory's lease on the file is valid,
+ * see managers/memory/pgcache/lease.c. Once it expires, the next read
+ * asks for a new one. If the version has changed meanwhile, all pages
+ * of the file are dropped. Our own writes drop them directly.
+ * Truncate and unlink do not pass memory, we break leases after them.
+ *
+ * All pages are on one LRU list, at most FILE_CACHE_NR_PAGES of them.
+ */
+
+#include <lego/slab.h>
+#include <lego/files.h>
+#include <lego/jiffies.h>
+#include <lego/timer.h>
+#include <lego/kernel.h>
+#include <lego/uaccess.h>
+#include <lego/spinlock.h>
+#include <lego/hashtable.h>
+#include <lego/radixtree.h>
+#include <lego/fit_ibapi.h>
+#include <lego/comp_common.h>
+#include <processor/fs.h>
+#include <processor/processor.h>
+
+#define FILE_CACHE_NR_PAGES	CONFIG_PROCESSOR_FILE_CACHE_NR_PAGES
+#define FILE_CACHE_MAX_READ	(4 * PAGE_SIZE)
+#define FILE_CACHE_HASH_BITS	8
+
+struct file_cache {
+	struct hlist_node	hnode;
+	unsigned int		nid;
+	u64			file_id;
+
+	int			nr_users;	/* struct files pointing here */
+	int			nr_pages;
+	struct list_head	pages_list;
+	struct radix_tree_root	pages;		/* indexed by pos >> PAGE_SHIFT */
+
+	u32			version;
+	unsigned long		lease_expire;	/* jiffies */
+	unsigned long		gen;		/* bumped each time pages are dropped */
+};
+
+/*
+ * @buf is the P2M_READ reply: [ssize_t nr of bytes read][data]
+ * A page shorter than PAGE_SIZE ends at EOF.
+ */
+struct file_cache_page {
+	struct list_head	lru;
+	struct list_head	next;		/* in file's pages_list */
+	struct file_cache	*fc;
+	unsigned long		index;
+	atomic_t		count;
+	ssize_t			*buf;
+};
+
+/* Protects all file caches, their pages and the LRU */
+static DEFINE_SPINLOCK(file_cache_lock);
+static DEFINE_HASHTABLE(file_cache_hash, FILE_CACHE_HASH_BITS);
+static LIST_HEAD(file_cache_lru);
+static int nr_file_cache_pages;
+
+static inline bool lease_valid(struct file_cache *fc)
+{
+	return time_before(jiffies, READ_ONCE(fc->lease_expire));
+}
+
+static inline void *page_data(struct file_cache_page *page)
+{
+	return page->buf + 1;
+}
+
+static void put_file_cache_page(struct file_cache_page *page)
+{
+	if (atomic_dec_and_test(&page->count)) {
+		kfree(page->buf);
+		kfree(page);
+	}
+}
+
+static void remove_file_cache_page_locked(struct file_cache_page *page)
+{
+	struct file_cache *fc = page->fc;
+
+	radix_tree_delete(&fc->pages, page->index);
+	list_del(&page->next);
+	list_del(&page->lru);
+	fc->nr_pages--;
+	nr_file_cache_pages--;
+
+	/* Drop the cache's reference, readers may still hold theirs */
+	put_file_cache_page(page);
+}
+
+static void drop_file_cache_pages_locked(struct file_cache *fc)
+{
+	struct file_cache_page *page, *tmp;
+
+	fc->gen++;
+	list_for_each_entry_safe(page, tmp, &fc->pages_list, next)
+		remove_file_cache_page_locked(page);
+}
+
+static void evict_file_cache_page_locked(void)
+{
+	struct file_cache_page *page;
+	struct file_cache *fc;
+
+	page = list_last_entry(&file_cache_lru, struct file_cache_page, lru);
+	fc = page->fc;
+	remove_file_cache_page_locked(page);
+
+	/* Nobody has it open, and nothing left to find */
+	if (!fc->nr_users && !fc->nr_pages) {
+		hash_del(&fc->hnode);
+		kfree(fc);
+	}
+}
+
+static void set_lease_locked(struct file_cache *fc, struct p2m_file_lease *lease,
+			     unsigned long t_sent)
+{
+	if (lease->version != fc->version) {
+		drop_file_cache_pages_locked(fc);
+		fc->version = lease->version;
+	}
+
+	/* One tick less, memory counts from after we asked */
+	if (lease->lease_msec)
+		WRITE_ONCE(fc->lease_expire,
+			   t_sent + msecs_to_jiffies(lease->lease_msec) - 1);
+	else
+		WRITE_ONCE(fc->lease_expire, t_sent);
+}
+
+static int renew_file_cache_lease(struct file *f, struct file_cache *fc)
+{
+	struct {
+		struct common_header		hdr;
+		struct p2m_file_lease_struct	payload;
+	} msg;
+	struct p2m_file_lease_reply reply;
+	unsigned long t_sent;
+	int retlen;
+
+	msg.hdr.opcode = P2M_FILE_LEASE;
+	msg.hdr.src_nid = LEGO_LOCAL_NID;
+	msg.hdr.length = sizeof(msg);
+	msg.payload.token = f->f_token;
+
+	t_sent = jiffies;
+	retlen = ibapi_send_reply_imm(f->f_token.nid, &msg, sizeof(msg),
+				      &reply, sizeof(reply), false);
+	if (unlikely(retlen != sizeof(reply) || reply.retval))
+		return -EIO;
+
+	spin_lock(&file_cache_lock);
+	set_lease_locked(fc, &reply.lease, t_sent);
+	spin_unlock(&file_cache_lock);
+
+	return reply.lease.lease_msec ? 0 : -EAGAIN;
+}
+
+static struct file_cache_page *
+find_file_cache_page(struct file_cache *fc, unsigned long index)
+{
+	struct file_cache_page *page = NULL;
+
+	spin_lock(&file_cache_lock);
+	if (likely(lease_valid(fc))) {
+		page = radix_tree_lookup(&fc->pages, index);
+		if (page) {
+			atomic_inc(&page->count);
+			list_move(&page->lru, &file_cache_lru);
+		}
+	}
+	spin_unlock(&file_cache_lock);
+
+	return page;
+}
+
+/*
+ * Read page @index from memory, and cache it if nothing changed meanwhile.
+ * Holding a valid lease when the reply is back means memory read the page
+ * before any change from another node. A changed gen means the page may
+ * predate our own write, or a new version. Either way, the page is still
+ * good for the read that asked for it.
+ */
+static struct file_cache_page *
+fill_file_cache_page(struct file *f, struct file_cache *fc, unsigned long index)
+{
+	struct {
+		struct common_header		hdr;
+		struct p2m_read_write_payload	payload;
+	} msg;
+	struct file_cache_page *page, *old;
+	unsigned long gen;
+	int retlen;
+
+	page = kmalloc(sizeof(*page), GFP_KERNEL);
+	if (!page)
+		return ERR_PTR(-ENOMEM);
+
+	page->buf = kmalloc(sizeof(ssize_t) + PAGE_SIZE, GFP_KERNEL);
+	if (!page->buf) {
+		kfree(page);
+		return ERR_PTR(-ENOMEM);
+	}
+	page->fc = fc;
+	page->index = index;
+	atomic_set(&page->count, 1);
+
+	spin_lock(&file_cache_lock);
+	gen = fc->gen;
+	spin_unlock(&file_cache_lock);
+
+	msg.hdr.opcode = P2M_READ;
+	msg.hdr.src_nid = LEGO_LOCAL_NID;
+	msg.hdr.length = sizeof(msg);
+	msg.payload.pid = current->pid;
+	msg.payload.tgid = current->tgid;
+	msg.payload.buf = NULL;
+	msg.payload.token = f->f_token;
+	msg.payload.len = PAGE_SIZE;
+	msg.payload.offset = (loff_t)index << PAGE_SHIFT;
+
+	retlen = ibapi_send_reply_imm(f->f_token.nid, &msg, sizeof(msg),
+				      page->buf, sizeof(ssize_t) + PAGE_SIZE, false);
+	if (unlikely(retlen < (int)sizeof(ssize_t) || *page->buf < 0 ||
+		     *page->buf > PAGE_SIZE)) {
+		ssize_t ret = retlen < (int)sizeof(ssize_t) ? -EIO : *page->buf;
+
+		put_file_cache_page(page);
+		return ERR_PTR(ret > 0 ? -EIO : ret);
+	}
+
+	spin_lock(&file_cache_lock);
+	if (fc->gen != gen || !lease_valid(fc))
+		goto out;
+
+	old = radix_tree_lookup(&fc->pages, index);
+	if (old) {
+		atomic_inc(&old->count);
+		spin_unlock(&file_cache_lock);
+		put_file_cache_page(page);
+		return old;
+	}
+
+	if (radix_tree_insert(&fc->pages, index, page))
+		goto out;
+
+	/* The cache's reference */
+	atomic_inc(&page->count);
+	list_add(&page->lru, &file_cache_lru);
+	list_add(&page->next, &fc->pages_list);
+	fc->nr_pages++;
+	nr_file_cache_pages++;
+
+	while (nr_file_cache_pages > FILE_CACHE_NR_PAGES)
+		evict_file_cache_page_locked();
+out:
+	spin_unlock(&file_cache_lock);
+	return page;
+}
+
+/**
+ * file_cache_read
+ * @f: regular file opened by P2M_OPEN
+ *
+ * Serve a small read from the cache, filling missing pages.
+ * Return -EAGAIN if the read has to go to memory instead.
+ */
+ssize_t file_cache_read(struct file *f, char __user *buf, size_t count,
+			loff_t *pos)
+{
+	struct file_cache *fc = f->f_cache;
+	struct file_cache_page *page;
+	size_t done = 0, offset, n;
+	unsigned long index;
+	ssize_t len;
+
+	if (!fc || count > FILE_CACHE_MAX_READ)
+		return -EAGAIN;
+
+	if (!lease_valid(fc) && renew_file_cache_lease(f, fc))
+		return -EAGAIN;
+
+	while (done < count) {
+		index = (*pos + done) >> PAGE_SHIFT;
+		offset = (*pos + done) & ~PAGE_MASK;
+
+		page = find_file_cache_page(fc, index);
+		if (!page)
+			page = fill_file_cache_page(f, fc, index);
+		if (IS_ERR(page)) {
+			if (!done)
+				return PTR_ERR(page);
+			break;
+		}
+
+		len = *page->buf;
+		n = 0;
+		if (offset < len) {
+			n = min_t(size_t, count - done, len - offset);
+			if (copy_to_user(buf + done, page_data(page) + offset, n)) {
+				put_file_cache_page(page);
+				if (!done)
+					return -EFAULT;
+				break;
+			}
+		}
+		put_file_cache_page(page);
+		done += n;
+
+		/* A short page ends at EOF */
+		if (len < PAGE_SIZE)
+			break;
+	}
+
+	*pos += done;
+	return done;
+}
+
+/* Drop cached pages of @f, before and after we change it */
+void file_cache_invalidate(struct file *f)
+{
+	struct file_cache *fc = f->f_cache;
+
+	if (!fc)
+		return;
+
+	spin_lock(&file_cache_lock);
+	drop_file_cache_pages_locked(fc);
+	spin_unlock(&file_cache_lock);
+}
+
+/**
+ * file_cache_open
+ * @f: the file P2M_OPEN just opened
+ * @lease: lease in P2M_OPEN's reply
+ * @t_sent: jiffies when P2M_OPEN was sent
+ *
+ * Attach @f to the cache of its file, which may already have pages.
+ */
+void file_cache_open(struct file *f, struct p2m_file_lease *lease,
+		     unsigned long t_sent)
+{
+	struct file_cache *fc, *new;
+	unsigned int nid = f->f_token.nid;
+
+	/* Memory has no lease for this file */
+	if (!lease->file_id)
+		return;
+
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return;
+
+	spin_lock(&file_cache_lock);
+	hash_for_each_possible(file_cache_hash, fc, hnode, lease->file_id) {
+		if (fc->nid == nid && fc->file_id == lease->file_id)
+			goto found;
+	}
+
+	fc = new;
+	new = NULL;
+	fc->nid = nid;
+	fc->file_id = lease->file_id;
+	fc->version = lease->version;
+	INIT_LIST_HEAD(&fc->pages_list);
+	INIT_RADIX_TREE(&fc->pages, GFP_ATOMIC);
+	hash_add(file_cache_hash, &fc->hnode, lease->file_id);
+found:
+	fc->nr_users++;
+	set_lease_locked(fc, lease, t_sent);
+	spin_unlock(&file_cache_lock);
+
+	kfree(new);
+	f->f_cache = fc;
+}
+
+/* @f is going away, its pages stay around for the next open */
+void file_cache_release(struct file *f)
+{
+	struct file_cache *fc = f->f_cache;
+
+	if (!fc)
+		return;
+
+	spin_lock(&file_cache_lock);
+	fc->nr_users--;
+	if (!fc->nr_users && !fc->nr_pages) {
+		hash_del(&fc->hnode);
+		kfree(fc);
+	}
+	spin_unlock(&file_cache_lock);
+
+	f->f_cache = NULL;
+}
+
+/**
+ * file_cache_break_lease
+ * @name: absolute name of a file we truncated or unlinked at storage
+ *
+ * Memory did not see the change. Wait until no node, ourselves included,
+ * serves the old content, and the next lease comes with a new version.
+ */
+void file_cache_break_lease(const char *name)
+{
+	struct {
+		struct common_header			hdr;
+		struct p2m_file_lease_break_struct	payload;
+	} *msg;
+	int retval, retlen;
+
+	msg = kmalloc(sizeof(*msg), GFP_KERNEL);
+	if (unlikely(!msg))
+		return;
+
+	msg->hdr.opcode = P2M_FILE_LEASE_BREAK;
+	msg->hdr.src_nid = LEGO_LOCAL_NID;
+	msg->hdr.length = sizeof(*msg);
+	strlcpy(msg->payload.filename, name, MAX_FILENAME_LENGTH);
+
+	for (;;) {
+		retlen = ibapi_send_reply_imm(current_pgcache_home_node(), msg,
+					      sizeof(*msg), &retval, sizeof(retval),
+					      false);
+		if (retlen != sizeof(retval) || retval != -EAGAIN)
+			break;
+		msleep(P2M_LEASE_RETRY_MSEC);
+	}
+	kfree(msg);
+}
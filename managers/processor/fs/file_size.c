@@ -17,42 +17,26 @@
 #include <lego/comp_common.h>
 #include <lego/fit_ibapi.h>
 
-/* 
+/*
  * get_file_size: get up-to-date file size from page cache(memory component)
  * callers: lseek
- * @pathname: full path of the file.
- % @to_storage: if false, will return -ENOENT if file is not in page cache
+ * @filp: the file, opened by P2M_OPEN
  * retval: sizeof the file.
  */
-ssize_t get_file_size(const char *pathname)
+ssize_t get_file_size(struct file *filp)
 {
 	ssize_t ret = 0;
-	void *msg;
-	struct common_header *hdr;
-	int pgcache_node;
-	struct p2m_lseek_struct *payload;
-	u32 len_msg = sizeof(*hdr) + sizeof(*payload);
-	
-	msg = kmalloc(len_msg, GFP_KERNEL);
-	if (unlikely(!msg)) {
-		ret = -ENOMEM;
-		goto out;
-	}
-
-	hdr = msg;
-	hdr->opcode = P2M_LSEEK;
-	hdr->src_nid = LEGO_LOCAL_NID;
-	hdr->length = len_msg;
-
-	payload = msg + sizeof(*hdr);
-	strncpy(payload->filename, pathname, FILENAME_LEN_DEFAULT);
-
-	pgcache_node = current_pgcache_home_node();
-	payload->storage_node = current_storage_home_node();
+	struct {
+		struct common_header	hdr;
+		struct p2m_lseek_struct	payload;
+	} msg;
 
-	ibapi_send_reply_imm(pgcache_node, msg, len_msg, &ret, sizeof(ret), false);
+	msg.hdr.opcode = P2M_LSEEK;
+	msg.hdr.src_nid = LEGO_LOCAL_NID;
+	msg.hdr.length = sizeof(msg);
+	msg.payload.token = filp->f_token;
 
-	kfree(msg);
-out:
+	ibapi_send_reply_imm(filp->f_token.nid, &msg, sizeof(msg),
+			     &ret, sizeof(ret), false);
 	return ret;
 }
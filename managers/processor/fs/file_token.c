@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2016-2018 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Release memory's file handles
+ *
+ * The last put_file() of a regular file often happens under
+ * files->file_lock (close, free_fd), where we can not send P2M_CLOSE.
+ * Such files are queued here, and a daemon sends their tokens to
+ * memory in batches, then frees them.
+ */
+
+#include <lego/slab.h>
+#include <lego/files.h>
+#include <lego/sched.h>
+#include <lego/kthread.h>
+#include <lego/spinlock.h>
+#include <lego/fit_ibapi.h>
+#include <lego/comp_common.h>
+#include <processor/fs.h>
+
+static LIST_HEAD(closed_files);
+static DEFINE_SPINLOCK(closed_files_lock);
+static struct task_struct *file_token_thread;
+
+void close_file_token(struct file *filp)
+{
+	spin_lock(&closed_files_lock);
+	list_add_tail(&filp->f_closed_list, &closed_files);
+	spin_unlock(&closed_files_lock);
+
+	wake_up_process(file_token_thread);
+}
+
+/*
+ * Take up to P2M_CLOSE_BATCH_MAX files of the same memory node
+ * off the queue into @batch. Return the number.
+ */
+static int dequeue_closed_files(struct list_head *batch)
+{
+	struct file *filp, *tmp;
+	unsigned int nid = 0;
+	int nr = 0;
+
+	spin_lock(&closed_files_lock);
+	list_for_each_entry_safe(filp, tmp, &closed_files, f_closed_list) {
+		if (nr == 0)
+			nid = filp->f_token.nid;
+		else if (filp->f_token.nid != nid)
+			continue;
+
+		list_move_tail(&filp->f_closed_list, batch);
+		if (++nr == P2M_CLOSE_BATCH_MAX)
+			break;
+	}
+	spin_unlock(&closed_files_lock);
+	return nr;
+}
+
+static void send_p2m_close(struct p2m_close_msg *msg, struct list_head *batch, int nr)
+{
+	struct file *filp, *tmp;
+	u32 len_msg;
+	int i = 0, retval;
+
+	len_msg = sizeof(*msg) + nr * sizeof(struct lego_file_token);
+	msg->header.opcode = P2M_CLOSE;
+	msg->header.src_nid = LEGO_LOCAL_NID;
+	msg->header.length = len_msg;
+	msg->nr_tokens = nr;
+
+	list_for_each_entry(filp, batch, f_closed_list)
+		msg->tokens[i++] = filp->f_token;
+
+	filp = list_first_entry(batch, struct file, f_closed_list);
+	ibapi_send_reply_imm(filp->f_token.nid, msg, len_msg,
+			     &retval, sizeof(retval), false);
+
+	list_for_each_entry_safe(filp, tmp, batch, f_closed_list) {
+		list_del(&filp->f_closed_list);
+		file_cache_release(filp);
+		kfree(filp);
+	}
+}
+
+static int kfile_closed(void *unused)
+{
+	struct p2m_close_msg *msg;
+	LIST_HEAD(batch);
+	int nr;
+
+	msg = kmalloc(sizeof(*msg) + P2M_CLOSE_BATCH_MAX * sizeof(struct lego_file_token),
+		      GFP_KERNEL);
+	if (!msg)
+		panic("Fail to allocate P2M_CLOSE buffer");
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (list_empty(&closed_files))
+			schedule();
+		__set_current_state(TASK_RUNNING);
+
+		while ((nr = dequeue_closed_files(&batch)))
+			send_p2m_close(msg, &batch, nr);
+	}
+	return 0;
+}
+
+/* Has to be called after kthreadd is running */
+void __init file_token_init(void)
+{
+	file_token_thread = kthread_run(kfile_closed, NULL, "kfile_closed");
+	if (IS_ERR(file_token_thread))
+		panic("Fail to create file close thread!");
+}
@@ -12,6 +12,7 @@
 #include <lego/uaccess.h>
 #include <lego/files.h>
 #include <lego/syscalls.h>
+#include <lego/timer.h>
 #include <processor/fs.h>
 #include <processor/processor.h>
 #include <lego/comp_common.h>
@@ -195,6 +196,8 @@ static long do_unlinkat(int dfd, const char __user *pathname)
 
 	storage_node = current_storage_home_node();
 	ibapi_send_reply_imm(storage_node, msg, len_msg, &ret, sizeof(ret), false);
+	if (!ret)
+		file_cache_break_lease(payload->filename);
 
 	kfree(msg);
 
@@ -438,8 +441,15 @@ static long do_rename(const char __user *oldname, const char __user *newname)
 		goto out;
 	}
 
-	ibapi_send_reply_imm(current_pgcache_home_node(), msg, len_msg,
-				&ret, sizeof(ret), false);
+	for (;;) {
+		ibapi_send_reply_imm(current_pgcache_home_node(), msg, len_msg,
+					&ret, sizeof(ret), false);
+
+		/* Others still hold leases on the files */
+		if (ret != -EAGAIN)
+			break;
+		msleep(P2M_LEASE_RETRY_MSEC);
+	}
 
 	kfree(msg);
 
@@ -465,38 +475,28 @@ SYSCALL_DEFINE2(rename, const char __user *, oldname,
 SYSCALL_DEFINE1(fsync, unsigned int, fd)
 {
 #ifdef CONFIG_MEM_PAGE_CACHE
-	long ret;
-	void *msg;
-	struct common_header *hdr;
+	long ret = 0;
 	struct file *f;
-	struct p2m_fsync_struct *payload;
-	u32 len_msg = sizeof(*hdr) + sizeof(*payload);
-
-	msg = kmalloc(len_msg, GFP_KERNEL);
-	if (unlikely(!msg)) {
-		ret = -ENOMEM;
-		goto out;
-	}
+	struct {
+		struct common_header	hdr;
+		struct p2m_fsync_struct	payload;
+	} msg;
 
 	f = fdget(fd);
-	if (unlikely(!f)) {
-		kfree(msg);
+	if (unlikely(!f))
 		return -EBADF;
-	}
-
-	hdr = msg;
-	hdr->opcode = P2M_FSYNC;
-	hdr->src_nid = LEGO_LOCAL_NID;
-	hdr->length = len_msg;
 
-	payload = msg + sizeof(*hdr);
-	payload->storage_node = current_storage_home_node();
-	strncpy(payload->filename, f->f_name, MAX_FILENAME_LENGTH);
+	/* Not a regular file, nothing cached at memory */
+	if (!file_token_valid(&f->f_token))
+		goto out;
 
-	ibapi_send_reply_imm(current_pgcache_home_node(), msg, len_msg,
-				&ret, sizeof(ret), false);
+	msg.hdr.opcode = P2M_FSYNC;
+	msg.hdr.src_nid = LEGO_LOCAL_NID;
+	msg.hdr.length = sizeof(msg);
+	msg.payload.token = f->f_token;
 
-	kfree(msg);
+	ibapi_send_reply_imm(f->f_token.nid, &msg, sizeof(msg),
+			     &ret, sizeof(ret), false);
 
 out:
 	put_file(f);
@@ -136,53 +136,138 @@ SYSCALL_DEFINE0(sync)
 	return 0;
 }
 
-static ssize_t do_readv(unsigned long fd, const struct iovec __user *vec,
-			unsigned long vlen, int flags)
-{
-	pr_info("%s: fd: %lu\n", __func__, fd);
-	return -EFAULT;
-}
-
-static ssize_t do_writev(unsigned long fd, const struct iovec __user *vec,
-			 unsigned long vlen, int flags)
+/*
+ * Copy the iovec array in from user, into @fast_pointer if it fits.
+ * Return the total length, or -errno. *@ret_pointer is the array to
+ * use, the caller kfree()s it if it is not @fast_pointer.
+ */
+static ssize_t rw_copy_check_uvector(const struct iovec __user *uvector,
+				     unsigned long nr_segs, unsigned long fast_segs,
+				     struct iovec *fast_pointer,
+				     struct iovec **ret_pointer)
 {
-	struct iovec *kvec;
-	char *buf;
-	int i;
+	struct iovec *iov = fast_pointer;
 	ssize_t ret = 0;
+	unsigned long seg;
+
+	*ret_pointer = fast_pointer;
+	if (nr_segs == 0)
+		return 0;
+	if (nr_segs > UIO_MAXIOV)
+		return -EINVAL;
+
+	if (nr_segs > fast_segs) {
+		iov = kmalloc(nr_segs * sizeof(*iov), GFP_KERNEL);
+		if (!iov)
+			return -ENOMEM;
+		*ret_pointer = iov;
+	}
 
-	pr_info("%s: fd: %lu, nrvec: %lu\n",
-		__func__, fd, vlen);
+	if (copy_from_user(iov, uvector, nr_segs * sizeof(*iov)))
+		return -EFAULT;
 
-	kvec = kzalloc(vlen * sizeof(*kvec), GFP_KERNEL);
-	if (!kvec)
-		return -ENOMEM;
+	for (seg = 0; seg < nr_segs; seg++) {
+		ssize_t len = (ssize_t)iov[seg].iov_len;
 
-	buf = kzalloc(PAGE_SIZE, GFP_KERNEL);
-	if (!buf) {
-		kfree(kvec);
-		return -ENOMEM;
+		/* Overflow of either one iovec or the total */
+		if (len < 0 || ret + len < ret)
+			return -EINVAL;
+		ret += len;
 	}
+	return ret;
+}
 
-	if (copy_from_user(kvec, vec, vlen * sizeof(*kvec))) {
-		ret = -EFAULT;
-		goto free;
+/*
+ * Files that have no vectored op get one read/write per iovec,
+ * until one of them comes back short.
+ */
+static ssize_t do_loop_readv_writev(struct file *f, const struct iovec *iov,
+				    unsigned long nr_segs, loff_t *pos, bool write)
+{
+	ssize_t ret = 0, nr;
+
+	for (; nr_segs > 0; iov++, nr_segs--) {
+		if (write)
+			nr = f->f_op->write(f, iov->iov_base, iov->iov_len, pos);
+		else
+			nr = f->f_op->read(f, iov->iov_base, iov->iov_len, pos);
+
+		if (nr < 0) {
+			if (!ret)
+				ret = nr;
+			break;
+		}
+		ret += nr;
+		if (nr != iov->iov_len)
+			break;
 	}
+	return ret;
+}
 
-	for (i = 0; i < vlen; i++) {
-		if (copy_from_user(buf, kvec[i].iov_base, kvec[i].iov_len)) {
-			ret = -EFAULT;
-			goto free;
-		}
-		ret += kvec[i].iov_len;
+static ssize_t vfs_readv_writev(struct file *f, const struct iovec __user *uvector,
+			       unsigned long nr_segs, loff_t *pos, bool write)
+{
+	struct iovec iovstack[UIO_FASTIOV];
+	struct iovec *iov;
+	ssize_t ret;
 
-		pr_info("  vec[%d]: %s\n", i, buf);
-		memset(buf, 0, PAGE_SIZE);
-	}
+	ret = rw_copy_check_uvector(uvector, nr_segs, ARRAY_SIZE(iovstack),
+				    iovstack, &iov);
+	if (ret <= 0)
+		goto out;
+
+	if (write && f->f_op->writev)
+		ret = f->f_op->writev(f, iov, nr_segs, pos);
+	else if (!write && f->f_op->readv)
+		ret = f->f_op->readv(f, iov, nr_segs, pos);
+	else
+		ret = do_loop_readv_writev(f, iov, nr_segs, pos, write);
+
+out:
+	if (iov != iovstack)
+		kfree(iov);
+	return ret;
+}
+
+static ssize_t do_readv_writev(unsigned long fd, const struct iovec __user *vec,
+			unsigned long vlen, bool write)
+{
+	struct file *f;
+	ssize_t ret;
+	loff_t pos;
+
+	f = fdget(fd);
+	if (!f)
+		return -EBADF;
+
+	/*
+	 * f_pos is updated without locking
+	 * synchronization is maintained by application
+	 */
+	pos = f->f_pos;
+	ret = vfs_readv_writev(f, vec, vlen, &pos, write);
+	f->f_pos = pos;
 
-free:
-	kfree(kvec);
-	kfree(buf);
+	put_file(f);
+	return ret;
+}
+
+static ssize_t do_preadv_pwritev(unsigned long fd, const struct iovec __user *vec,
+			 unsigned long vlen, loff_t pos, bool write)
+{
+	struct file *f;
+	ssize_t ret;
+
+	if (pos < 0)
+		return -EINVAL;
+
+	f = fdget(fd);
+	if (!f)
+		return -EBADF;
+
+	ret = vfs_readv_writev(f, vec, vlen, &pos, write);
+
+	put_file(f);
 	return ret;
 }
 
@@ -193,7 +278,7 @@ SYSCALL_DEFINE3(readv, unsigned long, fd, const struct iovec __user *, vec,
 
 	syscall_enter("fd: %lu, vec: %p, vlen: %#lx\n",
 		fd, vec, vlen);
-	ret = do_readv(fd, vec, vlen, 0);
+	ret = do_readv_writev(fd, vec, vlen, false);
 	syscall_exit(ret);
 	return ret;
 }
@@ -205,7 +290,32 @@ SYSCALL_DEFINE3(writev, unsigned long, fd, const struct iovec __user *, vec,
 
 	syscall_enter("fd: %lu, vec: %p, vlen: %#lx\n",
 		fd, vec, vlen);
-	ret = do_writev(fd, vec, vlen, 0);
+	ret = do_readv_writev(fd, vec, vlen, true);
+	syscall_exit(ret);
+	return ret;
+}
+
+/* pos_h is only used by 32-bit ABIs */
+SYSCALL_DEFINE5(preadv, unsigned long, fd, const struct iovec __user *, vec,
+		unsigned long, vlen, unsigned long, pos_l, unsigned long, pos_h)
+{
+	long ret;
+
+	syscall_enter("fd: %lu, vec: %p, vlen: %#lx, pos: %Ld\n",
+		fd, vec, vlen, (loff_t)pos_l);
+	ret = do_preadv_pwritev(fd, vec, vlen, pos_l, false);
+	syscall_exit(ret);
+	return ret;
+}
+
+SYSCALL_DEFINE5(pwritev, unsigned long, fd, const struct iovec __user *, vec,
+		unsigned long, vlen, unsigned long, pos_l, unsigned long, pos_h)
+{
+	long ret;
+
+	syscall_enter("fd: %lu, vec: %p, vlen: %#lx, pos: %Ld\n",
+		fd, vec, vlen, (loff_t)pos_l);
+	ret = do_preadv_pwritev(fd, vec, vlen, pos_l, true);
 	syscall_exit(ret);
 	return ret;
 }
@@ -183,6 +183,11 @@ do_default_kstat(char *filepath, struct kstat *stat, int flag)
 	return get_kstat_from_storage(filepath, stat, flag);
 }
 
+static inline int do_default_fstat(struct file *f, struct kstat *stat)
+{
+	return get_kstat_from_storage(f->f_name, stat, 0);
+}
+
 #else
 /*
  * get_kstat_from_memory: get corresponding stats specific path
@@ -236,6 +241,36 @@ do_default_kstat(char *filepath, struct kstat *stat, int flag)
 	return get_kstat_from_memory(filepath, stat, flag);
 }
 
+/*
+ * Memory finds the file by token. Size comes from page cache,
+ * and follows renames done through memory.
+ */
+static int do_default_fstat(struct file *f, struct kstat *stat)
+{
+	struct {
+		struct common_header	hdr;
+		struct p2m_fstat_struct	payload;
+	} msg;
+	struct p2s_stat_ret_struct retbuf;
+	int ret;
+
+	if (!file_token_valid(&f->f_token))
+		return get_kstat_from_memory(f->f_name, stat, 0);
+
+	msg.hdr.opcode = P2M_FSTAT;
+	msg.hdr.src_nid = LEGO_LOCAL_NID;
+	msg.hdr.length = sizeof(msg);
+	msg.payload.token = f->f_token;
+
+	ret = ibapi_send_reply_imm(f->f_token.nid, &msg, sizeof(msg),
+				   &retbuf, sizeof(retbuf), false);
+	if (ret != sizeof(retbuf))
+		return -EIO;
+
+	*stat = retbuf.statbuf;
+	return retbuf.retval;
+}
+
 #endif /* CONFIG_MEM_PAGE_CACHE */
 
 #endif /* CONFIG_USE_RAMFS */
@@ -336,13 +371,16 @@ SYSCALL_DEFINE2(newfstat, unsigned int, fd, struct stat __user *, statbuf)
 		goto fill;
 
 #ifndef CONFIG_USE_RAMFS
-	ret = do_default_kstat(f->f_name, &stat, 0);
-	if (ret)
+	ret = do_default_fstat(f, &stat);
+	if (ret) {
+		put_file(f);
 		goto out;
+	}
 #endif
 
 fill:
 	ret = cp_new_stat(&stat, statbuf);
+	put_file(f);
 out:
 	syscall_exit(ret);
 	return ret;
@@ -47,6 +47,8 @@ long do_truncate(const char *kname, long length)
 	storage_node = current_storage_home_node();
 	ibapi_send_reply_imm(current_storage_home_node(), msg, len_msg,		\
 			&ret, sizeof(ret), false);
+	if (!ret)
+		file_cache_break_lease(kname);
 	
 	kfree(msg);
 	return ret;
@@ -94,6 +96,7 @@ SYSCALL_DEFINE2(ftruncate, unsigned int, fd, unsigned long, length)
 	}
 
 	ret = do_truncate(f->f_name, length);
+	file_cache_invalidate(f);
 out:
 	syscall_exit(ret);
 	return ret;
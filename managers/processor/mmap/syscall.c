@@ -22,6 +22,7 @@
 #include <processor/processor.h>
 #include <processor/distvm.h>
 #include <processor/zerofill.h>
+#include <processor/replication.h>
 
 #ifdef CONFIG_DEBUG_MMAP
 #define mmap_debug(fmt, ...)						\
@@ -311,6 +312,7 @@ SYSCALL_DEFINE3(msync, unsigned long, start, size_t, len, int, flags)
 	struct p2m_msync_struct payload;
 	long retbuf, ret;
 	unsigned long end;
+	int rep_ret = 0;
 
 	syscall_enter("start:%#lx,len:%#lx,flags:%#x\n",
 		start, len, flags);
@@ -328,6 +330,13 @@ SYSCALL_DEFINE3(msync, unsigned long, start, size_t, len, int, flags)
 	if (end == start)
 		return 0;
 
+	/*
+	 * Lines flushed before this point must have reached
+	 * the secondary memory as well.
+	 */
+	if (flags & MS_SYNC)
+		rep_ret = replication_barrier();
+
 	/* all good, send request */
 	payload.pid = current->tgid;
 	payload.start = start;
@@ -343,6 +352,10 @@ SYSCALL_DEFINE3(msync, unsigned long, start, size_t, len, int, flags)
 	else
 		ret = -EIO;
 
+	/* Home memory has the data, but its replica is incomplete */
+	if (!ret && rep_ret)
+		ret = rep_ret;
+
 	syscall_exit(ret);
 	return ret;
 }
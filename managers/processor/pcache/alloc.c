@@ -132,9 +132,9 @@ void __put_pcache_nolru(struct pcache_meta *pcm)
 		return;
 
 	pset = pcache_meta_to_pcache_set(pcm);
-	spin_lock(&pset->free_lock);
+	pset_lock(pset, PSET_LOCK_FREE);
 	__enqueue_free_list_head(pcm, pset);
-	spin_unlock(&pset->free_lock);
+	pset_unlock(pset, PSET_LOCK_FREE);
 }
 
 /*
@@ -178,13 +178,13 @@ pcache_alloc_fastpath(struct pcache_set *pset)
 		goto prep;
 	}
 
-	spin_lock(&pset->free_lock);
+	pset_lock(pset, PSET_LOCK_FREE);
 	if (list_empty(&pset->free_head)) {
-		spin_unlock(&pset->free_lock);
+		pset_unlock(pset, PSET_LOCK_FREE);
 		return NULL;
 	}
 	pcm = __dequeue_free_list_head(pset);
-	spin_unlock(&pset->free_lock);
+	pset_unlock(pset, PSET_LOCK_FREE);
 
 	pcache_reset_flags(pcm);
 prep:
@@ -194,6 +194,48 @@ prep:
 	return pcm;
 }
 
+/*
+ * Return true if allocating a line for @address will
+ * have to evict someone first. This is only a hint.
+ */
+bool pcache_alloc_need_evict(unsigned long address)
+{
+	struct pcache_set *pset;
+
+	if (this_cpu_read(piggybacker))
+		return false;
+
+	pset = user_vaddr_to_pcache_set(address);
+	return list_empty(&pset->free_head);
+}
+
+/*
+ * Allocate a free line from the pset @address maps to, never evict.
+ * Piggyback is disabled. Return NULL if the set is full.
+ */
+struct pcache_meta *pcache_alloc_nowait(unsigned long address)
+{
+	struct pcache_set *pset;
+	struct pcache_meta *pcm;
+
+	pset = user_vaddr_to_pcache_set(address);
+
+	pset_lock(pset, PSET_LOCK_FREE);
+	if (list_empty(&pset->free_head)) {
+		pset_unlock(pset, PSET_LOCK_FREE);
+		return NULL;
+	}
+	pcm = __dequeue_free_list_head(pset);
+	pset_unlock(pset, PSET_LOCK_FREE);
+
+	pcache_reset_flags(pcm);
+	prep_new_pcache_meta(pcm);
+	add_to_lru_list(pcm, pset);
+	inc_pcache_used();
+	inc_pset_event(pset, PSET_ALLOC);
+	return pcm;
+}
+
 DEFINE_PROFILE_POINT(pcache_alloc)
 DEFINE_PROFILE_POINT(pcache_alloc_evict)
 DEFINE_PROFILE_POINT(pcache_alloc_fastpath)
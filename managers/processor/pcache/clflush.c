@@ -43,15 +43,16 @@ DEFINE_PROFILE_POINT(pcache_flush_net)
  *
  * Replication is done the at the end, if configured.
  *
- * TODO:
- * Instead of having a per-cpu message array and doing a memcpy,
- * we should use IB sg list to send both metadate and in-place cache data out.
+ * Only the message header lives in the per-cpu array. The cache line is
+ * sent in place as the second sge, no memcpy. Replication copies the line
+ * into a replica batch, which is sent to secondary memory asynchronously.
  */
 void __clflush_one(pid_t tgid, unsigned long user_va,
 		   unsigned int m_nid, unsigned int rep_nid, void *cache_addr)
 {
 	int reply, cpu;
 	struct p2m_flush_msg *msg;
+	struct fit_sglist sgl[2];
 	PROFILE_POINT_TIME(pcache_flush_net)
 
 	/*
@@ -66,7 +67,11 @@ void __clflush_one(pid_t tgid, unsigned long user_va,
 	fill_common_header(msg, P2M_PCACHE_FLUSH);
 	msg->pid = tgid;
 	msg->user_va = user_va & PCACHE_LINE_MASK;
-	memcpy(msg->pcacheline, cache_addr, PCACHE_LINE_SIZE);
+
+	sgl[0].addr = msg;
+	sgl[0].len = offsetof(struct p2m_flush_msg, pcacheline);
+	sgl[1].addr = cache_addr;
+	sgl[1].len = PCACHE_LINE_SIZE;
 	barrier();
 
 	clflush_debug("I m_nid:%d tgid:%u user_va:%#lx cache_kva:%p",
@@ -74,8 +79,8 @@ void __clflush_one(pid_t tgid, unsigned long user_va,
 
 	/* Network */
 	PROFILE_START(pcache_flush_net);
-	ibapi_send_reply_timeout(m_nid, msg, sizeof(*msg),
-				 &reply, sizeof(reply), false, DEF_NET_TIMEOUT);
+	ibapi_send_reply_sge_timeout(m_nid, sgl, ARRAY_SIZE(sgl),
+				     &reply, sizeof(reply), DEF_NET_TIMEOUT);
 	PROFILE_LEAVE(pcache_flush_net);
 	clflush_debug("O tgid:%u user_va:%#lx cache_kva:%p reply:%d %s",
 		msg->pid, msg->user_va, cache_addr, reply, perror(reply));
@@ -84,13 +89,89 @@ void __clflush_one(pid_t tgid, unsigned long user_va,
 	inc_pcache_event(PCACHE_CLFLUSH);
 	inc_pcache_event_cond(PCACHE_CLFLUSH_FAIL, !!reply);
 
+	put_cpu();
+
 	/*
 	 * Replica this dirty cache line to secondary
 	 * memory component. If replication is enabled.
 	 */
 	replicate(tgid, user_va, m_nid, rep_nid, cache_addr);
+}
 
-	put_cpu();
+/*
+ * Send @nr lines that all go to @m_nid with one P2M_PCACHE_FLUSH_BATCH.
+ * Replication is still done line by line afterwards.
+ */
+static void clflush_batch_send(unsigned int m_nid, struct clflush_batch_entry *entries,
+			       int nr, struct p2m_flush_batch_msg *msg)
+{
+	struct fit_sglist sgl[P2M_PCACHE_FLUSH_BATCH_MAX + 1];
+	int i, ret, reply;
+
+	BUILD_BUG_ON(ARRAY_SIZE(sgl) > FIT_MAX_SEND_SGE);
+
+	fill_common_header(msg, P2M_PCACHE_FLUSH_BATCH);
+	msg->nr_entries = nr;
+	sgl[0].addr = msg;
+	sgl[0].len = sizeof(*msg);
+	for (i = 0; i < nr; i++) {
+		msg->entries[i].pid = entries[i].tgid;
+		msg->entries[i].user_va = entries[i].user_va & PCACHE_LINE_MASK;
+		sgl[i + 1].addr = entries[i].cache_addr;
+		sgl[i + 1].len = PCACHE_LINE_SIZE;
+	}
+	barrier();
+
+	ret = ibapi_send_reply_sge_timeout(m_nid, sgl, nr + 1, &reply, sizeof(reply),
+					   DEF_NET_TIMEOUT);
+	if (unlikely(ret != sizeof(reply)))
+		reply = nr;
+
+	inc_pcache_event(PCACHE_CLFLUSH_BATCH);
+	add_pcache_event(PCACHE_CLFLUSH, nr);
+	add_pcache_event(PCACHE_CLFLUSH_FAIL, reply);
+
+	for (i = 0; i < nr; i++)
+		replicate(entries[i].tgid, entries[i].user_va, m_nid,
+			  entries[i].rep_nid, entries[i].cache_addr);
+}
+
+/**
+ * __clflush_batch
+ * @entries: lines to flush, reordered on return
+ * @nr: number of lines, at most P2M_PCACHE_FLUSH_BATCH_MAX
+ * @msg: caller's buffer for the header, lines are sent from pcache
+ *
+ * Flush lines with one request per memory node. A lone line
+ * of a node still goes out as a normal P2M_PCACHE_FLUSH.
+ */
+void __clflush_batch(struct clflush_batch_entry *entries, int nr,
+		     struct p2m_flush_batch_msg *msg)
+{
+	unsigned int m_nid;
+	int i, n;
+
+	BUG_ON(nr > P2M_PCACHE_FLUSH_BATCH_MAX);
+
+	while (nr > 0) {
+		/* Move all lines of the same node to the front */
+		m_nid = entries[0].m_nid;
+		for (i = 1, n = 1; i < nr; i++) {
+			if (entries[i].m_nid == m_nid) {
+				swap(entries[i], entries[n]);
+				n++;
+			}
+		}
+
+		if (n == 1)
+			__clflush_one(entries[0].tgid, entries[0].user_va,
+				      m_nid, entries[0].rep_nid, entries[0].cache_addr);
+		else
+			clflush_batch_send(m_nid, entries, n, msg);
+
+		entries += n;
+		nr -= n;
+	}
 }
 
 /*
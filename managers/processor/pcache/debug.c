@@ -23,7 +23,9 @@
 	{1UL << PC_reclaim,		"reclaim"	},	\
 	{1UL << PC_writeback,		"writeback"	},	\
 	{1UL << PC_piggyback,		"piggyback"	},	\
-	{1UL << PC_piggyback,		"piggybackC"	}
+	{1UL << PC_piggyback,		"piggybackC"	},	\
+	{1UL << PC_prefetched,		"prefetched"	},	\
+	{1UL << PC_lru_staged,		"lrustaged"	}
 
 const struct trace_print_flags pcacheflag_names[] = {
 	__def_pcacheflag_names,
@@ -54,6 +56,7 @@ static const char *RMAP_CALLER_NAME[] = {
 	"cow",
 	"fork",
 	"mremap_slowpath",
+	"prefetch",
 };
 
 /**
@@ -108,27 +111,30 @@ void dump_pset(struct pcache_set *pset)
 
 	pr_debug("pset:%p set_idx: %lu nr_lru:%d\n",
 		pset, pcache_set_to_set_index(pset),
-		IS_ENABLED(CONFIG_PCACHE_EVICT_LRU) ? atomic_read(&pset->nr_lru) : 0);
+		IS_ENABLED(CONFIG_PCACHE_EVICT_LRU_LIST) ? atomic_read(&pset->nr_lru) : 0);
 
 	pcm = this_cpu_read(piggybacker);
 	if (pcm)
 		dump_pcache_meta(pcm, "This is piggybacker");
 
 	pr_info("Free List\n");
-	spin_lock(&pset->free_lock);
+	pset_lock(pset, PSET_LOCK_FREE);
 	list_for_each_entry(pcm, &pset->free_head, free_list) {
 		dump_pcache_meta(pcm, NULL);
 		dump_pcache_rmaps(pcm);
 	}
-	spin_unlock(&pset->free_lock);
+	pset_unlock(pset, PSET_LOCK_FREE);
 
+#ifdef CONFIG_PCACHE_EVICT_LRU_LIST
 	pr_info("LRU List\n");
-	spin_lock(&pset->lru_lock);
+	pset_lock(pset, PSET_LOCK_LRU);
+	__drain_lru_add(pset);
 	list_for_each_entry(pcm, &pset->lru_list, lru) {
 		dump_pcache_meta(pcm, NULL);
 		dump_pcache_rmaps(pcm);
 	}
-	spin_unlock(&pset->lru_lock);
+	pset_unlock(pset, PSET_LOCK_LRU);
+#endif
 	spin_unlock(&dump_pset_lock);
 }
 
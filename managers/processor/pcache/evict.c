@@ -37,6 +37,10 @@ evict_find_line(struct pcache_set *pset)
 	return evict_find_line_fifo(pset);
 #elif defined(CONFIG_PCACHE_EVICT_LRU)
 	return evict_find_line_lru(pset);
+#elif defined(CONFIG_PCACHE_EVICT_CLOCK)
+	return evict_find_line_clock(pset);
+#elif defined(CONFIG_PCACHE_EVICT_ADAPTIVE)
+	return evict_find_line_adaptive(pset);
 #endif
 }
 
@@ -178,6 +182,10 @@ int pcache_evict_line(struct pcache_set *pset, unsigned long address,
 	nr_mapped = pcache_mapcount(pcm);
 	BUG_ON(nr_mapped < 1);
 
+	/* Was this line brought in by prefetcher and never used? */
+	if (PcachePrefetched(pcm))
+		pcache_prefetch_account(pcm, pcache_referenced(pcm) > 0);
+
 	PROFILE_START(pcache_alloc_evict_do_evict);
 	ret = evict_line(pset, pcm, address, piggyback);
 	PROFILE_LEAVE(pcache_alloc_evict_do_evict);
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2016-2018 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Adaptive eviction algorithm, using set dueling.
+ *
+ * Within every PCACHE_EVICT_DUEL_PERIOD sets, the first few sets are sample
+ * sets, each of them always uses one fixed policy. A set only evicts when a
+ * miss lands in it while it is full, so the number of evictions in sample
+ * sets tells us which policy misses the least. Every PCACHE_EVICT_DUEL_EPOCH
+ * sample evictions, all the other sets switch to the winner.
+ */
+
+#include <lego/mm.h>
+#include <lego/kernel.h>
+#include <processor/pcache.h>
+#include <processor/processor.h>
+
+#define DUEL_PERIOD	CONFIG_PCACHE_EVICT_DUEL_PERIOD
+#define DUEL_EPOCH	CONFIG_PCACHE_EVICT_DUEL_EPOCH
+
+static atomic_t duel_evictions[NR_PCACHE_EVICT_POLICIES];
+static atomic_t duel_nr_samples = ATOMIC_INIT(0);
+
+/* CLOCK does not need sweep thread, a good start */
+static int follower_policy __read_mostly = PCACHE_EVICT_POLICY_CLOCK;
+
+static const char *const evict_policy_text[NR_PCACHE_EVICT_POLICIES] = {
+	[PCACHE_EVICT_POLICY_LRU]	= "LRU",
+	[PCACHE_EVICT_POLICY_CLOCK]	= "CLOCK",
+	[PCACHE_EVICT_POLICY_RANDOM]	= "Random",
+};
+
+/* Return the policy @pset samples, or -1 if it is a follower */
+static inline int pset_sample_policy(struct pcache_set *pset)
+{
+	unsigned long idx;
+
+	idx = pcache_set_to_set_index(pset) % DUEL_PERIOD;
+	if (idx < NR_PCACHE_EVICT_POLICIES)
+		return idx;
+	return -1;
+}
+
+static void duel_select_policy(void)
+{
+	int i, best, nr_best;
+	int nr[NR_PCACHE_EVICT_POLICIES];
+
+	for (i = 0; i < NR_PCACHE_EVICT_POLICIES; i++)
+		nr[i] = atomic_xchg(&duel_evictions[i], 0);
+
+	/* Stick with current one if there is a tie */
+	best = READ_ONCE(follower_policy);
+	nr_best = nr[best];
+	for (i = 0; i < NR_PCACHE_EVICT_POLICIES; i++) {
+		if (nr[i] < nr_best) {
+			best = i;
+			nr_best = nr[i];
+		}
+	}
+
+	if (best != READ_ONCE(follower_policy)) {
+		WRITE_ONCE(follower_policy, best);
+		inc_pcache_event(PCACHE_DUEL_SWITCH);
+	}
+}
+
+static inline void duel_account_eviction(int policy)
+{
+	atomic_inc(&duel_evictions[policy]);
+
+	/* Only one CPU can see the exact number */
+	if (atomic_inc_return(&duel_nr_samples) == DUEL_EPOCH) {
+		atomic_sub(DUEL_EPOCH, &duel_nr_samples);
+		duel_select_policy();
+	}
+}
+
+struct pcache_meta *evict_find_line_adaptive(struct pcache_set *pset)
+{
+	struct pcache_meta *pcm;
+	int policy;
+
+	policy = pset_sample_policy(pset);
+	if (likely(policy < 0))
+		return evict_find_line_list(pset, READ_ONCE(follower_policy));
+
+	pcm = evict_find_line_list(pset, policy);
+	if (!IS_ERR_OR_NULL(pcm))
+		duel_account_eviction(policy);
+	return pcm;
+}
+
+void print_pcache_evict_duel(void)
+{
+	int i;
+
+	pr_info("pcache eviction policy: %s\n",
+		evict_policy_text[READ_ONCE(follower_policy)]);
+	for (i = 0; i < NR_PCACHE_EVICT_POLICIES; i++)
+		pr_info("  sample %s evictions: %d\n", evict_policy_text[i],
+			atomic_read(&duel_evictions[i]));
+}
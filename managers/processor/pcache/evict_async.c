@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2016-2018 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Background eviction daemon
+ *
+ * A pgfault that misses in a full set queues the set here, and goes on
+ * sending its miss request. This daemon evicts one line from the set
+ * while the request is in flight. At most one request per set is queued,
+ * PsetAsyncEvict is cleared once the eviction is done.
+ */
+
+#include <lego/mm.h>
+#include <lego/smp.h>
+#include <lego/slab.h>
+#include <lego/wait.h>
+#include <lego/kernel.h>
+#include <lego/kthread.h>
+#include <lego/profile.h>
+#include <processor/pcache.h>
+#include <processor/processor.h>
+
+static atomic_t nr_async_evict_jobs = ATOMIC_INIT(0);
+static DEFINE_SPINLOCK(async_evict_lock);
+static LIST_HEAD(async_evict_queue);
+static struct task_struct *async_evict_thread;
+static DEFINE_WAIT_QUEUE_HEAD(async_evict_wait);
+
+void pcache_evict_async(unsigned long address)
+{
+	struct pcache_set *pset;
+
+	pset = user_vaddr_to_pcache_set(address);
+	if (TestSetPsetAsyncEvict(pset))
+		return;
+
+	spin_lock(&async_evict_lock);
+	pset->async_evict_address = address;
+	list_add_tail(&pset->async_evict_list, &async_evict_queue);
+	atomic_inc(&nr_async_evict_jobs);
+	spin_unlock(&async_evict_lock);
+
+	wake_up(&async_evict_wait);
+}
+
+static struct pcache_set *dequeue_async_evict(void)
+{
+	struct pcache_set *pset = NULL;
+
+	spin_lock(&async_evict_lock);
+	if (likely(!list_empty(&async_evict_queue))) {
+		pset = list_first_entry(&async_evict_queue, struct pcache_set,
+					async_evict_list);
+		list_del_init(&pset->async_evict_list);
+		atomic_dec(&nr_async_evict_jobs);
+	}
+	spin_unlock(&async_evict_lock);
+	return pset;
+}
+
+static void do_async_evict(struct pcache_set *pset)
+{
+	/* Someone may have freed a line already */
+	if (!list_empty(&pset->free_head))
+		return;
+
+	/*
+	 * The faulting thread does not take piggyback candidates,
+	 * disable it. Failures are fine here, faulting thread will
+	 * fall back to synchronous eviction.
+	 */
+	pcache_evict_line(pset, pset->async_evict_address, DISABLE_PIGGYBACK);
+}
+
+static int kevict_asyncd(void *unused)
+{
+	struct pcache_set *pset;
+
+	for (;;) {
+		wait_event_interruptible(async_evict_wait,
+					 atomic_read(&nr_async_evict_jobs));
+
+		while ((pset = dequeue_async_evict())) {
+			do_async_evict(pset);
+			ClearPsetAsyncEvict(pset);
+		}
+	}
+	return 0;
+}
+
+void __init evict_async_init(void)
+{
+	async_evict_thread = kthread_run(kevict_asyncd, NULL, "kevict_asyncd");
+	if (IS_ERR(async_evict_thread))
+		panic("Fail to create async evict thread!");
+}
@@ -22,6 +22,13 @@
  * New pcache lines are inserted at the head
  * Eviction scan from the tail reversely
  * Sweep will move unused pcache to tail
+ *
+ * CLOCK and Random reuse the same list:
+ * - CLOCK checks the Accessed bit of each candidate. If referenced,
+ *   the bit is cleared and the line is moved to the head. A line whose
+ *   pte lock stays busy keeps coming back, thus a scan gives up after
+ *   looking at twice the number of lines in the set.
+ * - Random skips a random number of lines from the tail.
  */
 
 static inline bool pset_has_free_lines(struct pcache_set *pset)
@@ -74,14 +81,43 @@ static inline int lru_get_pcache(struct pcache_meta *pcm)
 	return !get_pcache_unless_zero(pcm);
 }
 
+/*
+ * Give the line a second chance if it was accessed since last check.
+ * Return true if it was rotated to the head of the list.
+ */
+static inline bool
+clock_second_chance(struct pcache_meta *pcm, struct pcache_set *pset)
+{
+	int pte_referenced, pte_contention;
+
+	pcache_referenced_trylock(pcm, &pte_referenced, &pte_contention);
+
+	/*
+	 * Accessed bit is cleared now, account prefetch here,
+	 * eviction will not be able to tell it was used.
+	 */
+	if (pte_referenced && PcachePrefetched(pcm))
+		pcache_prefetch_account(pcm, true);
+
+	/* pte lock contention, someone is likely using it */
+	if (pte_contention || pte_referenced) {
+		list_move(&pcm->lru, &pset->lru_list);
+		inc_pcache_event(PCACHE_CLOCK_SECOND_CHANCE);
+		return true;
+	}
+	return false;
+}
+
 /*
  * This function is similar to some part of shrink_page_list(). 
  * The returned pcache is Locked, Reclaim, ref inc'ed 1 by us.
  */
-struct pcache_meta *evict_find_line_lru(struct pcache_set *pset)
+struct pcache_meta *
+evict_find_line_list(struct pcache_set *pset, enum pcache_evict_policy policy)
 {
-	struct pcache_meta *pcm;
+	struct pcache_meta *pcm, *n;
 	bool found = false;
+	int nr_to_skip = 0, nr_to_scan;
 
 	/*
 	 * We used to check if @pset has free lines in the middle
@@ -90,10 +126,24 @@ struct pcache_meta *evict_find_line_lru(struct pcache_set *pset)
 	 * CPUs to contend for one just-freed-line. Instead, we
 	 * want each CPU do its eviction and allocation on its own.
 	 */
-	spin_lock(&pset->lru_lock);
-	list_for_each_entry_reverse(pcm, &pset->lru_list, lru) {
+	pset_lock(pset, PSET_LOCK_LRU);
+	__drain_lru_add(pset);
+	if (policy == PCACHE_EVICT_POLICY_RANDOM && pset_nr_lru(pset))
+		nr_to_skip = sched_clock() % pset_nr_lru(pset);
+	nr_to_scan = 2 * pset_nr_lru(pset);
+
+	list_for_each_entry_safe_reverse(pcm, n, &pset->lru_list, lru) {
 		PCACHE_BUG_ON_PCM(PcacheReclaim(pcm), pcm);
 
+		/* Rotated lines come around again, do not chase them forever */
+		if (nr_to_scan-- <= 0)
+			break;
+
+		if (nr_to_skip) {
+			nr_to_skip--;
+			continue;
+		}
+
 		/*
 		 * Someone else freed at the same time
 		 * Counter is updated within lru_lock, but we are holding it.
@@ -124,6 +174,10 @@ struct pcache_meta *evict_find_line_lru(struct pcache_set *pset)
 		if (unlikely(pcache_ref_count(pcm) > 2))
 			goto unlock_pcache;
 
+		if (policy == PCACHE_EVICT_POLICY_CLOCK &&
+		    clock_second_chance(pcm, pset))
+			goto unlock_pcache;
+
 		/*
 		 * Yeah! We have a candidate that is:
 		 * 0) Valid, mapped to user pgtable
@@ -145,7 +199,7 @@ put_pcache:
 	}
 
 unlock_lru:
-	spin_unlock(&pset->lru_lock);
+	pset_unlock(pset, PSET_LOCK_LRU);
 
 	if (!found)
 		pcm = ERR_PTR(-EAGAIN);
@@ -203,8 +257,9 @@ static void sweep_pset(struct pcache_set *pset)
 	if (!nr_to_sweep || !nr_goal)
 		return;
 
-	if (!spin_trylock(&pset->lru_lock))
+	if (!pset_trylock(pset, PSET_LOCK_LRU))
 		return;
+	__drain_lru_add(pset);
 
 	list_for_each_entry_safe(pcm, n, &pset->lru_list, lru) {
 		int pte_referenced, pte_contention;
@@ -278,7 +333,7 @@ put_pcache:
 		if (PsetEvicting(pset))
 			break;
 	}
-	spin_unlock(&pset->lru_lock);
+	pset_unlock(pset, PSET_LOCK_LRU);
 }
 
 /*
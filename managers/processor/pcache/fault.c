@@ -118,8 +118,7 @@ int common_do_fill_page(struct mm_struct *mm, unsigned long address,
 	if (unlikely(!pcm))
 		return VM_FAULT_OOM;
 
-	/* TODO: Need right permission bits */
-	entry = pcache_mk_pte(pcm, PAGE_SHARED_EXEC);
+	entry = pcache_mk_pte(pcm, PCACHE_LINE_PGPROT);
 
 	/*
 	 * Concurrent faults are serialized by this lock
@@ -181,6 +180,54 @@ DEFINE_PROFILE_POINT(__pcache_fill_remote_piggyback_net)
 
 static DEFINE_PER_CPU(struct p2m_pcache_miss_flush_combine_msg, pb_msg_array);
 
+/*
+ * Send a normal pcache miss to @dst_nid, and have the line filled into
+ * @va_cache. Return the reply length, or network error.
+ */
+static int pcache_fill_remote(int dst_nid, unsigned long address,
+			      unsigned long flags, void *va_cache)
+{
+#ifdef CONFIG_PCACHE_FILL_BATCH
+	return pcache_fill_batch(dst_nid, address, flags, va_cache);
+#else
+	struct p2m_pcache_miss_msg msg;
+
+	fill_common_header(&msg, P2M_PCACHE_MISS);
+	msg.has_flush_msg = 0;
+	msg.pid = current->pid;
+	msg.tgid = current->tgid;
+	msg.flags = flags;
+	msg.missing_vaddr = address;
+
+	return ibapi_send_reply_timeout(dst_nid, &msg, sizeof(msg),
+					va_cache, PCACHE_LINE_SIZE, false,
+					DEF_NET_TIMEOUT);
+#endif
+}
+
+/* Processor manager rely on the reply length to know if memory succeed */
+static int pcache_fill_reply_to_errno(int len)
+{
+	if (likely(len >= (int)PCACHE_LINE_SIZE))
+		return 0;
+
+	if (likely(len == sizeof(int))) {
+		/* remote reported error */
+		return -EFAULT;
+	} else if (len < 0) {
+		/*
+		 * Network error:
+		 * EIO: IB is not available
+		 * ETIMEDOUT: timeout for reply
+		 */
+		WARN_ON_ONCE(1);
+		return len;
+	}
+
+	WARN(1, "Invalid reply length: %d\n", len);
+	return -EFAULT;
+}
+
 /*
  * Callback for common fill code
  * Fill the pcache line from remote memory.
@@ -192,7 +239,6 @@ __pcache_do_fill_page(unsigned long address, unsigned long flags,
 	int ret, len, dst_nid;
 	struct pcache_set *pset;
 	void *va_cache = pcache_meta_to_kva(pcm);
-	struct p2m_pcache_miss_msg msg;
 	PROFILE_POINT_TIME(__pcache_fill_remote_net)
 	PROFILE_POINT_TIME(__pcache_fill_remote_piggyback_net)
 
@@ -265,47 +311,126 @@ __pcache_do_fill_page(unsigned long address, unsigned long flags,
 		inc_pcache_event(PCACHE_FAULT_FILL_FROM_MEMORY_PIGGYBACK);
 	} else {
 fallback:
-		fill_common_header(&msg, P2M_PCACHE_MISS);
-		msg.has_flush_msg = 0;
-		msg.pid = current->pid;
-		msg.tgid = current->tgid;
-		msg.flags = flags;
-		msg.missing_vaddr = address;
-
 		PROFILE_START(__pcache_fill_remote_net);
-		len = ibapi_send_reply_timeout(dst_nid, &msg, sizeof(msg),
-					       va_cache, PCACHE_LINE_SIZE, false,
-					       DEF_NET_TIMEOUT);
+		len = pcache_fill_remote(dst_nid, address, flags, va_cache);
 		PROFILE_LEAVE(__pcache_fill_remote_net);
 	}
 
-	if (unlikely(len < (int)PCACHE_LINE_SIZE)) {
-		if (likely(len == sizeof(int))) {
-			/* remote reported error */
-			ret = -EFAULT;
-			goto out;
-		} else if (len < 0) {
-			/*
-			 * Network error:
-			 * EIO: IB is not available
-			 * ETIMEDOUT: timeout for reply
-			 */
-			ret = len;
-			WARN_ON_ONCE(1);
-			goto out;
-		} else {
-			WARN(1, "Invalid reply length: %d\n", len);
-			ret = -EFAULT;
+	ret = pcache_fill_reply_to_errno(len);
+	inc_pset_event(pset, PSET_FILL_MEMORY);
+	inc_pcache_event(PCACHE_FAULT_FILL_FROM_MEMORY);
+	return ret;
+}
+
+#ifdef CONFIG_PCACHE_FILL_OVERLAP_EVICTION
+/*
+ * The set is full, pcache_alloc() would have to evict a line before
+ * we can even send the miss request. Instead, ask the async eviction
+ * daemon to make room, and fetch the line into a staging buffer
+ * meanwhile. Once the reply is back, take the freed line and copy over.
+ *
+ * Neither the request nor the wait for a free line holds the pte lock:
+ * the victim may share it with us. Instead, the pte is marked fill
+ * pending. Faults on it wait until we are done, and zap or move of it
+ * waits for us as well. Thus nobody can put newer data behind our back,
+ * and the staged reply is always good to install.
+ *
+ * The staging buffer belongs to this request, we may be scheduled out
+ * anywhere in between. If async eviction did not leave a line for us,
+ * we evict on our own and still install the staged reply. Those who
+ * wait on the pending pte yield the cpu meanwhile.
+ *
+ * Return -EAGAIN if the staging buffer can not be allocated,
+ * caller then takes the normal path.
+ */
+static int
+pcache_do_fill_page_overlap(struct mm_struct *mm, unsigned long address,
+			    pte_t *page_table, pte_t orig_pte, pmd_t *pmd,
+			    unsigned long flags)
+{
+	struct pcache_meta *pcm = NULL;
+	struct pcache_set *pset;
+	spinlock_t *ptl;
+	void *staging;
+	pte_t pending, entry;
+	int ret, len;
+
+	pset = user_vaddr_to_pcache_set(address);
+
+	staging = kmalloc(PCACHE_LINE_SIZE, GFP_KERNEL);
+	if (unlikely(!staging))
+		return -EAGAIN;
+
+	page_table = pte_offset_lock(mm, pmd, address, &ptl);
+	if (unlikely(!pte_same(*page_table, orig_pte))) {
+		spin_unlock(ptl);
+		ret = 0;
+		goto free;
+	}
+	pending = pte_mkfill_pending(orig_pte);
+	pte_set(page_table, pending);
+	spin_unlock(ptl);
+
+	pcache_evict_async(address);
+
+	len = pcache_fill_remote(get_memory_node(current, address),
+				 address, flags, staging);
+	inc_pset_event(pset, PSET_FILL_MEMORY);
+	inc_pcache_event(PCACHE_FAULT_FILL_FROM_MEMORY);
+	if (unlikely(pcache_fill_reply_to_errno(len))) {
+		ret = VM_FAULT_SIGSEGV;
+		goto out;
+	}
+
+	/*
+	 * Normally eviction finishes before the reply comes back.
+	 * If not, let it finish.
+	 */
+	while (!(pcm = pcache_alloc_nowait(address)) && PsetAsyncEvict(pset))
+		cond_resched();
+	if (!pcm) {
+		/* The reply is here already, do not fetch it again */
+		inc_pcache_event(PCACHE_FAULT_FILL_OVERLAP_FB);
+		pcm = pcache_alloc(address, DISABLE_PIGGYBACK);
+		if (unlikely(!pcm)) {
+			ret = VM_FAULT_OOM;
 			goto out;
 		}
 	}
-
+	memcpy(pcache_meta_to_kva(pcm), staging, PCACHE_LINE_SIZE);
 	ret = 0;
+
 out:
-	inc_pset_event(pset, PSET_FILL_MEMORY);
-	inc_pcache_event(PCACHE_FAULT_FILL_FROM_MEMORY);
+	entry = pcm ? pcache_mk_pte(pcm, PCACHE_LINE_PGPROT) : orig_pte;
+
+	spin_lock(ptl);
+	PCACHE_BUG_ON(!pte_same(*page_table, pending));
+	pte_set(page_table, entry);
+	if (pcm) {
+		/* which will also mark PcacheValid */
+		if (unlikely(pcache_add_rmap(pcm, page_table, address, mm,
+					     current->group_leader,
+					     RMAP_FILL_PAGE_REMOTE))) {
+			pte_set(page_table, orig_pte);
+			put_pcache(pcm);
+			ret = VM_FAULT_OOM;
+		} else
+			inc_pcache_event(PCACHE_FAULT_FILL_OVERLAP);
+	}
+	spin_unlock(ptl);
+free:
+	kfree(staging);
 	return ret;
 }
+#else
+static inline int
+pcache_do_fill_page_overlap(struct mm_struct *mm, unsigned long address,
+			    pte_t *page_table, pte_t orig_pte, pmd_t *pmd,
+			    unsigned long flags)
+{
+	return -EAGAIN;
+}
+#endif /* CONFIG_PCACHE_FILL_OVERLAP_EVICTION */
 
 /*
  * This function handles normal cache line misses.
@@ -315,6 +440,16 @@ static inline int
 pcache_do_fill_page(struct mm_struct *mm, unsigned long address,
 		    pte_t *page_table, pte_t orig_pte, pmd_t *pmd, unsigned long flags)
 {
+	int ret;
+
+	if (IS_ENABLED(CONFIG_PCACHE_FILL_OVERLAP_EVICTION) &&
+	    pcache_alloc_need_evict(address)) {
+		ret = pcache_do_fill_page_overlap(mm, address, page_table,
+						  orig_pte, pmd, flags);
+		if (likely(ret != -EAGAIN))
+			return ret;
+	}
+
 	return common_do_fill_page(mm, address, page_table, orig_pte, pmd, flags,
 			__pcache_do_fill_page, NULL, RMAP_FILL_PAGE_REMOTE,
 			ENABLE_PIGGYBACK);
@@ -487,8 +622,7 @@ static int pcache_do_wp_page(struct mm_struct *mm, unsigned long address,
 		}
 		cow_pcache(new_pcm, old_pcm);
 
-		/* TODO: need right permission */
-		entry = pcache_mk_pte(new_pcm, PAGE_SHARED_EXEC);
+		entry = pcache_mk_pte(new_pcm, PCACHE_LINE_PGPROT);
 		entry = pte_mkdirty(entry);
 		entry = pte_mkwrite(entry);
 
@@ -569,8 +703,16 @@ static int pcache_handle_pte_fault(struct mm_struct *mm, unsigned long address,
 			 *
 			 * All of them fall-back and merge into this:
 			 */
+			pcache_prefetch_on_miss(address, flags);
 			return pcache_do_fill_page(mm, address, pte, entry, pmd, flags);
 		}
+
+		/* Another thread is filling it, retry once it is done */
+		if (unlikely(pte_fill_pending(entry))) {
+			while (pte_fill_pending(READ_ONCE(*pte)))
+				cond_resched();
+			return 0;
+		}
 		return pcache_do_zerofill_page(mm, address, pte, entry, pmd, flags);
 	}
 
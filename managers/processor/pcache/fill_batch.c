@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2016-2018 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Coalesce concurrent pcache misses that go to the same memory node.
+ *
+ * Each faulting thread queues its miss into the per-node pending list.
+ * Up to PCACHE_FILL_BATCH_LEADERS threads can talk to a node at the same
+ * time. If a leader slot is free, the thread takes it: it takes up to
+ * PCACHE_FILL_BATCH_MAX pending misses, sends them in one
+ * P2M_PCACHE_MISS_BATCH request, and copies each line to its requester.
+ * Most of the time that is just its own miss, sent as a normal one.
+ * With PCACHE_FILL_RDMA_WRITE, memory writes lines into pcache directly,
+ * only misses that do not target a pcache line are copied.
+ * Only while all leaders are waiting for the network, new misses pile up
+ * in the list, and they will be served by the next free leader.
+ *
+ * Every thread enters with its pte lock held, and spins here until its
+ * own miss is served. The leader never touches others' page tables, so
+ * no lock ordering issue is introduced.
+ */
+
+#include <lego/mm.h>
+#include <lego/net.h>
+#include <lego/slab.h>
+#include <lego/kernel.h>
+#include <lego/spinlock.h>
+#include <lego/fit_ibapi.h>
+#include <lego/comp_common.h>
+#include <processor/pcache.h>
+#include <processor/processor.h>
+
+#define PCACHE_FILL_BATCH_MAX		CONFIG_PCACHE_FILL_BATCH_MAX
+#define PCACHE_FILL_BATCH_LEADERS	CONFIG_PCACHE_FILL_BATCH_LEADERS
+
+struct pcache_fill_req {
+	unsigned long		address;
+	unsigned long		flags;
+	pid_t			pid;
+	pid_t			tgid;
+	void			*va_cache;
+	int			len;
+	int			done;
+	struct list_head	next;
+};
+
+/* Buffers of one leader slot */
+struct pcache_fill_batch_leader {
+	struct p2m_pcache_miss_batch_msg	msg;
+	struct p2m_pcache_miss_batch_reply	*reply;
+};
+
+struct pcache_fill_batch_node {
+	spinlock_t		lock;
+	unsigned long		free_leaders;	/* bitmap of free slots */
+	struct list_head	pending;
+
+	struct pcache_fill_batch_leader	leaders[PCACHE_FILL_BATCH_LEADERS];
+} ____cacheline_aligned;
+
+static struct pcache_fill_batch_node fill_batch_nodes[MAX_NODE];
+
+static inline void complete_fill_req(struct pcache_fill_req *req, int len)
+{
+	req->len = len;
+	smp_wmb();
+	WRITE_ONCE(req->done, 1);
+}
+
+/* A lone miss, fill the line directly, no extra copy */
+static void send_one(int nid, struct pcache_fill_req *req)
+{
+	struct p2m_pcache_miss_msg msg;
+	int len;
+
+	fill_common_header(&msg, P2M_PCACHE_MISS);
+	msg.has_flush_msg = 0;
+	msg.pid = req->pid;
+	msg.tgid = req->tgid;
+	msg.flags = req->flags;
+	msg.missing_vaddr = req->address;
+
+	len = ibapi_send_reply_timeout(nid, &msg, sizeof(msg),
+				       req->va_cache, PCACHE_LINE_SIZE, false,
+				       DEF_NET_TIMEOUT);
+	complete_fill_req(req, len);
+}
+
+static void send_batch(int nid, struct pcache_fill_batch_leader *leader,
+		       struct pcache_fill_req **reqs, int nr)
+{
+	struct p2m_pcache_miss_batch_msg *msg = &leader->msg;
+	struct p2m_pcache_miss_batch_reply *reply = leader->reply;
+	int i, len, reply_len, slot, nr_slots = 0;
+
+	fill_common_header(msg, P2M_PCACHE_MISS_BATCH);
+	msg->nr_entries = nr;
+	for (i = 0; i < nr; i++) {
+		msg->entries[i].pid = reqs[i]->pid;
+		msg->entries[i].tgid = reqs[i]->tgid;
+		msg->entries[i].flags = reqs[i]->flags;
+		msg->entries[i].missing_vaddr = reqs[i]->address;
+		msg->entries[i].line_addr = pcache_kva_to_dma(reqs[i]->va_cache);
+		if (!msg->entries[i].line_addr)
+			nr_slots++;
+	}
+
+	reply_len = sizeof(*reply) + nr_slots * PCACHE_LINE_SIZE;
+	len = ibapi_send_reply_timeout(nid, msg, sizeof(*msg), reply,
+				       reply_len, false, DEF_NET_TIMEOUT);
+	inc_pcache_event(PCACHE_FAULT_FILL_FROM_MEMORY_BATCH);
+
+	/*
+	 * Memory failed to RDMA write lines, none of them can be trusted.
+	 * Fill them one by one with normal replies.
+	 */
+	if (unlikely(len == sizeof(int) && *(int *)reply == RET_EAGAIN)) {
+		inc_pcache_event(PCACHE_FAULT_FILL_RDMA_WRITE_FAIL);
+		for (i = 0; i < nr; i++)
+			send_one(nid, reqs[i]);
+		return;
+	}
+
+	/*
+	 * Network error, or remote does not understand us.
+	 * Let the caller of each request handle it.
+	 */
+	if (unlikely(len != reply_len)) {
+		for (i = 0; i < nr; i++)
+			complete_fill_req(reqs[i], len);
+		return;
+	}
+
+	for (i = 0, slot = 0; i < nr; i++) {
+		bool written = msg->entries[i].line_addr;
+
+		if (!written)
+			slot++;
+
+		if (unlikely(reply->status[i])) {
+			/* Same as single miss: an int means remote error */
+			complete_fill_req(reqs[i], sizeof(int));
+			continue;
+		}
+
+		if (written)
+			inc_pcache_event(PCACHE_FAULT_FILL_RDMA_WRITE);
+		else
+			memcpy(reqs[i]->va_cache,
+			       reply->data + (slot - 1) * PCACHE_LINE_SIZE,
+			       PCACHE_LINE_SIZE);
+		complete_fill_req(reqs[i], PCACHE_LINE_SIZE);
+	}
+	add_pcache_event(PCACHE_FAULT_FILL_FROM_MEMORY_BATCHED, nr);
+}
+
+/*
+ * Serve pending misses at @node with a free leader slot, called with
+ * node->lock held. Lock is dropped while talking to remote memory.
+ */
+static void fill_batch_lead(int nid, struct pcache_fill_batch_node *node)
+{
+	struct pcache_fill_req *reqs[PCACHE_FILL_BATCH_MAX];
+	struct pcache_fill_req *req, *tmp;
+	int slot, nr = 0;
+
+	list_for_each_entry_safe(req, tmp, &node->pending, next) {
+		list_del(&req->next);
+		reqs[nr++] = req;
+		if (nr == PCACHE_FILL_BATCH_MAX)
+			break;
+	}
+	slot = __ffs(node->free_leaders);
+	__clear_bit(slot, &node->free_leaders);
+	spin_unlock(&node->lock);
+
+	if (nr == 1)
+		send_one(nid, reqs[0]);
+	else
+		send_batch(nid, &node->leaders[slot], reqs, nr);
+
+	spin_lock(&node->lock);
+	__set_bit(slot, &node->free_leaders);
+}
+
+/**
+ * pcache_fill_batch
+ * @nid: the memory node @address belongs to
+ * @address: the missing user virtual address
+ * @flags: fault flags
+ * @va_cache: kernel virtual address of the pcache line to fill
+ *
+ * Fill one pcache line from remote memory, possibly together with other
+ * concurrent misses. The return value has the same meaning as the reply
+ * length of a single P2M_PCACHE_MISS.
+ */
+int pcache_fill_batch(int nid, unsigned long address,
+		      unsigned long flags, void *va_cache)
+{
+	struct pcache_fill_batch_node *node = &fill_batch_nodes[nid];
+	struct pcache_fill_req req = {
+		.address	= address,
+		.flags		= flags,
+		.pid		= current->pid,
+		.tgid		= current->tgid,
+		.va_cache	= va_cache,
+	};
+
+	spin_lock(&node->lock);
+	list_add_tail(&req.next, &node->pending);
+	for (;;) {
+		if (READ_ONCE(req.done))
+			break;
+
+		/*
+		 * A leader slot is free, we lead.
+		 * Our own request may not be in the first batch,
+		 * in which case we come back and lead again.
+		 */
+		if (node->free_leaders) {
+			fill_batch_lead(nid, node);
+			continue;
+		}
+
+		spin_unlock(&node->lock);
+		while (!READ_ONCE(req.done) && !READ_ONCE(node->free_leaders))
+			cpu_relax();
+		spin_lock(&node->lock);
+	}
+	spin_unlock(&node->lock);
+
+	smp_rmb();
+	return req.len;
+}
+
+void __init pcache_fill_batch_post_init(void)
+{
+	struct pcache_fill_batch_node *node;
+	struct pcache_fill_batch_leader *leader;
+	int nid, i;
+
+	BUILD_BUG_ON(PCACHE_FILL_BATCH_MAX > P2M_PCACHE_MISS_BATCH_MAX);
+	BUILD_BUG_ON(PCACHE_FILL_BATCH_LEADERS >= BITS_PER_LONG);
+
+	for (nid = 0; nid < MAX_NODE; nid++) {
+		node = &fill_batch_nodes[nid];
+
+		spin_lock_init(&node->lock);
+		INIT_LIST_HEAD(&node->pending);
+		node->free_leaders = (1UL << PCACHE_FILL_BATCH_LEADERS) - 1;
+
+		for (i = 0; i < PCACHE_FILL_BATCH_LEADERS; i++) {
+			leader = &node->leaders[i];
+			leader->reply = kmalloc(sizeof(*leader->reply) +
+					PCACHE_FILL_BATCH_MAX * PCACHE_LINE_SIZE,
+					GFP_KERNEL);
+			if (!leader->reply)
+				panic("Fail to allocate pcache miss batch buffer!");
+		}
+	}
+}
@@ -14,11 +14,13 @@
 #include <lego/pgfault.h>
 #include <lego/syscalls.h>
 #include <lego/memblock.h>
+#include <lego/fit_ibapi.h>
 
 #include <processor/pcache.h>
 #include <processor/processor.h>
 
 #include <asm/io.h>
+#include <asm/numa.h>
 
 u64 pcache_registered_start;
 u64 pcache_registered_size;
@@ -43,10 +45,16 @@ atomic_long_t nr_used_cachelines;
 u64 phys_start_cacheline __read_mostly;
 u64 phys_start_metadata __read_mostly;
 u64 virt_start_cacheline __read_mostly;
+#ifdef CONFIG_PCACHE_FILL_RDMA_WRITE
+u64 dma_start_cacheline __read_mostly;
+#endif
 struct pcache_meta *pcache_meta_map __read_mostly;
 
 struct pcache_set *pcache_set_map __read_mostly;
 
+/* NUMA node that holds pcache lines, where metadata goes to */
+int pcache_nid __read_mostly = NUMA_NO_NODE;
+
 /*
  * Bits to mask virtual address:
  * |MSB ..     |    ...   |      ...      LSB|
@@ -64,13 +72,40 @@ u64 nr_bits_tag;
 /* Offset between neighbouring ways within a set */
 u64 pcache_way_cache_stride __read_mostly;
 
+#ifdef CONFIG_PCACHE_NUMA_LOCAL
+static void __init pcache_find_nid(void)
+{
+	u64 end = phys_start_metadata + nr_pages_metadata * PAGE_SIZE - 1;
+	int end_nid;
+
+	pcache_nid = early_phys_to_nid(phys_start_cacheline);
+	end_nid = early_phys_to_nid(end);
+	if (pcache_nid != end_nid)
+		pr_warn("pcache: memmap $ spans node %d and %d\n",
+			pcache_nid, end_nid);
+}
+#else
+static inline void pcache_find_nid(void) { }
+#endif
+
+/*
+ * Allocate early pcache metadata. Prefer the node of pcache lines,
+ * memblock falls back to other nodes if it runs out of local memory.
+ */
+void * __init pcache_memblock_alloc(u64 size)
+{
+	return memblock_virt_alloc_try_nid_nopanic(size, PAGE_SIZE, 0,
+						   BOOTMEM_ALLOC_ACCESSIBLE,
+						   pcache_nid);
+}
+
 static void __init alloc_pcache_set_map(void)
 {
 	u64 size;
 
 	/* the pset array */
 	size = nr_cachesets * sizeof(struct pcache_set);
-	pcache_set_map = memblock_virt_alloc(size, PAGE_SIZE);
+	pcache_set_map = pcache_memblock_alloc(size);
 	if (!pcache_set_map)
 		panic("Unable to allocate pcache set array!");
 }
@@ -140,6 +175,7 @@ void __init pcache_early_init(void)
 	pcache_way_cache_stride = nr_cachesets * PCACHE_LINE_SIZE;
 
 	/* Early allocation that needs memblock */
+	pcache_find_nid();
 	alloc_pcache_set_map();
 	alloc_pcache_rmap_map();
 	alloc_pcache_perset_map();
@@ -171,10 +207,12 @@ static void __init init_pcache_set_map(void)
 		spin_lock_init(&pset->free_lock);
 
 		/* Eviction Algorithm Specific */
-#ifdef CONFIG_PCACHE_EVICT_LRU
+#ifdef CONFIG_PCACHE_EVICT_LRU_LIST
 		INIT_LIST_HEAD(&pset->lru_list);
 		spin_lock_init(&pset->lru_lock);
 		atomic_set(&pset->nr_lru, 0);
+		INIT_LIST_HEAD(&pset->lru_add_list);
+		spin_lock_init(&pset->lru_add_lock);
 #endif
 
 		/* Eviction Mechanism Specific */
@@ -186,8 +224,16 @@ static void __init init_pcache_set_map(void)
 		atomic_set(&pset->nr_eviction_entries, 0);
 #endif
 
+#ifdef CONFIG_PCACHE_FILL_OVERLAP_EVICTION
+		INIT_LIST_HEAD(&pset->async_evict_list);
+#endif
+
 		for (j = 0; j < NR_PSET_STAT_ITEMS; j++)
 			atomic_set(&pset->stat[j], 0);
+
+#ifdef CONFIG_PCACHE_LOCK_STAT
+		memset(pset->lock_stat, 0, sizeof(pset->lock_stat));
+#endif
 	}
 }
 
@@ -249,9 +295,24 @@ void __init pcache_post_init(void)
 
 	init_pcache_clflush_buffer();
 
+#ifdef CONFIG_PCACHE_FILL_RDMA_WRITE
+	/* Let memory write lines straight into cachelines */
+	dma_start_cacheline = ibapi_reg_mr_addr((void *)virt_start_cacheline,
+						nr_pages_cacheline * PAGE_SIZE);
+#endif
+
 	/* Create victim_flush thread if configured */
 	victim_cache_post_init();
 
+	/* Allocate miss batch buffers if configured */
+	pcache_fill_batch_post_init();
+
+	/* Create prefetch thread if configured */
+	pcache_prefetch_post_init();
+
+	/* Create async eviction thread if configured */
+	evict_async_init();
+
 	/* Create sweep threads if configured */
 	ret = evict_sweep_init();
 	if (ret)
@@ -265,6 +326,9 @@ void __init pcache_print_info(void)
 	pr_info("Processor LLC Configurations:\n");
 	pr_info("    PhysStart:         %#llx\n",	pcache_registered_start);
 	pr_info("    VirtStart:         %#llx\n",	virt_start_cacheline);
+#ifdef CONFIG_PCACHE_FILL_RDMA_WRITE
+	pr_info("    DMAStart:          %#llx\n",	dma_start_cacheline);
+#endif
 	pr_info("    Registered Size:   %#llx\n",	pcache_registered_size);
 	pr_info("    Actual Used Size:  %#llx\n",	llc_cache_size);
 	pr_info("    NR cachelines:     %llu\n",	nr_cachelines);
@@ -305,6 +369,7 @@ void __init pcache_print_info(void)
 		(unsigned long)(pcache_set_map + nr_cachesets) - 1);
 
 	pr_info("    Way cache stride:  %#llx\n", pcache_way_cache_stride);
+	pr_info("    Metadata node:           %d\n", pcache_nid);
 
 	pr_info("    Memmap $ semantic:       %s\n",
 		IS_ENABLED(CONFIG_PROCESSOR_MEMMAP_MEMBLOCK_RESERVED) ?
@@ -93,9 +93,9 @@ static inline void __pset_del_eviction_entry(struct pset_eviction_entry *p,
 static inline void
 pset_add_eviction_entry(struct pset_eviction_entry *new, struct pcache_set *pset)
 {
-	spin_lock(&pset->eviction_list_lock);
+	pset_lock(pset, PSET_LOCK_EVICTION_LIST);
 	__pset_add_eviction_entry(new, pset);
-	spin_unlock(&pset->eviction_list_lock);
+	pset_unlock(pset, PSET_LOCK_EVICTION_LIST);
 }
 
 bool __pset_find_eviction(struct pcache_set *pset, unsigned long uvaddr,
@@ -106,7 +106,7 @@ bool __pset_find_eviction(struct pcache_set *pset, unsigned long uvaddr,
 
 	uvaddr &= PAGE_MASK;
 
-	spin_lock(&pset->eviction_list_lock);
+	pset_lock(pset, PSET_LOCK_EVICTION_LIST);
 	list_for_each_entry(pos, &pset->eviction_list, next) {
 		if (uvaddr == pos->address &&
 		   same_thread_group(tsk, pos->owner)) {
@@ -116,7 +116,7 @@ bool __pset_find_eviction(struct pcache_set *pset, unsigned long uvaddr,
 			break;
 		}
 	}
-	spin_unlock(&pset->eviction_list_lock);
+	pset_unlock(pset, PSET_LOCK_EVICTION_LIST);
 
 	return found;
 }
@@ -191,7 +191,7 @@ void pset_remove_eviction(struct pcache_set *pset,
 {
 	struct pset_eviction_entry *pos;
 
-	spin_lock(&pset->eviction_list_lock);
+	pset_lock(pset, PSET_LOCK_EVICTION_LIST);
 	list_for_each_entry(pos, &pset->eviction_list, next) {
 		if (pos->pcm == pcm) {
 			__pset_del_eviction_entry(pos, pset);
@@ -199,7 +199,7 @@ void pset_remove_eviction(struct pcache_set *pset,
 			nr_added--;
 		}
 	}
-	spin_unlock(&pset->eviction_list_lock);
+	pset_unlock(pset, PSET_LOCK_EVICTION_LIST);
 
 	BUG_ON(nr_added);
 }
@@ -278,7 +278,7 @@ void __init alloc_pcache_perset_map(void)
 	size = sizeof(struct pset_eviction_entry);
 	total = size * nr_cachelines;
 
-	pset_eviction_entry_map = memblock_virt_alloc(total, PAGE_SIZE);
+	pset_eviction_entry_map = pcache_memblock_alloc(total);
 	if (!pset_eviction_entry_map)
 		panic("Unable to allocate pset_eviction_entry_map!");
 
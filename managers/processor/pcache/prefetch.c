@@ -9,6 +9,21 @@
 
 /*
  * Prefetch facilities
+ *
+ * Each thread feeds its remote pcache misses into a tiny stride detector.
+ * Once a stride repeats, we queue a prefetch job for the lines that follow.
+ * A background daemon picks up the job, allocates pcache lines, fetches all
+ * of them with one P2M_PCACHE_PREFETCH request, and installs the PTEs if
+ * nobody else did so in the meantime.
+ *
+ * Prefetched lines are mapped with the Accessed bit cleared and marked
+ * Prefetched. When they are evicted or zapped, the Accessed bit tells us
+ * whether the prefetch was useful or wasted.
+ *
+ * The daemon walks and fills pgtables without holding any mm lock. Code that
+ * zaps, frees or moves pgtables brackets itself with pcache_prefetch_block()
+ * and pcache_prefetch_unblock(): jobs of a blocked mm are dropped, and the
+ * running ones are waited for.
  */
 
 #include <lego/mm.h>
@@ -17,9 +32,400 @@
 #include <lego/log2.h>
 #include <lego/hash.h>
 #include <lego/kernel.h>
+#include <lego/kthread.h>
 #include <lego/pgfault.h>
 #include <lego/syscalls.h>
 #include <lego/jiffies.h>
+#include <lego/fit_ibapi.h>
+#include <lego/comp_common.h>
 #include <processor/pcache.h>
+#include <processor/distvm.h>
 #include <processor/processor.h>
 
+/*
+ * A stream is detected once the same stride is seen
+ * PREFETCH_MIN_CONFIDENCE times in a row. Strides larger than
+ * PREFETCH_MAX_STRIDE_LINES are treated as random access.
+ */
+#define PREFETCH_MIN_CONFIDENCE		2
+#define PREFETCH_MAX_STRIDE_LINES	16
+
+struct pcache_prefetch_job {
+	struct task_struct	*tsk;
+	struct mm_struct	*mm;
+	unsigned long		start;
+	long			stride;
+	unsigned int		nr_lines;
+	unsigned long		flags;
+	struct list_head	next;
+};
+
+static atomic_t nr_prefetch_jobs = ATOMIC_INIT(0);
+static DEFINE_SPINLOCK(prefetch_lock);
+static LIST_HEAD(prefetch_queue);
+static struct task_struct *prefetch_thread;
+
+/* Reply buffer, only used by prefetch daemon */
+static void *prefetch_reply_buf;
+
+static inline void enqueue_prefetch_job(struct pcache_prefetch_job *job)
+{
+	spin_lock(&prefetch_lock);
+	list_add_tail(&job->next, &prefetch_queue);
+	atomic_inc(&nr_prefetch_jobs);
+	spin_unlock(&prefetch_lock);
+
+	wake_up_process(prefetch_thread);
+}
+
+static inline struct pcache_prefetch_job *dequeue_prefetch_job(void)
+{
+	struct pcache_prefetch_job *job = NULL;
+
+	spin_lock(&prefetch_lock);
+	if (likely(!list_empty(&prefetch_queue))) {
+		job = list_first_entry(&prefetch_queue,
+				       struct pcache_prefetch_job, next);
+		list_del(&job->next);
+		atomic_dec(&nr_prefetch_jobs);
+	}
+	spin_unlock(&prefetch_lock);
+	return job;
+}
+
+static void submit_prefetch(struct task_struct *tsk, unsigned long start,
+			    long stride, unsigned long flags)
+{
+	struct pcache_prefetch_info *pi = &tsk->pm_data.prefetch;
+	struct pcache_prefetch_job *job;
+
+	job = kmalloc(sizeof(*job), GFP_KERNEL);
+	if (unlikely(!job))
+		return;
+
+	job->tsk = tsk;
+	job->mm = tsk->mm;
+	job->start = start;
+	job->stride = stride;
+	job->nr_lines = PCACHE_PREFETCH_NR_LINES;
+	job->flags = flags;
+
+	/* Dropped by daemon once the job is done */
+	atomic_inc(&pi->nr_inflight);
+	atomic_inc(&job->mm->nr_prefetch_inflight);
+	enqueue_prefetch_job(job);
+}
+
+/**
+ * pcache_prefetch_on_miss
+ * @address: the missing user virtual address
+ * @flags: fault flags
+ *
+ * Called by current thread before it fetches @address from remote memory.
+ * Update the stride detector, and queue a prefetch window if a stream
+ * is detected. At most one window is in flight per thread.
+ */
+void pcache_prefetch_on_miss(unsigned long address, unsigned long flags)
+{
+	struct pcache_prefetch_info *pi = &current->pm_data.prefetch;
+	long delta;
+
+	address &= PCACHE_LINE_MASK;
+	delta = address - pi->last_address;
+	pi->last_address = address;
+
+	if (unlikely(!delta))
+		return;
+
+	if (delta != pi->stride) {
+		pi->stride = delta;
+		pi->confidence = 0;
+		return;
+	}
+
+	if (pi->confidence < PREFETCH_MIN_CONFIDENCE) {
+		pi->confidence++;
+		return;
+	}
+
+	if (abs(delta) > PREFETCH_MAX_STRIDE_LINES * PCACHE_LINE_SIZE)
+		return;
+
+	if (atomic_read(&pi->nr_inflight))
+		return;
+
+	submit_prefetch(current, address + delta, delta, flags);
+
+	/*
+	 * Pretend the thread has walked through the window.
+	 * If the stream goes on, the next miss lands right after
+	 * the window and keeps the same stride.
+	 */
+	pi->last_address = address + delta * PCACHE_PREFETCH_NR_LINES;
+}
+
+/* Called at fork() time, the new task must not inherit parent's state */
+void pcache_prefetch_fork(struct task_struct *new)
+{
+	struct pcache_prefetch_info *pi = &new->pm_data.prefetch;
+
+	pi->last_address = 0;
+	pi->stride = 0;
+	pi->confidence = 0;
+	atomic_set(&pi->nr_inflight, 0);
+}
+
+/*
+ * Called when a thread exit or exec, before mm is released.
+ * Daemon is still using @tsk and its mm, wait until it finishes.
+ */
+void pcache_prefetch_thread_exit(struct task_struct *tsk)
+{
+	struct pcache_prefetch_info *pi = &tsk->pm_data.prefetch;
+
+	while (atomic_read(&pi->nr_inflight))
+		schedule();
+}
+
+/*
+ * Called before pgtables of @mm are zapped, freed or moved.
+ * Jobs queued from now on leave @mm alone, wait for those
+ * that may already be walking its pgtables.
+ */
+void pcache_prefetch_block(struct mm_struct *mm)
+{
+	atomic_inc(&mm->prefetch_blocked);
+	smp_mb__after_atomic();
+
+	while (atomic_read(&mm->nr_prefetch_inflight))
+		schedule();
+}
+
+void pcache_prefetch_unblock(struct mm_struct *mm)
+{
+	atomic_dec(&mm->prefetch_blocked);
+}
+
+/* Pairs with the barrier in pcache_prefetch_block() */
+static inline bool prefetch_mm_blocked(struct mm_struct *mm)
+{
+	smp_mb();
+	return atomic_read(&mm->prefetch_blocked);
+}
+
+static pte_t *prefetch_get_pte(struct mm_struct *mm, unsigned long address,
+			       pmd_t **pmdp)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = pgd_offset(mm, address);
+	pud = pud_alloc(mm, pgd, address);
+	if (!pud)
+		return NULL;
+	pmd = pmd_alloc(mm, pud, address);
+	if (!pmd)
+		return NULL;
+
+	*pmdp = pmd;
+	return pte_alloc(mm, pmd, address);
+}
+
+/*
+ * Lines that are still being flushed back, or are sitting in
+ * victim cache, must be filled by the normal pgfault path.
+ */
+static inline bool prefetch_line_busy(unsigned long address,
+				      struct task_struct *tsk)
+{
+#ifdef CONFIG_PCACHE_EVICTION_PERSET_LIST
+	if (pset_find_eviction(address, tsk))
+		return true;
+#elif defined(CONFIG_PCACHE_EVICTION_VICTIM)
+	if (victim_may_hit(address))
+		return true;
+#endif
+	return false;
+}
+
+static void install_prefetched_line(struct pcache_prefetch_job *job,
+				    struct pcache_meta *pcm, pmd_t *pmd,
+				    unsigned long address, void *data)
+{
+	struct mm_struct *mm = job->mm;
+	spinlock_t *ptl;
+	pte_t *pte;
+	pte_t entry;
+
+	/* NULL if memory has written the line directly */
+	if (data)
+		memcpy(pcache_meta_to_kva(pcm), data, PCACHE_LINE_SIZE);
+
+	entry = pcache_mk_pte(pcm, PCACHE_LINE_PGPROT);
+	entry = pte_mkold(entry);
+
+	pte = pte_offset_lock(mm, pmd, address, &ptl);
+	if (unlikely(!pte_none(*pte) || prefetch_line_busy(address, job->tsk) ||
+		     atomic_read(&mm->prefetch_blocked)))
+		goto drop;
+
+	SetPcachePrefetched(pcm);
+	pte_set(pte, entry);
+
+	/* which will also mark PcacheValid */
+	if (unlikely(pcache_add_rmap(pcm, pte, address, mm,
+				     job->tsk->group_leader, RMAP_PREFETCH))) {
+		pte_clear(pte);
+		ClearPcachePrefetched(pcm);
+		goto drop;
+	}
+	spin_unlock(ptl);
+	return;
+
+drop:
+	spin_unlock(ptl);
+	put_pcache(pcm);
+	inc_pcache_event(PCACHE_PREFETCH_WASTED);
+}
+
+static void do_prefetch(struct pcache_prefetch_job *job)
+{
+	struct pcache_meta *pcms[P2M_PCACHE_PREFETCH_MAX_LINES];
+	pmd_t *pmds[P2M_PCACHE_PREFETCH_MAX_LINES];
+	struct p2m_pcache_prefetch_msg msg;
+	struct task_struct *tsk = job->tsk;
+	unsigned long address, start = 0;
+	int i, nr, nr_filled, len, len_msg, nid = -1;
+	void *data;
+	pte_t *pte;
+
+	/* munmap, mremap or exit is on its way */
+	if (prefetch_mm_blocked(job->mm))
+		return;
+
+	/*
+	 * Find the window to fetch: skip leading lines that are
+	 * already cached, stop at the first line that can not be
+	 * fetched or lives in a different memory node.
+	 */
+	for (i = 0, nr = 0; i < job->nr_lines; i++) {
+		address = job->start + i * job->stride;
+		if (address >= TASK_SIZE)
+			break;
+
+		pte = prefetch_get_pte(job->mm, address, &pmds[nr]);
+		if (!pte)
+			break;
+
+		if (!pte_none(*pte) || prefetch_line_busy(address, tsk)) {
+			if (nr)
+				break;
+			continue;
+		}
+
+		if (!nr) {
+			start = address;
+			nid = get_memory_node(tsk, address);
+		} else if (get_memory_node(tsk, address) != nid)
+			break;
+
+		pcms[nr] = pcache_alloc(address, DISABLE_PIGGYBACK);
+		if (!pcms[nr])
+			break;
+		nr++;
+	}
+
+	if (!nr)
+		return;
+
+	fill_common_header(&msg, P2M_PCACHE_PREFETCH);
+	msg.pid = tsk->pid;
+	msg.tgid = tsk->tgid;
+	msg.flags = job->flags;
+	msg.nr_lines = nr;
+	msg.stride = job->stride;
+	msg.start_vaddr = start;
+	msg.mode = 0;
+
+#ifdef CONFIG_PCACHE_FILL_RDMA_WRITE
+	msg.mode = P2M_PREFETCH_RDMA_WRITE;
+	for (i = 0; i < nr; i++)
+		msg.line_addr[i] = pcache_kva_to_dma(pcache_meta_to_kva(pcms[i]));
+	len_msg = offsetof(struct p2m_pcache_prefetch_msg, line_addr[nr]);
+#else
+	len_msg = offsetof(struct p2m_pcache_prefetch_msg, line_addr);
+#endif
+
+	len = ibapi_send_reply_timeout(nid, &msg, len_msg,
+				       prefetch_reply_buf, nr * PCACHE_LINE_SIZE,
+				       false, DEF_NET_TIMEOUT);
+	add_pcache_event(PCACHE_PREFETCH_ISSUED, nr);
+
+	if (msg.mode & P2M_PREFETCH_RDMA_WRITE) {
+		struct p2m_pcache_prefetch_rdma_reply *r = prefetch_reply_buf;
+
+		/*
+		 * Lines are already there, reply tells how many.
+		 * An int reply means memory failed to write them.
+		 */
+		nr_filled = 0;
+		if (len == sizeof(*r) && !r->status)
+			nr_filled = min_t(int, r->nr_lines, nr);
+		add_pcache_event(PCACHE_FAULT_FILL_RDMA_WRITE, nr_filled);
+	} else {
+		/* Error reply is an int, less than one line */
+		nr_filled = (len > 0) ? (len / (int)PCACHE_LINE_SIZE) : 0;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (i >= nr_filled) {
+			put_pcache(pcms[i]);
+			continue;
+		}
+
+		data = NULL;
+		if (!(msg.mode & P2M_PREFETCH_RDMA_WRITE))
+			data = prefetch_reply_buf + i * PCACHE_LINE_SIZE;
+
+		address = start + i * job->stride;
+		install_prefetched_line(job, pcms[i], pmds[i], address, data);
+	}
+}
+
+static int pcache_prefetchd(void *unused)
+{
+	struct pcache_prefetch_job *job;
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!atomic_read(&nr_prefetch_jobs))
+			schedule();
+		__set_current_state(TASK_RUNNING);
+
+		while ((job = dequeue_prefetch_job())) {
+			do_prefetch(job);
+
+			/* mm goes away once the thread has no job left */
+			atomic_dec(&job->mm->nr_prefetch_inflight);
+			atomic_dec(&job->tsk->pm_data.prefetch.nr_inflight);
+			kfree(job);
+		}
+	}
+	return 0;
+}
+
+/* Has to be called after kthreadd is running */
+void __init pcache_prefetch_post_init(void)
+{
+	BUILD_BUG_ON(PCACHE_PREFETCH_NR_LINES > P2M_PCACHE_PREFETCH_MAX_LINES);
+
+	prefetch_reply_buf = kmalloc(PCACHE_PREFETCH_NR_LINES * PCACHE_LINE_SIZE,
+				     GFP_KERNEL);
+	if (!prefetch_reply_buf)
+		panic("Fail to allocate pcache prefetch buffer!");
+
+	prefetch_thread = kthread_run(pcache_prefetchd, NULL, "kpcache_prefetchd");
+	if (IS_ERR(prefetch_thread))
+		panic("Fail to create pcache prefetch thread!");
+}
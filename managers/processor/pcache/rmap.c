@@ -918,6 +918,7 @@ int pcache_zap_pte(struct mm_struct *mm, unsigned long address,
 	}
 
 	rmap_walk(pcm, &rwc);
+	pcache_prefetch_account(pcm, pte_young(ptent));
 	unlock_pcache(pcm);
 
 	/*
@@ -1406,7 +1407,7 @@ void __init alloc_pcache_rmap_map(void)
 	size = sizeof(struct pcache_rmap);
 	total = size * nr_cachelines;
 
-	rmap_map = memblock_virt_alloc(total, PAGE_SIZE);
+	rmap_map = pcache_memblock_alloc(total);
 	if (!rmap_map)
 		panic("Unable to allocate rmap map!");
 
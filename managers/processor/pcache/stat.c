@@ -21,6 +21,13 @@ static const char *const pcache_event_text[] = {
 	"nr_clflush_clean_skipped",
 	"nr_clflush_fail",
 	"nr_clflush_piggyback_fallback",
+	"nr_clflush_batch",
+
+	"nr_replica_line",
+	"nr_replica_batch",
+	"nr_replica_fail",
+	"nr_replica_window_full",
+	"nr_replica_barrier",
 
 	/* write-protection fault */
 	"nr_pgfault_wp",
@@ -33,7 +40,13 @@ static const char *const pcache_event_text[] = {
 	"nr_pcache_fill_from_memory",
 	"nr_pcache_fill_from_memory_piggyback",
 	"nr_pcache_fill_from_memory_piggyback_fallback",
+	"nr_pcache_fill_from_memory_batch",
+	"nr_pcache_fill_from_memory_batched",
+	"nr_pcache_fill_rdma_write",
+	"nr_pcache_fill_rdma_write_fail",
 	"nr_pcache_fill_from_victim",			/* victim cache specific */
+	"nr_pcache_fill_overlap",
+	"nr_pcache_fill_overlap_fallback",
 
 	"nr_pcache_eviction_triggered",
 	"nr_pcache_eviction_eagain_freeable",
@@ -42,6 +55,8 @@ static const char *const pcache_event_text[] = {
 	"nr_pcache_eviction_failure_evict",
 	"nr_pcache_eviction_succeed",
 
+	"nr_lru_add_staged",
+
 	"nr_pset_list_lookup",
 	"nr_pset_list_hit",
 
@@ -68,6 +83,9 @@ static const char *const pcache_event_text[] = {
 	"nr_sweep_nr_pset",
 	"nr_sweep_nr_moved_pcm",
 
+	"nr_clock_second_chance",
+	"nr_duel_switch",
+
 	"nr_mremap_pset_same",
 	"nr_mremap_pset_diff",
 
@@ -80,8 +98,40 @@ static const char *const pcache_event_text[] = {
 	"nr_pcache_pee_alloc_kmalloc",
 	"nr_pcache_pee_free",
 	"nr_pcache_pee_free_kmalloc",
+
+	"nr_pcache_prefetch_issued",
+	"nr_pcache_prefetch_useful",
+	"nr_pcache_prefetch_wasted",
 };
 
+#ifdef CONFIG_PCACHE_LOCK_STAT
+/* Sum up lock stats of all sets */
+void fill_pset_lock_stat(struct pcache_stat *kstat)
+{
+	struct pcache_set *pset;
+	struct pset_lock_stat *stat;
+	int setidx, i, j;
+
+	BUILD_BUG_ON(NR_PSET_LOCKS != PCACHE_NR_SET_LOCKS);
+
+	pcache_for_each_set(pset, setidx) {
+		for (i = 0; i < NR_PSET_LOCKS; i++) {
+			stat = &pset->lock_stat[i];
+
+			kstat->lock_nr_acquired[i] += stat->nr_acquired;
+			kstat->lock_nr_contended[i] += stat->nr_contended;
+			for (j = 0; j < PCACHE_LOCK_HIST_BUCKETS; j++)
+				kstat->lock_hold_hist[i][j] += stat->hold_hist[j];
+
+			if (stat->nr_contended > kstat->lock_max_contended[i]) {
+				kstat->lock_max_contended[i] = stat->nr_contended;
+				kstat->lock_max_contended_set[i] = setidx;
+			}
+		}
+	}
+}
+#endif
+
 void print_pcache_events(void)
 {
 	int i;
@@ -92,4 +142,6 @@ void print_pcache_events(void)
 		pr_info("%s: %lu\n", pcache_event_text[i],
 			atomic_long_read(&pcache_event_stats.event[i]));
 	}
+
+	print_pcache_evict_duel();
 }
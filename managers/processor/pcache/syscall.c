@@ -22,6 +22,8 @@ SYSCALL_DEFINE1(pcache_stat, struct pcache_stat __user *, statbuf)
 {
 	struct pcache_stat kstat;
 
+	memset(&kstat, 0, sizeof(kstat));
+
 	/* General info */
 	kstat.nr_cachelines = nr_cachelines;
 	kstat.nr_cachesets = nr_cachesets;
@@ -35,6 +37,9 @@ SYSCALL_DEFINE1(pcache_stat, struct pcache_stat __user *, statbuf)
 	kstat.nr_flush = pcache_event(PCACHE_CLFLUSH);
 	kstat.nr_eviction = pcache_event(PCACHE_EVICTION_SUCCEED);
 
+	/* Lock stats, racy but good enough */
+	fill_pset_lock_stat(&kstat);
+
 	if (copy_to_user(statbuf, &kstat, sizeof(kstat)))
 		return -EFAULT;
 	return 0;
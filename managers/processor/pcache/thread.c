@@ -88,5 +88,5 @@ void pcache_process_exit(struct task_struct *tsk)
  */
 void pcache_thread_exit(struct task_struct *tsk)
 {
-
+	pcache_prefetch_thread_exit(tsk);
 }
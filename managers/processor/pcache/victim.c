@@ -139,9 +139,12 @@
  * (victim_check_hit_entry() and find_victim_to_evict())
  *
  * E)
- * Lock ordering:
- *  usable_victims_lock
- *   .. victim->lock
+ * There is no global list or lock for usable victims. Eviction and
+ * lookup walk pcache_victim_meta_map directly: grab a reference, then
+ * check Usable && !Reclaim (get_usable_victim()). A victim that is being
+ * freed or allocated has ref 0 or is not Usable yet, so it is skipped.
+ * Reclaim is set and checked under victim->lock, which is the only lock
+ * taken on a victim.
  */
 
 #ifdef CONFIG_DEBUG_PCACHE_VICTIM
@@ -156,39 +159,42 @@ struct pcache_victim_meta pcache_victim_meta_map[VICTIM_NR_ENTRIES] __read_mostl
 void *pcache_victim_data_map __read_mostly;
 
 static atomic_t nr_usable_victims = ATOMIC_INIT(0);
-static LIST_HEAD(usable_victims);
-static DEFINE_SPINLOCK(usable_victims_lock);
 
-/* FIFO: Add to tail, while eviction search from head */
-static inline void __enqueue_usable_victim(struct pcache_victim_meta *v)
-{
-	list_add_tail(&v->next, &usable_victims);
-	atomic_inc(&nr_usable_victims);
-}
+/* Allocation sequence, eviction picks the smallest (FIFO) */
+static atomic64_t victim_seq = ATOMIC64_INIT(0);
 
-static inline void enqueue_usable_victim(struct pcache_victim_meta *v)
-{
-	spin_lock(&usable_victims_lock);
-	__enqueue_usable_victim(v);
-	spin_unlock(&usable_victims_lock);
-}
+/*
+ * Each CPU starts its allocation scan from its own hint: the victim it
+ * freed last, or the one after its last allocation. CPUs evicting at the
+ * same time thus spread over the map instead of racing for the same first
+ * free entry. The scan itself is lock-free, and covers the whole map.
+ */
+static DEFINE_PER_CPU(unsigned int, victim_alloc_hint);
 
-static inline void __dequeue_usable_victim(struct pcache_victim_meta *v)
+/*
+ * Grab a reference to @v if it is usable and not selected for eviction.
+ * The flags are checked again after the get, @v may have been freed and
+ * reallocated in between. Our reference keeps it alive afterwards.
+ */
+static inline bool get_usable_victim(struct pcache_victim_meta *v)
 {
-	list_del_init(&v->next);
-	atomic_dec(&nr_usable_victims);
-}
+	if (!VictimUsable(v) || VictimReclaim(v))
+		return false;
 
-static inline void dequeue_usable_victim(struct pcache_victim_meta *v)
-{
-	spin_lock(&usable_victims_lock);
-	__dequeue_usable_victim(v);
-	spin_unlock(&usable_victims_lock);
+	if (unlikely(!get_victim_unless_zero(v)))
+		return false;
+
+	if (unlikely(!VictimUsable(v) || VictimReclaim(v))) {
+		put_victim(v);
+		return false;
+	}
+	return true;
 }
 
 static void victim_free_hit_entries(struct pcache_victim_meta *victim);
 
-static void __put_victim_nolist(struct pcache_victim_meta *v)
+/* Called when refcount drops to 0 */
+void __put_victim(struct pcache_victim_meta *v)
 {
 	PCACHE_BUG_ON_VICTIM(victim_ref_count(v), v);
 	PCACHE_BUG_ON_VICTIM(!VictimAllocated(v) || !VictimUsable(v) ||
@@ -201,13 +207,54 @@ static void __put_victim_nolist(struct pcache_victim_meta *v)
 
 	/* Clear all flags */
 	smp_store_mb(v->flags, 0);
+	atomic_dec(&nr_usable_victims);
+
+	/* Likely still hot in our cache, reuse it first */
+	this_cpu_write(victim_alloc_hint, victim_index(v));
 }
 
-/* Called when refcount drops to 0 */
-void __put_victim(struct pcache_victim_meta *v)
+/*
+ * Return the oldest usable victim allocated after @after with a
+ * reference held, or NULL if there is none.
+ */
+static struct pcache_victim_meta *oldest_usable_victim(u64 after)
 {
-	dequeue_usable_victim(v);
-	__put_victim_nolist(v);
+	struct pcache_victim_meta *v, *oldest;
+	unsigned int index;
+	u64 seq, oldest_seq;
+
+again:
+	oldest = NULL;
+	oldest_seq = 0;
+	for_each_victim(v, index) {
+		if (!VictimUsable(v) || VictimReclaim(v))
+			continue;
+
+		seq = READ_ONCE(v->seq);
+		if (seq <= after)
+			continue;
+		if (!oldest || seq < oldest_seq) {
+			oldest = v;
+			oldest_seq = seq;
+		}
+	}
+
+	if (!oldest)
+		return NULL;
+
+	if (unlikely(!get_usable_victim(oldest)))
+		goto skip;
+
+	/* Freed and reallocated since the scan? */
+	if (unlikely(READ_ONCE(oldest->seq) != oldest_seq)) {
+		put_victim(oldest);
+		goto skip;
+	}
+	return oldest;
+
+skip:
+	after = oldest_seq;
+	goto again;
 }
 
 /*
@@ -220,8 +267,8 @@ void __put_victim(struct pcache_victim_meta *v)
 static struct pcache_victim_meta *
 find_victim_to_evict(void)
 {
-	bool found = false;
-	struct pcache_victim_meta *v, *safer;
+	struct pcache_victim_meta *v;
+	u64 seq = 0;
 
 	/*
 	 * If multiple CPUs want to evict victim, we don't want them
@@ -233,18 +280,17 @@ find_victim_to_evict(void)
 	victim_debug("begin selection. nr_allocated: %d",
 		atomic_read(&nr_usable_victims));
 
-	spin_lock(&usable_victims_lock);
-	list_for_each_entry_safe(v, safer, &usable_victims, next) {
-		PCACHE_BUG_ON_VICTIM(!VictimUsable(v), v);
-		PCACHE_BUG_ON_VICTIM(VictimReclaim(v), v);
-
-		if (unlikely(!get_victim_unless_zero(v)))
-			goto out_unlock_list;
+	while ((v = oldest_usable_victim(seq))) {
+		seq = v->seq;
 
 		/* Lock contention? */
 		if (!spin_trylock(&v->lock))
 			goto loop_put;
 
+		/* Another CPU selected it after our check */
+		if (unlikely(VictimReclaim(v)))
+			goto loop_unlock_victim;
+
 		/*
 		 * Skip victim that is, was filling back to pcache.
 		 * victim_try_fill_pcache() is responsible for free the vicitm.
@@ -277,19 +323,17 @@ find_victim_to_evict(void)
 		 * 2) locked by us
 		 * 3) not filling pcache
 		 *
-		 * Now set the Reclaim flag, unlock the victim,
-		 * and remove it from usable_victims_list.
-		 * But we still hold 1 more ref here.
+		 * Now set the Reclaim flag and unlock the victim. Lookups
+		 * skip it from now on. But we still hold 1 more ref here.
 		 */
 		if (unlikely(TestSetVictimReclaim(v))) {
 			dump_pcache_victim(v, NULL);
 			BUG();
 		}
 		spin_unlock(&v->lock);
-		__dequeue_usable_victim(v);
 
-		found = true;
-		goto out_unlock_list;
+		victim_debug("finish selection, evict v%u", victim_index(v));
+		return v;
 
 loop_unlock_victim:
 		spin_unlock(&v->lock);
@@ -299,19 +343,10 @@ loop_put:
 		 * jump out and let caller retry:
 		 */
 		if (unlikely(put_victim_testzero(v))) {
-			__dequeue_usable_victim(v);
-			__put_victim_nolist(v);
-			goto out_unlock_list;
+			__put_victim(v);
+			break;
 		}
 	}
-
-out_unlock_list:
-	spin_unlock(&usable_victims_lock);
-
-	if (likely(found)) {
-		victim_debug("finish selection, evict v%u", victim_index(v));
-		return v;
-	}
 	return NULL;
 }
 
@@ -327,9 +362,8 @@ static int victim_evict_line(void)
 	inc_pcache_event(PCACHE_VICTIM_EVICTION_TRIGGERED);
 
 	/*
-	 * If a victim is selected to be evicted, it is removed
-	 * from the allocated_victim list, and has Reclaim flag set.
-	 * Also it has ref=1 or ref=2.
+	 * If a victim is selected to be evicted, it has Reclaim
+	 * flag set. Also it has ref=1 or ref=2.
 	 */
 	victim = find_victim_to_evict();
 	if (!victim) {
@@ -338,20 +372,21 @@ static int victim_evict_line(void)
 	}
 	PCACHE_BUG_ON_VICTIM(!VictimReclaim(victim), victim);
 
+	/*
+	 * A lookup may still hold a transient reference it grabbed
+	 * before seeing Reclaim. Give the victim back and retry.
+	 */
 	if (unlikely(!victim_ref_freeze(victim, 2))) {
-		if (unlikely(victim_ref_sub_and_test(victim, 2))) {
+		ClearVictimReclaim(victim);
+		if (unlikely(put_victim_testzero(victim))) {
 			dump_pcache_victim(victim, "ref error");
 			WARN_ON_ONCE(1);
-			goto free;
+			__put_victim(victim);
 		}
-
-		ClearVictimReclaim(victim);
-		enqueue_usable_victim(victim);
 		return -EAGAIN;
 	}
 
-free:
-	__put_victim_nolist(victim);
+	__put_victim(victim);
 	inc_pcache_event(PCACHE_VICTIM_EVICTION_SUCCEED);
 	return 0;
 }
@@ -376,26 +411,35 @@ static inline void prep_new_victim(struct pcache_victim_meta *victim)
 
 	victim->pcm = NULL;
 	victim->pset = NULL;
-	INIT_LIST_HEAD(&victim->next);
 	INIT_LIST_HEAD(&victim->hits);
 }
 
 static __always_inline struct pcache_victim_meta *
 victim_alloc_fastpath(void)
 {
-	int index;
+	unsigned int i, index, start;
 	struct pcache_victim_meta *v;
 
-	for_each_victim(v, index) {
+	start = this_cpu_read(victim_alloc_hint);
+	for (i = 0; i < VICTIM_NR_ENTRIES; i++) {
+		index = start + i;
+		if (index >= VICTIM_NR_ENTRIES)
+			index -= VICTIM_NR_ENTRIES;
+
+		v = pcache_victim_meta_map + index;
 		if (likely(!TestSetVictimAllocated(v))) {
+			this_cpu_write(victim_alloc_hint,
+				       (index + 1) % VICTIM_NR_ENTRIES);
 			prep_new_victim(v);
+			WRITE_ONCE(v->seq, atomic64_inc_return(&victim_seq));
+			atomic_inc(&nr_usable_victims);
 
 			/*
 			 * Make the victim line visible to other
 			 * victim code such as pgfault fill path:
 			 */
+			smp_wmb();
 			set_victim_usable(v);
-			enqueue_usable_victim(v);
 			return v;
 		}
 	}
@@ -415,12 +459,16 @@ victim_check_hit_entry(struct pcache_victim_meta *victim,
 
 static void check_victim_starving(struct pcache_set *pset, unsigned long address)
 {
-	struct pcache_victim_meta *v, *safer;
+	struct pcache_victim_meta *v;
 	enum victim_check_status result;
+	unsigned int index;
+
+	for_each_victim(v, index) {
+		if (!get_usable_victim(v))
+			continue;
 
-	spin_lock(&usable_victims_lock);
-	list_for_each_entry_safe(v, safer, &usable_victims, next) {
 		result = victim_check_hit_entry(v, address, current, true);
+		put_victim(v);
 		if (result != VICTIM_HIT)
 			continue;
 
@@ -436,7 +484,6 @@ static void check_victim_starving(struct pcache_set *pset, unsigned long address
 		dump_stack();
 		break;
 	}
-	spin_unlock(&usable_victims_lock);
 }
 
 /**
@@ -474,7 +521,7 @@ retry:
 			jiffies_to_msecs(jiffies - alloc_start),
 			atomic_read(&nr_usable_victims),
 			pcache_set_to_set_index(pset), pcache_set_victim_nr(pset),
-			IS_ENABLED(CONFIG_PCACHE_EVICT_LRU) ? atomic_read(&pset->nr_lru) : 0,
+			IS_ENABLED(CONFIG_PCACHE_EVICT_LRU_LIST) ? atomic_read(&pset->nr_lru) : 0,
 			address);
 
 		/*
@@ -778,6 +825,10 @@ victim_check_hit_entry(struct pcache_victim_meta *victim,
 	if (unlikely(VictimNohit(victim)))
 		goto out;
 
+	/* Selected for eviction after our get_usable_victim() */
+	if (unlikely(VictimReclaim(victim)))
+		goto out;
+
 	list_for_each_entry(entry, &victim->hits, next) {
 		victim_debug("    v%d[%#lx %d] u[%#lx %d]",
 			victim_index(victim), entry->address, entry->tgid,
@@ -813,16 +864,15 @@ int victim_try_fill_pcache(struct mm_struct *mm, unsigned long address,
 			   pte_t *page_table, pte_t orig_pte, pmd_t *pmd,
 			   unsigned long flags)
 {
-	struct pcache_victim_meta *v, *safer;
+	struct pcache_victim_meta *v;
 	enum victim_check_status result;
+	unsigned int index;
 	int ret = 1;
 
 	inc_pcache_event(PCACHE_VICTIM_LOOKUP);
 
-	spin_lock(&usable_victims_lock);
-	list_for_each_entry_safe(v, safer, &usable_victims, next) {
-		PCACHE_BUG_ON_VICTIM(VictimReclaim(v), v);
-		if (unlikely(!get_victim_unless_zero(v)))
+	for_each_victim(v, index) {
+		if (!get_usable_victim(v))
 			continue;
 
 		result = victim_check_hit_entry(v, address, current, true);
@@ -832,11 +882,9 @@ int victim_try_fill_pcache(struct mm_struct *mm, unsigned long address,
 			 * which will further try to allocate a pcache line.
 			 * If pcache is already full, it will evict one to victim.
 			 * If victim is also full, victim needs to evict one, too.
-			 * This eventually goes to find_victim_to_evict().
-			 * So, _don't_ hold the same lock:
+			 * This eventually goes to find_victim_to_evict(),
+			 * which skips this victim while we are filling.
 			 */
-			spin_unlock(&usable_victims_lock);
-
 			inc_pcache_event(PCACHE_VICTIM_HIT);
 			ret = victim_fill_pcache(mm, address, page_table, orig_pte,
 						 pmd, flags, v);
@@ -854,7 +902,7 @@ int victim_try_fill_pcache(struct mm_struct *mm, unsigned long address,
 			 * Drop the victim once hit by pcache and refill succeed.
 			 *
 			 * This victim can be hit concurrently by multiple CPUs,
-			 * because we released the big lock above. Meanwhile, this
+			 * because lookups do not exclude each other. Meanwhile, this
 			 * victim could be held by flush thread as well.
 			 *
 			 * Ground rule is: only one thread can free the victim,
@@ -902,20 +950,15 @@ int victim_try_fill_pcache(struct mm_struct *mm, unsigned long address,
 			goto out;
 		} else if (result == VICTIM_MISS) {
 			/*
-			 * If it is miss, we do not need to release the lock.
-			 * But we do need to decrement 1 reference. Meanwhile
-			 * there might be another thread having a hit and tried
-			 * to free the pcache line:
+			 * If it is miss, we do need to decrement 1 reference.
+			 * Meanwhile there might be another thread having a hit
+			 * and tried to free the pcache line:
 			 */
-			if (unlikely(put_victim_testzero(v))) {
-				__dequeue_usable_victim(v);
-				__put_victim_nolist(v);
-			}
+			put_victim(v);
 			continue;
 		} else
 			BUG();
 	}
-	spin_unlock(&usable_victims_lock);
 out:
 	return ret;
 }
@@ -935,12 +978,21 @@ static void __init victim_cache_init_meta_map(void)
 		v->pset = NULL;
 		spin_lock_init(&v->lock);
 		INIT_LIST_HEAD(&v->hits);
-		INIT_LIST_HEAD(&v->next);
+		v->seq = 0;
 		atomic_set(&v->nr_fill_pcache, 0);
 		victim_ref_count_set(v, 0);
 	}
 }
 
+/* Spread CPUs over the victim map */
+void __init victim_cache_init_alloc_hint(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		per_cpu(victim_alloc_hint, cpu) = cpu % VICTIM_NR_ENTRIES;
+}
+
 /*
  * Allocate victim metadata and cache lines
  * This function is called during early boot, both buddy allocator
@@ -952,7 +1004,7 @@ void __init victim_cache_early_init(void)
 
 	/* allocate the victim cache lines */
 	size = VICTIM_NR_ENTRIES * PCACHE_LINE_SIZE;
-	pcache_victim_data_map = memblock_virt_alloc(size, PAGE_SIZE);
+	pcache_victim_data_map = pcache_memblock_alloc(size);
 	if (!pcache_victim_data_map)
 		panic("Unable to allocate victim data map!");
 	memset(pcache_victim_data_map, 0, size);
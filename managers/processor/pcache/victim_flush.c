@@ -8,7 +8,15 @@
  */
 
 /*
- * Victim cache's background flush daemon thread
+ * Victim cache's background flush daemon threads
+ *
+ * Up to VICTIM_NR_FLUSHD threads share the flush queue. Each of them grabs
+ * up to VICTIM_FLUSH_BATCH jobs at once, and dirty lines that go to the same
+ * memory node are sent in one P2M_PCACHE_FLUSH_BATCH.
+ *
+ * They sleep while there is nothing to do. The first one is woken for every
+ * job. Flusher i is only woken once more than i batches are queued, that is,
+ * when the ones before it can not keep up.
  */
 
 #include <lego/mm.h>
@@ -28,10 +36,31 @@
 #include <processor/pcache.h>
 #include <processor/processor.h>
 
+#define VICTIM_NR_FLUSHD	CONFIG_PCACHE_EVICTION_VICTIM_NR_FLUSHD
+#define VICTIM_FLUSH_BATCH	P2M_PCACHE_FLUSH_BATCH_MAX
+
 atomic_t nr_flush_jobs = ATOMIC_INIT(0);
 DEFINE_SPINLOCK(victim_flush_lock);
 LIST_HEAD(victim_flush_queue);
-static struct task_struct *victim_flush_thread;
+static struct task_struct *victim_flush_threads[VICTIM_NR_FLUSHD];
+static wait_queue_head_t victim_flush_wait[VICTIM_NR_FLUSHD];
+
+/* Queued jobs needed to wake flusher @i */
+static inline int victim_flushd_load(int i)
+{
+	return i * VICTIM_FLUSH_BATCH;
+}
+
+static inline void wake_up_victim_flushd(void)
+{
+	int i, nr = nr_flush_queue_jobs();
+
+	for (i = 0; i < VICTIM_NR_FLUSHD; i++) {
+		if (nr <= victim_flushd_load(i))
+			break;
+		wake_up(&victim_flush_wait[i]);
+	}
+}
 
 static inline void __dequeue_victim_flush_job(struct victim_flush_job *job)
 {
@@ -105,6 +134,7 @@ int victim_submit_flush(struct pcache_victim_meta *victim, bool wait, bool dirty
 
 	enqueue_victim_flush_job(job);
 	inc_pcache_event(PCACHE_VICTIM_FLUSH_SUBMITTED_DIRTY);
+	wake_up_victim_flushd();
 
 	/* flush thread will free job */
 	if (unlikely(wait))
@@ -112,40 +142,23 @@ int victim_submit_flush(struct pcache_victim_meta *victim, bool wait, bool dirty
 	return 0;
 }
 
-/*
- * Return number of succeed clflush
- * It can be 0, if the address belonged area was unmapped
- */
-static void victim_flush_one(struct pcache_victim_meta *victim)
+static void victim_flush_begin(struct victim_flush_job *job)
 {
-	void *cache_kva;
-	struct pcache_victim_hit_entry *entry;
+	struct pcache_victim_meta *victim = job->victim;
 
-	cache_kva = pcache_victim_to_kva(victim);
+	PCACHE_BUG_ON_VICTIM(!VictimHasdata(victim) || !VictimAllocated(victim), victim);
+	PCACHE_BUG_ON_VICTIM(VictimFlushed(victim) || VictimWriteback(victim), victim);
+	PCACHE_BUG_ON_VICTIM(!VictimWaitflush(victim), victim);
 
-	/*
-	 * We don't need acquire the spinlock to walk through
-	 * the list at this point: 1) Eviction won't take this
-	 * victim cause Flushed is not set. 2) Insertion only
-	 * happens once and it already happened.
-	 */
-	list_for_each_entry(entry, &victim->hits, next)
-		__clflush_one(entry->tgid, entry->address,
-			      entry->m_nid, entry->rep_nid, cache_kva);
+	__SetVictimWriteback(victim);
 }
 
-void __victim_flush_func(struct victim_flush_job *job)
+static void victim_flush_end(struct victim_flush_job *job)
 {
 	bool wait = job->wait;
 	struct completion *done = &job->done;
 	struct pcache_victim_meta *victim = job->victim;
 
-	PCACHE_BUG_ON_VICTIM(!VictimHasdata(victim) || !VictimAllocated(victim), victim);
-	PCACHE_BUG_ON_VICTIM(VictimFlushed(victim) || VictimWriteback(victim), victim);
-	PCACHE_BUG_ON_VICTIM(!VictimWaitflush(victim), victim);
-
-	__SetVictimWriteback(victim);
-	victim_flush_one(victim);
 	inc_pcache_event(PCACHE_VICTIM_FLUSH_FINISHED_DIRTY);
 	__ClearVictimWriteback(victim);
 
@@ -168,6 +181,86 @@ void __victim_flush_func(struct victim_flush_job *job)
 	kfree(job);
 }
 
+/*
+ * Return number of succeed clflush
+ * It can be 0, if the address belonged area was unmapped
+ */
+static void victim_flush_one(struct pcache_victim_meta *victim)
+{
+	void *cache_kva;
+	struct pcache_victim_hit_entry *entry;
+
+	cache_kva = pcache_victim_to_kva(victim);
+
+	/*
+	 * We don't need acquire the spinlock to walk through
+	 * the list at this point: 1) Eviction won't take this
+	 * victim cause Flushed is not set. 2) Insertion only
+	 * happens once and it already happened.
+	 */
+	list_for_each_entry(entry, &victim->hits, next)
+		__clflush_one(entry->tgid, entry->address,
+			      entry->m_nid, entry->rep_nid, cache_kva);
+}
+
+void __victim_flush_func(struct victim_flush_job *job)
+{
+	victim_flush_begin(job);
+	victim_flush_one(job->victim);
+	victim_flush_end(job);
+}
+
+/*
+ * Flush all lines of @jobs, batched per memory node.
+ * Same as victim_flush_one(), walking hits needs no lock.
+ */
+static void victim_flush_jobs(struct victim_flush_job **jobs, int nr_jobs,
+			      struct p2m_flush_batch_msg *msg)
+{
+	struct clflush_batch_entry lines[VICTIM_FLUSH_BATCH];
+	struct pcache_victim_hit_entry *entry;
+	int i, nr = 0;
+
+	for (i = 0; i < nr_jobs; i++) {
+		struct pcache_victim_meta *victim = jobs[i]->victim;
+
+		victim_flush_begin(jobs[i]);
+		list_for_each_entry(entry, &victim->hits, next) {
+			if (nr == VICTIM_FLUSH_BATCH) {
+				__clflush_batch(lines, nr, msg);
+				nr = 0;
+			}
+
+			lines[nr].tgid = entry->tgid;
+			lines[nr].user_va = entry->address;
+			lines[nr].m_nid = entry->m_nid;
+			lines[nr].rep_nid = entry->rep_nid;
+			lines[nr].cache_addr = pcache_victim_to_kva(victim);
+			nr++;
+		}
+	}
+	if (nr)
+		__clflush_batch(lines, nr, msg);
+
+	for (i = 0; i < nr_jobs; i++)
+		victim_flush_end(jobs[i]);
+}
+
+static int dequeue_victim_flush_jobs(struct victim_flush_job **jobs, int max)
+{
+	int nr = 0;
+
+	spin_lock(&victim_flush_lock);
+	while (nr < max && !list_empty(&victim_flush_queue)) {
+		jobs[nr] = list_entry(victim_flush_queue.next,
+				      struct victim_flush_job, next);
+		__dequeue_victim_flush_job(jobs[nr]);
+		nr++;
+	}
+	spin_unlock(&victim_flush_lock);
+	return nr;
+}
+
 /*
  * Stead a victim flush job from the pending queue.
  * Return NULL if we failed.
@@ -185,29 +278,29 @@ struct victim_flush_job *__steal_victim_flush_job(void)
 	return job;
 }
 
-static int victim_flush_async(void *unused)
+struct victim_flushd_arg {
+	int				idx;
+	struct p2m_flush_batch_msg	msg;
+};
+
+static int victim_flush_async(void *_arg)
 {
-	if (pin_current_thread())
-		panic("Fail to pin victim flush");
+	struct victim_flush_job *jobs[VICTIM_FLUSH_BATCH];
+	struct victim_flushd_arg *arg = _arg;
+	struct p2m_flush_batch_msg *msg = &arg->msg;
+	int load = victim_flushd_load(arg->idx);
+	int nr;
 
 	for (;;) {
-		while (!nr_flush_queue_jobs())
-			cpu_relax();
-
-		spin_lock(&victim_flush_lock);
-		while (!list_empty(&victim_flush_queue)) {
-			struct victim_flush_job *job;
-
-			job = list_entry(victim_flush_queue.next,
-					 struct victim_flush_job, next);
-			__dequeue_victim_flush_job(job);
-			spin_unlock(&victim_flush_lock);
-
-			__victim_flush_func(job);
-
-			spin_lock(&victim_flush_lock);
-		}
-		spin_unlock(&victim_flush_lock);
+		wait_event_interruptible(victim_flush_wait[arg->idx],
+					 nr_flush_queue_jobs() > load);
+
+		/* Other flushd may have taken them */
+		nr = dequeue_victim_flush_jobs(jobs, VICTIM_FLUSH_BATCH);
+		if (nr == 1)
+			__victim_flush_func(jobs[0]);
+		else if (nr > 1)
+			victim_flush_jobs(jobs, nr, msg);
 	}
 	return 0;
 }
@@ -215,7 +308,22 @@ static int victim_flush_async(void *unused)
 /* Has to be called after kthreadd is running */
 void __init victim_cache_post_init(void)
 {
-	victim_flush_thread = kthread_run(victim_flush_async, NULL, "kvictim_flushd");
-	if (IS_ERR(victim_flush_thread))
-		panic("Fail to create victim flush thread!");
+	struct victim_flushd_arg *arg;
+	int i;
+
+	victim_cache_init_alloc_hint();
+
+	for (i = 0; i < VICTIM_NR_FLUSHD; i++) {
+		init_waitqueue_head(&victim_flush_wait[i]);
+
+		arg = kmalloc(sizeof(*arg), GFP_KERNEL);
+		if (!arg)
+			panic("Fail to allocate victim flush buffer!");
+		arg->idx = i;
+
+		victim_flush_threads[i] = kthread_run(victim_flush_async, arg,
+						      "kvictim_flushd/%d", i);
+		if (IS_ERR(victim_flush_threads[i]))
+			panic("Fail to create victim flush thread!");
+	}
 }
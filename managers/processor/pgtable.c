@@ -137,6 +137,15 @@ retry:
 		ptent = *pte;
 		if (pte_none(ptent))
 			continue;
+
+		/* See pcache_do_fill_page_overlap(), let the filler finish */
+		if (unlikely(pte_fill_pending(ptent))) {
+			spin_unlock(ptl);
+			cond_resched();
+			spin_lock(ptl);
+			goto retry;
+		}
+
 		if (pte_present(ptent)) {
 			int ret;
 
@@ -254,11 +263,15 @@ void release_pgtable(struct task_struct *tsk,
 	pgtable_debug("%s[%d] [%#lx - %#lx]",
 		tsk->comm, tsk->tgid, start, end);
 
+	pcache_prefetch_block(mm);
+
 	/* Free actual pages */
 	unmap_page_range(mm, start, end);
 
 	/* Free pgtable pages */
 	free_pgd_range(mm, start, end);
+
+	pcache_prefetch_unblock(mm);
 }
 
 /*
@@ -348,7 +361,8 @@ pcache_copy_pte_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 	do {
 		pte_t ptecont = *src_pte;
 
-		if (pte_none(ptecont))
+		/* Child fetches lines being filled on its own */
+		if (pte_none(ptecont) || pte_fill_pending(ptecont))
 			continue;
 
 		if (!pte_present(ptecont)) {
@@ -530,6 +544,21 @@ retry:
 		if (pte_none(*old_pte))
 			continue;
 
+		/*
+		 * See pcache_do_fill_page_overlap(), let the filler finish.
+		 * It may have to evict a line mapped by new_pte.
+		 */
+		if (unlikely(pte_fill_pending(*old_pte))) {
+			if (new_ptl != old_ptl)
+				spin_unlock(new_ptl);
+			spin_unlock(old_ptl);
+			cond_resched();
+			spin_lock(old_ptl);
+			if (new_ptl != old_ptl)
+				spin_lock(new_ptl);
+			goto retry;
+		}
+
 		if (!pte_present(*old_pte)) {
 #ifdef CONFIG_PCACHE_ZEROFILL
 			/*
@@ -610,6 +639,7 @@ unsigned long move_page_tables(struct task_struct *tsk,
 
 	old_end = old_addr + len;
 
+	pcache_prefetch_block(mm);
 	for (; old_addr < old_end; old_addr += extent, new_addr += extent) {
 		next = (old_addr + PMD_SIZE) & PMD_MASK;
 
@@ -638,6 +668,7 @@ unsigned long move_page_tables(struct task_struct *tsk,
 		move_ptes(mm, old_pmd, old_addr, old_addr + extent,
 			  new_pmd, new_addr);
 	}
+	pcache_prefetch_unblock(mm);
 
 	return len + old_addr - old_end;	/* how much done */
 }
@@ -7,45 +7,118 @@
  * (at your option) any later version.
  */
 
+/*
+ * Replication pipeline
+ *
+ * replicate() copies the line into a per-destination replica batch and
+ * returns. Full batches are queued to kreplicad, which sends them in
+ * order with P2M_PCACHE_REPLICA_BATCH and waits for the ack. Whenever
+ * kreplicad finds its queue empty, it seals partially filled batches
+ * too, thus batches grow only while the network is busy.
+ *
+ * REPLICA_WINDOW batches are preallocated, being filled, queued or in
+ * flight. replicate() is called from eviction, which may hold pte or
+ * pcache locks, thus it never waits for a free one: if all of them are
+ * used, the caller sends its line itself with a P2M_PCACHE_REPLICA and
+ * waits for the reply, just like the flush it follows. Memory used by
+ * replication stays bounded, and a slow replica slows down eviction.
+ *
+ * Each queued batch gets a sequence number, which is acked in order.
+ * replication_barrier() seals all batches and waits for the last
+ * sequence number, it does not wait for lines replicated after it.
+ *
+ * Every barrier also starts a new epoch. Batches and synchronous sends
+ * record the epoch they were sent in. If lines of an epoch were not
+ * appended by the remote, the first barrier that covers that epoch
+ * returns -EIO, and the failure is not reported again.
+ */
+
 #include <lego/mm.h>
 #include <lego/wait.h>
 #include <lego/slab.h>
-#include <lego/log2.h>
-#include <lego/hash.h>
 #include <lego/kernel.h>
-#include <lego/pgfault.h>
-#include <lego/profile.h>
-#include <lego/syscalls.h>
-#include <lego/jiffies.h>
+#include <lego/kthread.h>
+#include <lego/spinlock.h>
 #include <lego/fit_ibapi.h>
 #include <processor/pcache.h>
 #include <processor/processor.h>
 #include <processor/distvm.h>
+#include <processor/replication.h>
+
+#define REPLICA_BATCH_MAX	P2M_PCACHE_REPLICA_BATCH_MAX
+#define REPLICA_WINDOW		CONFIG_REPLICATION_MEMORY_WINDOW
+
+#define REPLICA_MSG_SIZE(nr)	\
+	(sizeof(struct p2m_replica_batch_msg) + (nr) * sizeof(struct replica_log))
+
+struct replica_batch {
+	struct p2m_replica_batch_msg	*msg;
+	unsigned int			nid;
+	unsigned long			seq;
+	unsigned long			epoch;
+	struct list_head		next;
+};
+
+/* The batch being filled for each destination */
+struct replica_staging {
+	spinlock_t			lock;
+	struct replica_batch		*batch;
+};
+
+static struct replica_batch replica_batches[REPLICA_WINDOW];
+static struct replica_staging replica_staging[CONFIG_FIT_NR_NODES];
+
+/* Used by replicate() if the window is full */
+static DEFINE_PER_CPU(struct p2m_replica_msg, replica_sync_msg);
+
+/* Protect free and queued list, sequence numbers and epochs */
+static DEFINE_SPINLOCK(replica_lock);
+static LIST_HEAD(replica_free_list);
+static LIST_HEAD(replica_queue);
+static unsigned long replica_queued_seq;
+static unsigned long replica_acked_seq;
+static unsigned long replica_epoch;
+
+/* Range of epochs that lost lines, not reported by a barrier yet */
+static bool replica_failed;
+static unsigned long replica_failed_first;
+static unsigned long replica_failed_last;
 
-static DEFINE_PER_CPU(struct p2m_replica_msg, p2m_replica_msg_array);
+/* Lines that are not acked yet */
+static atomic_t nr_replica_pending = ATOMIC_INIT(0);
+
+/* Wait for ack */
+static DEFINE_WAIT_QUEUE_HEAD(replica_wait);
+
+static struct task_struct *replica_task;
 
 static inline int post_choose_rep(unsigned int m_nid, unsigned int rep_nid)
 {
 	return rep_nid;
 }
 
-/*
- * At the time of calling, the associated task/mm may have been freed already.
- * Caller needs to provide all necessary information to perform the replication.
- */
-void replicate(pid_t tgid, unsigned long user_va,
-	       unsigned int m_nid, unsigned int rep_nid, void *cache_addr)
+static struct replica_batch *get_free_replica_batch(unsigned int nid)
 {
-	struct p2m_replica_msg *msg;
-	struct replica_log *log;
-	struct replica_log_meta *meta;
+	struct replica_batch *b = NULL;
 
-	msg = this_cpu_ptr(&p2m_replica_msg_array);
+	spin_lock(&replica_lock);
+	if (!list_empty(&replica_free_list)) {
+		b = list_first_entry(&replica_free_list, struct replica_batch, next);
+		list_del(&b->next);
+	}
+	spin_unlock(&replica_lock);
 
-	fill_common_header(msg, P2M_PCACHE_REPLICA);
+	if (b) {
+		b->nid = nid;
+		b->msg->nr_logs = 0;
+	}
+	return b;
+}
 
-	log = &msg->log;
-	meta = &log->meta;
+static inline void fill_replica_log_meta(struct replica_log_meta *meta,
+					 pid_t tgid, unsigned long user_va,
+					 unsigned int m_nid)
+{
 	meta->pid = tgid;
 	meta->vnode_id = 0;
 	meta->nid_processor = LEGO_LOCAL_NID;
@@ -53,9 +126,282 @@ void replicate(pid_t tgid, unsigned long user_va,
 	meta->flags = 0;
 	meta->csum = 0;
 	meta->nid_memory = m_nid;
-	memcpy(log->data, cache_addr, PCACHE_LINE_SIZE);
+}
+
+/*
+ * The window is used up. Send the line right away and wait for the reply,
+ * from the per-cpu message and the cache line itself, no copy needed.
+ * Return 0 if the replica was appended.
+ */
+static int replicate_sync(pid_t tgid, unsigned long user_va, unsigned int m_nid,
+			  unsigned int rep_nid, void *cache_addr)
+{
+	struct p2m_replica_msg *msg;
+	struct fit_sglist sgl[2];
+	int ret, reply;
+
+	msg = &get_cpu_var(replica_sync_msg);
+
+	fill_common_header(msg, P2M_PCACHE_REPLICA);
+	fill_replica_log_meta(&msg->log.meta, tgid, user_va, m_nid);
+
+	sgl[0].addr = msg;
+	sgl[0].len = offsetof(struct p2m_replica_msg, log.data);
+	sgl[1].addr = cache_addr;
+	sgl[1].len = PCACHE_LINE_SIZE;
+	barrier();
+
+	ret = ibapi_send_reply_sge_timeout(rep_nid, sgl, ARRAY_SIZE(sgl),
+					   &reply, sizeof(reply), DEF_NET_TIMEOUT);
+	put_cpu_var(replica_sync_msg);
+
+	if (unlikely(ret != sizeof(reply)))
+		return -EIO;
+	return reply;
+}
+
+static void queue_replica_batch(struct replica_batch *b)
+{
+	spin_lock(&replica_lock);
+	b->seq = ++replica_queued_seq;
+	b->epoch = replica_epoch;
+	list_add_tail(&b->next, &replica_queue);
+	spin_unlock(&replica_lock);
+}
+
+/* Caller holds replica_lock */
+static void __replica_fail_epoch(unsigned long epoch)
+{
+	if (!replica_failed || epoch < replica_failed_first)
+		replica_failed_first = epoch;
+	if (!replica_failed || epoch > replica_failed_last)
+		replica_failed_last = epoch;
+	replica_failed = true;
+}
+
+static void replica_fail(int nr)
+{
+	add_pcache_event(PCACHE_REPLICA_FAIL, nr);
+
+	spin_lock(&replica_lock);
+	__replica_fail_epoch(replica_epoch);
+	spin_unlock(&replica_lock);
+}
+
+static struct replica_batch *dequeue_replica_batch(void)
+{
+	struct replica_batch *b = NULL;
+
+	spin_lock(&replica_lock);
+	if (!list_empty(&replica_queue)) {
+		b = list_first_entry(&replica_queue, struct replica_batch, next);
+		list_del(&b->next);
+	}
+	spin_unlock(&replica_lock);
+	return b;
+}
+
+/* Queue all partially filled batches */
+static void seal_replica_batches(void)
+{
+	struct replica_staging *s;
+	struct replica_batch *b;
+	int nid;
+
+	for (nid = 0; nid < CONFIG_FIT_NR_NODES; nid++) {
+		s = &replica_staging[nid];
+
+		/* Racy check is fine, barrier callers seal again under lock */
+		if (!READ_ONCE(s->batch))
+			continue;
+
+		spin_lock(&s->lock);
+		b = s->batch;
+		s->batch = NULL;
+		if (b)
+			queue_replica_batch(b);
+		spin_unlock(&s->lock);
+	}
+}
+
+/*
+ * At the time of calling, the associated task/mm may have been freed already.
+ * Caller needs to provide all necessary information to perform the replication.
+ * @cache_addr is copied or sent before return. Never sleeps, callable with
+ * preemption disabled or under spinlocks.
+ */
+void replicate(pid_t tgid, unsigned long user_va,
+	       unsigned int m_nid, unsigned int rep_nid, void *cache_addr)
+{
+	struct replica_staging *s;
+	struct replica_batch *b;
+	struct replica_log *log;
+	bool sealed = false;
 
 	rep_nid = post_choose_rep(m_nid, rep_nid);
+	s = &replica_staging[rep_nid];
+
+	spin_lock(&s->lock);
+	if (!s->batch) {
+		b = get_free_replica_batch(rep_nid);
+		if (unlikely(!b)) {
+			spin_unlock(&s->lock);
+
+			/* Let kreplicad drain the window meanwhile */
+			wake_up_process(replica_task);
+
+			inc_pcache_event(PCACHE_REPLICA_WINDOW_FULL);
+			if (replicate_sync(tgid, user_va, m_nid, rep_nid, cache_addr))
+				replica_fail(1);
+			return;
+		}
+		s->batch = b;
+	}
+
+	b = s->batch;
+	log = &b->msg->logs[b->msg->nr_logs++];
+	fill_replica_log_meta(&log->meta, tgid, user_va, m_nid);
+	memcpy(log->data, cache_addr, PCACHE_LINE_SIZE);
+
+	atomic_inc(&nr_replica_pending);
+
+	if (b->msg->nr_logs == REPLICA_BATCH_MAX) {
+		s->batch = NULL;
+		sealed = true;
+	}
+	spin_unlock(&s->lock);
+
+	if (sealed)
+		queue_replica_batch(b);
+
+	inc_pcache_event(PCACHE_REPLICA_LINE);
+	wake_up_process(replica_task);
+}
+
+static void send_replica_batch(struct replica_batch *b)
+{
+	struct p2m_replica_batch_msg *msg = b->msg;
+	int ret, reply, nr = msg->nr_logs;
+
+	fill_common_header(msg, P2M_PCACHE_REPLICA_BATCH);
+	ret = ibapi_send_reply_timeout(b->nid, msg, REPLICA_MSG_SIZE(nr),
+				       &reply, sizeof(reply), false, DEF_NET_TIMEOUT);
+
+	if (unlikely(ret != sizeof(reply) || reply < 0))
+		reply = 0;
+
+	inc_pcache_event(PCACHE_REPLICA_BATCH);
+	add_pcache_event(PCACHE_REPLICA_FAIL, nr - reply);
+
+	spin_lock(&replica_lock);
+	if (unlikely(reply < nr))
+		__replica_fail_epoch(b->epoch);
+	replica_acked_seq = b->seq;
+	list_add(&b->next, &replica_free_list);
+	spin_unlock(&replica_lock);
+
+	atomic_sub(nr, &nr_replica_pending);
+	wake_up(&replica_wait);
+}
+
+static int kreplicad(void *unused)
+{
+	struct replica_batch *b;
+
+	set_cpus_allowed_ptr(current, cpu_active_mask);
+
+	while (1) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!atomic_read(&nr_replica_pending))
+			schedule();
+		__set_current_state(TASK_RUNNING);
+
+		b = dequeue_replica_batch();
+		if (!b) {
+			seal_replica_batches();
+			b = dequeue_replica_batch();
+			if (!b) {
+				/*
+				 * Lines are counted, but their batch is being
+				 * filled or queued by replicate(), which wakes
+				 * us up once done. Sleep a tick in case that
+				 * wakeup came before we set our state.
+				 */
+				set_current_state(TASK_INTERRUPTIBLE);
+				schedule_timeout(1);
+				continue;
+			}
+		}
+		send_replica_batch(b);
+	}
+	BUG();
+	return 0;
+}
+
+static inline bool replica_acked(unsigned long seq)
+{
+	return (long)(READ_ONCE(replica_acked_seq) - seq) >= 0;
+}
+
+/**
+ * replication_barrier
+ *
+ * Wait until all lines passed to replicate() before this call
+ * are acked by secondary memory.
+ *
+ * Return -EIO if some of them, or lines of an earlier epoch that no
+ * barrier has reported yet, were not appended. 0 otherwise.
+ */
+int replication_barrier(void)
+{
+	unsigned long seq, epoch;
+	int ret = 0;
+
+	inc_pcache_event(PCACHE_REPLICA_BARRIER);
+
+	seal_replica_batches();
+
+	/* Batches queued from now on belong to the next epoch */
+	spin_lock(&replica_lock);
+	seq = replica_queued_seq;
+	epoch = replica_epoch++;
+	spin_unlock(&replica_lock);
+
+	wake_up_process(replica_task);
+	wait_event(replica_wait, replica_acked(seq));
+
+	spin_lock(&replica_lock);
+	if (replica_failed && replica_failed_first <= epoch) {
+		ret = -EIO;
+
+		/* Keep failures of later epochs for their barriers */
+		if (replica_failed_last <= epoch)
+			replica_failed = false;
+		else
+			replica_failed_first = epoch + 1;
+	}
+	spin_unlock(&replica_lock);
+
+	return ret;
+}
+
+void __init replication_init(void)
+{
+	struct replica_batch *b;
+	int i;
+
+	for (i = 0; i < CONFIG_FIT_NR_NODES; i++)
+		spin_lock_init(&replica_staging[i].lock);
+
+	for (i = 0; i < REPLICA_WINDOW; i++) {
+		b = &replica_batches[i];
+		b->msg = kmalloc(REPLICA_MSG_SIZE(REPLICA_BATCH_MAX), GFP_KERNEL);
+		if (!b->msg)
+			panic("Fail to allocate replica batch");
+		list_add(&b->next, &replica_free_list);
+	}
 
-	ibapi_send(rep_nid, msg, sizeof(*msg));
+	replica_task = kthread_run(kreplicad, NULL, "kreplicad");
+	if (IS_ERR(replica_task))
+		panic("Fail to create kreplicad");
 }
@@ -217,6 +217,129 @@ int ibapi_multicast_send_reply_timeout(int num_nodes, int *target_node,
 	return ret;
 }
 
+/**
+ * ibapi_send_reply_sge_timeout
+ * @target_node: target node id
+ * @sgl: message segments, sent as one message
+ * @nr_sge: number of segments, at most FIT_MAX_SEND_SGE
+ * @ret_addr: reply buffer
+ * @max_ret_size: size of reply buffer
+ * @timeout_sec: timeout in seconds
+ *
+ * Same as ibapi_send_reply_timeout(), but the message is gathered by
+ * the NIC, callers do not need to copy header and payload together.
+ *
+ * Return:
+ * Negative values on failure (-ETIMEDOUT for timeout)
+ * Positive values indicate the reply message length
+ */
+int ibapi_send_reply_sge_timeout(int target_node, struct fit_sglist *sgl, int nr_sge,
+				 void *ret_addr, int max_ret_size, unsigned long timeout_sec)
+{
+	int ret;
+
+	if (unlikely(target_node >= CONFIG_FIT_NR_NODES)) {
+		pr_info("target_node: %d\n", target_node);
+		BUG();
+	}
+
+#ifdef CONFIG_COUNTER_FIT_IB
+	{
+		int i;
+
+		atomic_long_inc(&nr_ib_send_reply);
+		for (i = 0; i < nr_sge; i++)
+			atomic_long_add(sgl[i].len, &nr_bytes_tx);
+	}
+#endif
+
+	lock_ib();
+	ret = fit_send_reply_sge(FIT_ctx, target_node, sgl, nr_sge, ret_addr,
+				 max_ret_size, timeout_sec, __builtin_return_address(0));
+	if (unlikely(ret > max_ret_size)) {
+		pr_info("ret: %d, max_ret_size: %d\n", ret, max_ret_size);
+		BUG();
+	}
+	unlock_ib();
+
+#ifdef CONFIG_COUNTER_FIT_IB
+	if (ret > 0)
+		atomic_long_add(ret, &nr_bytes_rx);
+#endif
+	return ret;
+}
+
+/**
+ * ibapi_send_reply_post
+ * @target_node: target node id
+ * @addr: message
+ * @size: size of message
+ * @ret_addr: reply buffer
+ * @max_ret_size: size of reply buffer
+ *
+ * Post a send-reply and return without waiting for the reply, so that
+ * a thread can keep up to FIT_MAX_PENDING_REPLIES requests in flight.
+ * @addr and @ret_addr must stay valid until ibapi_wait_reply() returns.
+ * With FIT_SEQUENTIAL_IBAPI, the reply is waited for before return.
+ *
+ * Return:
+ * A handle for ibapi_wait_reply(), or ERR_PTR on failure
+ */
+struct fit_pending_reply *
+ibapi_send_reply_post(int target_node, void *addr, int size,
+		      void *ret_addr, int max_ret_size)
+{
+	struct fit_pending_reply *pr;
+
+	if (unlikely(target_node >= CONFIG_FIT_NR_NODES)) {
+		pr_info("target_node: %d\n", target_node);
+		BUG();
+	}
+
+#ifdef CONFIG_COUNTER_FIT_IB
+	atomic_long_inc(&nr_ib_send_reply);
+	atomic_long_add(size, &nr_bytes_tx);
+#endif
+
+	lock_ib();
+	pr = fit_send_reply_post(FIT_ctx, target_node, addr, size, ret_addr,
+				 max_ret_size, __builtin_return_address(0));
+#ifdef CONFIG_FIT_SEQUENTIAL_IBAPI
+	if (!IS_ERR(pr))
+		fit_wait_reply(FIT_ctx, pr, FIT_MAX_TIMEOUT_SEC,
+			       __builtin_return_address(0));
+#endif
+	unlock_ib();
+	return pr;
+}
+
+/**
+ * ibapi_wait_reply
+ * @pr: returned by ibapi_send_reply_post()
+ * @timeout_sec: timeout in seconds
+ *
+ * Wait for the reply of @pr. @pr is gone after this returns.
+ *
+ * Return:
+ * Negative values on failure (-ETIMEDOUT for timeout)
+ * Positive values indicate the reply message length
+ */
+int ibapi_wait_reply(struct fit_pending_reply *pr, unsigned long timeout_sec)
+{
+	int ret;
+
+	ret = fit_wait_reply(FIT_ctx, pr, timeout_sec, __builtin_return_address(0));
+	if (unlikely(ret == -ETIMEDOUT))
+		return ret;
+	kfree(pr);
+
+#ifdef CONFIG_COUNTER_FIT_IB
+	if (ret > 0)
+		atomic_long_add(ret, &nr_bytes_rx);
+#endif
+	return ret;
+}
+
 inline int ibapi_receive_message(unsigned int designed_port,
 		void *ret_addr, int receive_size, uintptr_t *descriptor)
 {
@@ -231,6 +354,20 @@ int ibapi_receive_message_no_reply(unsigned int designed_port,
 	return fit_receive_message_no_reply(ctx, designed_port, ret_addr, receive_size, 0);
 }
 
+/**
+ * ibapi_reg_mr_addr
+ * @addr: kernel virtual address
+ * @size: length of the region
+ *
+ * Return the DMA address of [@addr, @addr + @size) within our global MR.
+ * Remote nodes can RDMA WRITE into it with the rkey carried by our requests.
+ */
+u64 ibapi_reg_mr_addr(void *addr, size_t size)
+{
+	ppc *ctx = FIT_ctx;
+	return fit_reg_mr_addr(ctx, addr, size);
+}
+
 inline int ibapi_reply_message(void *addr, int size, uintptr_t descriptor)
 {
 	ppc *ctx = FIT_ctx;
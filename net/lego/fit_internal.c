@@ -212,10 +212,11 @@ retry:
 
 	/*
 	 * All full? Given the fact that we are using sync RPC,
-	 * the maximum outstanding requests will equal to nr_cpus.
+	 * the maximum outstanding requests will equal to nr_cpus,
+	 * or FIT_MAX_PENDING_REPLIES per cpu with posted replies.
 	 * Show correct warnings here.
 	 */
-	if (likely(IMM_NUM_OF_SEMAPHORE <= nr_cpus)) {
+	if (likely(IMM_NUM_OF_SEMAPHORE <= nr_cpus * FIT_MAX_PENDING_REPLIES)) {
 		WARN_ONCE(1, "Please set a larger IMM_NUM_OF_SEMAPHORE.");
 		goto retry;
 	}
@@ -573,6 +574,11 @@ fit_ib_reg_mr_addr(ppc *ctx, void *addr, size_t length)
 					    addr, length, DMA_BIDIRECTIONAL);
 }
 
+uintptr_t fit_reg_mr_addr(ppc *ctx, void *addr, size_t length)
+{
+	return fit_ib_reg_mr_addr(ctx, addr, length);
+}
+
 DEFINE_PROFILE_POINT(fit_post_recv)
 
 static int fit_post_receives_message(ppc *ctx, int connection_id, int depth)
@@ -1294,6 +1300,68 @@ int fit_receive_message_no_reply(ppc *ctx, unsigned int port, void *ret_addr, in
 }
 
 #ifdef CONFIG_COMP_MEMORY
+/*
+ * Unsignaled WRITEs we leave in a send queue at most. Other threads post
+ * to the same QP at the same time, each of them has one signaled WR out,
+ * thus only half of the queue is ours, the reply included.
+ */
+#define FIT_RDMA_WRITE_BUDGET	max(MAX_OUTSTANDING_SEND / 2 - 1, 1)
+
+/*
+ * Post handler supplied RDMA WRITEs to @connection_id. The reply is posted
+ * to the same connection afterwards, RC delivers them in order, thus once
+ * requester sees the reply IMM, all data has landed.
+ *
+ * WRITEs are unsignaled, every FIT_RDMA_WRITE_BUDGET-th one is signaled
+ * and waited for, which retires all earlier ones.
+ * Return 0 if all WRITEs completed or are queued ahead of the reply.
+ */
+static int fit_post_rdma_write_list(ppc *ctx, int connection_id, uint32_t rkey,
+				    struct fit_rdma_write_entry *entries, int nr)
+{
+	struct ib_send_wr wr, *bad_wr = NULL;
+	struct ib_sge sge;
+	int poll_status;
+	int i, ret, nr_posted = 0;
+
+	for (i = 0; i < nr; i++) {
+		memset(&wr, 0, sizeof(wr));
+
+		sge.addr = fit_ib_reg_mr_addr(ctx, entries[i].local_addr, entries[i].size);
+		sge.length = entries[i].size;
+		sge.lkey = ctx->proc->lkey;
+
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		wr.opcode = IB_WR_RDMA_WRITE;
+		wr.wr.rdma.remote_addr = entries[i].remote_addr;
+		wr.wr.rdma.rkey = rkey;
+
+		if (++nr_posted >= FIT_RDMA_WRITE_BUDGET) {
+			poll_status = SEND_REPLY_WAIT;
+			wr.wr_id = (uint64_t)&poll_status;
+			wr.send_flags = IB_SEND_SIGNALED;
+		}
+
+		ret = ib_post_send(ctx->qp[connection_id], &wr, &bad_wr);
+		if (unlikely(ret)) {
+			pr_info_once("Fail to post rdma write to con:%d ret:%d\n",
+				connection_id, ret);
+			WARN_ON_ONCE(1);
+			return ret;
+		}
+
+		if (wr.send_flags & IB_SEND_SIGNALED) {
+			ret = fit_internal_poll_sendcq(ctx, ctx->send_cq[connection_id],
+						       connection_id, &poll_status, 1);
+			if (unlikely(ret))
+				return ret;
+			nr_posted = 0;
+		}
+	}
+	return 0;
+}
+
 /*
  * Callback for thread pool
  */
@@ -1301,7 +1369,7 @@ void fit_ack_reply_callback(struct thpool_buffer *b)
 {
 	int last_ack, ack_flag = 0;
 	int reply_size, node_id, offset;
-	int reply_connection_id;
+	int reply_connection_id, write_err;
 	void *reply_data;
 	ppc *ctx;
 	struct imm_message_metadata *request_metadata;
@@ -1356,6 +1424,21 @@ void fit_ack_reply_callback(struct thpool_buffer *b)
 	 */
         reply_connection_id = fit_get_connection_by_atomic_number(ctx, node_id, LOW_PRIORITY);
 
+	/*
+	 * Handler wants to push data to requester directly.
+	 * If that fails, requester must not use any of it: replace the
+	 * reply with RET_EAGAIN, it will fall back to normal replies.
+	 */
+	if (ThpoolBufferRdmaWrite(b)) {
+		if (unlikely(fit_post_rdma_write_list(ctx, reply_connection_id,
+						      request_metadata->reply_rkey,
+						      b->rdma_writes, b->nr_rdma_writes))) {
+			write_err = RET_EAGAIN;
+			reply_data = &write_err;
+			reply_size = sizeof(write_err);
+		}
+	}
+
 	/* Send it out. It is really a mess. */
 	fit_send_message_with_rdma_write_with_imm_request(ctx, reply_connection_id,
 			request_metadata->reply_rkey,
@@ -2380,6 +2463,274 @@ int fit_send_with_rdma_write_with_imm(ppc *ctx, int target_node, void *addr,
 	return ret;
 }
 
+/*
+ * Same as FIT_SEND_MESSAGE_HEADER_AND_IMM mode of
+ * fit_send_message_with_rdma_write_with_imm_request(), except the message
+ * is gathered from @sgl. Remote side sees one contiguous message.
+ * Send CQ is polled before return, @sgl buffers can be reused afterwards.
+ */
+static int fit_send_message_with_sgl(ppc *ctx, int connection_id, uint32_t input_mr_rkey,
+				uintptr_t input_mr_addr, int offset, uint32_t imm,
+				struct imm_message_metadata *header,
+				struct fit_sglist *sgl, int nr_sge)
+{
+	struct ib_send_wr wr, *bad_wr = NULL;
+	struct ib_sge sge[FIT_MAX_SEND_SGE + 1];
+	int poll_status = SEND_REPLY_WAIT;
+	int i, ret;
+
+	memset(&wr, 0, sizeof(wr));
+
+	wr.sg_list = sge;
+	wr.num_sge = nr_sge + 1;
+	wr.wr.rdma.remote_addr = (uintptr_t)(input_mr_addr + offset);
+	wr.wr.rdma.rkey = input_mr_rkey;
+	wr.opcode = IB_WR_RDMA_WRITE_WITH_IMM;
+	wr.ex.imm_data = imm;
+	wr.send_flags = IB_SEND_SIGNALED;
+
+	if (header->reply_indicator_index == -1)
+		wr.wr_id = -1;
+	else
+		wr.wr_id = (u64)get_reply_ready_ptr(ctx, header->reply_indicator_index);
+
+	sge[0].addr = fit_ib_reg_mr_addr(ctx, header, sizeof(*header));
+	sge[0].length = sizeof(*header);
+	sge[0].lkey = ctx->proc->lkey;
+
+	for (i = 0; i < nr_sge; i++) {
+		sge[i + 1].addr = fit_ib_reg_mr_addr(ctx, sgl[i].addr, sgl[i].len);
+		sge[i + 1].length = sgl[i].len;
+		sge[i + 1].lkey = ctx->proc->lkey;
+	}
+
+	ret = ib_post_send(ctx->qp[connection_id], &wr, &bad_wr);
+	if (unlikely(ret)) {
+		pr_info_once("Fail to post send to con:%d ret:%d\n",
+			connection_id, ret);
+		WARN_ON_ONCE(1);
+		return ret;
+	}
+
+	return fit_internal_poll_sendcq(ctx, ctx->send_cq[connection_id],
+					connection_id, &poll_status, 0);
+}
+
+/*
+ * Reserve @real_size bytes in @target_node's ring.
+ * Return the start offset.
+ */
+static int fit_reserve_remote_ring(ppc *ctx, int target_node, int real_size)
+{
+	int tar_offset_start, last_ack;
+
+	spin_lock(&ctx->remote_imm_offset_lock[target_node]);
+	/* If hits the end of ring, write start from 0 directly */
+	if (ctx->remote_rdma_ring_mrs_offset[target_node] + real_size >= RDMA_RING_SIZE)
+		/* Record the last point */
+		ctx->remote_rdma_ring_mrs_offset[target_node] = real_size;
+	else
+		ctx->remote_rdma_ring_mrs_offset[target_node] += real_size;
+
+	/* Trace back to the real starting point */
+	tar_offset_start = ctx->remote_rdma_ring_mrs_offset[target_node] - real_size;
+	spin_unlock(&ctx->remote_imm_offset_lock[target_node]);
+
+	/* Make sure we do not write beyond lastack */
+	while (1) {
+		last_ack = ctx->remote_last_ack_index[target_node];
+		if (tar_offset_start < last_ack && tar_offset_start + real_size > last_ack)
+			schedule();
+		else
+			break;
+	}
+	return tar_offset_start;
+}
+
+static int fit_sglist_size(struct fit_sglist *sgl, int nr_sge)
+{
+	int i, size = 0;
+
+	for (i = 0; i < nr_sge; i++)
+		size += sgl[i].len;
+	return size;
+}
+
+/*
+ * Scatter-gather version of fit_send_reply_with_rdma_write_with_imm().
+ * Header and payload can be sent from where they are, without
+ * being copied into one buffer first.
+ *
+ * Return:
+ * Negative values on failues
+ * Positive values indicate the reply message length
+ */
+int fit_send_reply_sge(ppc *ctx, int target_node, struct fit_sglist *sgl, int nr_sge,
+		       void *ret_addr, int max_ret_size,
+		       unsigned long timeout_sec, void *caller)
+{
+	struct imm_message_metadata msg_header;
+	struct fit_ibv_mr *remote_mr;
+	int tar_offset_start, connection_id, reply_indicator_index;
+	int size, real_size, ret;
+	unsigned long start_time;
+	int local_reply_ready_checker = SEND_REPLY_WAIT;
+
+	if (unlikely(!nr_sge || nr_sge > FIT_MAX_SEND_SGE)) {
+		fit_err("BUG: nr_sge %d. Caller: %pS", nr_sge, caller);
+		return -EINVAL;
+	}
+
+	size = fit_sglist_size(sgl, nr_sge);
+	real_size = size + sizeof(struct imm_message_metadata);
+	if (unlikely(real_size > IMM_MAX_SIZE)) {
+		fit_err("Size %d + header > %d", size, IMM_MAX_SIZE);
+		return -EINVAL;
+	}
+
+	tar_offset_start = fit_reserve_remote_ring(ctx, target_node, real_size);
+	remote_mr = &(ctx->remote_rdma_ring_mrs[target_node]);
+	connection_id = fit_get_connection_by_atomic_number(ctx, target_node, LOW_PRIORITY);
+	reply_indicator_index = alloc_index_and_set_reply_indicator(ctx, &local_reply_ready_checker);
+
+	msg_header.reply_addr = fit_ib_reg_mr_addr(ctx, ret_addr, max_ret_size);
+	msg_header.reply_rkey = ctx->proc->rkey;
+	msg_header.reply_indicator_index = reply_indicator_index;
+	msg_header.source_node_id = ctx->node_id;
+	msg_header.size = size;
+
+	ret = fit_send_message_with_sgl(ctx, connection_id, remote_mr->rkey,
+			(uintptr_t)remote_mr->addr, tar_offset_start,
+			IMM_SEND_REPLY_SEND | tar_offset_start, &msg_header, sgl, nr_sge);
+	if (unlikely(ret)) {
+		free_reply_indicator(ctx, reply_indicator_index);
+		return ret;
+	}
+
+	/* Caller does not specify an timeout, use the maximum */
+	if (timeout_sec == 0 || timeout_sec > FIT_MAX_TIMEOUT_SEC)
+		timeout_sec = FIT_MAX_TIMEOUT_SEC;
+
+	start_time = jiffies;
+	while (local_reply_ready_checker == SEND_REPLY_WAIT) {
+		cpu_relax();
+		if (unlikely(time_after(jiffies, start_time + timeout_sec * HZ))) {
+			pr_warn("%s() CPU:%d PID:%d timeout (%u ms), caller: %pS\n",
+				__func__, smp_processor_id(), current->pid,
+				jiffies_to_msecs(jiffies - start_time), caller);
+			return -ETIMEDOUT;
+		}
+	}
+	free_reply_indicator(ctx, reply_indicator_index);
+
+	if (unlikely(local_reply_ready_checker < 0)) {
+		fit_err("connection-%d inbox-%d reply-length-%d",
+			connection_id, reply_indicator_index, local_reply_ready_checker);
+	}
+	return local_reply_ready_checker;
+}
+
+struct fit_pending_reply {
+	int				ready;		/* set by recv_cq polling thread */
+	int				reply_indicator_index;
+	int				connection_id;
+	struct imm_message_metadata	msg_header;	/* read by the NIC until replied */
+};
+
+/*
+ * First half of fit_send_reply_with_rdma_write_with_imm(): post the
+ * request and return without waiting. @addr and @ret_addr must stay
+ * valid until fit_wait_reply() returns.
+ */
+struct fit_pending_reply *
+fit_send_reply_post(ppc *ctx, int target_node, void *addr, int size,
+		    void *ret_addr, int max_ret_size, void *caller)
+{
+	struct fit_pending_reply *pr;
+	struct fit_ibv_mr *remote_mr;
+	int tar_offset_start, real_size, ret;
+
+	if (unlikely(!addr)) {
+		fit_err("BUG: NULL addr. Caller: %pS", caller);
+		return ERR_PTR(-EINVAL);
+	}
+
+	real_size = size + sizeof(struct imm_message_metadata);
+	if (unlikely(real_size > IMM_MAX_SIZE)) {
+		fit_err("Size %d + header > %d", size, IMM_MAX_SIZE);
+		return ERR_PTR(-EINVAL);
+	}
+
+	pr = kmalloc(sizeof(*pr), GFP_KERNEL);
+	if (unlikely(!pr))
+		return ERR_PTR(-ENOMEM);
+	pr->ready = SEND_REPLY_WAIT;
+
+	tar_offset_start = fit_reserve_remote_ring(ctx, target_node, real_size);
+	remote_mr = &(ctx->remote_rdma_ring_mrs[target_node]);
+	pr->connection_id = fit_get_connection_by_atomic_number(ctx, target_node, LOW_PRIORITY);
+	pr->reply_indicator_index = alloc_index_and_set_reply_indicator(ctx, &pr->ready);
+
+	pr->msg_header.reply_addr = fit_ib_reg_mr_addr(ctx, ret_addr, max_ret_size);
+	pr->msg_header.reply_rkey = ctx->proc->rkey;
+	pr->msg_header.reply_indicator_index = pr->reply_indicator_index;
+	pr->msg_header.source_node_id = ctx->node_id;
+	pr->msg_header.size = size;
+
+	ret = fit_send_message_with_rdma_write_with_imm_request(ctx, pr->connection_id,
+			remote_mr->rkey, (uintptr_t)remote_mr->addr, addr, size,
+			tar_offset_start, IMM_SEND_REPLY_SEND | tar_offset_start,
+			FIT_SEND_MESSAGE_HEADER_AND_IMM, &pr->msg_header, 0);
+	if (unlikely(ret)) {
+		free_reply_indicator(ctx, pr->reply_indicator_index);
+		kfree(pr);
+		return ERR_PTR(ret);
+	}
+	return pr;
+}
+
+/*
+ * Second half: busy poll until @pr is replied. Callers free @pr after,
+ * but not after a timeout, the reply may still land in it.
+ * Calling it again on a replied @pr just returns the length.
+ *
+ * Return:
+ * Negative values on failues
+ * Positive values indicate the reply message length
+ */
+int fit_wait_reply(ppc *ctx, struct fit_pending_reply *pr,
+		   unsigned long timeout_sec, void *caller)
+{
+	unsigned long start_time;
+	int reply_length;
+
+	/* Caller does not specify an timeout, use the maximum */
+	if (timeout_sec == 0 || timeout_sec > FIT_MAX_TIMEOUT_SEC)
+		timeout_sec = FIT_MAX_TIMEOUT_SEC;
+
+	start_time = jiffies;
+	while (READ_ONCE(pr->ready) == SEND_REPLY_WAIT) {
+		cpu_relax();
+		if (unlikely(time_after(jiffies, start_time + timeout_sec * HZ))) {
+			pr_warn("%s() CPU:%d PID:%d timeout (%u ms), caller: %pS\n",
+				__func__, smp_processor_id(), current->pid,
+				jiffies_to_msecs(jiffies - start_time), caller);
+			return -ETIMEDOUT;
+		}
+	}
+	reply_length = pr->ready;
+	if (pr->reply_indicator_index < 0)
+		return reply_length;
+
+	if (unlikely(reply_length < 0)) {
+		fit_err("connection-%d inbox-%d reply-length-%d",
+			pr->connection_id, pr->reply_indicator_index, reply_length);
+	}
+	free_reply_indicator(ctx, pr->reply_indicator_index);
+	pr->reply_indicator_index = -1;
+	return reply_length;
+}
+
 /*
  * This is one major function, it is used by ibapi_send_reply().
  * This function is blocking, it uses busy polling to get reply.
@@ -65,12 +65,22 @@ int fit_multicast_send_reply(ppc *ctx, int num_nodes, int *target_node,
 
 int fit_send_with_rdma_write_with_imm(ppc *ctx, int target_node, void *addr,
 					       int size, int userspace_flag);
+int fit_send_reply_sge(ppc *ctx, int target_node, struct fit_sglist *sgl, int nr_sge,
+		       void *ret_addr, int max_ret_size,
+		       unsigned long timeout_sec, void *caller);
+struct fit_pending_reply *
+fit_send_reply_post(ppc *ctx, int target_node, void *addr, int size,
+		    void *ret_addr, int max_ret_size, void *caller);
+int fit_wait_reply(ppc *ctx, struct fit_pending_reply *pr,
+		   unsigned long timeout_sec, void *caller);
 int fit_receive_message_no_reply(ppc *ctx, unsigned int port, void *ret_addr, int receive_size, int userspace_flag);
 
 int fit_reply_message(ppc *ctx, void *addr, int size, uintptr_t descriptor, int userspace_flag, int if_poll_now);
 int fit_reply_message_w_extra_bits(ppc *ctx, void *addr, int size, int private_bits, uintptr_t descriptor, int userspace_flag, int if_poll_now);
 int fit_receive_message(ppc *ctx, unsigned int port, void *ret_addr, int receive_size, uintptr_t *reply_descriptor, int userspace_flag);
 
+uintptr_t fit_reg_mr_addr(ppc *ctx, void *addr, size_t length);
+
 int fit_internal_init(void);
 int fit_internal_cleanup(void);
 